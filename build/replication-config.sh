@@ -5,9 +5,9 @@
 
 sed -i.old \
     -e 's/#* *wal_level *= *[a-z]*/wal_level = logical/' \
-    -e 's/#* *max_wal_senders *= *[0-9]*/max_wal_senders = 8/' \
+    -e 's/#* *max_wal_senders *= *[0-9]*/max_wal_senders = 16/' \
     -e 's/#* *wal_keep_segments *= *[0-9]*/wal_keep_segments = 4/' \
-    -e 's/#* *max_replication_slots *= *[0-9]*/max_replication_slots = 4/' \
+    -e 's/#* *max_replication_slots *= *[0-9]*/max_replication_slots = 12/' \
     "${PGDATA}/postgresql.conf"
 
 # TODO authenticate the user
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Entrypoint of a container that runs a hot standby of the "postgres" container,
+# for testing logical decoding on a standby. On first start it clones the primary
+# with pg_basebackup, and then hands over to the image's usual entrypoint, which
+# finds the data directory initialised.
+
+set -e
+
+if [ ! -s "${PGDATA}/PG_VERSION" ]; then
+  until pg_basebackup -h postgres -U postgres -D "${PGDATA}" -R -X stream; do
+    echo "$0: waiting for the primary" >&2
+    rm -rf "${PGDATA:?}"/*
+    sleep 1
+  done
+  echo "hot_standby_feedback = on" >> "${PGDATA}/postgresql.conf"
+  chown -R postgres:postgres "${PGDATA}"
+  chmod 700 "${PGDATA}"
+fi
+
+exec docker-entrypoint.sh postgres
@@ -25,9 +25,9 @@ static char *progname;
 
 void usage(void);
 void parse_options(client_context_t context, int argc, char **argv);
-static int print_begin_txn(void *context, uint64_t wal_pos, uint32_t xid);
-static int print_commit_txn(void *context, uint64_t wal_pos, uint32_t xid);
-static int print_table_schema(void *context, uint64_t wal_pos, Oid relid,
+static int print_begin_txn(void *context, uint64_t wal_pos, uint32_t xid, int64_t commit_time);
+static int print_commit_txn(void *context, uint64_t wal_pos, uint32_t xid, int64_t commit_time);
+static int print_table_schema(void *context, uint64_t wal_pos, Oid relid, uint64_t fingerprint,
         const char *key_schema_json, size_t key_schema_len, avro_schema_t key_schema,
         const char *row_schema_json, size_t row_schema_len, avro_schema_t row_schema);
 static int print_insert_row(void *context, uint64_t wal_pos, Oid relid,
@@ -40,6 +40,7 @@ static int print_update_row(void *context, uint64_t wal_pos, Oid relid,
 static int print_delete_row(void *context, uint64_t wal_pos, Oid relid,
         const void *key_bin, size_t key_len, avro_value_t *key_val,
         const void *old_bin, size_t old_len, avro_value_t *old_val);
+static int print_truncate_table(void *context, uint64_t wal_pos, Oid relid);
 void checkpoint(void *context, uint64_t wal_pos);
 client_context_t init_client(void);
 void exit_nicely(client_context_t context);
@@ -93,7 +94,7 @@ void parse_options(client_context_t context, int argc, char **argv) {
     if (!context->conninfo || optind < argc) usage();
 }
 
-static int print_begin_txn(void *ctx, uint64_t wal_pos, uint32_t xid) {
+static int print_begin_txn(void *ctx, uint64_t wal_pos, uint32_t xid, int64_t commit_time) {
     client_context_t context = (client_context_t) ctx;
     if (xid == 0) {
         fprintf(stderr, "Created replication slot \"%s\", capturing consistent snapshot \"%s\".\n",
@@ -105,20 +106,21 @@ static int print_begin_txn(void *ctx, uint64_t wal_pos, uint32_t xid) {
     return 0;
 }
 
-static int print_commit_txn(void *ctx, uint64_t wal_pos, uint32_t xid) {
+static int print_commit_txn(void *ctx, uint64_t wal_pos, uint32_t xid, int64_t commit_time) {
     client_context_t context = (client_context_t) ctx;
     if (xid == 0) {
         fprintf(stderr, "Snapshot complete, streaming changes from %X/%X.\n",
                 (uint32) (wal_pos >> 32), (uint32) wal_pos);
         context->taking_snapshot = false;
     } else {
-        printf("commit xid=%u wal_pos=%X/%X\n", xid, (uint32) (wal_pos >> 32), (uint32) wal_pos);
+        printf("commit xid=%u wal_pos=%X/%X commit_time=%" PRId64 "\n", xid,
+                (uint32) (wal_pos >> 32), (uint32) wal_pos, commit_time);
         checkpoint(context, wal_pos);
     }
     return 0;
 }
 
-static int print_table_schema(void *context, uint64_t wal_pos, Oid relid,
+static int print_table_schema(void *context, uint64_t wal_pos, Oid relid, uint64_t fingerprint,
         const char *key_schema_json, size_t key_schema_len, avro_schema_t key_schema,
         const char *row_schema_json, size_t row_schema_len, avro_schema_t row_schema) {
     printf("new schema for relid=%u\n\tkey = %.*s\n\trow = %.*s\n", relid,
@@ -206,6 +208,12 @@ static int print_delete_row(void *context, uint64_t wal_pos, Oid relid,
     return err;
 }
 
+static int print_truncate_table(void *context, uint64_t wal_pos, Oid relid) {
+    printf("truncate relid %u\n", relid);
+    checkpoint(context, wal_pos);
+    return 0;
+}
+
 void checkpoint(void *context, uint64_t wal_pos) {
     replication_stream_t stream = &((client_context_t) context)->repl;
     stream->fsync_lsn = Max(wal_pos, stream->fsync_lsn);
@@ -219,6 +227,7 @@ client_context_t init_client() {
     frame_reader->on_insert_row   = print_insert_row;
     frame_reader->on_update_row   = print_update_row;
     frame_reader->on_delete_row   = print_delete_row;
+    frame_reader->on_truncate_table = print_truncate_table;
 
     client_context_t context = db_client_new();
     context->app_name = APP_NAME;
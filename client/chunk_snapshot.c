@@ -0,0 +1,377 @@
+/* A snapshot that does not hold back the xmin horizon. The ordinary snapshot
+ * (snapshot_start() in connect.c) reads every table in one REPEATABLE READ
+ * transaction, which stops vacuum from removing rows that die after it started,
+ * throughout the cluster, until the last table has been read. This one starts
+ * streaming from the slot straight away instead, and reads each table in chunks
+ * of rows in key order, each chunk in a short transaction of its own, on a
+ * separate connection.
+ *
+ * Since the chunks are not read at one point in time, they are reconciled with
+ * the stream, as in Netflix's DBLog. Just before and just after reading a chunk,
+ * the client writes a low and a high watermark: a row of the bottledwater_watermark
+ * table, whose transaction it recognises in the stream by its ID. A change to a row
+ * of the chunk that is streamed between the two watermarks was committed around
+ * the time the chunk was read, so the chunk's copy of the row may be stale, and is
+ * dropped: the stream carries the row's later state. The rest of the chunk is passed
+ * on as inserts just before the high watermark's commit, as part of that transaction.
+ * A change committed before the low watermark is visible in the chunk, and one
+ * committed after the high watermark is streamed after it, so the end result is
+ * the same as that of a consistent snapshot.
+ *
+ * The rows of a chunk are not in the WAL, so they cannot be streamed again after a
+ * failure. As with the ordinary snapshot, a failed snapshot has to start over. */
+
+#include "chunk_snapshot.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define check(err, call) { err = call; if (err) return err; }
+
+/* Type OIDs of the parameters passed to the server */
+#define NAMEOID 19
+#define INT4OID 23
+#define TEXTOID 25
+#define TEXTARRAYOID 1009
+
+int chunk_read(chunk_snapshot_t chunks);
+int chunk_watermark(chunk_snapshot_t chunks, uint32_t *xid_out);
+int chunk_emit(chunk_snapshot_t chunks, uint64_t wal_pos);
+void chunk_clear_rows(chunk_snapshot_t chunks);
+int chunk_row_compare(const void *a, const void *b);
+int chunk_tap_begin_txn(void *context, uint64_t wal_pos, uint32_t xid, int64_t commit_time);
+int chunk_tap_commit_txn(void *context, uint64_t wal_pos, uint32_t xid, int64_t commit_time);
+int chunk_tap_row_key(void *context, uint64_t wal_pos, Oid relid, const void *key_bin, size_t key_len);
+int chunk_tap_truncate_table(void *context, uint64_t wal_pos, Oid relid);
+void chunk_snapshot_error(chunk_snapshot_t chunks, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+
+/* Connects to the server, fetches the list of tables to export, and hooks into the
+ * replication stream's frame reader to watch for the watermarks. slot_name, shard,
+ * shard_key_tables and chunk_size must be set first. No chunk is read until
+ * chunk_snapshot_poll() is called. */
+int chunk_snapshot_start(chunk_snapshot_t chunks, const char *conninfo, frame_reader_t stream_reader) {
+    if (chunks->chunk_size < 1) {
+        chunk_snapshot_error(chunks, "chunk size must be at least 1");
+        return EINVAL;
+    }
+
+    chunks->conn = PQconnectdb(conninfo);
+    if (PQstatus(chunks->conn) != CONNECTION_OK) {
+        chunk_snapshot_error(chunks, "Snapshot connection failed: %s", PQerrorMessage(chunks->conn));
+        return EIO;
+    }
+
+    /* Ask for the frames that the frame reader understands */
+    char set_version[64];
+    snprintf(set_version, sizeof(set_version), "SET bottledwater.protocol_version = %d", PROTOCOL_VERSION);
+    PGresult *res = PQexec(chunks->conn, set_version);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        chunk_snapshot_error(chunks, "Could not set protocol version: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        return EIO;
+    }
+    PQclear(res);
+
+    Oid argtypes[] = { TEXTOID, TEXTOID };
+    const char *args[] = {
+        chunks->shard ? chunks->shard : "",
+        chunks->shard_key_tables ? chunks->shard_key_tables : ""
+    };
+
+    res = PQexecParams(chunks->conn,
+            "SELECT relid, table_name FROM bottledwater_export_tables(shard := $1, shard_key_tables := $2)",
+            2, argtypes, args, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        chunk_snapshot_error(chunks, "Could not list tables for chunked snapshot: %s",
+                PQresultErrorMessage(res));
+        PQclear(res);
+        return EIO;
+    }
+
+    chunks->num_tables = PQntuples(res);
+    chunks->tables = calloc(chunks->num_tables > 0 ? chunks->num_tables : 1, sizeof(chunk_table));
+    for (int i = 0; i < chunks->num_tables; i++) {
+        chunks->tables[i].relid = (Oid) atoll(PQgetvalue(res, i, 0));
+        chunks->tables[i].name = strdup(PQgetvalue(res, i, 1));
+    }
+    PQclear(res);
+
+    chunks->after_key = strdup("{}");
+    chunks->reader = frame_reader_new();
+    chunks->stream_reader = stream_reader;
+    chunks->phase = chunks->num_tables > 0 ? CHUNK_IDLE : CHUNK_DONE;
+
+    stream_reader->tap_context = chunks;
+    stream_reader->tap_begin_txn = chunk_tap_begin_txn;
+    stream_reader->tap_commit_txn = chunk_tap_commit_txn;
+    stream_reader->tap_row_key = chunk_tap_row_key;
+    stream_reader->tap_truncate_table = chunk_tap_truncate_table;
+    return 0;
+}
+
+/* Reads the next chunk, if the previous one has been passed on. Blocks while the
+ * chunk is read, which takes about as long as a query of chunk_size rows. */
+int chunk_snapshot_poll(chunk_snapshot_t chunks) {
+    if (chunks->phase != CHUNK_IDLE) return 0;
+    return chunk_read(chunks);
+}
+
+/* Returns true once every chunk has been passed on, and the caller has checkpointed
+ * (as recorded in fsync_lsn) the transaction of the last one. */
+bool chunk_snapshot_complete(chunk_snapshot_t chunks, XLogRecPtr fsync_lsn) {
+    return chunks->phase == CHUNK_DONE && fsync_lsn >= chunks->done_lsn;
+}
+
+/* Closes the connection, unhooks from the stream's frame reader, and frees the
+ * snapshot's state (but not the struct itself). */
+void chunk_snapshot_free(chunk_snapshot_t chunks) {
+    if (chunks->stream_reader && chunks->stream_reader->tap_context == chunks) {
+        chunks->stream_reader->tap_context = NULL;
+        chunks->stream_reader->tap_begin_txn = NULL;
+        chunks->stream_reader->tap_commit_txn = NULL;
+        chunks->stream_reader->tap_row_key = NULL;
+        chunks->stream_reader->tap_truncate_table = NULL;
+    }
+    if (chunks->conn) PQfinish(chunks->conn);
+    if (chunks->reader) frame_reader_free(chunks->reader);
+
+    chunk_clear_rows(chunks);
+    for (int i = 0; i < chunks->num_tables; i++) free(chunks->tables[i].name);
+    free(chunks->tables);
+    free(chunks->after_key);
+    free(chunks->slot_name);
+    free(chunks->shard);
+    free(chunks->shard_key_tables);
+
+    chunks->conn = NULL;
+    chunks->reader = NULL;
+    chunks->stream_reader = NULL;
+    chunks->tables = NULL;
+    chunks->num_tables = 0;
+    chunks->after_key = NULL;
+    chunks->slot_name = chunks->shard = chunks->shard_key_tables = NULL;
+}
+
+/* Writes the low watermark, reads the next chunk of the current table, and writes
+ * the high watermark. Each is a transaction of its own. */
+int chunk_read(chunk_snapshot_t chunks) {
+    int err = 0;
+    chunk_table *table = &chunks->tables[chunks->current_table];
+
+    check(err, chunk_watermark(chunks, &chunks->low_xid));
+
+    char chunk_size[16];
+    snprintf(chunk_size, sizeof(chunk_size), "%d", chunks->chunk_size);
+
+    Oid argtypes[] = { TEXTOID, TEXTARRAYOID, INT4OID, TEXTOID, TEXTOID };
+    const char *args[] = {
+        table->name,
+        chunks->after_key,
+        chunk_size,
+        chunks->shard ? chunks->shard : "",
+        chunks->shard_key_tables ? chunks->shard_key_tables : ""
+    };
+
+    PGresult *res = PQexecParams(chunks->conn,
+            "SELECT key, frame, key_values::text FROM bottledwater_export_chunk("
+            "table_name := $1, after_key := $2, chunk_size := $3, shard := $4, shard_key_tables := $5)",
+            5, argtypes, args, NULL, NULL, 1); // The final 1 requests results in binary format
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) < 1 || PQgetisnull(res, 0, 1)) {
+        chunk_snapshot_error(chunks, "Could not read chunk of table %s: %s",
+                table->name, PQresultErrorMessage(res));
+        PQclear(res);
+        return EIO;
+    }
+
+    /* The first row is the table's schema; the rest are the rows of the chunk */
+    int tuples = PQntuples(res);
+    chunks->schema_frame_len = PQgetlength(res, 0, 1);
+    chunks->schema_frame = malloc(chunks->schema_frame_len);
+    memcpy(chunks->schema_frame, PQgetvalue(res, 0, 1), chunks->schema_frame_len);
+    chunks->rows = calloc(tuples, sizeof(chunk_row));
+
+    for (int i = 1; i < tuples; i++) {
+        free(chunks->after_key);
+        chunks->after_key = strdup(PQgetvalue(res, i, 2));
+
+        /* Rows of other shards are only there to move after_key along */
+        if (PQgetisnull(res, i, 1)) continue;
+
+        chunk_row *row = &chunks->rows[chunks->num_rows++];
+        row->key_len = PQgetlength(res, i, 0);
+        row->key = malloc(row->key_len);
+        memcpy(row->key, PQgetvalue(res, i, 0), row->key_len);
+        row->frame_len = PQgetlength(res, i, 1);
+        row->frame = malloc(row->frame_len);
+        memcpy(row->frame, PQgetvalue(res, i, 1), row->frame_len);
+    }
+
+    chunks->last_chunk = tuples - 1 < chunks->chunk_size;
+    PQclear(res);
+    qsort(chunks->rows, chunks->num_rows, sizeof(chunk_row), chunk_row_compare);
+
+    check(err, chunk_watermark(chunks, &chunks->high_xid));
+    chunks->phase = CHUNK_WAITING;
+    chunks->chunks_read++;
+    return err;
+}
+
+/* Writes a watermark, and sets *xid_out to the ID of its transaction. */
+int chunk_watermark(chunk_snapshot_t chunks, uint32_t *xid_out) {
+    Oid argtypes[] = { NAMEOID };
+    const char *args[] = { chunks->slot_name };
+
+    PGresult *res = PQexecParams(chunks->conn, "SELECT bottledwater_watermark($1)",
+            1, argtypes, args, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1 || PQgetisnull(res, 0, 0)) {
+        chunk_snapshot_error(chunks, "Could not write snapshot watermark: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        return EIO;
+    }
+
+    *xid_out = (uint32_t) strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+    PQclear(res);
+    return 0;
+}
+
+/* Passes on the rows of the current chunk that were not changed between its
+ * watermarks, as inserts at wal_pos, and moves on to the next chunk. The chunk's
+ * frames are read by a frame reader of their own, since this is called while the
+ * stream's frame reader is in the middle of a frame, but go to the same callbacks. */
+int chunk_emit(chunk_snapshot_t chunks, uint64_t wal_pos) {
+    int err = 0;
+    frame_reader_t reader = chunks->reader, stream_reader = chunks->stream_reader;
+
+    reader->cb_context = stream_reader->cb_context;
+    reader->on_table_schema = stream_reader->on_table_schema;
+    reader->on_insert_row = stream_reader->on_insert_row;
+    reader->on_error = stream_reader->on_error;
+    reader->decode_values = stream_reader->decode_values;
+    reader->max_decoders = stream_reader->max_decoders;
+    memcpy(reader->active_schema_list, stream_reader->active_schema_list, sizeof(reader->active_schema_list));
+    reader->num_active_schemas = stream_reader->num_active_schemas;
+
+    /* The table's schema goes first, unless every row of the chunk was dropped */
+    bool schema_sent = false;
+    for (int i = 0; i < chunks->num_rows; i++) {
+        chunk_row *row = &chunks->rows[i];
+        if (row->changed) continue;
+
+        if (!schema_sent) {
+            err = parse_frame(reader, wal_pos, chunks->schema_frame, chunks->schema_frame_len);
+            if (err) break;
+            schema_sent = true;
+        }
+        err = parse_frame(reader, wal_pos, row->frame, row->frame_len);
+        if (err) break;
+        chunks->rows_sent++;
+    }
+    if (err) {
+        chunk_snapshot_error(chunks, "Error parsing chunk of table %s: %s",
+                chunks->tables[chunks->current_table].name, reader->error);
+        return err;
+    }
+
+    chunk_clear_rows(chunks);
+
+    if (chunks->last_chunk) {
+        chunks->current_table++;
+        free(chunks->after_key);
+        chunks->after_key = strdup("{}");
+    }
+
+    if (chunks->current_table < chunks->num_tables) {
+        chunks->phase = CHUNK_IDLE;
+    } else {
+        chunks->phase = CHUNK_DONE;
+        chunks->done_lsn = wal_pos;
+    }
+    return err;
+}
+
+/* Frees the rows of the current chunk. */
+void chunk_clear_rows(chunk_snapshot_t chunks) {
+    for (int i = 0; i < chunks->num_rows; i++) {
+        free(chunks->rows[i].key);
+        free(chunks->rows[i].frame);
+    }
+    free(chunks->rows);
+    free(chunks->schema_frame);
+    chunks->rows = NULL;
+    chunks->num_rows = 0;
+    chunks->schema_frame = NULL;
+    chunks->schema_frame_len = 0;
+}
+
+/* Orders chunk rows by their encoded key, so that they can be found by bsearch(). */
+int chunk_row_compare(const void *a, const void *b) {
+    const chunk_row *row_a = a, *row_b = b;
+    int len = row_a->key_len < row_b->key_len ? row_a->key_len : row_b->key_len;
+    int cmp = memcmp(row_a->key, row_b->key, len);
+    if (cmp != 0) return cmp;
+    return row_a->key_len - row_b->key_len;
+}
+
+/* Opens the window in which changes are reconciled with the chunk, when the low
+ * watermark's transaction begins. */
+int chunk_tap_begin_txn(void *context, uint64_t wal_pos, uint32_t xid, int64_t commit_time) {
+    chunk_snapshot_t chunks = (chunk_snapshot_t) context;
+    if (chunks->phase == CHUNK_WAITING && xid == chunks->low_xid) {
+        chunks->phase = CHUNK_IN_WINDOW;
+    }
+    return 0;
+}
+
+/* Closes the window when the high watermark's transaction commits, and passes on
+ * what is left of the chunk as part of that transaction. */
+int chunk_tap_commit_txn(void *context, uint64_t wal_pos, uint32_t xid, int64_t commit_time) {
+    chunk_snapshot_t chunks = (chunk_snapshot_t) context;
+    if (chunks->phase == CHUNK_IN_WINDOW && xid == chunks->high_xid) {
+        return chunk_emit(chunks, wal_pos);
+    }
+    return 0;
+}
+
+/* Drops the chunk's copy of a row that changed while the window is open. */
+int chunk_tap_row_key(void *context, uint64_t wal_pos, Oid relid, const void *key_bin, size_t key_len) {
+    chunk_snapshot_t chunks = (chunk_snapshot_t) context;
+    if (chunks->phase != CHUNK_IN_WINDOW || !key_bin) return 0;
+    if (relid != chunks->tables[chunks->current_table].relid) return 0;
+
+    chunk_row key = { .key = (char *) key_bin, .key_len = (int) key_len };
+    chunk_row *row = bsearch(&key, chunks->rows, chunks->num_rows, sizeof(chunk_row), chunk_row_compare);
+    if (row && !row->changed) {
+        row->changed = true;
+        chunks->rows_dropped++;
+    }
+    return 0;
+}
+
+/* Drops the whole chunk if its table is truncated while the window is open. Rows
+ * read before the truncation no longer exist, and any read after it were inserted
+ * within the window, so the stream carries them anyway. */
+int chunk_tap_truncate_table(void *context, uint64_t wal_pos, Oid relid) {
+    chunk_snapshot_t chunks = (chunk_snapshot_t) context;
+    if (chunks->phase != CHUNK_IN_WINDOW) return 0;
+    if (relid != chunks->tables[chunks->current_table].relid) return 0;
+
+    for (int i = 0; i < chunks->num_rows; i++) {
+        if (!chunks->rows[i].changed) {
+            chunks->rows[i].changed = true;
+            chunks->rows_dropped++;
+        }
+    }
+    return 0;
+}
+
+/* Updates the snapshot's statically allocated error buffer with a message. */
+void chunk_snapshot_error(chunk_snapshot_t chunks, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(chunks->error, CHUNK_SNAPSHOT_ERROR_LEN, fmt, args);
+    va_end(args);
+}
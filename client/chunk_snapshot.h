@@ -0,0 +1,66 @@
+#ifndef CHUNK_SNAPSHOT_H
+#define CHUNK_SNAPSHOT_H
+
+#include "protocol_client.h"
+#include <libpq-fe.h>
+#include <postgres_fe.h>
+#include <access/xlogdefs.h>
+
+#define CHUNK_SNAPSHOT_ERROR_LEN 512
+
+typedef enum {
+    CHUNK_IDLE = 0,             /* Ready to read the next chunk */
+    CHUNK_WAITING,              /* Chunk read; its low watermark has not yet been streamed */
+    CHUNK_IN_WINDOW,            /* Streaming the changes between the low and high watermark */
+    CHUNK_DONE                  /* Every table has been read */
+} chunk_phase_t;
+
+/* One row of the chunk being reconciled with the replication stream */
+typedef struct {
+    char *key;                  /* Encoded key, as in the row events of the stream */
+    int key_len;
+    char *frame;                /* Wire protocol frame with an insert of the row */
+    int frame_len;
+    bool changed;               /* A change to this key was streamed, so the row is dropped */
+} chunk_row;
+
+typedef struct {
+    Oid relid;
+    char *name;                 /* Qualified name, to pass to bottledwater_export_chunk() */
+} chunk_table;
+
+/* State of a snapshot that reads each table in chunks, in key order, while the
+ * replication stream runs (see chunk_snapshot.c). */
+typedef struct {
+    PGconn *conn;               /* SQL connection on which chunks and watermarks are written */
+    char *slot_name, *shard, *shard_key_tables;
+    int chunk_size;             /* Maximum rows per chunk */
+    chunk_table *tables;
+    int num_tables;
+    int current_table;          /* Index into tables of the table being read */
+    char *after_key;            /* Key columns of the last row read, as a text[] literal */
+    chunk_phase_t phase;
+    uint32_t low_xid;           /* Transaction IDs of the current chunk's watermarks */
+    uint32_t high_xid;
+    char *schema_frame;         /* Frame with the schema of the current chunk's table */
+    int schema_frame_len;
+    chunk_row *rows;            /* The current chunk's rows, sorted by key */
+    int num_rows;
+    bool last_chunk;            /* The current chunk is the last of its table */
+    frame_reader_t reader;      /* Reads the chunks' frames, apart from the stream's */
+    frame_reader_t stream_reader; /* Frame reader of the replication stream */
+    XLogRecPtr done_lsn;        /* Commit position of the last chunk's high watermark */
+    uint64_t chunks_read;
+    uint64_t rows_sent;         /* Rows of chunks passed on to the callbacks */
+    uint64_t rows_dropped;      /* Rows of chunks superseded by a change in the stream */
+    char error[CHUNK_SNAPSHOT_ERROR_LEN];
+} chunk_snapshot;
+
+typedef chunk_snapshot *chunk_snapshot_t;
+
+int chunk_snapshot_start(chunk_snapshot_t chunks, const char *conninfo, frame_reader_t stream_reader);
+int chunk_snapshot_poll(chunk_snapshot_t chunks);
+bool chunk_snapshot_complete(chunk_snapshot_t chunks, XLogRecPtr fsync_lsn);
+void chunk_snapshot_free(chunk_snapshot_t chunks);
+
+#endif /* CHUNK_SNAPSHOT_H */
@@ -5,10 +5,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h> /* k4m */
 
+#include <datatype/timestamp.h>
 #include <internal/pqexpbuffer.h>
 
+/* Server settings for the lease connection, so that the server notices within a few
+ * seconds if the client's host disappears, and releases its lease */
+#define LEASE_KEEPALIVE_SQL \
+    "SET tcp_keepalives_idle = 1; SET tcp_keepalives_interval = 1; SET tcp_keepalives_count = 5"
+/* How often to check that the connection holding the lease is still up */
+#define LEASE_CHECK_INTERVAL_SEC 1
+/* How long the server may take to answer a probe on the lease connection */
+#define LEASE_PROBE_TIMEOUT_SEC 10
+/* How long to wait for the previous holder's walsender to exit after taking over */
+#define LEASE_TAKEOVER_WAIT_MSEC 10000
+/* Version of the extension's SQL objects that this client needs, at least */
+#define EXTENSION_VERSION_MAJOR 0
+#define EXTENSION_VERSION_MINOR 2
+/* How long the heartbeat and lease connections may take to connect, unless the
+ * connection string sets connect_timeout */
+#define SIDE_CONNECT_TIMEOUT_SEC 10
+
 /* Wrap around a function call to bail on error. */
 #define check(err, call) { err = call; if (err) return err; }
 
@@ -26,11 +45,26 @@
 void client_error(client_context_t context, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 int exec_sql(client_context_t context, char *query);
 int client_connect(client_context_t context);
+int standby_check(client_context_t context);
+int extension_tables(client_context_t context);
+int extension_version_check(client_context_t context);
 void client_sql_disconnect(client_context_t context);
 int replication_slot_exists(client_context_t context, bool *exists);
 int snapshot_start(client_context_t context);
 int snapshot_poll(client_context_t context);
 int snapshot_tuple(client_context_t context, PGresult *res, int row_number);
+int chunked_snapshot_start(client_context_t context);
+int chunked_snapshot_poll(client_context_t context);
+int heartbeat_poll(client_context_t context);
+int heartbeat_result(client_context_t context);
+void heartbeat_failed(client_context_t context);
+PGconn *side_connect(client_context_t context, bool nonblocking);
+int side_connect_poll(client_context_t context, PGconn *conn, PostgresPollingStatusType *status,
+        int64 started, const char *what);
+int lease_take_over(client_context_t context);
+int lease_check(client_context_t context);
+int lease_renew(client_context_t context);
+void lease_release(client_context_t context);
 
 /* k4m: make active table list */
 int client_sql_connect(client_context_t context);
@@ -51,10 +85,15 @@ client_context_t db_client_new() {
 /* Closes any network connections, if applicable, and frees the client_context struct. */
 void db_client_free(client_context_t context) {
     client_sql_disconnect(context);
+    if (context->heartbeat_conn) PQfinish(context->heartbeat_conn);
     if (context->repl.conn) PQfinish(context->repl.conn);
+    lease_release(context);
+    chunk_snapshot_free(&context->chunks);
     if (context->repl.snapshot_name) free(context->repl.snapshot_name);
     if (context->repl.output_plugin) free(context->repl.output_plugin);
     if (context->repl.slot_name) free(context->repl.slot_name);
+    if (context->repl.shard) free(context->repl.shard);
+    if (context->repl.shard_key_tables) free(context->repl.shard_key_tables);
     if (context->error_policy) free(context->error_policy);
     if (context->app_name) free(context->app_name);
     if (context->conninfo) free(context->conninfo);
@@ -71,12 +110,19 @@ void db_client_set_error_policy(client_context_t context, const char *policy) {
  * context->app_name as client name), and checks whether replication slot
  * context->repl.slot_name already exists. If yes, sets up the context to start
  * receiving the stream of changes from that slot. If no, creates the slot, and
- * initiates the consistent snapshot. */
+ * initiates the consistent snapshot. With context->snapshot_chunk_size, the
+ * snapshot is instead read in chunks alongside the stream (see chunk_snapshot.c).
+ *
+ * The server may be a hot standby running Postgres 16 or later, in which case
+ * the slot is created, and the snapshot taken, on the standby. */
 int db_client_start(client_context_t context) {
     int err = 0;
     bool slot_exists=false;
 
     check(err, client_connect(context));
+    check(err, standby_check(context));
+    check(err, extension_version_check(context));
+    check(err, extension_tables(context));
     checkRepl(err, context, replication_stream_check(&context->repl));
     check(err, replication_slot_exists(context, &slot_exists));
 
@@ -86,7 +132,16 @@ int db_client_start(client_context_t context) {
         checkRepl(err, context, replication_slot_create(&context->repl));
         context->slot_created = true;
 
-        if (!context->skip_snapshot) {
+        if (!context->skip_snapshot && context->snapshot_chunk_size > 0) {
+            context->taking_snapshot = true;
+            check(err, chunked_snapshot_start(context));
+            client_sql_disconnect(context);
+
+            /* db_client_poll reads the chunks as the stream goes along */
+            checkRepl(err, context, replication_stream_start(&context->repl, context->error_policy));
+            return err;
+
+        } else if (!context->skip_snapshot) {
             context->taking_snapshot = true;
             check(err, snapshot_start(context));
 
@@ -105,6 +160,77 @@ int db_client_start(client_context_t context) {
 }
 
 
+/* Closes the client's connections to the server, for example after the replication
+ * stream has failed, but keeps everything else (in particular the frame reader and
+ * the schemas it knows), so that db_client_reconnect() can carry on from there. */
+void db_client_disconnect(client_context_t context) {
+    client_sql_disconnect(context);
+    if (context->heartbeat_conn) PQfinish(context->heartbeat_conn);
+    if (context->repl.conn) PQfinish(context->repl.conn);
+    context->heartbeat_conn = NULL;
+    context->heartbeat_busy = false;
+    context->heartbeat_lsn = 0;
+    context->repl.conn = NULL;
+    context->repl.status = 0;
+    context->status = 0;
+}
+
+
+/* Connects to the server again after db_client_disconnect(), and resumes streaming
+ * from the slot at context->repl.fsync_lsn, the position up to which the caller
+ * has durably written all changes. Transactions after that position are sent
+ * again, so the caller must first discard any it has only partly received. Only
+ * possible once the snapshot (if any) is complete, since an interrupted snapshot
+ * cannot be resumed. The frame reader is kept, so the server does not need to
+ * send the schemas that the client already has. */
+int db_client_reconnect(client_context_t context) {
+    int err = 0;
+    bool slot_exists = false;
+
+    if (context->taking_snapshot) {
+        client_error(context, "Cannot reconnect while the snapshot is in progress");
+        return EINVAL;
+    }
+
+    db_client_disconnect(context);
+
+    /* If we lost our lease along with the connection, another client may have
+     * taken over the slot in the meantime. (An error from lease_check() means
+     * just that, and is reported below if the lease cannot be taken again.) */
+    if (context->lease_held) {
+        context->lease_checked = 0;
+        lease_check(context);
+    }
+    if (context->lease && !context->lease_held) {
+        bool acquired = false;
+        check(err, db_client_lease(context, false, &acquired));
+        if (!acquired) {
+            client_error(context, "Replication slot \"%s\" has been taken over by another client",
+                    context->repl.slot_name);
+            return EBUSY;
+        }
+    }
+
+    check(err, client_connect(context));
+    check(err, standby_check(context));
+    check(err, extension_version_check(context));
+    check(err, extension_tables(context));
+    checkRepl(err, context, replication_stream_check(&context->repl));
+    check(err, replication_slot_exists(context, &slot_exists));
+    client_sql_disconnect(context);
+
+    if (!slot_exists) {
+        client_error(context, "Replication slot \"%s\" no longer exists", context->repl.slot_name);
+        return ENOENT;
+    }
+
+    /* The slot may not have heard of our last checkpoints before the connection failed */
+    context->repl.start_lsn = Max(context->repl.start_lsn, context->repl.fsync_lsn);
+    checkRepl(err, context, replication_stream_start(&context->repl, context->error_policy));
+    return err;
+}
+
+
 /* Checks whether new data has arrived from the server (on either the snapshot
  * connection or the replication connection, as appropriate). If yes, it is
  * processed, and context->status is set to 1. If no data is available, this
@@ -133,41 +259,91 @@ int db_client_poll(client_context_t context) {
 
 		/* k4m: make active table list 
          * Got tht signal from the server for updated replication table entry*/
-		if(received_reload_signal){
-			sleep(1);
+		if(received_reload_signal || context->reload_pending){
+			if(received_reload_signal) sleep(1);
 			check(err, client_sql_connect(context));
 			check(err, update_repl_table_entry(context));
 			client_sql_disconnect(context);
 			received_reload_signal = 0;
+			context->reload_pending = false;
 		}
 		/* k4m: make active table list  */
 
         checkRepl(err, context, replication_stream_poll(&context->repl));
         context->status = context->repl.status;
+
+        if (context->taking_snapshot && context->snapshot_chunk_size > 0) {
+            check(err, chunked_snapshot_poll(context));
+        }
+
+        if (context->lease_held && lease_check(context)) check(err, lease_renew(context));
+
+        /* A standby is read-only, so there is nowhere to write heartbeats to */
+        if (context->heartbeat_interval > 0 && !context->on_standby) {
+            if (heartbeat_poll(context)) heartbeat_failed(context);
+        }
         return err;
     }
 }
 
 
+/* Returns true if the replication connection has failed, or the server has ended
+ * the stream, which db_client_reconnect() may be able to recover from. Any other
+ * error (e.g. one returned by a frame reader callback) would only recur after
+ * reconnecting. */
+bool db_client_connection_lost(client_context_t context) {
+    return !context->repl.conn || PQstatus(context->repl.conn) == CONNECTION_BAD ||
+        context->repl.status < 0;
+}
+
+
 /* Blocks until more data is received from the server. You don't have to use
  * this if you have your own select loop. */
 int db_client_wait(client_context_t context) {
+    client_context_t failed;
+    return db_client_wait_many(&context, 1, &failed);
+}
+
+/* Like db_client_wait(), but for a process that streams from several databases:
+ * blocks until more data is received on any of the clients' connections, or for
+ * at most a second. Also returns once a status update to the server falls due,
+ * so that feedback is not delayed by waiting. On failure, sets the error of the
+ * client concerned, points *failed_out at it and returns nonzero. */
+int db_client_wait_many(client_context_t *contexts, int num_contexts, client_context_t *failed_out) {
     fd_set input_mask;
     FD_ZERO(&input_mask);
+    int max_fd = -1;
+    int64 now = current_time();
+    int64 wait_usec = USECS_PER_SEC;
 
-    int rep_fd = PQsocket(context->repl.conn);
-    int max_fd = rep_fd;
-    FD_SET(rep_fd, &input_mask);
+    for (int i = 0; i < num_contexts; i++) {
+        client_context_t context = contexts[i];
 
-    if (context->sql_conn) {
-        int sql_fd = PQsocket(context->sql_conn);
-        if (sql_fd > max_fd) max_fd = sql_fd;
-        FD_SET(sql_fd, &input_mask);
+        int64 feedback_due = replication_stream_feedback_due(&context->repl);
+        if (feedback_due != 0 && feedback_due - now < wait_usec) {
+            wait_usec = feedback_due > now ? feedback_due - now : 0;
+        }
+
+        int rep_fd = PQsocket(context->repl.conn);
+        if (rep_fd > max_fd) max_fd = rep_fd;
+        FD_SET(rep_fd, &input_mask);
+
+        if (context->sql_conn) {
+            int sql_fd = PQsocket(context->sql_conn);
+            if (sql_fd > max_fd) max_fd = sql_fd;
+            FD_SET(sql_fd, &input_mask);
+        }
+
+        if (context->heartbeat_busy) {
+            int heartbeat_fd = PQsocket(context->heartbeat_conn);
+            if (heartbeat_fd > max_fd) max_fd = heartbeat_fd;
+            FD_SET(heartbeat_fd, &input_mask);
+        }
     }
 
     struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+    timeout.tv_sec = wait_usec / USECS_PER_SEC;
+    timeout.tv_usec = wait_usec % USECS_PER_SEC;
 
     int ret = select(max_fd + 1, &input_mask, NULL, NULL, &timeout);
 
@@ -175,19 +351,197 @@ int db_client_wait(client_context_t context) {
         return 0; /* timeout or signal */
     }
     if (ret < 0) {
-        client_error(context, "select() failed: %s", strerror(errno));
+        *failed_out = contexts[0];
+        client_error(contexts[0], "select() failed: %s", strerror(errno));
         return errno;
     }
 
-    /* Data has arrived on the socket */
-    if (!PQconsumeInput(context->repl.conn)) {
-        client_error(context, "Could not receive replication data: %s",
-                PQerrorMessage(context->repl.conn));
+    /* Data has arrived on one of the sockets */
+    for (int i = 0; i < num_contexts; i++) {
+        client_context_t context = contexts[i];
+        *failed_out = context;
+
+        if (!PQconsumeInput(context->repl.conn)) {
+            client_error(context, "Could not receive replication data: %s",
+                    PQerrorMessage(context->repl.conn));
+            return EIO;
+        }
+        if (context->sql_conn && !PQconsumeInput(context->sql_conn)) {
+            client_error(context, "Could not receive snapshot data: %s",
+                    PQerrorMessage(context->sql_conn));
+            return EIO;
+        }
+        /* A heartbeat failure is not fatal; heartbeat_poll() notices and handles it */
+        if (context->heartbeat_busy) PQconsumeInput(context->heartbeat_conn);
+    }
+    *failed_out = NULL;
+    return 0;
+}
+
+
+/* Drives the heartbeat, if enabled. Every context->heartbeat_interval seconds, a
+ * row in the bottledwater_heartbeat table is updated through a separate SQL
+ * connection. The resulting transaction passes through the replication stream
+ * like any other, so it gives the slot something to advance past even when
+ * nothing else in this database is changing. The heartbeat function returns the
+ * WAL insert position after its update; once the client has checkpointed past
+ * that position, the heartbeat has made it all the way through the pipeline,
+ * and the elapsed time is recorded in context->heartbeat_latency. Only one
+ * heartbeat is outstanding at a time. Does not block: the connection is
+ * established in the background by side_connect_poll(), and a heartbeat is sent
+ * on the first poll after it is up. */
+int heartbeat_poll(client_context_t context) {
+    int err = 0;
+    int64 now = current_time();
+
+    if (context->heartbeat_busy) {
+        if (!PQconsumeInput(context->heartbeat_conn)) {
+            client_error(context, "Could not receive heartbeat result: %s",
+                    PQerrorMessage(context->heartbeat_conn));
+            return EIO;
+        }
+        if (PQisBusy(context->heartbeat_conn)) return err;
+        check(err, heartbeat_result(context));
+    }
+
+    if (context->heartbeat_lsn != InvalidXLogRecPtr) {
+        if (context->repl.fsync_lsn < context->heartbeat_lsn) return err;
+
+        context->heartbeat_latency = now - context->heartbeat_sent;
+        context->heartbeat_count++;
+        context->heartbeat_lsn = InvalidXLogRecPtr;
+    }
+
+    if (now - context->heartbeat_sent < context->heartbeat_interval * USECS_PER_SEC) {
+        return err;
+    }
+
+    if (!context->heartbeat_conn) {
+        context->heartbeat_conn = side_connect(context, true);
+        /* As documented for PQconnectStart(), start out as if PQconnectPoll() had
+         * asked to wait for the socket to become writable */
+        context->heartbeat_connecting = PGRES_POLLING_WRITING;
+        context->heartbeat_connect_started = now;
+    }
+    check(err, side_connect_poll(context, context->heartbeat_conn, &context->heartbeat_connecting,
+                context->heartbeat_connect_started, "Heartbeat"));
+    if (context->heartbeat_connecting != PGRES_POLLING_OK) return err;
+
+    Oid argtypes[] = { 19 }; // 19 == NAMEOID
+    const char *args[] = { context->repl.slot_name };
+
+    if (!PQsendQueryParams(context->heartbeat_conn, "SELECT bottledwater_heartbeat($1)",
+                1, argtypes, args, NULL, NULL, 0)) {
+        client_error(context, "Could not send heartbeat: %s",
+                PQerrorMessage(context->heartbeat_conn));
         return EIO;
     }
-    if (context->sql_conn && !PQconsumeInput(context->sql_conn)) {
-        client_error(context, "Could not receive snapshot data: %s",
-                PQerrorMessage(context->sql_conn));
+
+    context->heartbeat_busy = true;
+    context->heartbeat_sent = now;
+    return err;
+}
+
+/* Reads the result of a heartbeat query: the WAL position that the replication
+ * stream needs to pass before the heartbeat counts as delivered. */
+int heartbeat_result(client_context_t context) {
+    int err = 0;
+    PGresult *res;
+
+    while ((res = PQgetResult(context->heartbeat_conn)) != NULL) {
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            client_error(context, "Heartbeat failed: %s", PQresultErrorMessage(res));
+            err = EIO;
+        } else if (PQntuples(res) == 1 && !PQgetisnull(res, 0, 0)) {
+            uint32 h32=0, l32=0;
+            if (sscanf(PQgetvalue(res, 0, 0), "%X/%X", &h32, &l32) != 2) {
+                client_error(context, "Could not parse heartbeat LSN: \"%s\"", PQgetvalue(res, 0, 0));
+                err = EIO;
+            } else {
+                context->heartbeat_lsn = ((uint64) h32) << 32 | l32;
+            }
+        }
+        PQclear(res);
+    }
+
+    context->heartbeat_busy = false;
+    return err;
+}
+
+/* Called when a heartbeat could not be sent or its result could not be read,
+ * e.g. because the database is briefly unavailable. That does not stop the
+ * replication stream, so rather than failing the client, the heartbeat
+ * connection is closed, the error is kept in context->heartbeat_error for the
+ * caller to log, and the next heartbeat is attempted after the usual interval. */
+void heartbeat_failed(client_context_t context) {
+    memcpy(context->heartbeat_error, context->error, CLIENT_CONTEXT_ERROR_LEN);
+    context->error[0] = '\0';
+    context->heartbeat_failures++;
+
+    if (context->heartbeat_conn) PQfinish(context->heartbeat_conn);
+    context->heartbeat_conn = NULL;
+    context->heartbeat_busy = false;
+    context->heartbeat_lsn = InvalidXLogRecPtr;
+    context->heartbeat_sent = current_time();
+}
+
+/* Opens an SQL connection for heartbeats or the lease. These run alongside the
+ * replication stream, so connecting must not hold it up for long when the server
+ * is slow to answer: unless the connection string sets its own connect_timeout,
+ * a blocking connection attempt gives up after SIDE_CONNECT_TIMEOUT_SEC. If
+ * nonblocking is true, the connection is only started, and must be completed by
+ * calling side_connect_poll() until it is up. Returns NULL only if out of memory. */
+PGconn *side_connect(client_context_t context, bool nonblocking) {
+    char timeout[16];
+    snprintf(timeout, sizeof(timeout), "%d", SIDE_CONNECT_TIMEOUT_SEC);
+
+    /* Settings in the expanded connection string override those before it */
+    const char *keys[] = { "connect_timeout", "dbname", NULL };
+    const char *values[] = { timeout, context->conninfo, NULL };
+
+    if (nonblocking) return PQconnectStartParams(keys, values, true);
+    return PQconnectdbParams(keys, values, true);
+}
+
+/* Takes a connection started by side_connect() one step further, if its socket is
+ * ready, without blocking. *status holds the last result of PQconnectPoll(), and
+ * is PGRES_POLLING_OK once the connection is up. libpq does not enforce
+ * connect_timeout on a nonblocking connection, so the attempt is abandoned here
+ * once SIDE_CONNECT_TIMEOUT_SEC have passed since started. */
+int side_connect_poll(client_context_t context, PGconn *conn, PostgresPollingStatusType *status,
+        int64 started, const char *what) {
+    if (*status == PGRES_POLLING_OK) return 0;
+
+    if (!conn || PQstatus(conn) == CONNECTION_BAD) {
+        client_error(context, "%s connection failed: %s", what,
+                conn ? PQerrorMessage(conn) : "out of memory");
+        return EIO;
+    }
+    if (current_time() - started >= SIDE_CONNECT_TIMEOUT_SEC * USECS_PER_SEC) {
+        client_error(context, "%s connection failed: timeout expired after %d seconds",
+                what, SIDE_CONNECT_TIMEOUT_SEC);
+        return ETIMEDOUT;
+    }
+
+    /* PQconnectPoll() may only be called once the socket is ready */
+    int fd = PQsocket(conn);
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    struct timeval no_wait = { 0, 0 };
+    int ret = *status == PGRES_POLLING_READING ?
+        select(fd + 1, &fds, NULL, NULL, &no_wait) :
+        select(fd + 1, NULL, &fds, NULL, &no_wait);
+
+    if (ret == 0 || (ret < 0 && errno == EINTR)) return 0;
+    if (ret < 0) {
+        client_error(context, "select() failed: %s", strerror(errno));
+        return errno;
+    }
+
+    *status = PQconnectPoll(conn);
+    if (*status == PGRES_POLLING_FAILED) {
+        client_error(context, "%s connection failed: %s", what, PQerrorMessage(conn));
         return EIO;
     }
     return 0;
@@ -217,6 +571,229 @@ int exec_sql(client_context_t context, char *query) {
 }
 
 
+/* Tries to take the lease on the replication slot: a session-level advisory lock,
+ * keyed by the slot name, which is held on a separate connection for as long as
+ * the client streams from the slot. Only one client at a time can hold it, so a
+ * client standing by on another host can call this function periodically, and is
+ * granted the lease once the session of the active client ends. So that this does
+ * not take as long as the server's TCP timeout when the active client's host
+ * disappears, the lease connection asks the server to probe it every second.
+ *
+ * If take_over is true and the lease is granted, any walsender still streaming
+ * from the slot (left over from the previous holder) is terminated, so that the
+ * slot can be used straight away. Sets *acquired to whether the lease is held. */
+int db_client_lease(client_context_t context, bool take_over, bool *acquired) {
+    int err = 0;
+    *acquired = context->lease_held;
+    if (context->lease_held) return err;
+
+    if (!context->lease_conn) {
+        context->lease_conn = side_connect(context, false);
+        if (PQstatus(context->lease_conn) != CONNECTION_OK) {
+            client_error(context, "Lease connection failed: %s", PQerrorMessage(context->lease_conn));
+            lease_release(context);
+            return EIO;
+        }
+
+        PGresult *res = PQexec(context->lease_conn, LEASE_KEEPALIVE_SQL);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            client_error(context, "Could not set up lease connection: %s",
+                    PQerrorMessage(context->lease_conn));
+            PQclear(res);
+            lease_release(context);
+            return EIO;
+        }
+        PQclear(res);
+    }
+
+    Oid argtypes[] = { 25 }; // 25 == TEXTOID
+    const char *args[] = { context->repl.slot_name };
+    PGresult *res = PQexecParams(context->lease_conn,
+            "SELECT pg_try_advisory_lock(hashtext('bottledwater'), hashtext($1))",
+            1, argtypes, args, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not take lease on replication slot: %s",
+                PQerrorMessage(context->lease_conn));
+        PQclear(res);
+        lease_release(context);
+        return EIO;
+    }
+
+    context->lease_held = !strcmp(PQgetvalue(res, 0, 0), "t");
+    context->lease_checked = current_time();
+    *acquired = context->lease_held;
+    PQclear(res);
+
+    if (context->lease_held && take_over) check(err, lease_take_over(context));
+    return err;
+}
+
+/* Called when a client that was standing by has just been granted the lease.
+ * The server may not yet have noticed that the previous holder is gone, in which
+ * case its walsender is terminated. Waits for the slot to become free. */
+int lease_take_over(client_context_t context) {
+    Oid argtypes[] = { 19 }; // 19 == NAMEOID
+    const char *args[] = { context->repl.slot_name };
+
+    PGresult *res = PQexecParams(context->lease_conn,
+            "SELECT pg_terminate_backend(active_pid) FROM pg_replication_slots "
+            "WHERE slot_name = $1 AND active_pid IS NOT NULL",
+            1, argtypes, args, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not terminate previous user of replication slot: %s",
+                PQerrorMessage(context->lease_conn));
+        PQclear(res); return EIO;
+    }
+    PQclear(res);
+
+    for (int i = 0; i < LEASE_TAKEOVER_WAIT_MSEC / 100; i++) {
+        res = PQexecParams(context->lease_conn,
+                "SELECT active FROM pg_replication_slots WHERE slot_name = $1",
+                1, argtypes, args, NULL, NULL, 0);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            client_error(context, "Could not check whether replication slot is in use: %s",
+                    PQerrorMessage(context->lease_conn));
+            PQclear(res); return EIO;
+        }
+
+        bool active = PQntuples(res) > 0 && !strcmp(PQgetvalue(res, 0, 0), "t");
+        PQclear(res);
+        if (!active) return 0;
+        struct timespec delay = { 0, 100000000 };
+        nanosleep(&delay, NULL);
+    }
+
+    client_error(context, "Replication slot \"%s\" is still in use by another process",
+            context->repl.slot_name);
+    return EBUSY;
+}
+
+/* Checks, at most every LEASE_CHECK_INTERVAL_SEC, that the connection holding the
+ * lease is still up. If it is not, the server has released the lock (or will do
+ * so shortly), and another client may take over the slot; the lease is given up
+ * and an error returned. An idle connection to a server that has gone away (e.g.
+ * whose host lost power) would look healthy, so each check sends a trivial query,
+ * and the connection counts as lost if the previous one has not been answered
+ * within LEASE_PROBE_TIMEOUT_SEC. Does not block. */
+int lease_check(client_context_t context) {
+    int64 now = current_time();
+    if (now - context->lease_checked < LEASE_CHECK_INTERVAL_SEC * USECS_PER_SEC) return 0;
+    context->lease_checked = now;
+
+    if (!PQconsumeInput(context->lease_conn) || PQstatus(context->lease_conn) != CONNECTION_OK) {
+        client_error(context, "Lost lease on replication slot \"%s\": %s",
+                context->repl.slot_name, PQerrorMessage(context->lease_conn));
+        lease_release(context);
+        return EIO;
+    }
+
+    if (context->lease_probe_busy) {
+        if (PQisBusy(context->lease_conn)) {
+            if (now - context->lease_probe_sent < LEASE_PROBE_TIMEOUT_SEC * USECS_PER_SEC) return 0;
+            client_error(context, "Lost lease on replication slot \"%s\": server did not respond "
+                    "within %d seconds", context->repl.slot_name, LEASE_PROBE_TIMEOUT_SEC);
+            lease_release(context);
+            return EIO;
+        }
+
+        PGresult *res;
+        bool ok = true;
+        while ((res = PQgetResult(context->lease_conn))) {
+            if (PQresultStatus(res) != PGRES_TUPLES_OK) ok = false;
+            PQclear(res);
+        }
+        if (!ok) {
+            client_error(context, "Lost lease on replication slot \"%s\": %s",
+                    context->repl.slot_name, PQerrorMessage(context->lease_conn));
+            lease_release(context);
+            return EIO;
+        }
+        context->lease_probe_busy = false;
+    }
+
+    if (!PQsendQuery(context->lease_conn, "SELECT 1")) {
+        client_error(context, "Lost lease on replication slot \"%s\": %s",
+                context->repl.slot_name, PQerrorMessage(context->lease_conn));
+        lease_release(context);
+        return EIO;
+    }
+    context->lease_probe_busy = true;
+    context->lease_probe_sent = now;
+    return 0;
+}
+
+/* Called when lease_check() finds that the lease connection has failed while the
+ * replication connection carries on. Tries straight away to take the lease again on
+ * a new connection; if that works, nothing was lost, as no other client can have
+ * taken over the slot while the walsender is still streaming it to us. This happens
+ * at most once per failure, and connecting blocks for at most SIDE_CONNECT_TIMEOUT_SEC
+ * (see side_connect()) before streaming stops with an error. Records the
+ * failure in context->lease_error and lease_renewals. Returns an error if the lease
+ * cannot be taken again, in which case streaming must stop. */
+int lease_renew(client_context_t context) {
+    int err = 0;
+    bool acquired = false;
+    memcpy(context->lease_error, context->error, CLIENT_CONTEXT_ERROR_LEN);
+    context->error[0] = '\0';
+
+    check(err, db_client_lease(context, false, &acquired));
+    if (!acquired) {
+        client_error(context, "Replication slot \"%s\" has been taken over by another client",
+                context->repl.slot_name);
+        return EBUSY;
+    }
+    context->lease_renewals++;
+    return err;
+}
+
+/* Closes the lease connection, which releases the lease if it was held. */
+void lease_release(client_context_t context) {
+    if (context->lease_conn) PQfinish(context->lease_conn);
+    context->lease_conn = NULL;
+    context->lease_held = false;
+    context->lease_probe_busy = false;
+}
+
+/* Loads the schemas of the tables in the active table list (tbl_mapps, see
+ * update_repl_table_entry()) into the frame reader, as bottledwater_row_schema()
+ * and bottledwater_key_schema() generate them, passing each to the frame reader's
+ * on_table_schema callback. A client standing by to take over the slot calls this
+ * so that it has its topics and registered schemas ready, and the server can skip
+ * sending the schemas, when it starts streaming. The key condition mirrors
+ * table_key_index() in the output plugin. */
+int db_client_preload_schemas(client_context_t context) {
+    int err = 0;
+    check(err, client_sql_connect(context));
+
+    PGresult *res = PQexec(context->sql_conn,
+            "SELECT c.oid, "
+            "CASE WHEN c.relreplident <> 'n' AND EXISTS ("
+            "  SELECT 1 FROM pg_index i WHERE i.indrelid = c.oid AND i.indisvalid AND i.indisready"
+            "  AND (i.indisprimary OR (c.relreplident = 'i' AND i.indisreplident))) "
+            "THEN bottledwater_key_schema(c.oid::regclass::text) END, "
+            "bottledwater_row_schema(c.oid::regclass::text) "
+            "FROM tbl_mapps m JOIN pg_class c ON c.oid = m.reloid ORDER BY c.oid");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not generate table schemas: %s", PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        client_sql_disconnect(context);
+        return EIO;
+    }
+
+    for (int i = 0; i < PQntuples(res) && !err; i++) {
+        bool keyed = !PQgetisnull(res, i, 1);
+        err = frame_reader_preload_schema(context->repl.frame_reader, (Oid) atoll(PQgetvalue(res, i, 0)),
+                keyed ? PQgetvalue(res, i, 1) : NULL, keyed ? PQgetlength(res, i, 1) : 0,
+                PQgetvalue(res, i, 2), PQgetlength(res, i, 2));
+        if (err) strncpy(context->error, context->repl.frame_reader->error, CLIENT_CONTEXT_ERROR_LEN);
+    }
+
+    PQclear(res);
+    client_sql_disconnect(context);
+    return err;
+}
+
+
 /* Establishes two network connections to a Postgres server: one for SQL, and one
  * for replication. context->conninfo contains the connection string or URL to connect
  * to, and context->app_name is the client name (which appears, for example, in
@@ -291,6 +868,105 @@ void client_sql_disconnect(client_context_t context) {
 }
 
 
+/* Finds out whether the server is a hot standby, and if so, whether it is able
+ * to do logical decoding. Decoding on a standby needs Postgres 16 or later, and
+ * wal_level = logical on the primary (which the server checks itself when the
+ * slot is created). Without hot_standby_feedback, the primary may vacuum away
+ * catalog rows that the slot still needs, which invalidates the slot; that is
+ * not an error here, but the caller is expected to warn about it.
+ *
+ * If the standby is later promoted, the slot survives, and the next
+ * db_client_start() finds the server is no longer in recovery. */
+int standby_check(client_context_t context) {
+    int err = 0;
+    PGresult *res = PQexec(context->sql_conn,
+            "SELECT pg_is_in_recovery(), current_setting('hot_standby_feedback')");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+        client_error(context, "Could not check whether server is a standby: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res); return EIO;
+    }
+
+    context->on_standby = !strcmp(PQgetvalue(res, 0, 0), "t");
+    context->standby_feedback = !strcmp(PQgetvalue(res, 0, 1), "on");
+    context->repl.on_standby = context->on_standby;
+
+    if (context->on_standby && PQserverVersion(context->sql_conn) < 160000) {
+        client_error(context, "Server is a standby running Postgres %d; logical decoding "
+                "on a standby requires Postgres 16 or later",
+                PQserverVersion(context->sql_conn) / 10000);
+        err = EINVAL;
+    }
+
+    PQclear(res);
+    return err;
+}
+
+
+/* Looks up the relids of the extension's own tables, so that applications can
+ * recognise their changes whichever schema the extension was installed in. They
+ * are left as InvalidOid if the extension is not installed in this database. */
+int extension_tables(client_context_t context) {
+    PGresult *res = PQexec(context->sql_conn,
+            "SELECT c.oid, c.relname FROM pg_extension e "
+            "JOIN pg_depend d ON d.refclassid = 'pg_extension'::regclass AND d.refobjid = e.oid "
+            "JOIN pg_class c ON d.classid = 'pg_class'::regclass AND d.objid = c.oid "
+            "WHERE e.extname = 'bottledwater' AND d.deptype = 'e' AND c.relkind = 'r'");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not look up the extension's tables: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    context->heartbeat_relid = InvalidOid;
+    context->watermark_relid = InvalidOid;
+
+    for (int i = 0; i < PQntuples(res); i++) {
+        Oid relid = (Oid) strtoul(PQgetvalue(res, i, 0), NULL, 10);
+        if (!strcmp(PQgetvalue(res, i, 1), HEARTBEAT_TABLE)) context->heartbeat_relid = relid;
+        if (!strcmp(PQgetvalue(res, i, 1), WATERMARK_TABLE)) context->watermark_relid = relid;
+    }
+
+    PQclear(res);
+    return 0;
+}
+
+
+/* Checks that the extension in this database is at least the version this client
+ * was built for. Upgrading the extension's files replaces the output plugin, but
+ * a database keeps the older version of the extension's SQL objects, which this
+ * client cannot use, until ALTER EXTENSION bottledwater UPDATE is run. Conversely,
+ * an older output plugin would ignore the "protocol_version" option, and send
+ * frames that the client's frame reader cannot decode. If the extension is not
+ * installed in this database, there is nothing to check. */
+int extension_version_check(client_context_t context) {
+    PGresult *res = PQexec(context->sql_conn,
+            "SELECT extversion FROM pg_extension WHERE extname = 'bottledwater'");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        client_error(context, "Could not look up the extension's version: %s",
+                PQerrorMessage(context->sql_conn));
+        PQclear(res);
+        return EIO;
+    }
+
+    int err = 0, major = 0, minor = 0;
+    if (PQntuples(res) == 1 &&
+            (sscanf(PQgetvalue(res, 0, 0), "%d.%d", &major, &minor) != 2 ||
+             major < EXTENSION_VERSION_MAJOR ||
+             (major == EXTENSION_VERSION_MAJOR && minor < EXTENSION_VERSION_MINOR))) {
+        client_error(context, "Extension bottledwater is at version %s in this database, but this "
+                "client needs version %d.%d or later. Install the new version of the extension, "
+                "and run ALTER EXTENSION bottledwater UPDATE", PQgetvalue(res, 0, 0),
+                EXTENSION_VERSION_MAJOR, EXTENSION_VERSION_MINOR);
+        err = EINVAL;
+    }
+
+    PQclear(res);
+    return err;
+}
+
+
 /* Sets *exists to true if a replication slot with the name context->repl.slot_name
  * already exists, and false if not. In addition, if the slot already exists,
  * context->repl.start_lsn is filled in with the LSN at which the client should
@@ -305,8 +981,20 @@ int replication_slot_exists(client_context_t context, bool *exists) {
     Oid argtypes[] = { 19 }; // 19 == NAMEOID
     const char *args[] = { context->repl.slot_name };
 
-    PGresult *res = PQexecParams(context->sql_conn,
-            "SELECT restart_lsn FROM pg_replication_slots where slot_name = $1",
+    /* A slot whose WAL has been removed (Postgres 13+), or which conflicted with
+     * recovery on a standby (Postgres 16+), can no longer be streamed from. */
+    const char *query;
+    if (PQserverVersion(context->sql_conn) >= 160000) {
+        query = "SELECT restart_lsn, wal_status = 'lost' OR conflicting "
+                "FROM pg_replication_slots where slot_name = $1";
+    } else if (PQserverVersion(context->sql_conn) >= 130000) {
+        query = "SELECT restart_lsn, wal_status = 'lost' "
+                "FROM pg_replication_slots where slot_name = $1";
+    } else {
+        query = "SELECT restart_lsn, false FROM pg_replication_slots where slot_name = $1";
+    }
+
+    PGresult *res = PQexecParams(context->sql_conn, query,
             1, argtypes, args, NULL, NULL, 0);
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         client_error(context, "Could not check for existing replication slot: %s",
@@ -315,6 +1003,14 @@ int replication_slot_exists(client_context_t context, bool *exists) {
         PQclear(res); return err;
     }
 
+    if (PQntuples(res) > 0 && !strcmp(PQgetvalue(res, 0, 1), "t")) {
+        client_error(context, "Replication slot \"%s\" has been invalidated%s; drop it "
+                "with pg_drop_replication_slot() to start again from a new snapshot",
+                context->repl.slot_name,
+                context->on_standby ? " (on a standby, check hot_standby_feedback)" : "");
+        PQclear(res); return EIO;
+    }
+
     *exists = (PQntuples(res) > 0 && !PQgetisnull(res, 0, 0));
 
     if (*exists) {
@@ -349,18 +1045,28 @@ int snapshot_start(client_context_t context) {
     PQExpBuffer query = createPQExpBuffer();
     appendPQExpBuffer(query, "SET TRANSACTION SNAPSHOT '%s'", context->repl.snapshot_name);
     check(err, exec_sql(context, query->data));
+
+    /* Ask for the frames that the frame reader understands */
+    resetPQExpBuffer(query);
+    appendPQExpBuffer(query, "SET LOCAL bottledwater.protocol_version = %d", PROTOCOL_VERSION);
+    check(err, exec_sql(context, query->data));
     destroyPQExpBuffer(query);
 
-    Oid argtypes[] = { 25, 16, 25 }; // 25 == TEXTOID, 16 == BOOLOID
+    Oid argtypes[] = { 25, 16, 25, 25, 25 }; // 25 == TEXTOID, 16 == BOOLOID
     const char *args[] = {
         "%",
         context->allow_unkeyed ? "t" : "f",
-        context->error_policy
+        context->error_policy,
+        context->repl.shard ? context->repl.shard : "",
+        context->repl.shard_key_tables ? context->repl.shard_key_tables : ""
     };
 
-    if (!PQsendQueryParams(context->sql_conn,
-                "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2, error_policy := $3)",
-                3, argtypes, args, NULL, NULL, 1)) { // The final 1 requests results in binary format
+    const char *sql =
+        "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2, error_policy := $3, "
+        "shard := $4, shard_key_tables := $5)";
+
+    if (!PQsendQueryParams(context->sql_conn, sql, 5,
+                argtypes, args, NULL, NULL, 1)) { // The final 1 requests results in binary format
         client_error(context, "Could not dispatch snapshot fetch: %s",
                 PQerrorMessage(context->sql_conn));
         return EIO;
@@ -375,11 +1081,49 @@ int snapshot_start(client_context_t context) {
     begin_txn_cb begin_txn = context->repl.frame_reader->on_begin_txn;
     void *cb_context = context->repl.frame_reader->cb_context;
     if (begin_txn) {
-        check(err, begin_txn(cb_context, context->repl.start_lsn, 0));
+        check(err, begin_txn(cb_context, context->repl.start_lsn, 0, 0));
     }
     return 0;
 }
 
+/* Starts a snapshot that reads the tables in chunks while the replication stream
+ * runs, instead of in one transaction before it. Writing the watermarks needs a
+ * primary, so this is not possible on a standby. */
+int chunked_snapshot_start(client_context_t context) {
+    int err = 0;
+    chunk_snapshot_t chunks = &context->chunks;
+
+    if (context->on_standby) {
+        client_error(context, "A chunked snapshot cannot be taken on a standby");
+        return EINVAL;
+    }
+
+    chunks->slot_name = strdup(context->repl.slot_name);
+    if (context->repl.shard) chunks->shard = strdup(context->repl.shard);
+    if (context->repl.shard_key_tables) chunks->shard_key_tables = strdup(context->repl.shard_key_tables);
+    chunks->chunk_size = context->snapshot_chunk_size;
+
+    err = chunk_snapshot_start(chunks, context->conninfo, context->repl.frame_reader);
+    if (err) strncpy(context->error, chunks->error, CLIENT_CONTEXT_ERROR_LEN);
+    return err;
+}
+
+/* Reads the next chunk of the snapshot if the previous one has been passed on, and
+ * ends the snapshot once the last chunk has been checkpointed. */
+int chunked_snapshot_poll(client_context_t context) {
+    int err = chunk_snapshot_poll(&context->chunks);
+    if (err) {
+        strncpy(context->error, context->chunks.error, CLIENT_CONTEXT_ERROR_LEN);
+        return err;
+    }
+
+    if (chunk_snapshot_complete(&context->chunks, context->repl.fsync_lsn)) {
+        context->taking_snapshot = false;
+        chunk_snapshot_free(&context->chunks);
+    }
+    return err;
+}
+
 /* Reads the next result row from the snapshot query, parses and processes it.
  * Blocks until a new row is available, if necessary. */
 int snapshot_poll(client_context_t context) {
@@ -395,7 +1139,7 @@ int snapshot_poll(client_context_t context) {
         commit_txn_cb on_commit = context->repl.frame_reader->on_commit_txn;
         void *cb_context = context->repl.frame_reader->cb_context;
         if (on_commit) {
-            check(err, on_commit(cb_context, context->repl.start_lsn, 0));
+            check(err, on_commit(cb_context, context->repl.start_lsn, 0, 0));
         }
         return 0;
     }
@@ -432,6 +1176,10 @@ int snapshot_tuple(client_context_t context, PGresult *res, int row_number) {
         return EIO;
     }
 
+    /* Snapshot rows are not sent by a walsender, so there is no send time */
+    context->repl.frame_send_time = 0;
+    context->repl.frame_recv_time = current_time();
+
     /* wal_pos == 0 == InvalidXLogRecPtr */
     int err = parse_frame(context->repl.frame_reader, 0, PQgetvalue(res, row_number, 0),
             PQgetlength(res, row_number, 0));
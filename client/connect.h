@@ -1,10 +1,16 @@
 #ifndef CONNECT_H
 #define CONNECT_H
 
+#include "chunk_snapshot.h"
 #include "replication.h"
 
 #define CLIENT_CONTEXT_ERROR_LEN 512
 
+/* Tables that the extension creates for its own use (see bottledwater--0.2.sql). Their
+ * changes only serve to advance the replication slot, and applications skip them. */
+#define HEARTBEAT_TABLE "bottledwater_heartbeat"
+#define WATERMARK_TABLE "bottledwater_watermark"
+
 typedef struct {
     char *conninfo, *app_name;
     char *error_policy;
@@ -13,7 +19,33 @@ typedef struct {
     bool allow_unkeyed;
     bool skip_snapshot;
     bool taking_snapshot;
+    int snapshot_chunk_size;         /* Read the snapshot in chunks of this many rows while streaming; 0 = in one transaction */
+    chunk_snapshot chunks;           /* State of the chunked snapshot, if one is being taken */
     bool slot_created;
+    bool on_standby;                 /* Connected to a hot standby rather than a primary */
+    bool standby_feedback;           /* hot_standby_feedback is on (only checked on a standby) */
+    bool reload_pending;             /* Reload the active table list before the next poll (k4m) */
+    Oid heartbeat_relid;             /* HEARTBEAT_TABLE in this database, or InvalidOid */
+    Oid watermark_relid;             /* WATERMARK_TABLE in this database, or InvalidOid */
+    PGconn *heartbeat_conn;          /* SQL connection for heartbeats, opened on first use */
+    PostgresPollingStatusType heartbeat_connecting; /* PQconnectPoll() status of heartbeat_conn; PGRES_POLLING_OK once connected */
+    int64 heartbeat_connect_started; /* current_time() at which heartbeat_conn started connecting */
+    int heartbeat_interval;          /* Seconds between heartbeats; 0 disables heartbeats */
+    bool heartbeat_busy;             /* Heartbeat query sent, result not yet received */
+    int64 heartbeat_sent;            /* current_time() at which the last heartbeat was sent */
+    XLogRecPtr heartbeat_lsn;        /* WAL position the last heartbeat must pass, or 0 */
+    int64 heartbeat_latency;         /* Microseconds from sending to checkpointing the last heartbeat */
+    uint64_t heartbeat_count;        /* Number of heartbeats that have completed */
+    uint64_t heartbeat_failures;     /* Number of heartbeats that have failed */
+    char heartbeat_error[CLIENT_CONTEXT_ERROR_LEN]; /* Why the last heartbeat failed */
+    bool lease;                      /* Hold the slot's lease while streaming (see db_client_lease()) */
+    PGconn *lease_conn;              /* SQL connection on which the lease is taken */
+    bool lease_held;                 /* The lease has been granted on lease_conn */
+    int64 lease_checked;             /* current_time() at which lease_conn was last checked */
+    bool lease_probe_busy;           /* Probe query sent on lease_conn, result not yet received */
+    int64 lease_probe_sent;          /* current_time() at which that probe was sent */
+    uint64_t lease_renewals;         /* Number of times the lease was taken again after lease_conn failed */
+    char lease_error[CLIENT_CONTEXT_ERROR_LEN]; /* Why lease_conn last failed */
     int status; /* 1 = message was processed on last poll; 0 = no data available right now; -1 = stream ended */
     char error[CLIENT_CONTEXT_ERROR_LEN];
 } client_context;
@@ -25,6 +57,12 @@ void db_client_free(client_context_t context);
 void db_client_set_error_policy(client_context_t context, const char *policy);
 int db_client_start(client_context_t context);
 int db_client_poll(client_context_t context);
+void db_client_disconnect(client_context_t context);
+int db_client_reconnect(client_context_t context);
+bool db_client_connection_lost(client_context_t context);
+int db_client_lease(client_context_t context, bool take_over, bool *acquired);
+int db_client_preload_schemas(client_context_t context);
 int db_client_wait(client_context_t context);
+int db_client_wait_many(client_context_t *contexts, int num_contexts, client_context_t *failed_out);
 
 #endif /* CONNECT_H */
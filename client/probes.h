@@ -0,0 +1 @@
+../ext/probes.h
\ No newline at end of file
@@ -2,12 +2,16 @@
  * and the client application. */
 
 #include "protocol_client.h"
+#include "probes.h"
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define check(err, call) { err = call; if (err) return err; }
 
+/* Fingerprint of no data, as in the output plugin's schema cache */
+#define CRC64_AVRO_EMPTY 0xc15d213aa4d7a795ULL
+
 #define check_handle(err, reader, call, fmt, ...) \
     do { \
         err = call; \
@@ -46,12 +50,22 @@ int process_frame_begin_txn(avro_value_t *record_val, frame_reader_t reader, uin
 int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int table_schema_known(frame_reader_t reader, uint64_t wal_pos, int64_t relid, known_schema *known);
 int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
+int process_frame_truncate(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 schema_list_entry *schema_list_lookup(frame_reader_t reader, int64_t relid);
 schema_list_entry *schema_list_replace(frame_reader_t reader, int64_t relid);
 schema_list_entry *schema_list_entry_new(frame_reader_t reader);
-void schema_list_entry_decrefs(schema_list_entry *entry);
+int schema_list_entry_values(frame_reader_t reader, schema_list_entry *entry);
+void schema_list_entry_free_values(frame_reader_t reader, schema_list_entry *entry);
+void schema_list_entry_decrefs(frame_reader_t reader, schema_list_entry *entry);
+known_schema *known_schema_lookup(frame_reader_t reader, uint64_t fingerprint);
+int known_schema_add(frame_reader_t reader, uint64_t fingerprint,
+        const char *key_schema_json, size_t key_schema_len,
+        const char *row_schema_json, size_t row_schema_len, known_schema **known_out);
+char *copy_json(const char *json, size_t len);
+uint64_t schema_fingerprint(uint64_t fp, const char *json, size_t len);
 int read_entirely(frame_reader_t reader, avro_value_t *value, avro_reader_t avro_reader, const void *buf, size_t len);
 
 int frame_reader_handle(frame_reader_t reader, int err, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
@@ -59,8 +73,10 @@ int frame_reader_handle(frame_reader_t reader, int err, const char *fmt, ...) __
 
 int parse_frame(frame_reader_t reader, uint64_t wal_pos, char *buf, int buflen) {
     int err = 0;
-    check(err, read_entirely(reader, &reader->frame_value, reader->avro_reader, buf, buflen));
-    check(err, process_frame(&reader->frame_value, reader, wal_pos));
+    BW_PROBE2(frame__start, wal_pos, buflen);
+    err = read_entirely(reader, &reader->frame_value, reader->avro_reader, buf, buflen);
+    if (!err) err = process_frame(&reader->frame_value, reader, wal_pos);
+    BW_PROBE2(frame__done, wal_pos, err);
     return err;
 }
 
@@ -97,6 +113,9 @@ int process_frame(avro_value_t *frame_val, frame_reader_t reader, uint64_t wal_p
             case PROTOCOL_MSG_DELETE:
                 check(err, process_frame_delete(&record_val, reader, wal_pos));
                 break;
+            case PROTOCOL_MSG_TRUNCATE:
+                check(err, process_frame_truncate(&record_val, reader, wal_pos));
+                break;
             default:
                 return frame_reader_handle(reader, EINVAL,
                         "Unknown message type %d", msg_type);
@@ -107,14 +126,20 @@ int process_frame(avro_value_t *frame_val, frame_reader_t reader, uint64_t wal_p
 
 int process_frame_begin_txn(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
     int err = 0;
-    avro_value_t xid_val;
-    int64_t xid;
+    avro_value_t xid_val, time_val;
+    int64_t xid, commit_time;
 
     check_avro(err, reader, avro_value_get_by_index(record_val, 0, &xid_val, NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &time_val, NULL));
     check_avro(err, reader, avro_value_get_long(&xid_val, &xid));
+    check_avro(err, reader, avro_value_get_long(&time_val, &commit_time));
 
+    if (reader->tap_begin_txn) {
+        check_handle(err, reader, reader->tap_begin_txn(reader->tap_context, wal_pos, (uint32_t) xid, commit_time),
+                "error in begin_txn tap for xid %" PRIu64, xid);
+    }
     if (reader->on_begin_txn) {
-        check_handle(err, reader, reader->on_begin_txn(reader->cb_context, wal_pos, (uint32_t) xid),
+        check_handle(err, reader, reader->on_begin_txn(reader->cb_context, wal_pos, (uint32_t) xid, commit_time),
                 "error in begin_txn callback for xid %" PRIu64, xid);
     }
     return err;
@@ -122,14 +147,20 @@ int process_frame_begin_txn(avro_value_t *record_val, frame_reader_t reader, uin
 
 int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
     int err = 0;
-    avro_value_t xid_val;
-    int64_t xid;
+    avro_value_t xid_val, time_val;
+    int64_t xid, commit_time;
 
     check_avro(err, reader, avro_value_get_by_index(record_val, 0, &xid_val, NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &time_val, NULL));
     check_avro(err, reader, avro_value_get_long(&xid_val, &xid));
+    check_avro(err, reader, avro_value_get_long(&time_val, &commit_time));
 
+    if (reader->tap_commit_txn) {
+        check_handle(err, reader, reader->tap_commit_txn(reader->tap_context, wal_pos, (uint32_t) xid, commit_time),
+                "error in commit_txn tap for xid %" PRIu64, xid);
+    }
     if (reader->on_commit_txn) {
-        check_handle(err, reader, reader->on_commit_txn(reader->cb_context, wal_pos, (uint32_t) xid),
+        check_handle(err, reader, reader->on_commit_txn(reader->cb_context, wal_pos, (uint32_t) xid, commit_time),
                 "error in commit_txn callback for xid %" PRIu64, xid);
     }
     return err;
@@ -137,44 +168,59 @@ int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, ui
 
 int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
     int err = 0, key_schema_present=0;
-    avro_value_t relid_val, key_schema_val, row_schema_val, branch_val;
-    int64_t relid=0;
+    avro_value_t relid_val, key_schema_val, row_schema_val, fingerprint_val, branch_val;
+    int64_t relid=0, fingerprint=0;
     const char *key_schema_json = NULL, *row_schema_json;
     size_t key_schema_len = 1, row_schema_len;
-    avro_schema_t key_schema = NULL, row_schema;
 
-    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &relid_val,      NULL));
-    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &key_schema_val, NULL));
-    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &row_schema_val, NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &relid_val,       NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 1, &key_schema_val,  NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 2, &row_schema_val,  NULL));
+    check_avro(err, reader, avro_value_get_by_index(record_val, 3, &fingerprint_val, NULL));
     check_avro(err, reader, avro_value_get_long(&relid_val, &relid));
+    check_avro(err, reader, avro_value_get_long(&fingerprint_val, &fingerprint));
     check_avro(err, reader, avro_value_get_discriminant(&key_schema_val, &key_schema_present));
     check_avro(err, reader, avro_value_get_string(&row_schema_val, &row_schema_json, &row_schema_len));
-    check_avro(err, reader, avro_schema_from_json_length(row_schema_json, row_schema_len - 1, &row_schema));
-
-    schema_list_entry *entry = schema_list_replace(reader, relid);
-    entry->relid = relid;
-    entry->row_schema = row_schema;
-    entry->row_iface = avro_generic_class_from_schema(row_schema);
-    avro_generic_value_new(entry->row_iface, &entry->row_value);
-    avro_generic_value_new(entry->row_iface, &entry->old_value);
-    entry->avro_reader = avro_reader_memory(NULL, 0);
 
     if (key_schema_present) {
         check_avro(err, reader, avro_value_get_current_branch(&key_schema_val, &branch_val));
         check_avro(err, reader, avro_value_get_string(&branch_val, &key_schema_json, &key_schema_len));
-        check_avro(err, reader, avro_schema_from_json_length(key_schema_json, key_schema_len - 1, &key_schema));
-        entry->key_schema = key_schema;
-        entry->key_iface = avro_generic_class_from_schema(key_schema);
-        avro_generic_value_new(entry->key_iface, &entry->key_value);
-    } else {
-        entry->key_schema = NULL;
     }
 
+    /* If we have seen these schemas before (on this connection or an earlier one),
+     * reuse the parsed copy. The server leaves out the JSON if we told it we have it. */
+    known_schema *known = known_schema_lookup(reader, (uint64_t) fingerprint);
+    if (!known) {
+        if (row_schema_len <= 1) {
+            return frame_reader_handle(reader, EINVAL,
+                    "Received unknown schema fingerprint %016" PRIx64 " for relid %" PRIu64,
+                    (uint64_t) fingerprint, relid);
+        }
+        check(err, known_schema_add(reader, (uint64_t) fingerprint,
+                    key_schema_json, key_schema_len - 1,
+                    row_schema_json, row_schema_len - 1, &known));
+    }
+
+    return table_schema_known(reader, wal_pos, relid, known);
+}
+
+/* Makes the given known schemas the current ones for relid, and passes them on to
+ * the on_table_schema callback. */
+int table_schema_known(frame_reader_t reader, uint64_t wal_pos, int64_t relid, known_schema *known) {
+    int err = 0;
+
+    /* The classes and values for decoding are created when the first row arrives */
+    schema_list_entry *entry = schema_list_replace(reader, relid);
+    entry->relid = relid;
+    entry->fingerprint = known->fingerprint;
+    entry->row_schema = avro_schema_incref(known->row_schema);
+    entry->key_schema = known->key_schema ? avro_schema_incref(known->key_schema) : NULL;
+
     if (reader->on_table_schema) {
         check_handle(err, reader,
-                reader->on_table_schema(reader->cb_context, wal_pos, relid,
-                    key_schema_json, key_schema_len - 1, key_schema,
-                    row_schema_json, row_schema_len - 1, row_schema),
+                reader->on_table_schema(reader->cb_context, wal_pos, relid, known->fingerprint,
+                    known->key_schema_json, known->key_schema_len, known->key_schema,
+                    known->row_schema_json, known->row_schema_len, known->row_schema),
                 "error in table_schema callback for relid %" PRIu64, relid);
     }
     return err;
@@ -203,19 +249,27 @@ int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64
                 "Received insert for unknown relid %" PRIu64, relid);
     }
 
+    bool decode = reader->decode_values;
+    if (decode) check(err, schema_list_entry_values(reader, entry));
+
     if (key_present) {
         check_avro(err, reader, avro_value_get_current_branch(&key_val, &branch_val));
         check_avro(err, reader, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
-        check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
+        if (decode) check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
     }
 
-    check(err, read_entirely(reader, &entry->row_value, entry->avro_reader, new_bin, new_len));
+    if (decode) check(err, read_entirely(reader, &entry->row_value, entry->avro_reader, new_bin, new_len));
+
+    if (reader->tap_row_key) {
+        check_handle(err, reader, reader->tap_row_key(reader->tap_context, wal_pos, relid, key_bin, key_len),
+                "error in row key tap for relid %" PRIu64, relid);
+    }
 
     if (reader->on_insert_row) {
         check_handle(err, reader,
                 reader->on_insert_row(reader->cb_context, wal_pos, relid,
-                    key_bin, key_len, key_bin ? &entry->key_value : NULL,
-                    new_bin, new_len, &entry->row_value),
+                    key_bin, key_len, key_bin && decode ? &entry->key_value : NULL,
+                    new_bin, new_len, decode ? &entry->row_value : NULL),
                 "error in insert_row callback for relid %" PRIu64, relid);
     }
     return err;
@@ -246,26 +300,34 @@ int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64
                 "Received update for unknown relid %" PRIu64, relid);
     }
 
+    bool decode = reader->decode_values;
+    if (decode) check(err, schema_list_entry_values(reader, entry));
+
     if (key_present) {
         check_avro(err, reader, avro_value_get_current_branch(&key_val, &branch_val));
         check_avro(err, reader, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
-        check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
+        if (decode) check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
     }
 
     if (old_present) {
         check_avro(err, reader, avro_value_get_current_branch(&old_val, &branch_val));
         check_avro(err, reader, avro_value_get_bytes(&branch_val, &old_bin, &old_len));
-        check(err, read_entirely(reader, &entry->old_value, entry->avro_reader, old_bin, old_len));
+        if (decode) check(err, read_entirely(reader, &entry->old_value, entry->avro_reader, old_bin, old_len));
     }
 
-    check(err, read_entirely(reader, &entry->row_value, entry->avro_reader, new_bin, new_len));
+    if (decode) check(err, read_entirely(reader, &entry->row_value, entry->avro_reader, new_bin, new_len));
+
+    if (reader->tap_row_key) {
+        check_handle(err, reader, reader->tap_row_key(reader->tap_context, wal_pos, relid, key_bin, key_len),
+                "error in row key tap for relid %" PRIu64, relid);
+    }
 
     if (reader->on_update_row) {
         check_handle(err, reader,
                 reader->on_update_row(reader->cb_context, wal_pos, relid,
-                    key_bin, key_len, key_bin ? &entry->key_value : NULL,
-                    old_bin, old_len, old_bin ? &entry->old_value : NULL,
-                    new_bin, new_len, &entry->row_value),
+                    key_bin, key_len, key_bin && decode ? &entry->key_value : NULL,
+                    old_bin, old_len, old_bin && decode ? &entry->old_value : NULL,
+                    new_bin, new_len, decode ? &entry->row_value : NULL),
                 "error in update_row callback for relid %" PRIu64, relid);
     }
     return err;
@@ -294,38 +356,75 @@ int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64
                 "Received delete for unknown relid %" PRIu64, relid);
     }
 
+    bool decode = reader->decode_values;
+    if (decode) check(err, schema_list_entry_values(reader, entry));
+
     if (key_present) {
         check_avro(err, reader, avro_value_get_current_branch(&key_val, &branch_val));
         check_avro(err, reader, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
-        check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
+        if (decode) check(err, read_entirely(reader, &entry->key_value, entry->avro_reader, key_bin, key_len));
     }
 
     if (old_present) {
         check_avro(err, reader, avro_value_get_current_branch(&old_val, &branch_val));
         check_avro(err, reader, avro_value_get_bytes(&branch_val, &old_bin, &old_len));
-        check(err, read_entirely(reader, &entry->old_value, entry->avro_reader, old_bin, old_len));
+        if (decode) check(err, read_entirely(reader, &entry->old_value, entry->avro_reader, old_bin, old_len));
+    }
+
+    if (reader->tap_row_key) {
+        check_handle(err, reader, reader->tap_row_key(reader->tap_context, wal_pos, relid, key_bin, key_len),
+                "error in row key tap for relid %" PRIu64, relid);
     }
 
     if (reader->on_delete_row) {
         check_handle(err, reader,
                 reader->on_delete_row(reader->cb_context, wal_pos, relid,
-                    key_bin, key_len, key_bin ? &entry->key_value : NULL,
-                    old_bin, old_len, old_bin ? &entry->old_value : NULL),
+                    key_bin, key_len, key_bin && decode ? &entry->key_value : NULL,
+                    old_bin, old_len, old_bin && decode ? &entry->old_value : NULL),
                 "error in delete_row callback for relid %" PRIu64, relid);
     }
     return err;
 }
 
+int process_frame_truncate(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
+    int err = 0;
+    avro_value_t relid_val;
+    int64_t relid=0;
+
+    check_avro(err, reader, avro_value_get_by_index(record_val, 0, &relid_val, NULL));
+    check_avro(err, reader, avro_value_get_long(&relid_val, &relid));
+
+	/* k4m: send only active schema to kafka */
+	CHECK_ACTIVE_SCHEMA(err, reader, relid);
+
+    if (!schema_list_lookup(reader, relid)) {
+        return frame_reader_handle(reader, EINVAL,
+                "Received truncate for unknown relid %" PRIu64, relid);
+    }
+
+    if (reader->tap_truncate_table) {
+        check_handle(err, reader, reader->tap_truncate_table(reader->tap_context, wal_pos, relid),
+                "error in truncate tap for relid %" PRIu64, relid);
+    }
+
+    if (reader->on_truncate_table) {
+        check_handle(err, reader, reader->on_truncate_table(reader->cb_context, wal_pos, relid),
+                "error in truncate_table callback for relid %" PRIu64, relid);
+    }
+    return err;
+}
+
 frame_reader_t frame_reader_new() {
     frame_reader_t reader = malloc(sizeof(frame_reader));
     check_alloc(reader);
     memset(reader, 0, sizeof(frame_reader));
+    reader->decode_values = true;
     reader->num_schemas = 0;
     reader->capacity = 16;
     reader->schemas = malloc(reader->capacity * sizeof(void*));
     check_alloc(reader->schemas);
 
-    reader->frame_schema = schema_for_frame();
+    reader->frame_schema = schema_for_frame(PROTOCOL_VERSION);
     reader->frame_iface = avro_generic_class_from_schema(reader->frame_schema);
     avro_generic_value_new(reader->frame_iface, &reader->frame_value);
     reader->avro_reader = avro_reader_memory(NULL, 0);
@@ -348,7 +447,7 @@ schema_list_entry *schema_list_lookup(frame_reader_t reader, int64_t relid) {
 schema_list_entry *schema_list_replace(frame_reader_t reader, int64_t relid) {
     schema_list_entry *entry = schema_list_lookup(reader, relid);
     if (entry) {
-        schema_list_entry_decrefs(entry);
+        schema_list_entry_decrefs(reader, entry);
         return entry;
     } else {
         return schema_list_entry_new(reader);
@@ -372,19 +471,192 @@ schema_list_entry *schema_list_entry_new(frame_reader_t reader) {
     return new_entry;
 }
 
-/* Decrements the reference counts of a schema list entry. */
-void schema_list_entry_decrefs(schema_list_entry *entry) {
+/* Returns the schemas previously received with the given fingerprint, or null if
+ * there are none. */
+known_schema *known_schema_lookup(frame_reader_t reader, uint64_t fingerprint) {
+    for (int i = 0; i < reader->num_known; i++) {
+        if (reader->known[i].fingerprint == fingerprint) return &reader->known[i];
+    }
+    return NULL;
+}
+
+/* Parses schema JSON received from the server, and remembers it under its
+ * fingerprint. Sets *known_out to the new entry. */
+int known_schema_add(frame_reader_t reader, uint64_t fingerprint,
+        const char *key_schema_json, size_t key_schema_len,
+        const char *row_schema_json, size_t row_schema_len, known_schema **known_out) {
+    int err = 0;
+    avro_schema_t key_schema = NULL, row_schema;
+
+    check_avro(err, reader, avro_schema_from_json_length(row_schema_json, row_schema_len, &row_schema));
+    if (key_schema_json) {
+        err = avro_schema_from_json_length(key_schema_json, key_schema_len, &key_schema);
+        if (err) {
+            avro_schema_decref(row_schema);
+            return frame_reader_handle(reader, err, "Avro error: %s", avro_strerror());
+        }
+    }
+
+    if (reader->num_known == reader->known_capacity) {
+        reader->known_capacity = reader->known_capacity ? 4 * reader->known_capacity : 16;
+        reader->known = realloc(reader->known, reader->known_capacity * sizeof(known_schema));
+        check_alloc(reader->known);
+    }
+
+    known_schema *known = &reader->known[reader->num_known++];
+    known->fingerprint = fingerprint;
+    known->key_schema_json = key_schema_json ? copy_json(key_schema_json, key_schema_len) : NULL;
+    known->key_schema_len = key_schema_json ? key_schema_len : 0;
+    known->row_schema_json = copy_json(row_schema_json, row_schema_len);
+    known->row_schema_len = row_schema_len;
+    known->key_schema = key_schema;
+    known->row_schema = row_schema;
+
+    *known_out = known;
+    return err;
+}
+
+/* Loads the schemas of a table before streaming starts, as if the server had sent
+ * them, and passes them on to the on_table_schema callback (with a wal_pos of 0).
+ * The JSON must be exactly what the output plugin generates, as returned by the
+ * bottledwater_key_schema() and bottledwater_row_schema() functions, so that the
+ * fingerprint matches the server's; the server then only sends the fingerprint
+ * when the table comes up in the stream. key_schema_json is NULL for an unkeyed
+ * table. */
+int frame_reader_preload_schema(frame_reader_t reader, Oid relid,
+        const char *key_schema_json, size_t key_schema_len,
+        const char *row_schema_json, size_t row_schema_len) {
+    int err = 0;
+    uint64_t fingerprint = schema_fingerprint(CRC64_AVRO_EMPTY, row_schema_json, row_schema_len);
+    if (key_schema_json) {
+        fingerprint = schema_fingerprint(fingerprint, key_schema_json, key_schema_len);
+    }
+
+    known_schema *known = known_schema_lookup(reader, fingerprint);
+    if (!known) {
+        check(err, known_schema_add(reader, fingerprint,
+                    key_schema_json, key_schema_len,
+                    row_schema_json, row_schema_len, &known));
+    }
+    return table_schema_known(reader, 0, relid, known);
+}
+
+/* Continues a CRC-64-AVRO over len bytes of schema JSON followed by a null byte,
+ * computed in the same way as by the output plugin (see schema_cache.c). */
+uint64_t schema_fingerprint(uint64_t fp, const char *json, size_t len) {
+    static uint64_t table[256];
+    static bool table_ready = false;
+
+    if (!table_ready) {
+        for (int i = 0; i < 256; i++) {
+            uint64_t entry = i;
+            for (int j = 0; j < 8; j++) {
+                entry = (entry >> 1) ^ (CRC64_AVRO_EMPTY & -(entry & 1));
+            }
+            table[i] = entry;
+        }
+        table_ready = true;
+    }
+
+    const unsigned char *bytes = (const unsigned char *) json;
+    for (size_t i = 0; i < len; i++) {
+        fp = (fp >> 8) ^ table[(fp ^ bytes[i]) & 0xff];
+    }
+    return (fp >> 8) ^ table[fp & 0xff];
+}
+
+/* Returns a malloc'ed, null-terminated copy of len bytes of JSON. */
+char *copy_json(const char *json, size_t len) {
+    char *copy = malloc(len + 1);
+    check_alloc(copy);
+    memcpy(copy, json, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/* Makes sure the schema list entry has the classes and values needed to decode rows,
+ * creating them if necessary. If reader->max_decoders entries already have them, the
+ * least recently used entry is made to release its own. */
+int schema_list_entry_values(frame_reader_t reader, schema_list_entry *entry) {
+    entry->last_used = ++reader->use_counter;
+    if (entry->has_values) return 0;
+
+    if (reader->max_decoders > 0 && reader->num_decoders >= reader->max_decoders) {
+        schema_list_entry *lru = NULL;
+        for (int i = 0; i < reader->num_schemas; i++) {
+            schema_list_entry *other = reader->schemas[i];
+            if (other->has_values && (!lru || other->last_used < lru->last_used)) lru = other;
+        }
+        if (lru) schema_list_entry_free_values(reader, lru);
+    }
+
+    entry->row_iface = avro_generic_class_from_schema(entry->row_schema);
+    if (!entry->row_iface) {
+        return frame_reader_handle(reader, EINVAL, "Avro error: %s", avro_strerror());
+    }
+    avro_generic_value_new(entry->row_iface, &entry->row_value);
+    avro_generic_value_new(entry->row_iface, &entry->old_value);
+    entry->avro_reader = avro_reader_memory(NULL, 0);
+
+    if (entry->key_schema) {
+        entry->key_iface = avro_generic_class_from_schema(entry->key_schema);
+        avro_generic_value_new(entry->key_iface, &entry->key_value);
+    }
+
+    entry->has_values = true;
+    reader->num_decoders++;
+    return 0;
+}
+
+/* Releases the classes and values that a schema list entry uses for decoding rows.
+ * They are created again when the next row for the table arrives. */
+void schema_list_entry_free_values(frame_reader_t reader, schema_list_entry *entry) {
+    if (!entry->has_values) return;
+
     avro_reader_free(entry->avro_reader);
     avro_value_decref(&entry->old_value);
     avro_value_decref(&entry->row_value);
     avro_value_iface_decref(entry->row_iface);
-    avro_schema_decref(entry->row_schema);
 
     if (entry->key_schema) {
         avro_value_decref(&entry->key_value);
         avro_value_iface_decref(entry->key_iface);
-        avro_schema_decref(entry->key_schema);
     }
+
+    entry->has_values = false;
+    reader->num_decoders--;
+}
+
+/* Decrements the reference counts of a schema list entry. */
+void schema_list_entry_decrefs(frame_reader_t reader, schema_list_entry *entry) {
+    schema_list_entry_free_values(reader, entry);
+    avro_schema_decref(entry->row_schema);
+    if (entry->key_schema) avro_schema_decref(entry->key_schema);
+}
+
+/* Forgets the known schemas that no table currently uses, which are left over from
+ * schema changes. This must only be called between replication connections, since
+ * the server may send just the fingerprint of any schema that was known when the
+ * connection started. */
+void frame_reader_prune_known(frame_reader_t reader) {
+    int kept = 0;
+    for (int i = 0; i < reader->num_known; i++) {
+        known_schema *known = &reader->known[i];
+        bool in_use = false;
+        for (int j = 0; j < reader->num_schemas && !in_use; j++) {
+            in_use = (reader->schemas[j]->fingerprint == known->fingerprint);
+        }
+
+        if (in_use) {
+            reader->known[kept++] = *known;
+        } else {
+            free(known->key_schema_json);
+            free(known->row_schema_json);
+            if (known->key_schema) avro_schema_decref(known->key_schema);
+            avro_schema_decref(known->row_schema);
+        }
+    }
+    reader->num_known = kept;
 }
 
 /* Frees all the memory structures associated with a frame reader. */
@@ -396,10 +668,19 @@ void frame_reader_free(frame_reader_t reader) {
 
     for (int i = 0; i < reader->num_schemas; i++) {
         schema_list_entry *entry = reader->schemas[i];
-        schema_list_entry_decrefs(entry);
+        schema_list_entry_decrefs(reader, entry);
         free(entry);
     }
 
+    for (int i = 0; i < reader->num_known; i++) {
+        known_schema *known = &reader->known[i];
+        free(known->key_schema_json);
+        free(known->row_schema_json);
+        if (known->key_schema) avro_schema_decref(known->key_schema);
+        avro_schema_decref(known->row_schema);
+    }
+
+    free(reader->known);
     free(reader->schemas);
     free(reader);
 }
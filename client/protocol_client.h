@@ -3,17 +3,18 @@
 
 #include "protocol.h"
 #include "postgres_ext.h"
+#include <stdbool.h>
 
-/* Parameters: context, wal_pos, xid */
-typedef int (*begin_txn_cb)(void *, uint64_t, uint32_t);
+/* Parameters: context, wal_pos, xid, commit_time */
+typedef int (*begin_txn_cb)(void *, uint64_t, uint32_t, int64_t);
 
-/* Parameters: context, wal_pos, xid */
-typedef int (*commit_txn_cb)(void *, uint64_t, uint32_t);
+/* Parameters: context, wal_pos, xid, commit_time */
+typedef int (*commit_txn_cb)(void *, uint64_t, uint32_t, int64_t);
 
-/* Parameters: context, wal_pos, relid,
+/* Parameters: context, wal_pos, relid, fingerprint,
  *             key_schema_json, key_schema_len, key_schema,
  *             row_schema_json, row_schema_len, row_schema */
-typedef int (*table_schema_cb)(void *, uint64_t, Oid,
+typedef int (*table_schema_cb)(void *, uint64_t, Oid, uint64_t,
         const char *, size_t, avro_schema_t,
         const char *, size_t, avro_schema_t);
 
@@ -40,6 +41,15 @@ typedef int (*delete_row_cb)(void *, uint64_t, Oid,
         const void *, size_t, avro_value_t *,
         const void *, size_t, avro_value_t *);
 
+/* Parameters: context, wal_pos, relid */
+typedef int (*truncate_table_cb)(void *, uint64_t, Oid);
+
+/* The avro_value_t parameters of the row callbacks above are NULL if the frame
+ * reader's decode_values is false. */
+
+/* Parameters: context, wal_pos, relid, key_bin, key_len */
+typedef int (*row_key_cb)(void *, uint64_t, Oid, const void *, size_t);
+
 #define FRAME_READER_SYNC_PENDING EBUSY
 
 /* Parameters: context, wal_pos
@@ -62,8 +72,11 @@ typedef int (*error_handler_cb)(void *, int err, const char *);
 
 typedef struct {
     Oid                 relid;       /* Uniquely identifies a table, even when it is renamed */
+    uint64_t            fingerprint; /* Identifies the key and row schemas, as computed by the server */
     avro_schema_t       key_schema;  /* Avro schema for the table's primary key or replica identity */
     avro_schema_t       row_schema;  /* Avro schema for one row of the table */
+    bool                has_values;  /* Whether the fields below have been created (they are created lazily) */
+    uint64_t            last_used;   /* Value of frame_reader.use_counter when a row was last decoded */
     avro_value_iface_t *key_iface;   /* Avro generic interface for creating key values */
     avro_value_iface_t *row_iface;   /* Avro generic interface for creating row values */
     avro_value_t        key_value;   /* Avro key value, for encoding one key */
@@ -72,6 +85,18 @@ typedef struct {
     avro_reader_t       avro_reader; /* In-memory buffer reader */
 } schema_list_entry;
 
+/* Schemas received from the server, kept across reconnects so that the server can
+ * send just the fingerprint for schemas we already have (see "known_schemas"). */
+typedef struct {
+    uint64_t            fingerprint;     /* CRC-64-AVRO of the schema JSON, as computed by the server */
+    char               *key_schema_json; /* Null-terminated key schema JSON, or NULL if the table has no key */
+    size_t              key_schema_len;  /* Length of key_schema_json, excluding the null */
+    char               *row_schema_json; /* Null-terminated row schema JSON */
+    size_t              row_schema_len;  /* Length of row_schema_json, excluding the null */
+    avro_schema_t       key_schema;      /* Parsed key_schema_json, or NULL */
+    avro_schema_t       row_schema;      /* Parsed row_schema_json */
+} known_schema;
+
 typedef struct {
     void *cb_context;                /* Pointer that is passed to callbacks */
     begin_txn_cb on_begin_txn;       /* Called to indicate that the following events belong to one transaction */
@@ -80,11 +105,24 @@ typedef struct {
     insert_row_cb on_insert_row;     /* Called when a row is inserted into a relation */
     update_row_cb on_update_row;     /* Called when a row in a relation is updated */
     delete_row_cb on_delete_row;     /* Called when a row in a relation is deleted */
+    truncate_table_cb on_truncate_table; /* Called when all rows of a relation are removed by TRUNCATE */
     keepalive_cb on_keepalive;       /* Called when server sends a keepalive message */
     error_handler_cb on_error;       /* Called when a frame cannot be read or when a callback returns a nonzero error code */
+    void *tap_context;               /* Pointer that is passed to the tap callbacks below */
+    begin_txn_cb tap_begin_txn;      /* If set, called before on_begin_txn (used by the client library itself) */
+    commit_txn_cb tap_commit_txn;    /* If set, called before on_commit_txn */
+    row_key_cb tap_row_key;          /* If set, called with the key of every row event, before its callback */
+    truncate_table_cb tap_truncate_table; /* If set, called before on_truncate_table */
+    bool decode_values;              /* If false, row callbacks get only the binary encoding, and NULL values */
+    int max_decoders;                /* Maximum number of tables with decoding state; 0 = unlimited */
+    int num_decoders;                /* Number of schema list entries with has_values set */
+    uint64_t use_counter;            /* Incremented every time a row is decoded, for LRU eviction */
     int num_schemas;                 /* Number of schemas in use */
     int capacity;                    /* Allocated size of schemas array */
     schema_list_entry **schemas;     /* Array of pointers to schema_list_entry structs */
+    int num_known;                   /* Number of schemas received, by fingerprint */
+    int known_capacity;              /* Allocated size of known array */
+    known_schema *known;             /* Schemas received, to be reused when their fingerprint comes up again */
     avro_schema_t frame_schema;      /* Avro schema of a frame, as defined by the protocol */
     avro_value_iface_t *frame_iface; /* Avro generic interface for the frame schema */
     avro_value_t frame_value;        /* Avro value for a frame */
@@ -98,6 +136,10 @@ typedef frame_reader *frame_reader_t;
 
 int parse_frame(frame_reader_t reader, uint64_t wal_pos, char *buf, int buflen);
 frame_reader_t frame_reader_new(void);
+int frame_reader_preload_schema(frame_reader_t reader, Oid relid,
+        const char *key_schema_json, size_t key_schema_len,
+        const char *row_schema_json, size_t row_schema_len);
+void frame_reader_prune_known(frame_reader_t reader);
 void frame_reader_free(frame_reader_t reader);
 
 int handle_keepalive(frame_reader_t reader, uint64_t wal_pos);
@@ -14,6 +14,11 @@
 
 #define CHECKPOINT_INTERVAL_SEC 10
 
+/* In adaptive feedback mode, an advance of fsync_lsn is reported after at most
+ * FEEDBACK_INTERVAL_MSEC, or straight away once it amounts to FEEDBACK_BYTES. */
+#define FEEDBACK_INTERVAL_MSEC 200
+#define FEEDBACK_BYTES (16 * 1024 * 1024)
+
 // #define DEBUG 1
 
 int replication_stream_finish(replication_stream_t stream);
@@ -56,9 +61,20 @@ int replication_slot_create(replication_stream_t stream) {
     appendPQExpBuffer(query, "CREATE_REPLICATION_SLOT \"%s\" LOGICAL \"%s\"",
             stream->slot_name, stream->output_plugin);
 
+    /* On a standby, this blocks until the primary logs a running-transactions
+     * record, which the slot needs in order to find a consistent starting point.
+     * An idle primary only does so every 15 seconds or so (or on checkpoints). */
     PGresult *res = PQexec(stream->conn, query->data);
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        repl_error(stream, "Command failed: %s: %s", query->data, PQerrorMessage(stream->conn));
+        if (stream->on_standby) {
+            repl_error(stream, "Command failed on standby: %s: %s "
+                    "(Decoding on a standby needs wal_level = logical on the primary, "
+                    "and the slot may be invalidated by recovery conflicts if "
+                    "hot_standby_feedback is off.)",
+                    query->data, PQerrorMessage(stream->conn));
+        } else {
+            repl_error(stream, "Command failed: %s: %s", query->data, PQerrorMessage(stream->conn));
+        }
         destroyPQExpBuffer(query); PQclear(res); return EIO;
     }
 
@@ -142,13 +158,45 @@ int replication_stream_check(replication_stream_t stream) {
 
 
 /* Starts streaming logical changes from replication slot stream->slot_name,
- * starting from position stream->start_lsn. */
+ * starting from position stream->start_lsn, in the version of the protocol that
+ * the frame reader understands (PROTOCOL_VERSION). If stream->shard is set, the output
+ * plugin only sends the changes belonging to that shard. If stream->encode_workers
+ * is set, the plugin encodes rows in that many background workers. The fingerprints
+ * of all schemas the frame reader has already received are passed to the plugin,
+ * which then sends just the fingerprint when one of those schemas comes up again.
+ * Schemas superseded by a schema change are forgotten at this point. */
 int replication_stream_start(replication_stream_t stream, const char *error_policy) {
     PQExpBuffer query = createPQExpBuffer();
-    appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (\"error_policy\" '%s')",
+    appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X (\"error_policy\" '%s', "
+            "\"protocol_version\" '%d'",
             stream->slot_name,
             (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn,
-            error_policy);
+            error_policy, PROTOCOL_VERSION);
+
+    if (stream->shard) {
+        char *shard = PQescapeLiteral(stream->conn, stream->shard, strlen(stream->shard));
+        appendPQExpBuffer(query, ", \"shard\" %s", shard);
+        PQfreemem(shard);
+    }
+    if (stream->shard_key_tables) {
+        char *tables = PQescapeLiteral(stream->conn, stream->shard_key_tables,
+                strlen(stream->shard_key_tables));
+        appendPQExpBuffer(query, ", \"shard_key_tables\" %s", tables);
+        PQfreemem(tables);
+    }
+    if (stream->encode_workers > 0) {
+        appendPQExpBuffer(query, ", \"encode_workers\" '%d'", stream->encode_workers);
+    }
+    if (stream->frame_reader) frame_reader_prune_known(stream->frame_reader);
+    if (stream->frame_reader && stream->frame_reader->num_known > 0) {
+        appendPQExpBufferStr(query, ", \"known_schemas\" '");
+        for (int i = 0; i < stream->frame_reader->num_known; i++) {
+            appendPQExpBuffer(query, "%s%016" PRIx64, i > 0 ? "," : "",
+                    stream->frame_reader->known[i].fingerprint);
+        }
+        appendPQExpBufferChar(query, '\'');
+    }
+    appendPQExpBufferChar(query, ')');
 
     PGresult *res = PQexec(stream->conn, query->data);
 
@@ -225,20 +273,49 @@ int replication_stream_poll(replication_stream_t stream) {
 }
 
 
-/* Periodically sends a checkpoint ("Standby status update") message to the server.
- * This is required, as the server will otherwise consider the client dead and
- * close the connection. */
+/* Sends a checkpoint ("Standby status update") message to the server when one is
+ * due. At least one is needed every CHECKPOINT_INTERVAL_SEC, as the server will
+ * otherwise consider the client dead and close the connection. Depending on
+ * stream->feedback_mode, advances of fsync_lsn are reported sooner, so that the
+ * server can recycle WAL earlier (and fewer changes are replayed after a restart),
+ * or so that commits waiting for us as a synchronous standby can return. */
 int replication_stream_keepalive(replication_stream_t stream) {
     int err = 0;
-    if (stream->recvd_lsn != InvalidXLogRecPtr) {
+    int64 due = replication_stream_feedback_due(stream);
+    if (due != 0) {
         int64 now = current_time();
-        if (now - stream->last_checkpoint > CHECKPOINT_INTERVAL_SEC * USECS_PER_SEC) {
-            err = send_checkpoint(stream, now);
-        }
+        if (now >= due) err = send_checkpoint(stream, now);
     }
     return err;
 }
 
+/* Returns the time (in the units of current_time()) at which
+ * replication_stream_keepalive() will next send a status update, unless fsync_lsn
+ * advances in the meantime, or 0 if there is nothing to report yet. A caller that
+ * blocks waiting for data should not block past this time. */
+int64 replication_stream_feedback_due(replication_stream_t stream) {
+    if (stream->recvd_lsn == InvalidXLogRecPtr) return 0;
+
+    bool advanced = stream->fsync_lsn > stream->sent_fsync_lsn;
+    int64 due = stream->last_checkpoint + CHECKPOINT_INTERVAL_SEC * USECS_PER_SEC + 1;
+
+    switch (stream->feedback_mode) {
+        case FEEDBACK_ADAPTIVE:
+            if (advanced && stream->fsync_lsn - stream->sent_fsync_lsn >= FEEDBACK_BYTES) {
+                due = stream->last_checkpoint;
+            } else if (advanced) {
+                due = stream->last_checkpoint + FEEDBACK_INTERVAL_MSEC * 1000;
+            }
+            break;
+        case FEEDBACK_SYNC:
+            if (advanced) due = stream->last_checkpoint;
+            break;
+        case FEEDBACK_PERIODIC:
+            break;
+    }
+    return due;
+}
+
 
 /* Parses a "Primary keepalive message" received from the server. It is packed binary
  * with the following structure:
@@ -316,11 +393,16 @@ int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen) {
     }
 
     XLogRecPtr wal_pos = recvint64(&buf[1]);
+    stream->frame_send_time = recvint64(&buf[1 + 8 + 8]);
+    stream->frame_recv_time = current_time();
 
 #ifdef DEBUG
     fprintf(stderr, "XLogData: wal_pos %X/%X\n", (uint32) (wal_pos >> 32), (uint32) wal_pos);
 #endif
 
+    stream->recvd_frames++;
+    stream->recvd_bytes += buflen - hdrlen;
+
     int err = parse_frame(stream->frame_reader, wal_pos, buf + hdrlen, buflen - hdrlen);
     if (err) {
         repl_error(stream, "Error parsing frame data: %s", stream->frame_reader->error);
@@ -332,7 +414,10 @@ int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen) {
 
 
 /* Send a "Standby status update" message to server, indicating the LSN up to which we
- * have received logs. This message is packed binary with the following structure:
+ * have received logs. In FEEDBACK_SYNC mode, fsync_lsn is reported as the written and
+ * applied position as well, so that whichever synchronous_commit level the server
+ * uses, commits wait until they are in Kafka. This message is packed binary with the
+ * following structure:
  *
  *   - Byte1('r'): Identifies the message as a receiver status update.
  *   - Int64: The location of the last WAL byte + 1 received by the client.
@@ -345,10 +430,12 @@ int send_checkpoint(replication_stream_t stream, int64 now) {
     char buf[1 + 8 + 8 + 8 + 8 + 1];
     int offset = 0;
 
+    bool sync = (stream->feedback_mode == FEEDBACK_SYNC);
+
     buf[offset] = 'r';                          offset += 1;
-    sendint64(stream->recvd_lsn, &buf[offset]); offset += 8;
+    sendint64(sync ? stream->fsync_lsn : stream->recvd_lsn, &buf[offset]); offset += 8;
     sendint64(stream->fsync_lsn, &buf[offset]); offset += 8;
-    sendint64(InvalidXLogRecPtr, &buf[offset]); offset += 8; // only used by physical replication
+    sendint64(sync ? stream->fsync_lsn : InvalidXLogRecPtr, &buf[offset]); offset += 8;
     sendint64(now,               &buf[offset]); offset += 8;
     buf[offset] = 0;                            offset += 1;
 
@@ -365,6 +452,7 @@ int send_checkpoint(replication_stream_t stream, int64 now) {
 #endif
 
     stream->last_checkpoint = now;
+    stream->sent_fsync_lsn = stream->fsync_lsn;
     return 0;
 }
 
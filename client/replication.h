@@ -9,13 +9,30 @@
 
 #define REPLICATION_STREAM_ERROR_LEN 512
 
+/* When to send the server a "Standby status update" with our fsync_lsn */
+typedef enum {
+    FEEDBACK_ADAPTIVE = 0,      /* Soon after fsync_lsn advances, coalescing updates under load */
+    FEEDBACK_PERIODIC,          /* Every CHECKPOINT_INTERVAL_SEC, or when the server asks */
+    FEEDBACK_SYNC               /* As soon as fsync_lsn advances, reporting it as written and applied too */
+} feedback_mode_t;
+
 typedef struct {
     char *slot_name, *output_plugin, *snapshot_name;
+    char *shard;                /* Shard "i/n" to request from the output plugin, or NULL for all data */
+    char *shard_key_tables;     /* Comma-separated tables that the plugin shards by key, or NULL */
+    int encode_workers;         /* Background workers in which the plugin encodes rows; 0 = none */
     PGconn *conn;
+    bool on_standby;            /* Server is a hot standby (logical decoding there needs Postgres 16+) */
     XLogRecPtr start_lsn;
     XLogRecPtr recvd_lsn;
     XLogRecPtr fsync_lsn;
+    XLogRecPtr sent_fsync_lsn;  /* fsync_lsn as of the last status update sent to the server */
     int64 last_checkpoint;
+    feedback_mode_t feedback_mode;
+    uint64_t recvd_frames;      /* Number of XLogData messages received */
+    uint64_t recvd_bytes;       /* Total size of the output plugin data in those messages */
+    int64 frame_send_time;      /* Server clock when it sent the frame being parsed, or 0 */
+    int64 frame_recv_time;      /* current_time() when we received the frame being parsed */
     frame_reader_t frame_reader;
     int status; /* 1 = message was processed on last poll; 0 = no data available right now; -1 = stream ended */
     char error[REPLICATION_STREAM_ERROR_LEN];
@@ -29,5 +46,7 @@ int replication_stream_check(replication_stream_t stream);
 int replication_stream_start(replication_stream_t stream, const char *error_policy);
 int replication_stream_poll(replication_stream_t stream);
 int replication_stream_keepalive(replication_stream_t stream);
+int64 replication_stream_feedback_due(replication_stream_t stream);
+int64 current_time(void);
 
 #endif /* REPLICATION_H */
@@ -0,0 +1,132 @@
+-- Complain if script is sourced in psql, rather than via CREATE EXTENSION.
+\echo Use "CREATE EXTENSION bottledwater" to load this file. \quit
+
+CREATE OR REPLACE FUNCTION bottledwater_key_schema(name) RETURNS text
+    AS 'bottledwater', 'bottledwater_key_schema' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_row_schema(name) RETURNS text
+    AS 'bottledwater', 'bottledwater_row_schema' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_frame_schema() RETURNS text
+    AS 'bottledwater', 'bottledwater_frame_schema' LANGUAGE C VOLATILE STRICT;
+
+DROP DOMAIN IF EXISTS bottledwater_error_policy;
+CREATE DOMAIN bottledwater_error_policy AS text
+    CONSTRAINT bottledwater_error_policy_valid CHECK (VALUE IN (
+        -- these values should match the constants defined in protocol.h
+        'log',
+        'exit'
+    ));
+
+CREATE OR REPLACE FUNCTION bottledwater_export(
+        table_pattern text    DEFAULT '%',
+        allow_unkeyed boolean DEFAULT false,
+        error_policy bottledwater_error_policy DEFAULT 'exit',
+        shard text            DEFAULT '',
+        shard_key_tables text DEFAULT ''
+    ) RETURNS setof bytea
+    AS 'bottledwater', 'bottledwater_export' LANGUAGE C VOLATILE STRICT;
+
+-- One row per replication slot, updated by the client's optional heartbeat so that
+-- the slot can advance even when nothing else in the database is changing.
+CREATE TABLE IF NOT EXISTS bottledwater_heartbeat (
+    slot_name name PRIMARY KEY,
+    beat_time timestamp with time zone NOT NULL
+);
+
+-- Records a heartbeat for the given slot, and returns the WAL insert position just
+-- after the update. That is a lower bound on the LSN of the heartbeat's commit,
+-- which is not known until the transaction has committed: a transaction that
+-- commits concurrently, between the update and the heartbeat's commit, can take
+-- the client past that position first, so the latency that the client derives
+-- from it can come out a little short under load.
+CREATE OR REPLACE FUNCTION bottledwater_heartbeat(slot name) RETURNS text AS $$
+DECLARE
+    lsn text;
+BEGIN
+    UPDATE bottledwater_heartbeat SET beat_time = now() WHERE slot_name = slot;
+    IF NOT FOUND THEN
+        INSERT INTO bottledwater_heartbeat (slot_name, beat_time) VALUES (slot, now());
+    END IF;
+
+    IF current_setting('server_version_num')::integer >= 100000 THEN
+        EXECUTE 'SELECT pg_current_wal_insert_lsn()::text' INTO lsn;
+    ELSE
+        EXECUTE 'SELECT pg_current_xlog_insert_location()::text' INTO lsn;
+    END IF;
+    RETURN lsn;
+END
+$$ LANGUAGE plpgsql VOLATILE STRICT;
+
+-- One row per replication slot, updated by the client's chunked snapshot (see
+-- bottledwater_export_chunk) just before and just after it reads each chunk. The
+-- client finds these low and high watermark transactions in the replication stream
+-- by their transaction ID, and reconciles the chunk with the changes between them.
+CREATE TABLE IF NOT EXISTS bottledwater_watermark (
+    slot_name name PRIMARY KEY,
+    mark_time timestamp with time zone NOT NULL
+);
+
+-- Records a watermark for the given slot, and returns the (32-bit) ID of the
+-- transaction in which it was recorded.
+CREATE OR REPLACE FUNCTION bottledwater_watermark(slot name) RETURNS bigint AS $$
+BEGIN
+    UPDATE bottledwater_watermark SET mark_time = clock_timestamp() WHERE slot_name = slot;
+    IF NOT FOUND THEN
+        INSERT INTO bottledwater_watermark (slot_name, mark_time) VALUES (slot, clock_timestamp());
+    END IF;
+    RETURN txid_current() % 4294967296;
+END
+$$ LANGUAGE plpgsql VOLATILE STRICT;
+
+-- The tables that a chunked snapshot exports, all of which must have a primary key
+-- or replica identity index. With a shard, only the tables with rows in that shard.
+CREATE OR REPLACE FUNCTION bottledwater_export_tables(
+        shard text            DEFAULT '',
+        shard_key_tables text DEFAULT ''
+    ) RETURNS TABLE (relid oid, table_name text)
+    AS 'bottledwater', 'bottledwater_export_tables' LANGUAGE C VOLATILE STRICT;
+
+-- Reads the next chunk of up to chunk_size rows of a table, in key order, starting
+-- after the key whose column values (as text) are given in after_key ('{}' for the
+-- start of the table). The first row returned holds a frame with just the table's
+-- schema; every other row holds the encoded key, a frame with the row's insert, and
+-- the key's column values, to be passed as after_key for the next chunk. Rows that
+-- belong to another shard are returned without a key or frame. Fewer than
+-- chunk_size rows (not counting the schema) means that this was the last chunk.
+CREATE OR REPLACE FUNCTION bottledwater_export_chunk(
+        table_name text,
+        after_key text[],
+        chunk_size integer    DEFAULT 10000,
+        shard text            DEFAULT '',
+        shard_key_tables text DEFAULT ''
+    ) RETURNS TABLE (key bytea, frame bytea, key_values text[])
+    AS 'bottledwater', 'bottledwater_export_chunk' LANGUAGE C VOLATILE STRICT;
+
+-- Hashes of a table's rows for bwverify, which compares them with the latest value of
+-- each key in the table's Kafka topic. Rows are assigned to one of the given number
+-- of buckets by a hash of their encoded key, and each bucket's row count and hash sum
+-- is returned. With parent_buckets, only rows in the listed buckets of that coarser
+-- division are included (buckets must be a multiple of parent_buckets). Only heap
+-- pages in [first_page, last_page) are read, so that several sessions sharing a
+-- snapshot can hash one table in parallel; last_page -1 means the end of the table.
+CREATE OR REPLACE FUNCTION bottledwater_table_hashes(
+        table_name name,
+        buckets integer,
+        parent_buckets integer DEFAULT 1,
+        parents integer[]      DEFAULT '{0}',
+        first_page bigint      DEFAULT 0,
+        last_page bigint       DEFAULT -1
+    ) RETURNS TABLE (bucket integer, row_count bigint, hash_sum bigint)
+    AS 'bottledwater', 'bottledwater_table_hashes' LANGUAGE C VOLATILE STRICT;
+
+-- Like bottledwater_table_hashes, but returns the encoded key and hash of every row
+-- in the listed buckets, to find the rows that differ.
+CREATE OR REPLACE FUNCTION bottledwater_row_hashes(
+        table_name name,
+        buckets integer,
+        selected integer[],
+        first_page bigint      DEFAULT 0,
+        last_page bigint       DEFAULT -1
+    ) RETURNS TABLE (bucket integer, key bytea, row_hash bigint)
+    AS 'bottledwater', 'bottledwater_row_hashes' LANGUAGE C VOLATILE STRICT;
@@ -0,0 +1,617 @@
+/* Pool of dynamic background workers that take the Avro encoding of row changes
+ * off the walsender, which otherwise spends most of its time in tuple_to_avro_row
+ * and so limits replication to one core.
+ *
+ * Everything that needs the decoding session's historic catalog snapshot stays
+ * in the walsender: looking up the table schema, choosing the key index and
+ * fetching TOASTed values. The walsender then sends each changed tuple, flattened,
+ * to the next worker in round-robin order over a shm_mq, and the worker sends
+ * back the encoded key and row. Since every worker handles its queue in order,
+ * reading the results back in the same round-robin order restores the original
+ * order of the changes, and the walsender writes the frames in that order.
+ *
+ * Before a worker sees any row of a table, it is sent the table's tuple
+ * descriptor, key columns and Avro schemas; the walsender waits for all changes
+ * in flight to be written before a schema change, so that each row is encoded
+ * with the schema of the table at the time of the change. Type output
+ * functions run in the worker against the current catalogs, which only matters
+ * for types that are altered while changes to them are being decoded. */
+
+#include "encode_pool.h"
+#include "io_util.h"
+#include "oid2avro.h"
+
+#include <signal.h>
+#include "miscadmin.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "lib/stringinfo.h"
+#include "storage/ipc.h"
+#include "storage/proc.h"
+#include "storage/shm_toc.h"
+#include "tcop/tcopprot.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "access/heaptoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+
+/* Identifies our dynamic shared memory segment */
+#define ENCODE_POOL_MAGIC 0x42574550
+
+/* Size of each queue between the walsender and a worker, in each direction */
+#define ENCODE_QUEUE_SIZE (1024 * 1024)
+
+#define ENCODE_MSG_SCHEMA 'S'
+#define ENCODE_MSG_CHANGE 'C'
+
+#if PG_VERSION_NUM >= 150000
+#define encode_mq_send(handle, len, data, nowait) shm_mq_send(handle, len, data, nowait, true)
+#else
+#define encode_mq_send(handle, len, data, nowait) shm_mq_send(handle, len, data, nowait)
+#endif
+
+#if PG_VERSION_NUM >= 100000
+#define encode_toc_lookup(toc, key) shm_toc_lookup(toc, key, false)
+#else
+#define encode_toc_lookup(toc, key) shm_toc_lookup(toc, key)
+#endif
+
+/* Schema information that a worker keeps about each table it has seen. */
+typedef struct {
+    Oid relid;                      /* Key in hash table, so it must be first in struct */
+    TupleDesc tupdesc;              /* Descriptor of the tuples sent by the walsender */
+    int num_key_columns;            /* 0 if the table is unkeyed */
+    int *key_columns;               /* Zero-based positions of key columns in tupdesc */
+    avro_schema_t row_schema, key_schema;
+    avro_value_iface_t *row_iface, *key_iface;
+    avro_value_t row_value, key_value;
+} encode_table;
+
+/* Cursor for reading a message received from a queue. */
+typedef struct {
+    const char *data;
+    Size len, pos;
+} encode_reader;
+
+void encode_pool_complete_oldest(encode_pool_t pool);
+void encode_pool_send(encode_pool_t pool, int worker, StringInfo msg);
+void encode_put_int(StringInfo buf, int32 value);
+void encode_put_bytes(StringInfo buf, const char *data, int32 len);
+void encode_put_tuple(StringInfo buf, HeapTuple tuple, TupleDesc tupdesc);
+int32 encode_get_int(encode_reader *reader);
+const char *encode_get_bytes(encode_reader *reader, int32 *len_out);
+bytea *encode_get_bytea(encode_reader *reader);
+void encode_worker_schema(HTAB *tables, encode_reader *reader);
+void encode_worker_change(HTAB *tables, encode_reader *reader, StringInfo result);
+int encode_worker_tuple(encode_table *table, const char *data, int32 len,
+        bytea **key_out, bytea **row_out);
+void encode_table_free(encode_table *table);
+
+
+/* Creates the shared memory queues and starts the workers. Must be called in the
+ * walsender, with a database connection, outside of a transaction. The pool and
+ * its state are allocated in the given memory context. */
+encode_pool_t encode_pool_start(int num_workers, int max_pending, MemoryContext context,
+        encode_result_cb on_result, void *cb_context) {
+    shm_toc_estimator estimator;
+    shm_toc *toc;
+    Size size;
+    MemoryContext oldctx = MemoryContextSwitchTo(context);
+    encode_pool_t pool = palloc0(sizeof(encode_pool));
+
+    pool->num_workers = num_workers;
+    pool->max_pending = max_pending;
+    pool->pending = palloc0(max_pending * sizeof(encode_pending));
+    pool->on_result = on_result;
+    pool->cb_context = cb_context;
+    pool->result_context = AllocSetContextCreate(context, "Bottled Water encoder results",
+            ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+
+    shm_toc_initialize_estimator(&estimator);
+    for (int i = 0; i < 2 * num_workers; i++) {
+        shm_toc_estimate_chunk(&estimator, ENCODE_QUEUE_SIZE);
+    }
+    shm_toc_estimate_keys(&estimator, 2 * num_workers);
+    size = shm_toc_estimate(&estimator);
+
+    pool->segment = dsm_create(size, 0);
+    dsm_pin_mapping(pool->segment);
+    toc = shm_toc_create(ENCODE_POOL_MAGIC, dsm_segment_address(pool->segment), size);
+
+    for (int i = 0; i < num_workers; i++) {
+        BackgroundWorker worker;
+        shm_mq *to_worker = shm_mq_create(shm_toc_allocate(toc, ENCODE_QUEUE_SIZE), ENCODE_QUEUE_SIZE);
+        shm_mq *from_worker = shm_mq_create(shm_toc_allocate(toc, ENCODE_QUEUE_SIZE), ENCODE_QUEUE_SIZE);
+        shm_toc_insert(toc, 2 * i, to_worker);
+        shm_toc_insert(toc, 2 * i + 1, from_worker);
+        shm_mq_set_sender(to_worker, MyProc);
+        shm_mq_set_receiver(from_worker, MyProc);
+
+        memset(&worker, 0, sizeof(worker));
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        worker.bgw_restart_time = BGW_NEVER_RESTART;
+        worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(pool->segment));
+        worker.bgw_notify_pid = MyProcPid;
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "bottledwater");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "bottledwater_encode_main");
+        snprintf(worker.bgw_name, BGW_MAXLEN, "bottledwater encoder %d for PID %d", i, MyProcPid);
+        memcpy(worker.bgw_extra, &i, sizeof(int));
+        memcpy(worker.bgw_extra + sizeof(int), &MyDatabaseId, sizeof(Oid));
+
+        if (!RegisterDynamicBackgroundWorker(&worker, &pool->handles[i])) {
+            ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                    errmsg("could not register Bottled Water encoder worker"),
+                    errhint("You may need to increase max_worker_processes.")));
+        }
+
+        pool->to_worker[i] = shm_mq_attach(to_worker, pool->segment, pool->handles[i]);
+        pool->from_worker[i] = shm_mq_attach(from_worker, pool->segment, pool->handles[i]);
+    }
+
+    MemoryContextSwitchTo(oldctx);
+    return pool;
+}
+
+/* Tells every worker about the current schema of a table. Waits for all changes
+ * in flight to be handled first, since they may have been encoded with the
+ * previous schema. */
+void encode_pool_send_schema(encode_pool_t pool, Relation rel, schema_cache_entry *entry) {
+    StringInfoData msg;
+    TupleDesc tupdesc = RelationGetDescr(rel);
+    bytea *row_json = entry->row_schema_json, *key_json = entry->key_schema_json;
+
+    encode_pool_drain(pool);
+
+    initStringInfo(&msg);
+    appendStringInfoChar(&msg, ENCODE_MSG_SCHEMA);
+    encode_put_int(&msg, RelationGetRelid(rel));
+    encode_put_int(&msg, tupdesc->natts);
+    for (int i = 0; i < tupdesc->natts; i++) {
+        appendBinaryStringInfo(&msg, (char *) TupleDescAttr(tupdesc, i), ATTRIBUTE_FIXED_PART_SIZE);
+    }
+
+    if (entry->key_schema) {
+        Relation index_rel = table_key_index(rel);
+        Form_pg_index key_index = index_rel->rd_index;
+        encode_put_int(&msg, key_index->indkey.dim1);
+        for (int field = 0; field < key_index->indkey.dim1; field++) {
+            encode_put_int(&msg, key_index->indkey.values[field] - 1);
+        }
+        relation_close(index_rel, AccessShareLock);
+    } else {
+        encode_put_int(&msg, 0);
+    }
+
+    encode_put_bytes(&msg, VARDATA(row_json), VARSIZE(row_json) - VARHDRSZ);
+    if (key_json) {
+        encode_put_bytes(&msg, VARDATA(key_json), VARSIZE(key_json) - VARHDRSZ);
+    } else {
+        encode_put_bytes(&msg, NULL, -1);
+    }
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        encode_pool_send(pool, i, &msg);
+    }
+
+    pfree(msg.data);
+}
+
+/* Hands a change to the next worker. If too many changes are already in flight,
+ * first waits for the oldest one to be encoded and handled. schema, if not NULL,
+ * is the table schema to send to the client along with this change. */
+void encode_pool_submit(encode_pool_t pool, ReorderBufferChangeType action, Relation rel,
+        schema_cache_entry *schema, HeapTuple oldtuple, HeapTuple newtuple) {
+    StringInfoData msg;
+    encode_pending *pending;
+    int worker = pool->next_worker;
+
+    if (pool->num_pending == pool->max_pending) encode_pool_complete_oldest(pool);
+
+    initStringInfo(&msg);
+    appendStringInfoChar(&msg, ENCODE_MSG_CHANGE);
+    encode_put_int(&msg, action);
+    encode_put_int(&msg, RelationGetRelid(rel));
+    encode_put_tuple(&msg, oldtuple, RelationGetDescr(rel));
+    encode_put_tuple(&msg, newtuple, RelationGetDescr(rel));
+    encode_pool_send(pool, worker, &msg);
+    pfree(msg.data);
+
+    pending = &pool->pending[(pool->pending_head + pool->num_pending) % pool->max_pending];
+    pending->worker = worker;
+    pending->action = action;
+    pending->relid = RelationGetRelid(rel);
+    pending->schema = schema;
+    pool->num_pending++;
+    pool->next_worker = (worker + 1) % pool->num_workers;
+}
+
+/* Waits until every change in flight has been encoded and handled. */
+void encode_pool_drain(encode_pool_t pool) {
+    while (pool->num_pending > 0) encode_pool_complete_oldest(pool);
+}
+
+/* Detaches from the queues, which makes the workers exit, and releases the
+ * shared memory. */
+void encode_pool_stop(encode_pool_t pool) {
+    for (int i = 0; i < pool->num_workers; i++) {
+#if PG_VERSION_NUM >= 100000
+        shm_mq_detach(pool->to_worker[i]);
+        shm_mq_detach(pool->from_worker[i]);
+#endif
+        TerminateBackgroundWorker(pool->handles[i]);
+    }
+    dsm_detach(pool->segment);
+    MemoryContextDelete(pool->result_context);
+}
+
+/* Receives the result for the oldest change in flight, and passes it to the
+ * pool's callback. */
+void encode_pool_complete_oldest(encode_pool_t pool) {
+    encode_pending *pending = &pool->pending[pool->pending_head];
+    encode_result result;
+    encode_reader reader;
+    Size len;
+    void *data;
+    MemoryContext oldctx;
+
+    shm_mq_result res = shm_mq_receive(pool->from_worker[pending->worker], &len, &data, false);
+    if (res != SHM_MQ_SUCCESS) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+                errmsg("Bottled Water encoder worker %d exited unexpectedly", pending->worker)));
+    }
+
+    oldctx = MemoryContextSwitchTo(pool->result_context);
+    memset(&result, 0, sizeof(result));
+    result.action = pending->action;
+    result.relid = pending->relid;
+    result.schema = pending->schema;
+
+    reader.data = data;
+    reader.len = len;
+    reader.pos = 0;
+
+    if (encode_get_int(&reader) != 0) {
+        int32 error_len;
+        const char *error = encode_get_bytes(&reader, &error_len);
+        result.error = pnstrdup(error, error_len);
+    } else {
+        result.old_key_bin = encode_get_bytea(&reader);
+        result.new_key_bin = encode_get_bytea(&reader);
+        result.old_bin = encode_get_bytea(&reader);
+        result.new_bin = encode_get_bytea(&reader);
+    }
+
+    pool->pending_head = (pool->pending_head + 1) % pool->max_pending;
+    pool->num_pending--;
+
+    pool->on_result(pool->cb_context, &result);
+
+    MemoryContextSwitchTo(oldctx);
+    MemoryContextReset(pool->result_context);
+}
+
+/* Sends a message to a worker. While the worker's queue is full, handles the
+ * results of changes in flight; the worker may be waiting for room to send them,
+ * so blocking here could deadlock. */
+void encode_pool_send(encode_pool_t pool, int worker, StringInfo msg) {
+    shm_mq_result res;
+
+    while (true) {
+        res = encode_mq_send(pool->to_worker[worker], msg->len, msg->data, pool->num_pending > 0);
+        if (res != SHM_MQ_WOULD_BLOCK) break;
+        encode_pool_complete_oldest(pool);
+    }
+
+    if (res != SHM_MQ_SUCCESS) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+                errmsg("Bottled Water encoder worker %d exited unexpectedly", worker)));
+    }
+}
+
+void encode_put_int(StringInfo buf, int32 value) {
+    appendBinaryStringInfo(buf, (char *) &value, sizeof(value));
+}
+
+/* Appends a length-prefixed byte string, or a NULL if len is -1. */
+void encode_put_bytes(StringInfo buf, const char *data, int32 len) {
+    encode_put_int(buf, len);
+    if (len > 0) appendBinaryStringInfo(buf, data, len);
+}
+
+/* Appends a tuple (or NULL), with any out-of-line values fetched, since only the
+ * walsender can read them. */
+void encode_put_tuple(StringInfo buf, HeapTuple tuple, TupleDesc tupdesc) {
+    HeapTuple flat;
+
+    if (!tuple) {
+        encode_put_bytes(buf, NULL, -1);
+        return;
+    }
+
+    flat = HeapTupleHasExternal(tuple) ? toast_flatten_tuple(tuple, tupdesc) : tuple;
+    encode_put_bytes(buf, (char *) flat->t_data, flat->t_len);
+    if (flat != tuple) heap_freetuple(flat);
+}
+
+int32 encode_get_int(encode_reader *reader) {
+    int32 value;
+    if (reader->pos + sizeof(value) > reader->len) {
+        elog(ERROR, "Bottled Water encoder: message truncated");
+    }
+    memcpy(&value, reader->data + reader->pos, sizeof(value));
+    reader->pos += sizeof(value);
+    return value;
+}
+
+/* Returns a pointer to a byte string in the message, or NULL if it was NULL. */
+const char *encode_get_bytes(encode_reader *reader, int32 *len_out) {
+    const char *data;
+    int32 len = encode_get_int(reader);
+    *len_out = len;
+    if (len < 0) return NULL;
+
+    if (reader->pos + len > reader->len) {
+        elog(ERROR, "Bottled Water encoder: message truncated");
+    }
+    data = reader->data + reader->pos;
+    reader->pos += len;
+    return data;
+}
+
+/* Copies a byte string out of the message into a palloc'ed bytea. */
+bytea *encode_get_bytea(encode_reader *reader) {
+    int32 len;
+    bytea *value;
+    const char *data = encode_get_bytes(reader, &len);
+    if (!data) return NULL;
+
+    value = palloc(len + VARHDRSZ);
+    SET_VARSIZE(value, len + VARHDRSZ);
+    memcpy(VARDATA(value), data, len);
+    return value;
+}
+
+
+/* Entry point of an encoder worker. Handles messages from the walsender until
+ * the walsender detaches from the queue. */
+void bottledwater_encode_main(Datum main_arg) {
+    int index;
+    Oid database;
+    dsm_segment *segment;
+    shm_toc *toc;
+    shm_mq *to_worker, *from_worker;
+    shm_mq_handle *input, *output;
+    HTAB *tables;
+    HASHCTL hash_ctl;
+    MemoryContext work_context;
+    StringInfoData result;
+    bool in_transaction = false;
+
+    memcpy(&index, MyBgworkerEntry->bgw_extra, sizeof(int));
+    memcpy(&database, MyBgworkerEntry->bgw_extra + sizeof(int), sizeof(Oid));
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    CurrentResourceOwner = ResourceOwnerCreate(NULL, "Bottled Water encoder");
+
+    segment = dsm_attach(DatumGetUInt32(main_arg));
+    if (!segment) {
+        ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                errmsg("could not map Bottled Water encoder shared memory")));
+    }
+    dsm_pin_mapping(segment);
+    toc = shm_toc_attach(ENCODE_POOL_MAGIC, dsm_segment_address(segment));
+    if (!toc) elog(ERROR, "Bottled Water encoder: bad magic number in shared memory");
+
+    to_worker = encode_toc_lookup(toc, 2 * index);
+    from_worker = encode_toc_lookup(toc, 2 * index + 1);
+    shm_mq_set_receiver(to_worker, MyProc);
+    shm_mq_set_sender(from_worker, MyProc);
+    input = shm_mq_attach(to_worker, segment, NULL);
+    output = shm_mq_attach(from_worker, segment, NULL);
+
+#if PG_VERSION_NUM >= 110000
+    BackgroundWorkerInitializeConnectionByOid(database, InvalidOid, 0);
+#else
+    BackgroundWorkerInitializeConnectionByOid(database, InvalidOid);
+#endif
+
+    memset(&hash_ctl, 0, sizeof(hash_ctl));
+    hash_ctl.keysize = sizeof(Oid);
+    hash_ctl.entrysize = sizeof(encode_table);
+#ifdef HASH_BLOBS
+    tables = hash_create("Bottled Water encoder tables", 32, &hash_ctl, HASH_ELEM | HASH_BLOBS);
+#else
+    hash_ctl.hash = oid_hash;
+    tables = hash_create("Bottled Water encoder tables", 32, &hash_ctl, HASH_ELEM | HASH_FUNCTION);
+#endif
+
+    work_context = AllocSetContextCreate(TopMemoryContext, "Bottled Water encoder",
+            ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+    MemoryContextSwitchTo(TopMemoryContext);
+    initStringInfo(&result);
+
+    while (true) {
+        Size len;
+        void *data;
+        encode_reader reader;
+        MemoryContext oldctx;
+
+        /* Type output functions may look things up in the catalogs, so changes are
+         * encoded in a transaction, which is kept open while there is more work */
+        shm_mq_result res = shm_mq_receive(input, &len, &data, true);
+        if (res == SHM_MQ_WOULD_BLOCK) {
+            if (in_transaction) {
+                CommitTransactionCommand();
+                in_transaction = false;
+            }
+            res = shm_mq_receive(input, &len, &data, false);
+        }
+        if (res != SHM_MQ_SUCCESS) break;
+
+        if (!in_transaction) {
+            StartTransactionCommand();
+            in_transaction = true;
+        }
+
+        oldctx = MemoryContextSwitchTo(work_context);
+        reader.data = data;
+        reader.len = len;
+        reader.pos = 1;
+
+        if (len > 0 && ((char *) data)[0] == ENCODE_MSG_SCHEMA) {
+            encode_worker_schema(tables, &reader);
+        } else if (len > 0 && ((char *) data)[0] == ENCODE_MSG_CHANGE) {
+            resetStringInfo(&result);
+            encode_worker_change(tables, &reader, &result);
+            if (encode_mq_send(output, result.len, result.data, false) != SHM_MQ_SUCCESS) break;
+        } else {
+            elog(ERROR, "Bottled Water encoder: unknown message type");
+        }
+
+        MemoryContextSwitchTo(oldctx);
+        MemoryContextReset(work_context);
+    }
+
+    if (in_transaction) CommitTransactionCommand();
+    proc_exit(0);
+}
+
+/* Replaces the worker's schema information for a table. */
+void encode_worker_schema(HTAB *tables, encode_reader *reader) {
+    bool found = false;
+    int32 natts, json_len;
+    const char *json;
+    MemoryContext oldctx;
+    Oid relid = (Oid) encode_get_int(reader);
+    encode_table *table = hash_search(tables, &relid, HASH_ENTER, &found);
+
+    if (found) encode_table_free(table);
+    memset(table, 0, sizeof(encode_table));
+    table->relid = relid;
+
+    /* Unlike the message, the schema is kept until it is replaced */
+    oldctx = MemoryContextSwitchTo(TopMemoryContext);
+
+    natts = encode_get_int(reader);
+#if PG_VERSION_NUM >= 120000
+    table->tupdesc = CreateTemplateTupleDesc(natts);
+#else
+    table->tupdesc = CreateTemplateTupleDesc(natts, false);
+#endif
+    for (int i = 0; i < natts; i++) {
+        if (reader->pos + ATTRIBUTE_FIXED_PART_SIZE > reader->len) {
+            elog(ERROR, "Bottled Water encoder: message truncated");
+        }
+        memcpy(TupleDescAttr(table->tupdesc, i), reader->data + reader->pos, ATTRIBUTE_FIXED_PART_SIZE);
+        reader->pos += ATTRIBUTE_FIXED_PART_SIZE;
+    }
+
+    table->num_key_columns = encode_get_int(reader);
+    if (table->num_key_columns > 0) {
+        table->key_columns = palloc(table->num_key_columns * sizeof(int));
+        for (int i = 0; i < table->num_key_columns; i++) {
+            table->key_columns[i] = encode_get_int(reader);
+        }
+    }
+    MemoryContextSwitchTo(oldctx);
+
+    json = encode_get_bytes(reader, &json_len);
+    if (avro_schema_from_json_length(json, json_len, &table->row_schema)) {
+        elog(ERROR, "Bottled Water encoder: could not parse row schema: %s", avro_strerror());
+    }
+    table->row_iface = avro_generic_class_from_schema(table->row_schema);
+    avro_generic_value_new(table->row_iface, &table->row_value);
+
+    json = encode_get_bytes(reader, &json_len);
+    if (json) {
+        if (avro_schema_from_json_length(json, json_len, &table->key_schema)) {
+            elog(ERROR, "Bottled Water encoder: could not parse key schema: %s", avro_strerror());
+        }
+        table->key_iface = avro_generic_class_from_schema(table->key_schema);
+        avro_generic_value_new(table->key_iface, &table->key_value);
+    }
+}
+
+/* Encodes the old and new tuples of a change, and appends the result message:
+ * a status, followed by either an error message or the old key, new key, old
+ * row and new row, any of which may be NULL. */
+void encode_worker_change(HTAB *tables, encode_reader *reader, StringInfo result) {
+    int err = 0;
+    int32 old_len, new_len;
+    const char *old_data, *new_data;
+    bytea *old_key_bin = NULL, *new_key_bin = NULL, *old_bin = NULL, *new_bin = NULL;
+    encode_table *table;
+    Oid relid;
+
+    encode_get_int(reader); /* action, only needed by the walsender */
+    relid = (Oid) encode_get_int(reader);
+    old_data = encode_get_bytes(reader, &old_len);
+    new_data = encode_get_bytes(reader, &new_len);
+
+    table = hash_search(tables, &relid, HASH_FIND, NULL);
+    if (!table) elog(ERROR, "Bottled Water encoder: no schema for relation %u", relid);
+
+    if (old_data) err = encode_worker_tuple(table, old_data, old_len, &old_key_bin, &old_bin);
+    if (!err && new_data) err = encode_worker_tuple(table, new_data, new_len, &new_key_bin, &new_bin);
+
+    encode_put_int(result, err);
+    if (err) {
+        const char *error = avro_strerror();
+        encode_put_bytes(result, error, strlen(error));
+        return;
+    }
+
+#define PUT_BYTEA(value) \
+    encode_put_bytes(result, value ? VARDATA(value) : NULL, value ? VARSIZE(value) - VARHDRSZ : -1)
+    PUT_BYTEA(old_key_bin);
+    PUT_BYTEA(new_key_bin);
+    PUT_BYTEA(old_bin);
+    PUT_BYTEA(new_bin);
+#undef PUT_BYTEA
+}
+
+/* Encodes the key (if the table has one) and the row of a tuple sent by the
+ * walsender. */
+int encode_worker_tuple(encode_table *table, const char *data, int32 len,
+        bytea **key_out, bytea **row_out) {
+    int err = 0;
+    HeapTupleData tuple;
+
+    /* The message is not necessarily aligned, but the tuple must be */
+    tuple.t_len = len;
+    tuple.t_tableOid = table->relid;
+    ItemPointerSetInvalid(&tuple.t_self);
+    tuple.t_data = (HeapTupleHeader) palloc(len);
+    memcpy(tuple.t_data, data, len);
+
+    if (table->key_schema) {
+        check(err, tuple_to_avro_key_columns(&table->key_value, table->tupdesc, &tuple,
+                    table->num_key_columns, table->key_columns));
+        check(err, try_writing(key_out, &write_avro_binary, &table->key_value));
+    }
+
+    check(err, avro_value_reset(&table->row_value));
+    check(err, tuple_to_avro_row(&table->row_value, table->tupdesc, &tuple));
+    check(err, try_writing(row_out, &write_avro_binary, &table->row_value));
+    return err;
+}
+
+void encode_table_free(encode_table *table) {
+    if (table->key_schema) {
+        avro_value_decref(&table->key_value);
+        avro_value_iface_decref(table->key_iface);
+        avro_schema_decref(table->key_schema);
+    }
+    avro_value_decref(&table->row_value);
+    avro_value_iface_decref(table->row_iface);
+    avro_schema_decref(table->row_schema);
+    if (table->key_columns) pfree(table->key_columns);
+    FreeTupleDesc(table->tupdesc);
+}
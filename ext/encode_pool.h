@@ -0,0 +1,63 @@
+#ifndef ENCODE_POOL_H
+#define ENCODE_POOL_H
+
+#include "schema_cache.h"
+#include "postgres.h"
+#include "fmgr.h"
+#include "postmaster/bgworker.h"
+#include "replication/reorderbuffer.h"
+#include "storage/dsm.h"
+#include "storage/shm_mq.h"
+
+#define ENCODE_POOL_MAX_WORKERS 32
+
+/* A change that has been encoded by a worker, handed back in the original order. */
+typedef struct {
+    ReorderBufferChangeType action;
+    Oid relid;
+    schema_cache_entry *schema;     /* Table schema to send before the change, or NULL */
+    bytea *old_key_bin;             /* Encoded key of the old row, or NULL */
+    bytea *new_key_bin;             /* Encoded key of the new row, or NULL */
+    bytea *old_bin;                 /* Encoded old row, or NULL */
+    bytea *new_bin;                 /* Encoded new row, or NULL */
+    const char *error;              /* If not NULL, encoding failed and the above are unset */
+} encode_result;
+
+/* Called with each encoded change, in the order in which they were submitted. */
+typedef void (*encode_result_cb)(void *cb_context, encode_result *result);
+
+/* A change that has been sent to a worker, and whose result has not yet been received. */
+typedef struct {
+    int worker;
+    ReorderBufferChangeType action;
+    Oid relid;
+    schema_cache_entry *schema;
+} encode_pending;
+
+typedef struct {
+    int num_workers;
+    dsm_segment *segment;
+    BackgroundWorkerHandle *handles[ENCODE_POOL_MAX_WORKERS];
+    shm_mq_handle *to_worker[ENCODE_POOL_MAX_WORKERS];
+    shm_mq_handle *from_worker[ENCODE_POOL_MAX_WORKERS];
+    int next_worker;                /* Worker to which the next change is sent */
+    encode_pending *pending;        /* Ring buffer of changes in flight, oldest at pending_head */
+    int max_pending, pending_head, num_pending;
+    MemoryContext result_context;   /* Reset after each result has been handled */
+    encode_result_cb on_result;
+    void *cb_context;
+} encode_pool;
+
+typedef encode_pool *encode_pool_t;
+
+encode_pool_t encode_pool_start(int num_workers, int max_pending, MemoryContext context,
+        encode_result_cb on_result, void *cb_context);
+void encode_pool_send_schema(encode_pool_t pool, Relation rel, schema_cache_entry *entry);
+void encode_pool_submit(encode_pool_t pool, ReorderBufferChangeType action, Relation rel,
+        schema_cache_entry *schema, HeapTuple oldtuple, HeapTuple newtuple);
+void encode_pool_drain(encode_pool_t pool);
+void encode_pool_stop(encode_pool_t pool);
+
+PGDLLEXPORT void bottledwater_encode_main(Datum main_arg);
+
+#endif /* ENCODE_POOL_H */
@@ -1,4 +1,5 @@
 #include "io_util.h"
+#include "probes.h"
 
 #define INIT_BUFFER_LENGTH 16384
 #define MAX_BUFFER_LENGTH 1048576
@@ -26,6 +27,7 @@ int try_writing(bytea **output, try_writing_cb cb, void *context) {
 
         if (err == ENOSPC) {
             size *= 4;
+            BW_PROBE1(write__retry, size);
             pfree(*output);
         }
         avro_writer_free(writer);
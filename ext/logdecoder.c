@@ -2,6 +2,11 @@
 #include "protocol_server.h"
 #include "oid2avro.h"
 #include "error_policy.h"
+#include "probes.h"
+#include "shard.h"
+#include "encode_pool.h"
+#include "spool_worker.h"
+#include "shared_schema.h"
 
 #include "replication/logical.h"
 #include "replication/output_plugin.h"
@@ -17,21 +22,38 @@ static void output_avro_shutdown(LogicalDecodingContext *ctx);
 static void output_avro_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn);
 static void output_avro_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
 static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, Relation rel, ReorderBufferChange *change);
+#if PG_VERSION_NUM >= 110000
+static void output_avro_truncate(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+        int nrelations, Relation relations[], ReorderBufferChange *change);
+#endif
 
 typedef struct {
     MemoryContext memctx; /* reset after every change event, to prevent leaks */
+    int protocol_version; /* Version of the frame schema the client asked for */
     avro_schema_t frame_schema;
     avro_value_iface_t *frame_iface;
     avro_value_t frame_value;
     schema_cache_t schema_cache;
     error_policy_t error_policy;
+    shard_spec shard;     /* Which changes to emit, if this client is one of several shards */
+    int encode_workers;   /* Number of background workers that encode rows; 0 to encode here */
+    int encode_pending;   /* Maximum number of changes handed to workers but not yet written */
+    encode_pool_t encode_pool;
 } plugin_state;
 
+bool change_in_shard(plugin_state *state, Relation rel, ReorderBufferChange *change);
+void submit_change(plugin_state *state, Relation rel, ReorderBufferChange *change);
+void write_encoded_change(void *cb_context, encode_result *result);
+int parse_int_option(DefElem *elem, int min, int max);
+void parse_known_schemas(plugin_state *state, DefElem *elem);
 void reset_frame(plugin_state *state);
 int write_frame(LogicalDecodingContext *ctx, plugin_state *state);
 
 
 void _PG_init() {
+    protocol_server_init();
+    shared_schema_init();
+    spool_worker_init();
 }
 
 void _PG_output_plugin_init(OutputPluginCallbacks *cb) {
@@ -39,6 +61,9 @@ void _PG_output_plugin_init(OutputPluginCallbacks *cb) {
     cb->startup_cb = output_avro_startup;
     cb->begin_cb = output_avro_begin_txn;
     cb->change_cb = output_avro_change;
+#if PG_VERSION_NUM >= 110000
+    cb->truncate_cb = output_avro_truncate;
+#endif
     cb->commit_cb = output_avro_commit_txn;
     cb->shutdown_cb = output_avro_shutdown;
 }
@@ -47,16 +72,14 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
         bool is_init) {
     ListCell *option;
 
-    plugin_state *state = palloc(sizeof(plugin_state));
+    plugin_state *state = palloc0(sizeof(plugin_state));
     ctx->output_plugin_private = state;
     opt->output_type = OUTPUT_PLUGIN_BINARY_OUTPUT;
 
     state->memctx = AllocSetContextCreate(ctx->context, "Avro decoder context",
             ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
 
-    state->frame_schema = schema_for_frame();
-    state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
-    avro_generic_value_new(state->frame_iface, &state->frame_value);
+    state->protocol_version = PROTOCOL_VERSION_MIN;
     state->schema_cache = schema_cache_new(ctx->context);
 
     foreach(option, ctx->output_plugin_options) {
@@ -71,6 +94,26 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
             } else {
                 state->error_policy = parse_error_policy(strVal(elem->arg));
             }
+        } else if (strcmp(elem->defname, "shard") == 0) {
+            if (elem->arg == NULL) {
+                ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                        errmsg("No value specified for parameter \"%s\"",
+                            elem->defname)));
+            } else {
+                shard_parse(&state->shard, strVal(elem->arg));
+            }
+        } else if (strcmp(elem->defname, "shard_key_tables") == 0) {
+            if (elem->arg != NULL) {
+                shard_parse_key_tables(&state->shard, strVal(elem->arg));
+            }
+        } else if (strcmp(elem->defname, "encode_workers") == 0) {
+            state->encode_workers = parse_int_option(elem, 0, ENCODE_POOL_MAX_WORKERS);
+        } else if (strcmp(elem->defname, "encode_pending") == 0) {
+            state->encode_pending = parse_int_option(elem, 1, 1000000);
+        } else if (strcmp(elem->defname, "known_schemas") == 0) {
+            parse_known_schemas(state, elem);
+        } else if (strcmp(elem->defname, "protocol_version") == 0) {
+            state->protocol_version = parse_int_option(elem, PROTOCOL_VERSION_MIN, PROTOCOL_VERSION);
         } else {
             ereport(INFO, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
                     errmsg("Parameter \"%s\" = \"%s\" is unknown",
@@ -78,10 +121,24 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
                         elem->arg ? strVal(elem->arg) : "(null)")));
         }
     }
+
+    /* Clients that do not ask for a protocol version get the frames of the first
+     * release, which they know how to decode */
+    state->frame_schema = schema_for_frame(state->protocol_version);
+    state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
+    avro_generic_value_new(state->frame_iface, &state->frame_value);
+
+    /* Not when the slot is being created, as there is nothing to decode yet */
+    if (state->encode_workers > 0 && !is_init) {
+        if (state->encode_pending == 0) state->encode_pending = 1024;
+        state->encode_pool = encode_pool_start(state->encode_workers, state->encode_pending,
+                ctx->context, write_encoded_change, ctx);
+    }
 }
 
 static void output_avro_shutdown(LogicalDecodingContext *ctx) {
     plugin_state *state = ctx->output_plugin_private;
+    if (state->encode_pool) encode_pool_stop(state->encode_pool);
     MemoryContextDelete(state->memctx);
 
     schema_cache_free(state->schema_cache);
@@ -110,6 +167,7 @@ static void output_avro_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN
         XLogRecPtr commit_lsn) {
     plugin_state *state = ctx->output_plugin_private;
     MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
+    if (state->encode_pool) encode_pool_drain(state->encode_pool);
     reset_frame(state);
 
     if (update_frame_with_commit_txn(&state->frame_value, txn, commit_lsn)) {
@@ -129,6 +187,22 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
     HeapTuple oldtuple = NULL, newtuple = NULL;
     plugin_state *state = ctx->output_plugin_private;
     MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
+
+    if (!change_in_shard(state, rel, change)) {
+        MemoryContextSwitchTo(oldctx);
+        MemoryContextReset(state->memctx);
+        return;
+    }
+
+    BW_PROBE2(change__start, RelationGetRelid(rel), change->action);
+
+    if (state->encode_pool) {
+        submit_change(state, rel, change);
+        MemoryContextSwitchTo(oldctx);
+        MemoryContextReset(state->memctx);
+        return;
+    }
+
     reset_frame(state);
 
     switch (change->action) {
@@ -174,10 +248,178 @@ static void output_avro_change(LogicalDecodingContext *ctx, ReorderBufferTXN *tx
     if (write_frame(ctx, state)) {
         error_policy_handle(state->error_policy, "output_avro_change: writing Avro binary failed", avro_strerror());
     }
+    BW_PROBE2(change__done, RelationGetRelid(rel), ctx->out->len);
+
+    MemoryContextSwitchTo(oldctx);
+    MemoryContextReset(state->memctx);
+}
+
+#if PG_VERSION_NUM >= 110000
+/* Called for a TRUNCATE, which logical decoding reports once for all the tables it
+ * names (including those it cascades to), without the rows they contained. Every
+ * shard is sent the truncation of a table it has any rows of. Changes still with
+ * the encoder workers are written first, so that they stay in order. */
+static void output_avro_truncate(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+        int nrelations, Relation relations[], ReorderBufferChange *change) {
+    plugin_state *state = ctx->output_plugin_private;
+    MemoryContext oldctx;
+
+    /* Version 1 of the protocol has no message for a truncation */
+    if (state->protocol_version < 2) return;
+
+    oldctx = MemoryContextSwitchTo(state->memctx);
+    if (state->encode_pool) encode_pool_drain(state->encode_pool);
+    reset_frame(state);
+
+    for (int i = 0; i < nrelations; i++) {
+        if (!shard_contains_table(&state->shard, relations[i])) continue;
+
+        if (update_frame_with_truncate(&state->frame_value, state->schema_cache, relations[i])) {
+            elog(INFO, "Truncate conversion failed: %s", schema_debug_info(relations[i], NULL));
+            error_policy_handle(state->error_policy, "output_avro_truncate: schema conversion failed", avro_strerror());
+        }
+    }
+
+    if (write_frame(ctx, state)) {
+        error_policy_handle(state->error_policy, "output_avro_truncate: writing Avro binary failed", avro_strerror());
+    }
 
     MemoryContextSwitchTo(oldctx);
     MemoryContextReset(state->memctx);
 }
+#endif
+
+/* Returns false if the change belongs to another shard, and so should not be sent
+ * to this client. Begin and commit events are sent to every shard regardless. */
+bool change_in_shard(plugin_state *state, Relation rel, ReorderBufferChange *change) {
+    ReorderBufferTupleBuf *tuple;
+
+    if (state->shard.count <= 1) return true;
+
+    switch (change->action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            /* If an update changes the key, the new key decides the shard */
+            tuple = change->data.tp.newtuple;
+            break;
+        case REORDER_BUFFER_CHANGE_DELETE:
+            tuple = change->data.tp.oldtuple;
+            break;
+        default:
+            return true;
+    }
+
+    return shard_contains_row(&state->shard, rel, RelationGetDescr(rel),
+            tuple ? &tuple->tuple : NULL);
+}
+
+/* Hands a change to the encoder workers, instead of encoding it here. The frame
+ * is written by write_encoded_change() once the change has been encoded, which
+ * may be during a later callback; changes are still written in order, and all of
+ * them before the transaction's commit. */
+void submit_change(plugin_state *state, Relation rel, ReorderBufferChange *change) {
+    HeapTuple oldtuple = NULL, newtuple = NULL;
+    schema_cache_entry *entry;
+
+    int changed = schema_cache_lookup(state->schema_cache, rel, &entry);
+    if (changed < 0) {
+        elog(INFO, "Row conversion failed: %s", schema_debug_info(rel, NULL));
+        error_policy_handle(state->error_policy, "output_avro_change: schema conversion failed", avro_strerror());
+        return;
+    } else if (changed) {
+        encode_pool_send_schema(state->encode_pool, rel, entry);
+    }
+
+    switch (change->action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            if (!change->data.tp.newtuple) {
+                elog(ERROR, "output_avro_change: %s action without a tuple",
+                        change->action == REORDER_BUFFER_CHANGE_INSERT ? "insert" : "update");
+            }
+            if (change->data.tp.oldtuple) {
+                oldtuple = &change->data.tp.oldtuple->tuple;
+            }
+            newtuple = &change->data.tp.newtuple->tuple;
+            break;
+
+        case REORDER_BUFFER_CHANGE_DELETE:
+            if (change->data.tp.oldtuple) {
+                oldtuple = &change->data.tp.oldtuple->tuple;
+            }
+            break;
+
+        default:
+            elog(ERROR, "output_avro_change: unknown change action %d", change->action);
+    }
+
+    encode_pool_submit(state->encode_pool, change->action, rel, changed ? entry : NULL,
+            oldtuple, newtuple);
+}
+
+/* encode_result_cb that writes the frame for a change encoded by a worker. */
+void write_encoded_change(void *cb_context, encode_result *result) {
+    LogicalDecodingContext *ctx = cb_context;
+    plugin_state *state = ctx->output_plugin_private;
+    reset_frame(state);
+
+    if (result->schema && update_frame_with_table_schema(&state->frame_value, result->schema)) {
+        elog(ERROR, "output_avro_change: Avro conversion of schema failed: %s", avro_strerror());
+    }
+
+    if (result->error) {
+        elog(INFO, "Row conversion failed for relation %u", result->relid);
+        error_policy_handle(state->error_policy, "output_avro_change: row conversion failed", result->error);
+    } else if (update_frame_with_encoded_change(&state->frame_value, result->action, result->relid,
+                result->old_key_bin, result->new_key_bin, result->old_bin, result->new_bin)) {
+        error_policy_handle(state->error_policy, "output_avro_change: row conversion failed", avro_strerror());
+    }
+
+    if (write_frame(ctx, state)) {
+        error_policy_handle(state->error_policy, "output_avro_change: writing Avro binary failed", avro_strerror());
+    }
+    BW_PROBE2(change__done, result->relid, ctx->out->len);
+}
+
+/* Parses the value of an integer plugin option, which must be between min and max. */
+int parse_int_option(DefElem *elem, int min, int max) {
+    char *end;
+    long value;
+
+    if (elem->arg == NULL) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("No value specified for parameter \"%s\"", elem->defname)));
+    }
+
+    value = strtol(strVal(elem->arg), &end, 10);
+    if (*end != '\0' || end == strVal(elem->arg) || value < min || value > max) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("Parameter \"%s\" must be an integer between %d and %d",
+                    elem->defname, min, max)));
+    }
+    return (int) value;
+}
+
+/* Parses the "known_schemas" plugin option: a comma-separated list of the schema
+ * fingerprints (in hex) that the client received on an earlier connection. Tables
+ * whose schemas have one of these fingerprints are announced without the JSON. */
+void parse_known_schemas(plugin_state *state, DefElem *elem) {
+    char *list, *end;
+
+    if (elem->arg == NULL) return;
+    list = strVal(elem->arg);
+
+    while (*list != '\0') {
+        uint64 fingerprint = strtoull(list, &end, 16);
+        if (end == list || (*end != ',' && *end != '\0')) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("Parameter \"%s\" must be a comma-separated list of hexadecimal fingerprints",
+                        elem->defname)));
+        }
+        schema_cache_add_known(state->schema_cache, fingerprint);
+        list = (*end == ',') ? end + 1 : end;
+    }
+}
 
 void reset_frame(plugin_state *state) {
     if (avro_value_reset(&state->frame_value)) {
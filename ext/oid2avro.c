@@ -16,7 +16,8 @@
 #include "utils/numeric.h"
 #include "utils/timestamp.h"
 
-#ifndef HAVE_INT64_TIMESTAMP
+/* Postgres 10 dropped the option, and always uses integers */
+#if PG_VERSION_NUM < 100000 && !defined(HAVE_INT64_TIMESTAMP)
 #error Expecting timestamps to be represented as integers, not as floating-point.
 #endif
 
@@ -163,7 +164,7 @@ int schema_for_table_row(Relation rel, avro_schema_t *schema_out) {
     }
 
     for (int i = 0; i < tupdesc->natts; i++) {
-        Form_pg_attribute attr = tupdesc->attrs[i];
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
         if (attr->attisdropped) continue; /* skip dropped columns */
 
         attname_avro_safe = make_avro_safe(NameStr(attr->attname), false);
@@ -193,7 +194,7 @@ int tuple_to_avro_row(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tup
         bool isnull=false;
         Datum datum;
 
-        Form_pg_attribute attr = tupdesc->attrs[i];
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
         if (attr->attisdropped) continue; /* skip dropped columns */
 
         check(err, avro_value_get_by_index(output_val, field, &field_val, NULL));
@@ -222,32 +223,48 @@ int tuple_to_avro_key(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tup
         Relation rel, Form_pg_index key_index) {
     int err = 0;
     TupleDesc rel_tupdesc = RelationGetDescr(rel);
-    check(err, avro_value_reset(output_val));
+    int *columns = palloc(key_index->indkey.dim1 * sizeof(int));
 
     for (int field = 0; field < key_index->indkey.dim1; field++) {
-        Form_pg_attribute attr;
-        avro_value_t field_val;
-        bool isnull=false;
-        Datum datum;
-
         int attnum = key_index->indkey.values[field] - 1;
 
-        // rel_tupdesc->attrs[attnum] is the indexed attribute. To figure out which
+        // Attribute attnum of rel_tupdesc is the indexed attribute. To figure out which
         // attribute number in the tuple this corresponds to, we need to see if there
         // are any columns that are dropped in rel_tupdesc but not in tupdesc.
         int tup_i = 0;
         for (int rel_i = 0; rel_i < attnum; rel_i++) {
-            if (!rel_tupdesc->attrs[rel_i]->attisdropped || tupdesc->attrs[tup_i]->attisdropped) tup_i++;
+            if (!TupleDescAttr(rel_tupdesc, rel_i)->attisdropped || TupleDescAttr(tupdesc, tup_i)->attisdropped) tup_i++;
         }
 
-        if (tup_i >= tupdesc->natts || tupdesc->attrs[tup_i]->attisdropped) {
+        if (tup_i >= tupdesc->natts || TupleDescAttr(tupdesc, tup_i)->attisdropped) {
             elog(ERROR, "index refers to non-existent attribute number %d", attnum);
         }
+        columns[field] = tup_i;
+    }
+
+    err = tuple_to_avro_key_columns(output_val, tupdesc, tuple, key_index->indkey.dim1, columns);
+    pfree(columns);
+    return err;
+}
+
+
+/* Translates the key fields of a tuple into an Avro value in the schema generated
+ * by schema_for_table_key(), given the (zero-based) positions of the key columns
+ * in tupdesc, in the order in which they appear in the key. */
+int tuple_to_avro_key_columns(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple,
+        int num_columns, const int *columns) {
+    int err = 0;
+    check(err, avro_value_reset(output_val));
+
+    for (int field = 0; field < num_columns; field++) {
+        avro_value_t field_val;
+        bool isnull=false;
+        Datum datum;
 
-        attr = tupdesc->attrs[tup_i];
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, columns[field]);
         check(err, avro_value_get_by_index(output_val, field, &field_val, NULL));
 
-        datum = heap_getattr(tuple, tup_i + 1, tupdesc, &isnull);
+        datum = heap_getattr(tuple, columns[field] + 1, tupdesc, &isnull);
 
         if (isnull) {
             check(err, avro_value_set_branch(&field_val, 0, NULL));
@@ -2,6 +2,7 @@
 #define OID2AVRO_H
 
 #include "avro.h"
+#include "pg_compat.h"
 #include "postgres.h"
 #include "access/htup.h"
 #include "utils/rel.h"
@@ -15,5 +16,7 @@ int schema_for_table_row(Relation rel, avro_schema_t *schema_out);
 int tuple_to_avro_row(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple);
 int tuple_to_avro_key(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple,
         Relation rel, Form_pg_index key_index);
+int tuple_to_avro_key_columns(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple,
+        int num_columns, const int *columns);
 
 #endif /* OID2AVRO_H */
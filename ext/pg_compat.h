@@ -0,0 +1,29 @@
+#ifndef PG_COMPAT_H
+#define PG_COMPAT_H
+
+/* Differences between the Postgres versions that the extension builds against,
+ * for server APIs that are used in more than one file. Differences that only
+ * matter in one place are handled where they occur. */
+
+#include "postgres.h"
+#include "access/tupdesc.h"
+
+/* Postgres 11 changed TupleDesc->attrs from an array of pointers to an array of
+ * structs, and added this macro to get a pointer to an attribute either way. */
+#ifndef TupleDescAttr
+#define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
+#endif
+
+/* stringToQualifiedNameList() moved to regproc.h in Postgres 10, and gained an
+ * argument for soft error reporting in Postgres 16. */
+#if PG_VERSION_NUM >= 100000
+#include "utils/regproc.h"
+#endif
+
+#if PG_VERSION_NUM >= 160000
+#define string_to_qualified_name_list(string) stringToQualifiedNameList(string, NULL)
+#else
+#define string_to_qualified_name_list(string) stringToQualifiedNameList(string)
+#endif
+
+#endif /* PG_COMPAT_H */
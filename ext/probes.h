@@ -0,0 +1,58 @@
+/* This file is shared between the server-side extension and the client, in the
+ * same way as protocol.h. It defines statically defined tracing (USDT) probe
+ * points on the hot path, which can be attached to with bpftrace, perf or
+ * SystemTap, e.g.
+ *
+ *     bpftrace -e 'usdt:./bottledwater:bottledwater:backpressure__done { @ = hist(arg0); }'
+ *
+ * A probe point compiles down to a single nop instruction, so it costs nothing
+ * unless a tracer is attached. Probes are only compiled in if the build found
+ * <sys/sdt.h> (from systemtap-sdt-dev or systemtap-sdt-devel) and defined
+ * HAVE_SYS_SDT_H; otherwise the macros expand to nothing.
+ *
+ * Probes in the extension (provider "bottledwater", in bottledwater.so):
+ *
+ *   change__start(relid, action)          output plugin starts converting a change
+ *   change__done(relid, frame_len)        output plugin wrote the frame for a change
+ *   schema__miss(relid, result)           schema cache had no up-to-date entry; result is
+ *                                         as returned by schema_cache_lookup()
+ *   write__retry(buffer_len)              Avro output did not fit, retrying with a larger buffer
+ *
+ * Probes in the client (in bwtest, bwload and bottledwater):
+ *
+ *   frame__start(wal_pos, frame_len)      client starts parsing a frame
+ *   frame__done(wal_pos, err)             client finished parsing a frame
+ *
+ * Probes in the Kafka client (in bottledwater):
+ *
+ *   send(relid, wal_pos, key_len, val_len)    message encoded and handed to the producer
+ *   backpressure__start()                     blocking until the producer queue drains
+ *   backpressure__done(usecs)                 returned from backpressure, after usecs
+ *   deliver(relid, wal_pos, err)              Kafka reported delivery (err 0 = success)
+ *   checkpoint(xid, commit_lsn)               fsync LSN advanced past a transaction
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define BW_PROBE0(name)                 DTRACE_PROBE(bottledwater, name)
+#define BW_PROBE1(name, a)              DTRACE_PROBE1(bottledwater, name, a)
+#define BW_PROBE2(name, a, b)           DTRACE_PROBE2(bottledwater, name, a, b)
+#define BW_PROBE3(name, a, b, c)        DTRACE_PROBE3(bottledwater, name, a, b, c)
+#define BW_PROBE4(name, a, b, c, d)     DTRACE_PROBE4(bottledwater, name, a, b, c, d)
+
+#else
+
+#define BW_PROBE0(name)                 do {} while (0)
+#define BW_PROBE1(name, a)              do {} while (0)
+#define BW_PROBE2(name, a, b)           do {} while (0)
+#define BW_PROBE3(name, a, b, c)        do {} while (0)
+#define BW_PROBE4(name, a, b, c, d)     do {} while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* PROBES_H */
@@ -5,30 +5,43 @@
 #include "protocol.h"
 #include <assert.h>
 
-avro_schema_t schema_for_begin_txn(void);
-avro_schema_t schema_for_commit_txn(void);
-avro_schema_t schema_for_table_schema(void);
+avro_schema_t schema_for_begin_txn(int version);
+avro_schema_t schema_for_commit_txn(int version);
+avro_schema_t schema_for_table_schema(int version);
 avro_schema_t schema_for_insert(void);
 avro_schema_t schema_for_update(void);
 avro_schema_t schema_for_delete(void);
+avro_schema_t schema_for_truncate(void);
+avro_schema_t schema_for_truncate() {
+    avro_schema_t record_schema = avro_schema_record("Truncate", PROTOCOL_SCHEMA_NAMESPACE);
+
+    avro_schema_t field_schema = avro_schema_long();
+    avro_schema_record_field_append(record_schema, "relid", field_schema);
+    avro_schema_decref(field_schema);
+
+    return record_schema;
+}
+
 avro_schema_t nullable_schema(avro_schema_t value_schema);
 
-avro_schema_t schema_for_frame() {
+/* Returns the schema of a frame in the given version of the protocol (see
+ * PROTOCOL_VERSION). Later versions only add fields and messages. */
+avro_schema_t schema_for_frame(int version) {
     avro_schema_t union_schema, branch_schema, array_schema, record_schema;
     union_schema = avro_schema_union();
 
     assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_BEGIN_TXN);
-    branch_schema = schema_for_begin_txn();
+    branch_schema = schema_for_begin_txn(version);
     avro_schema_union_append(union_schema, branch_schema);
     avro_schema_decref(branch_schema);
 
     assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_COMMIT_TXN);
-    branch_schema = schema_for_commit_txn();
+    branch_schema = schema_for_commit_txn(version);
     avro_schema_union_append(union_schema, branch_schema);
     avro_schema_decref(branch_schema);
 
     assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_TABLE_SCHEMA);
-    branch_schema = schema_for_table_schema();
+    branch_schema = schema_for_table_schema(version);
     avro_schema_union_append(union_schema, branch_schema);
     avro_schema_decref(branch_schema);
 
@@ -47,6 +60,13 @@ avro_schema_t schema_for_frame() {
     avro_schema_union_append(union_schema, branch_schema);
     avro_schema_decref(branch_schema);
 
+    if (version >= 2) {
+        assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_TRUNCATE);
+        branch_schema = schema_for_truncate();
+        avro_schema_union_append(union_schema, branch_schema);
+        avro_schema_decref(branch_schema);
+    }
+
     array_schema = avro_schema_array(union_schema);
     avro_schema_decref(union_schema);
 
@@ -56,17 +76,23 @@ avro_schema_t schema_for_frame() {
     return record_schema;
 }
 
-avro_schema_t schema_for_begin_txn() {
+avro_schema_t schema_for_begin_txn(int version) {
     avro_schema_t record_schema = avro_schema_record("BeginTxn", PROTOCOL_SCHEMA_NAMESPACE);
 
     avro_schema_t field_schema = avro_schema_long();
     avro_schema_record_field_append(record_schema, "xid", field_schema);
     avro_schema_decref(field_schema);
 
+    if (version >= 2) {
+        field_schema = avro_schema_long();
+        avro_schema_record_field_append(record_schema, "commitTime", field_schema);
+        avro_schema_decref(field_schema);
+    }
+
     return record_schema;
 }
 
-avro_schema_t schema_for_commit_txn() {
+avro_schema_t schema_for_commit_txn(int version) {
     avro_schema_t record_schema = avro_schema_record("CommitTxn", PROTOCOL_SCHEMA_NAMESPACE);
 
     avro_schema_t field_schema = avro_schema_long();
@@ -77,10 +103,16 @@ avro_schema_t schema_for_commit_txn() {
     avro_schema_record_field_append(record_schema, "lsn", field_schema);
     avro_schema_decref(field_schema);
 
+    if (version >= 2) {
+        field_schema = avro_schema_long();
+        avro_schema_record_field_append(record_schema, "commitTime", field_schema);
+        avro_schema_decref(field_schema);
+    }
+
     return record_schema;
 }
 
-avro_schema_t schema_for_table_schema() {
+avro_schema_t schema_for_table_schema(int version) {
     avro_schema_t record_schema = avro_schema_record("TableSchema", PROTOCOL_SCHEMA_NAMESPACE);
 
     avro_schema_t field_schema = avro_schema_long();
@@ -95,6 +127,14 @@ avro_schema_t schema_for_table_schema() {
     avro_schema_record_field_append(record_schema, "rowSchema", field_schema);
     avro_schema_decref(field_schema);
 
+    /* Identifies the schemas; if the client announced it already knows this
+     * fingerprint, keySchema is null and rowSchema is empty. */
+    if (version >= 2) {
+        field_schema = avro_schema_long();
+        avro_schema_record_field_append(record_schema, "fingerprint", field_schema);
+        avro_schema_decref(field_schema);
+    }
+
     return record_schema;
 }
 
@@ -22,13 +22,28 @@
 #define PROTOCOL_MSG_INSERT         3
 #define PROTOCOL_MSG_UPDATE         4
 #define PROTOCOL_MSG_DELETE         5
+#define PROTOCOL_MSG_TRUNCATE       6
+
+/* The commitTime field of BeginTxn and CommitTxn messages is the transaction's
+ * commit timestamp, in microseconds since 2000-01-01 (the Postgres epoch), or
+ * zero if it is not known (e.g. for the snapshot, or on Postgres 9.4). */
+
+/* Versions of the frame schema. Version 1 is the frame of the first release;
+ * version 2 adds the commitTime field of BeginTxn and CommitTxn, the fingerprint
+ * field of TableSchema, and the Truncate message. The server sends version 1
+ * frames unless the client asks for a later version, with the "protocol_version"
+ * plugin option when streaming, or the bottledwater.protocol_version setting for
+ * the snapshot functions, so that existing clients keep working against an
+ * upgraded server. */
+#define PROTOCOL_VERSION_MIN 1
+#define PROTOCOL_VERSION     2
 
 
 /* Error policies, determining what the snapshot function and output plugin
  * should do if they encounter an error encoding a row.
  *
  * These should match the values of the bottledwater_error_policy_valid
- * constraint in bottledwater--0.1.sql.
+ * constraint in bottledwater--0.2.sql.
  */
 /* The default policy is "exit": an error will terminate the snapshot or
  * replication stream.  This policy should be used if avoiding data loss is the
@@ -44,6 +59,6 @@
 #define PROTOCOL_ERROR_POLICY_LOG "log"
 
 
-avro_schema_t schema_for_frame(void);
+avro_schema_t schema_for_frame(int version);
 
 #endif /* PROTOCOL_H */
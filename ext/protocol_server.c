@@ -8,23 +8,63 @@
 #include <stdarg.h>
 #include <string.h>
 #include "access/heapam.h"
+#include "utils/guc.h"
 
 int extract_tuple_key(schema_cache_entry *entry, Relation rel, TupleDesc tupdesc, HeapTuple tuple, bytea **key_out);
-int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry);
 int update_frame_with_insert_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *new_bin);
 int update_frame_with_update_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin, bytea *new_bin);
 int update_frame_with_delete_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin);
+int64 txn_commit_time(ReorderBufferTXN *txn);
+bool record_has_field(avro_value_t *record_val, size_t index);
+
+/* Frame schema version used by the snapshot functions (see PROTOCOL_VERSION) */
+int protocol_version_setting = PROTOCOL_VERSION_MIN;
+
+/* Called from _PG_init. Defines the setting with which a client asks the snapshot
+ * functions for a later version of the frame schema than the first. */
+void protocol_server_init() {
+    DefineCustomIntVariable("bottledwater.protocol_version",
+            "Version of the frame schema returned by the Bottled Water snapshot functions.",
+            "Clients that understand a later version of the protocol set this.",
+            &protocol_version_setting, PROTOCOL_VERSION_MIN, PROTOCOL_VERSION_MIN, PROTOCOL_VERSION,
+            PGC_USERSET, 0, NULL, NULL, NULL);
+}
+
+/* Returns whether a message record has a field at the given index, which fields
+ * added in later versions of the protocol do not in earlier ones. */
+bool record_has_field(avro_value_t *record_val, size_t index) {
+    size_t num_fields = 0;
+    return avro_value_get_size(record_val, &num_fields) == 0 && index < num_fields;
+}
+
+/* Returns the commit timestamp of a decoded transaction. The reorder buffer
+ * knows it before replaying the transaction, so this works in the begin callback
+ * too. Postgres 9.4 does not record it; Postgres 15 moved it into a union. */
+int64 txn_commit_time(ReorderBufferTXN *txn) {
+#if PG_VERSION_NUM >= 150000
+    return txn->xact_time.commit_time;
+#elif PG_VERSION_NUM >= 90500
+    return txn->commit_time;
+#else
+    return 0;
+#endif
+}
 
 /* Populates a wire protocol message for a "begin transaction" event. */
 int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn) {
     int err = 0;
-    avro_value_t msg_val, union_val, record_val, xid_val;
+    avro_value_t msg_val, union_val, record_val, xid_val, time_val;
 
     check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
     check(err, avro_value_append(&msg_val, &union_val, NULL));
     check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_BEGIN_TXN, &record_val));
     check(err, avro_value_get_by_index(&record_val, 0, &xid_val, NULL));
     check(err, avro_value_set_long(&xid_val, txn->xid));
+
+    if (record_has_field(&record_val, 1)) {
+        check(err, avro_value_get_by_index(&record_val, 1, &time_val, NULL));
+        check(err, avro_value_set_long(&time_val, txn_commit_time(txn)));
+    }
     return err;
 }
 
@@ -32,7 +72,7 @@ int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn)
 int update_frame_with_commit_txn(avro_value_t *frame_val, ReorderBufferTXN *txn,
         XLogRecPtr commit_lsn) {
     int err = 0;
-    avro_value_t msg_val, union_val, record_val, xid_val, lsn_val;
+    avro_value_t msg_val, union_val, record_val, xid_val, lsn_val, time_val;
 
     check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
     check(err, avro_value_append(&msg_val, &union_val, NULL));
@@ -41,6 +81,11 @@ int update_frame_with_commit_txn(avro_value_t *frame_val, ReorderBufferTXN *txn,
     check(err, avro_value_get_by_index(&record_val, 1, &lsn_val, NULL));
     check(err, avro_value_set_long(&xid_val, txn->xid));
     check(err, avro_value_set_long(&lsn_val, commit_lsn));
+
+    if (record_has_field(&record_val, 2)) {
+        check(err, avro_value_get_by_index(&record_val, 2, &time_val, NULL));
+        check(err, avro_value_set_long(&time_val, txn_commit_time(txn)));
+    }
     return err;
 }
 
@@ -170,37 +215,98 @@ int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Rela
     return err;
 }
 
+/* Updates the given frame with the truncation of a table. Only the table is sent,
+ * not the rows it contained, which logical decoding does not know about. */
+int update_frame_with_truncate(avro_value_t *frame_val, schema_cache_t cache, Relation rel) {
+    int err = 0;
+    schema_cache_entry *entry;
+    avro_value_t msg_val, union_val, record_val, relid_val;
+
+    int changed = schema_cache_lookup(cache, rel, &entry);
+    if (changed < 0) {
+        return EINVAL;
+    } else if (changed) {
+        check(err, update_frame_with_table_schema(frame_val, entry));
+    }
+
+    check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
+    check(err, avro_value_append(&msg_val, &union_val, NULL));
+    check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_TRUNCATE, &record_val));
+    check(err, avro_value_get_by_index(&record_val, 0, &relid_val, NULL));
+    check(err, avro_value_set_long(&relid_val, RelationGetRelid(rel)));
+    return err;
+}
+
+/* Updates the given frame with a change whose key and row values have already been
+ * encoded, by an encoder worker (see encode_pool.c). The arguments are as they
+ * would be computed by update_frame_with_insert/update/delete; any of them may be
+ * NULL except for new_bin on an insert or update. */
+int update_frame_with_encoded_change(avro_value_t *frame_val, ReorderBufferChangeType action, Oid relid,
+        bytea *old_key_bin, bytea *new_key_bin, bytea *old_bin, bytea *new_bin) {
+    switch (action) {
+        case REORDER_BUFFER_CHANGE_INSERT:
+            return update_frame_with_insert_raw(frame_val, relid, new_key_bin, new_bin);
+
+        case REORDER_BUFFER_CHANGE_UPDATE:
+            if (old_key_bin != NULL && (VARSIZE(old_key_bin) != VARSIZE(new_key_bin) ||
+                    memcmp(VARDATA(old_key_bin), VARDATA(new_key_bin), VARSIZE(new_key_bin) - VARHDRSZ) != 0)) {
+                /* If the primary key changed, turn the update into a delete and an insert. */
+                int err = 0;
+                check(err, update_frame_with_delete_raw(frame_val, relid, old_key_bin, old_bin));
+                return update_frame_with_insert_raw(frame_val, relid, new_key_bin, new_bin);
+            }
+            return update_frame_with_update_raw(frame_val, relid, new_key_bin, old_bin, new_bin);
+
+        case REORDER_BUFFER_CHANGE_DELETE:
+            return update_frame_with_delete_raw(frame_val, relid, old_key_bin, old_bin);
+
+        default:
+            return EINVAL;
+    }
+}
+
 /* Sends Avro schemas for a table to the client. This is called the first time we send
  * row-level events for a table, as well as every time the schema changes. All subsequent
- * inserts/updates/deletes are assumed to be encoded with this schema. */
+ * inserts/updates/deletes are assumed to be encoded with this schema. If the client
+ * already has schemas with the same fingerprint, only the fingerprint is sent. */
 int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry) {
     int err = 0;
     avro_value_t msg_val, union_val, record_val, relid_val, key_schema_val,
-                 row_schema_val, branch_val;
-    bytea *key_schema_json = NULL, *row_schema_json = NULL;
+                 row_schema_val, fingerprint_val, branch_val;
+    bool has_fingerprint;
 
     check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
     check(err, avro_value_append(&msg_val, &union_val, NULL));
     check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_TABLE_SCHEMA, &record_val));
-    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,      NULL));
-    check(err, avro_value_get_by_index(&record_val, 1, &key_schema_val, NULL));
-    check(err, avro_value_get_by_index(&record_val, 2, &row_schema_val, NULL));
+    check(err, avro_value_get_by_index(&record_val, 0, &relid_val,       NULL));
+    check(err, avro_value_get_by_index(&record_val, 1, &key_schema_val,  NULL));
+    check(err, avro_value_get_by_index(&record_val, 2, &row_schema_val,  NULL));
     check(err, avro_value_set_long(&relid_val, entry->relid));
 
-    if (entry->key_schema) {
-        check(err, try_writing(&key_schema_json, &write_schema_json, entry->key_schema));
+    /* Without the fingerprint, the client could not tell which schemas are meant */
+    has_fingerprint = record_has_field(&record_val, 3);
+    if (has_fingerprint) {
+        check(err, avro_value_get_by_index(&record_val, 3, &fingerprint_val, NULL));
+        check(err, avro_value_set_long(&fingerprint_val, (int64) entry->fingerprint));
+    }
+
+    if (entry->client_has_schema && has_fingerprint) {
+        check(err, avro_value_set_branch(&key_schema_val, 0, NULL));
+        check(err, avro_value_set_string(&row_schema_val, ""));
+        return err;
+    }
+
+    /* The JSON was serialized when the cache entry was created */
+    if (entry->key_schema_json) {
         check(err, avro_value_set_branch(&key_schema_val, 1, &branch_val));
-        check(err, avro_value_set_string_len(&branch_val, VARDATA(key_schema_json),
-                    VARSIZE(key_schema_json) - VARHDRSZ + 1));
-        pfree(key_schema_json);
+        check(err, avro_value_set_string_len(&branch_val, VARDATA(entry->key_schema_json),
+                    VARSIZE(entry->key_schema_json) - VARHDRSZ + 1));
     } else {
         check(err, avro_value_set_branch(&key_schema_val, 0, NULL));
     }
 
-    check(err, try_writing(&row_schema_json, &write_schema_json, entry->row_schema));
-    check(err, avro_value_set_string_len(&row_schema_val, VARDATA(row_schema_json),
-                VARSIZE(row_schema_json) - VARHDRSZ + 1));
-    pfree(row_schema_json);
+    check(err, avro_value_set_string_len(&row_schema_val, VARDATA(entry->row_schema_json),
+                VARSIZE(entry->row_schema_json) - VARHDRSZ + 1));
     return err;
 }
 
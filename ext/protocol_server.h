@@ -6,10 +6,17 @@
 #include "postgres.h"
 #include "replication/output_plugin.h"
 
+extern int protocol_version_setting;
+
+void protocol_server_init(void);
 int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn);
 int update_frame_with_commit_txn(avro_value_t *frame_val, ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
 int update_frame_with_insert(avro_value_t *frame_val, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple);
 int update_frame_with_update(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple);
 int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple);
+int update_frame_with_truncate(avro_value_t *frame_val, schema_cache_t cache, Relation rel);
+int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry);
+int update_frame_with_encoded_change(avro_value_t *frame_val, ReorderBufferChangeType action, Oid relid,
+        bytea *old_key_bin, bytea *new_key_bin, bytea *old_bin, bytea *new_bin);
 
 #endif /* PROTOCOL_SERVER_H */
@@ -1,14 +1,23 @@
 /* Maintains server-side state relating to conversion of Postgres relations to Avro schemas. */
 
 #include "schema_cache.h"
+#include "io_util.h"
+#include "probes.h"
+#include "shared_schema.h"
 #include "lib/stringinfo.h"
 #include "access/heapam.h"
 #include "access/tupdesc.h"
 #include "utils/lsyscache.h"
 
+/* CRC-64-AVRO, the Rabin fingerprint from the Avro specification */
+#define CRC64_AVRO_EMPTY UINT64CONST(0xc15d213aa4d7a795)
+
 int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, Relation rel);
+int schema_cache_entry_schemas(schema_cache_t cache, schema_cache_entry *entry, Relation rel);
 bool schema_cache_entry_changed(schema_cache_entry *entry, Relation rel);
 void schema_cache_entry_decrefs(schema_cache_entry *entry);
+bool schema_cache_mark_sent(schema_cache_t cache, uint64 fingerprint);
+uint64 schema_fingerprint(uint64 fp, bytea *json);
 void tupdesc_debug_info(StringInfo msg, TupleDesc tupdesc);
 
 /* Creates a new schema cache. All palloc allocations for this cache will be
@@ -35,6 +44,19 @@ schema_cache_t schema_cache_new(MemoryContext context) {
             HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 #endif
 
+    memset(&hash_ctl, 0, sizeof(hash_ctl));
+    hash_ctl.keysize = sizeof(uint64);
+    hash_ctl.entrysize = sizeof(uint64);
+    hash_ctl.hcxt = context;
+#ifdef HASH_BLOBS
+    cache->known_fingerprints = hash_create("Bottled Water known schemas", 32, &hash_ctl,
+            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+#else
+    hash_ctl.hash = tag_hash;
+    cache->known_fingerprints = hash_create("Bottled Water known schemas", 32, &hash_ctl,
+            HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+#endif
+
     MemoryContextSwitchTo(oldctx);
     return cache;
 }
@@ -60,20 +82,24 @@ int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry *
             /* Schema has changed since we last saw it -- update the cache */
             schema_cache_entry_decrefs(entry);
             err = schema_cache_entry_update(cache, entry, rel);
+            BW_PROBE2(schema__miss, relid, err ? -1 : 1);
             if (err) {
                 *entry_out = NULL;
                 return -1;
             }
+            entry->client_has_schema = schema_cache_mark_sent(cache, entry->fingerprint);
             *entry_out = entry;
             return 1;
         }
     } else {
         /* Schema not previously seen -- populate a new cache entry */
         err = schema_cache_entry_update(cache, entry, rel);
+        BW_PROBE2(schema__miss, relid, err ? -2 : 2);
         if (err) {
             *entry_out = NULL;
             return -2;
         }
+        entry->client_has_schema = schema_cache_mark_sent(cache, entry->fingerprint);
         *entry_out = entry;
         return 2;
     }
@@ -112,9 +138,7 @@ int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, R
     entry->row_tupdesc = CreateTupleDescCopyConstr(RelationGetDescr(rel));
     MemoryContextSwitchTo(oldctx);
 
-    err = schema_for_table_key(rel, &entry->key_schema);
-    if (err) return err;
-    err = schema_for_table_row(rel, &entry->row_schema);
+    err = schema_cache_entry_schemas(cache, entry, rel);
     if (err) return err;
     entry->row_iface = avro_generic_class_from_schema(entry->row_schema);
     if (entry->row_iface == NULL) return EINVAL;
@@ -129,6 +153,92 @@ int schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, R
     return 0;
 }
 
+/* Sets the Avro schemas of a cache entry, and their JSON form. If another backend
+ * has already generated them for this version of the table, they are parsed from
+ * the shared cache's JSON; otherwise they are generated, and offered to the
+ * shared cache. */
+int schema_cache_entry_schemas(schema_cache_t cache, schema_cache_entry *entry, Relation rel) {
+    int err = 0;
+    MemoryContext oldctx;
+    uint64 signature = shared_schema_signature(rel);
+
+    oldctx = MemoryContextSwitchTo(cache->context);
+    bool found = shared_schema_lookup(signature, entry->relid,
+            &entry->row_schema_json, &entry->key_schema_json);
+    MemoryContextSwitchTo(oldctx);
+
+    if (found) {
+        check(err, avro_schema_from_json_length(VARDATA(entry->row_schema_json),
+                    VARSIZE(entry->row_schema_json) - VARHDRSZ, &entry->row_schema));
+        if (entry->key_schema_json) {
+            check(err, avro_schema_from_json_length(VARDATA(entry->key_schema_json),
+                        VARSIZE(entry->key_schema_json) - VARHDRSZ, &entry->key_schema));
+        }
+        entry->fingerprint = schema_fingerprint(schema_fingerprint(CRC64_AVRO_EMPTY,
+                    entry->row_schema_json), entry->key_schema_json);
+        return err;
+    }
+
+    check(err, schema_for_table_key(rel, &entry->key_schema));
+    check(err, schema_for_table_row(rel, &entry->row_schema));
+
+    oldctx = MemoryContextSwitchTo(cache->context);
+    err = try_writing(&entry->row_schema_json, &write_schema_json, entry->row_schema);
+    if (!err && entry->key_schema) {
+        err = try_writing(&entry->key_schema_json, &write_schema_json, entry->key_schema);
+    }
+    MemoryContextSwitchTo(oldctx);
+    if (err) return err;
+
+    entry->fingerprint = schema_fingerprint(schema_fingerprint(CRC64_AVRO_EMPTY,
+                entry->row_schema_json), entry->key_schema_json);
+    shared_schema_store(signature, entry->relid, entry->row_schema_json, entry->key_schema_json);
+    return err;
+}
+
+/* Continues a CRC-64-AVRO over the given schema JSON, followed by a null byte so
+ * that a row schema cannot run into the key schema after it. A NULL json (as for
+ * an unkeyed table) leaves the fingerprint unchanged. */
+uint64 schema_fingerprint(uint64 fp, bytea *json) {
+    static uint64 table[256];
+    static bool table_ready = false;
+
+    if (!table_ready) {
+        for (int i = 0; i < 256; i++) {
+            uint64 entry = i;
+            for (int j = 0; j < 8; j++) {
+                entry = (entry >> 1) ^ (CRC64_AVRO_EMPTY & -(entry & 1));
+            }
+            table[i] = entry;
+        }
+        table_ready = true;
+    }
+
+    if (!json) return fp;
+
+    /* try_writing() leaves a null byte after the data */
+    const unsigned char *bytes = (const unsigned char *) VARDATA(json);
+    for (size_t i = 0; i < VARSIZE(json) - VARHDRSZ + 1; i++) {
+        fp = (fp >> 8) ^ table[(fp ^ bytes[i]) & 0xff];
+    }
+    return fp;
+}
+
+/* Records that the client has the schemas with the given fingerprint, because it
+ * said so when starting replication (the "known_schemas" option). */
+void schema_cache_add_known(schema_cache_t cache, uint64 fingerprint) {
+    hash_search(cache->known_fingerprints, &fingerprint, HASH_ENTER, NULL);
+}
+
+/* Called when a table's schemas are about to be sent. Returns true if the client
+ * already has them, in which case only the fingerprint needs to be sent. Either
+ * way, the client has them afterwards. */
+bool schema_cache_mark_sent(schema_cache_t cache, uint64 fingerprint) {
+    bool found = false;
+    hash_search(cache->known_fingerprints, &fingerprint, HASH_ENTER, &found);
+    return found;
+}
+
 /* Returns false if the schema of the given relation matches the cache entry,
  * and returns true if it has changed. This is detected by keeping a copy of
  * the schema information in the cache entry. An alternative way of implementing
@@ -166,6 +276,8 @@ bool schema_cache_entry_changed(schema_cache_entry *entry, Relation rel) {
 void schema_cache_entry_decrefs(schema_cache_entry *entry) {
     if (entry->key_tupdesc) pfree(entry->key_tupdesc);
     if (entry->row_tupdesc) pfree(entry->row_tupdesc);
+    if (entry->key_schema_json) pfree(entry->key_schema_json);
+    if (entry->row_schema_json) pfree(entry->row_schema_json);
 
     avro_value_decref(&entry->row_value);
     avro_value_iface_decref(entry->row_iface);
@@ -191,13 +303,14 @@ void schema_cache_free(schema_cache_t cache) {
     }
 
     hash_destroy(cache->entries);
+    hash_destroy(cache->known_fingerprints);
     pfree(cache);
 }
 
 /* Append debug information about table columns to a string buffer. */
 void tupdesc_debug_info(StringInfo msg, TupleDesc tupdesc) {
     for (int i = 0; i < tupdesc->natts; i++) {
-        Form_pg_attribute attr = tupdesc->attrs[i];
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
         appendStringInfo(msg, "\n\t%4d. attrelid = %u, attname = %s, atttypid = %u, attlen = %d, "
                 "attnum = %d, attndims = %d, atttypmod = %d, attnotnull = %d, "
                 "atthasdef = %d, attisdropped = %d, attcollation = %u",
@@ -21,17 +21,23 @@ typedef struct {
     avro_value_iface_t *row_iface;   /* Avro generic interface for creating row values */
     avro_value_t        key_value;   /* Avro key value, for encoding one key */
     avro_value_t        row_value;   /* Avro row value, for encoding one row */
+    bytea              *key_schema_json; /* key_schema serialized as JSON, or NULL if unkeyed */
+    bytea              *row_schema_json; /* row_schema serialized as JSON */
+    uint64              fingerprint; /* CRC-64-AVRO of the row and key schema JSON */
+    bool                client_has_schema; /* Client already knows fingerprint, so JSON need not be sent */
 } schema_cache_entry;
 
 typedef struct {
     MemoryContext context;         /* Context in which cache entries are allocated */
     HTAB *entries;                 /* Hash table mapping Oid to schema_cache_entry */
+    HTAB *known_fingerprints;      /* Set of schema fingerprints that the client has seen */
 } schema_cache;
 
 typedef schema_cache *schema_cache_t;
 
 schema_cache_t schema_cache_new(MemoryContext context);
 int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry **entry_out);
+void schema_cache_add_known(schema_cache_t cache, uint64 fingerprint);
 void schema_cache_free(schema_cache_t cache);
 char *schema_debug_info(Relation rel, TupleDesc tupdesc);
 
@@ -0,0 +1,165 @@
+/* Splitting the changes of one database across several clients, each of which
+ * has its own replication slot and asks the output plugin (and the snapshot) for
+ * one shard of the data. Every shard still receives every begin and commit event,
+ * so each client sees complete (if sometimes empty) transactions and can
+ * checkpoint its own slot independently of the others.
+ *
+ * The hash must give the same answer in the snapshot and in the replication
+ * stream, and across server versions, so we use our own (FNV-1a) rather than
+ * one of Postgres' internal hash functions. */
+
+#include "shard.h"
+#include "oid2avro.h"
+
+#include <string.h>
+#include "fmgr.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#if PG_VERSION_NUM >= 100000
+#include "utils/varlena.h"  /* SplitIdentifierString() moved here in Postgres 10 */
+#endif
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+uint32 shard_hash(uint32 hash, const void *data, size_t len);
+bool shard_is_key_table(shard_spec *shard, Relation rel);
+bool shard_key_hash(Relation rel, TupleDesc tupdesc, HeapTuple tuple, uint32 *hash_out);
+
+
+/* Parses a shard specification of the form "i/n", where n is the number of
+ * shards and i (counting from 0) is the shard that this client wants. */
+void shard_parse(shard_spec *shard, const char *spec) {
+    int index, count, consumed = 0;
+
+    if (sscanf(spec, "%d/%d%n", &index, &count, &consumed) != 2 || spec[consumed] != '\0' ||
+            count < 1 || index < 0 || index >= count) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("invalid shard \"%s\": expected i/n with 0 <= i < n", spec)));
+    }
+
+    shard->index = index;
+    shard->count = count;
+}
+
+/* Parses a comma-separated list of table names whose rows are to be sharded by
+ * key. The list is allocated in the current memory context. */
+void shard_parse_key_tables(shard_spec *shard, const char *table_list) {
+    List *names;
+
+    /* Unquoted names are folded to lower case, as in SQL. A schema-qualified name
+     * comes through as a single element, since only commas separate elements. */
+    if (!SplitIdentifierString(pstrdup(table_list), ',', &names)) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("invalid list of shard key tables: \"%s\"", table_list)));
+    }
+
+    shard->key_tables = list_concat(shard->key_tables, names);
+}
+
+/* Returns true if all rows of the given table belong to this shard, or if some of
+ * them might (because the table is sharded by key). Used by the snapshot to skip
+ * tables that belong entirely to other shards. */
+bool shard_contains_table(shard_spec *shard, Relation rel) {
+    Oid relid = RelationGetRelid(rel);
+
+    if (shard->count <= 1) return true;
+    if (strcmp(RelationGetRelationName(rel), SHARD_HEARTBEAT_TABLE) == 0) return true;
+    if (shard_is_key_table(shard, rel)) return true;
+
+    return shard_hash(FNV_OFFSET_BASIS, &relid, sizeof(relid)) % shard->count == shard->index;
+}
+
+/* Returns true if a change to the given row belongs to this shard. tuple may be
+ * NULL if the row is not known (e.g. a delete with REPLICA IDENTITY NOTHING), in
+ * which case the change is sharded by table like an ordinary table's would be. */
+bool shard_contains_row(shard_spec *shard, Relation rel, TupleDesc tupdesc, HeapTuple tuple) {
+    uint32 hash;
+
+    if (shard->count <= 1) return true;
+
+    if (tuple && shard_is_key_table(shard, rel) && shard_key_hash(rel, tupdesc, tuple, &hash)) {
+        return hash % shard->count == shard->index;
+    }
+
+    return shard_contains_table(shard, rel);
+}
+
+/* Returns true if the table is listed in key_tables, either by its bare name or
+ * qualified with its schema. */
+bool shard_is_key_table(shard_spec *shard, Relation rel) {
+    ListCell *cell;
+    const char *relname = RelationGetRelationName(rel);
+    char *qualified = NULL;
+
+    foreach(cell, shard->key_tables) {
+        const char *name = lfirst(cell);
+        if (strchr(name, '.') == NULL) {
+            if (strcmp(name, relname) == 0) return true;
+        } else {
+            if (!qualified) {
+                qualified = psprintf("%s.%s", get_namespace_name(RelationGetNamespace(rel)), relname);
+            }
+            if (strcmp(name, qualified) == 0) return true;
+        }
+    }
+    return false;
+}
+
+/* Hashes the text representation of the key columns of a row, so that all
+ * changes to one row go to the same shard, however its other columns change.
+ * tupdesc may omit dropped columns (as in the snapshot), which is handled in the
+ * same way as tuple_to_avro_key(). Returns false if the table is unkeyed. */
+bool shard_key_hash(Relation rel, TupleDesc tupdesc, HeapTuple tuple, uint32 *hash_out) {
+    TupleDesc rel_tupdesc = RelationGetDescr(rel);
+    Relation index_rel = table_key_index(rel);
+    Form_pg_index key_index;
+    uint32 hash = FNV_OFFSET_BASIS;
+
+    if (!index_rel) return false;
+    key_index = index_rel->rd_index;
+
+    for (int field = 0; field < key_index->indkey.dim1; field++) {
+        int attnum = key_index->indkey.values[field] - 1;
+        int tup_i = 0;
+        bool isnull;
+        Datum datum;
+
+        for (int rel_i = 0; rel_i < attnum; rel_i++) {
+            if (!TupleDescAttr(rel_tupdesc, rel_i)->attisdropped || TupleDescAttr(tupdesc, tup_i)->attisdropped) tup_i++;
+        }
+        if (tup_i >= tupdesc->natts || TupleDescAttr(tupdesc, tup_i)->attisdropped) {
+            elog(ERROR, "index refers to non-existent attribute number %d", attnum);
+        }
+
+        datum = heap_getattr(tuple, tup_i + 1, tupdesc, &isnull);
+        if (!isnull) {
+            Oid output_func;
+            bool is_varlena;
+            char *text;
+
+            getTypeOutputInfo(TupleDescAttr(tupdesc, tup_i)->atttypid, &output_func, &is_varlena);
+            text = OidOutputFunctionCall(output_func, datum);
+            hash = shard_hash(hash, text, strlen(text));
+            pfree(text);
+        }
+        /* Separate the columns, so that ('ab', 'c') and ('a', 'bc') hash differently */
+        hash = shard_hash(hash, isnull ? "\1" : "\0", 1);
+    }
+
+    relation_close(index_rel, AccessShareLock);
+    *hash_out = hash;
+    return true;
+}
+
+/* 32-bit FNV-1a, continuing from a previous hash value. */
+uint32 shard_hash(uint32 hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
@@ -0,0 +1,28 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "postgres.h"
+#include "access/htup.h"
+#include "nodes/pg_list.h"
+#include "utils/rel.h"
+
+/* Table that the client updates for heartbeats (see bottledwater--0.2.sql). Its
+ * changes go to every shard, so that every shard's slot can advance. */
+#define SHARD_HEARTBEAT_TABLE "bottledwater_heartbeat"
+
+/* Describes which part of a database's changes one client is responsible for.
+ * Tables are assigned to shards by a hash of their relid, except for the "hot"
+ * tables listed in key_tables, whose rows are spread across all shards by a
+ * hash of their primary key or replica identity. */
+typedef struct {
+    int index;          /* This shard, 0 <= index < count */
+    int count;          /* Number of shards; 0 or 1 means sharding is disabled */
+    List *key_tables;   /* Names of tables sharded by key, optionally schema-qualified */
+} shard_spec;
+
+void shard_parse(shard_spec *shard, const char *spec);
+void shard_parse_key_tables(shard_spec *shard, const char *table_list);
+bool shard_contains_table(shard_spec *shard, Relation rel);
+bool shard_contains_row(shard_spec *shard, Relation rel, TupleDesc tupdesc, HeapTuple tuple);
+
+#endif /* SHARD_H */
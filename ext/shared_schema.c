@@ -0,0 +1,267 @@
+/* Cache of generated Avro schemas (as JSON) in shared memory, so that walsenders
+ * and snapshot backends do not each generate and serialize the schema of every
+ * table they see. The per-backend schema_cache still holds the Avro objects for
+ * encoding; on a miss there, it asks this cache for the JSON before generating
+ * the schema itself.
+ *
+ * Entries are keyed by a signature: a hash of everything the schema is generated
+ * from (names, column types, and the key index). A walsender decoding older WAL
+ * sees the table as it was at that point, so it computes a different signature
+ * and never picks up a schema that does not match its tuples. Relcache
+ * invalidations remove a table's entries, which keeps superseded versions from
+ * filling the cache; they are regenerated on the next miss.
+ *
+ * The cache needs the library to be in shared_preload_libraries, and holds up to
+ * bottledwater.schema_cache_entries schemas of up to SHARED_SCHEMA_MAX_JSON bytes.
+ * Without it, or for larger schemas, every backend generates its own as before. */
+
+#include "shared_schema.h"
+#include "oid2avro.h"
+
+#include <string.h>
+#include "miscadmin.h"
+#include "access/heapam.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+
+/* Longest row and key schema JSON, combined, that fits in an entry */
+#define SHARED_SCHEMA_MAX_JSON 8192
+
+#define FNV64_OFFSET_BASIS UINT64CONST(14695981039346656037)
+#define FNV64_PRIME UINT64CONST(1099511628211)
+
+typedef struct {
+    uint64 signature;       /* Key in hash table, so it must be first in struct */
+    Oid relid;              /* Table the schema belongs to, to guard against collisions */
+    int32 row_json_len;     /* Length of the row schema JSON, at the start of json */
+    int32 key_json_len;     /* Length of the key schema JSON that follows it, or -1 */
+    char json[SHARED_SCHEMA_MAX_JSON];
+} shared_schema_entry;
+
+typedef struct {
+    LWLock *lock;           /* Protects the hash table */
+} shared_schema_header;
+
+static int shared_schema_entries = 1024;
+static shared_schema_header *shared_header = NULL;
+static HTAB *shared_schemas = NULL;
+static bool invalidation_registered = false;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static void shared_schema_shmem_request(void);
+static void shared_schema_shmem_startup(void);
+static void shared_schema_invalidate(Datum arg, Oid relid);
+uint64 shared_schema_hash(uint64 hash, const void *data, size_t len);
+uint64 shared_schema_hash_string(uint64 hash, const char *str);
+uint64 shared_schema_hash_tupdesc(uint64 hash, TupleDesc tupdesc);
+bytea *shared_schema_copy(const char *json, int32 len);
+
+
+/* Called from _PG_init. Reserves the shared memory if the library is being
+ * preloaded; otherwise the cache stays disabled in this server. */
+void shared_schema_init() {
+    if (!process_shared_preload_libraries_in_progress) return;
+
+    DefineCustomIntVariable("bottledwater.schema_cache_entries",
+            "Number of table schemas kept in shared memory for all Bottled Water backends.",
+            "0 disables the shared cache.",
+            &shared_schema_entries, 1024, 0, 1000000, PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+    if (shared_schema_entries == 0) return;
+
+    /* From Postgres 15, shared memory and locks can only be requested in this hook;
+     * earlier versions have no such hook, and expect the request from _PG_init. */
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = shared_schema_shmem_request;
+#else
+    shared_schema_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = shared_schema_shmem_startup;
+}
+
+static void shared_schema_shmem_request() {
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook) prev_shmem_request_hook();
+#endif
+    RequestAddinShmemSpace(MAXALIGN(sizeof(shared_schema_header)) +
+            hash_estimate_size(shared_schema_entries, sizeof(shared_schema_entry)));
+#if PG_VERSION_NUM >= 90600
+    RequestNamedLWLockTranche("bottledwater", 1);
+#else
+    RequestAddinLWLocks(1);
+#endif
+}
+
+static void shared_schema_shmem_startup() {
+    HASHCTL hash_ctl;
+    bool found = false;
+
+    if (prev_shmem_startup_hook) prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    shared_header = ShmemInitStruct("Bottled Water schema cache", sizeof(shared_schema_header), &found);
+    if (!found) {
+#if PG_VERSION_NUM >= 90600
+        shared_header->lock = &(GetNamedLWLockTranche("bottledwater"))->lock;
+#else
+        shared_header->lock = LWLockAssign();
+#endif
+    }
+
+    memset(&hash_ctl, 0, sizeof(hash_ctl));
+    hash_ctl.keysize = sizeof(uint64);
+    hash_ctl.entrysize = sizeof(shared_schema_entry);
+#ifdef HASH_BLOBS
+    shared_schemas = ShmemInitHash("Bottled Water schema cache entries",
+            shared_schema_entries, shared_schema_entries, &hash_ctl, HASH_ELEM | HASH_BLOBS);
+#else
+    hash_ctl.hash = tag_hash;
+    shared_schemas = ShmemInitHash("Bottled Water schema cache entries",
+            shared_schema_entries, shared_schema_entries, &hash_ctl, HASH_ELEM | HASH_FUNCTION);
+#endif
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/* Computes the signature of a table's schema, which changes whenever anything
+ * that schema_for_table_row() or schema_for_table_key() looks at changes. */
+uint64 shared_schema_signature(Relation rel) {
+    uint64 hash = FNV64_OFFSET_BASIS;
+    Oid relid = RelationGetRelid(rel);
+    Relation index_rel;
+
+    hash = shared_schema_hash(hash, &relid, sizeof(relid));
+    hash = shared_schema_hash_string(hash, RelationGetRelationName(rel));
+    hash = shared_schema_hash_string(hash, get_namespace_name(RelationGetNamespace(rel)));
+    hash = shared_schema_hash_tupdesc(hash, RelationGetDescr(rel));
+
+    index_rel = table_key_index(rel);
+    if (index_rel) {
+        Form_pg_index key_index = index_rel->rd_index;
+        hash = shared_schema_hash_string(hash, RelationGetRelationName(index_rel));
+        hash = shared_schema_hash_string(hash, get_namespace_name(RelationGetNamespace(index_rel)));
+        hash = shared_schema_hash_tupdesc(hash, RelationGetDescr(index_rel));
+        hash = shared_schema_hash(hash, key_index->indkey.values,
+                key_index->indkey.dim1 * sizeof(int16));
+        relation_close(index_rel, AccessShareLock);
+    }
+
+    return hash;
+}
+
+/* Looks for the schema JSON with the given signature. If found, sets the output
+ * arguments to palloc'ed copies (key_json_out to NULL for an unkeyed table), in
+ * the same format as try_writing() produces, and returns true. */
+bool shared_schema_lookup(uint64 signature, Oid relid, bytea **row_json_out, bytea **key_json_out) {
+    shared_schema_entry *entry;
+    bool found = false;
+
+    if (!shared_schemas) return false;
+
+    if (!invalidation_registered) {
+        CacheRegisterRelcacheCallback(shared_schema_invalidate, (Datum) 0);
+        invalidation_registered = true;
+    }
+
+    LWLockAcquire(shared_header->lock, LW_SHARED);
+    entry = hash_search(shared_schemas, &signature, HASH_FIND, NULL);
+    if (entry && entry->relid == relid) {
+        *row_json_out = shared_schema_copy(entry->json, entry->row_json_len);
+        *key_json_out = entry->key_json_len < 0 ? NULL :
+            shared_schema_copy(entry->json + entry->row_json_len, entry->key_json_len);
+        found = true;
+    }
+    LWLockRelease(shared_header->lock);
+    return found;
+}
+
+/* Adds schema JSON (as produced by try_writing()) to the cache, unless it is too
+ * large or the cache is full. */
+void shared_schema_store(uint64 signature, Oid relid, bytea *row_json, bytea *key_json) {
+    shared_schema_entry *entry;
+    bool found = false;
+    int32 row_len = VARSIZE(row_json) - VARHDRSZ;
+    int32 key_len = key_json ? VARSIZE(key_json) - VARHDRSZ : -1;
+
+    if (!shared_schemas || row_len + Max(key_len, 0) > SHARED_SCHEMA_MAX_JSON) return;
+
+    LWLockAcquire(shared_header->lock, LW_EXCLUSIVE);
+    if (hash_get_num_entries(shared_schemas) < shared_schema_entries) {
+        entry = hash_search(shared_schemas, &signature, HASH_ENTER_NULL, &found);
+        if (entry && !found) {
+            entry->relid = relid;
+            entry->row_json_len = row_len;
+            entry->key_json_len = key_len;
+            memcpy(entry->json, VARDATA(row_json), row_len);
+            if (key_json) memcpy(entry->json + row_len, VARDATA(key_json), key_len);
+        }
+    }
+    LWLockRelease(shared_header->lock);
+}
+
+/* Relcache invalidation callback. Drops all cached schemas of the table. A
+ * relid of InvalidOid means the whole relcache was reset, which says nothing
+ * about any particular table, so entries are kept. */
+static void shared_schema_invalidate(Datum arg, Oid relid) {
+    HASH_SEQ_STATUS iterator;
+    shared_schema_entry *entry;
+
+    if (!OidIsValid(relid) || !shared_schemas) return;
+
+    LWLockAcquire(shared_header->lock, LW_EXCLUSIVE);
+    hash_seq_init(&iterator, shared_schemas);
+    while ((entry = hash_seq_search(&iterator)) != NULL) {
+        if (entry->relid == relid) {
+            hash_search(shared_schemas, &entry->signature, HASH_REMOVE, NULL);
+        }
+    }
+    LWLockRelease(shared_header->lock);
+}
+
+/* 64-bit FNV-1a, continuing from a previous hash value. */
+uint64 shared_schema_hash(uint64 hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV64_PRIME;
+    }
+    return hash;
+}
+
+/* Hashes a string including its terminating null, so that adjacent strings
+ * cannot run into each other. */
+uint64 shared_schema_hash_string(uint64 hash, const char *str) {
+    return shared_schema_hash(hash, str, strlen(str) + 1);
+}
+
+uint64 shared_schema_hash_tupdesc(uint64 hash, TupleDesc tupdesc) {
+    hash = shared_schema_hash(hash, &tupdesc->natts, sizeof(tupdesc->natts));
+    for (int i = 0; i < tupdesc->natts; i++) {
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+        hash = shared_schema_hash_string(hash, NameStr(attr->attname));
+        hash = shared_schema_hash(hash, &attr->atttypid, sizeof(attr->atttypid));
+        hash = shared_schema_hash(hash, &attr->atttypmod, sizeof(attr->atttypmod));
+        hash = shared_schema_hash(hash, &attr->attisdropped, sizeof(attr->attisdropped));
+    }
+    return hash;
+}
+
+/* Copies JSON out of an entry into a bytea followed by a null byte, like the
+ * output of try_writing(). */
+bytea *shared_schema_copy(const char *json, int32 len) {
+    bytea *copy = palloc(VARHDRSZ + len + 1);
+    SET_VARSIZE(copy, VARHDRSZ + len);
+    memcpy(VARDATA(copy), json, len);
+    VARDATA(copy)[len] = '\0';
+    return copy;
+}
@@ -0,0 +1,12 @@
+#ifndef SHARED_SCHEMA_H
+#define SHARED_SCHEMA_H
+
+#include "postgres.h"
+#include "utils/rel.h"
+
+void shared_schema_init(void);
+uint64 shared_schema_signature(Relation rel);
+bool shared_schema_lookup(uint64 signature, Oid relid, bytea **row_json_out, bytea **key_json_out);
+void shared_schema_store(uint64 signature, Oid relid, bytea *row_json, bytea *key_json);
+
+#endif /* SHARED_SCHEMA_H */
@@ -2,19 +2,24 @@
 #include "oid2avro.h"
 #include "protocol_server.h"
 #include "error_policy.h"
+#include "shard.h"
 
 #include <string.h>
 #include "postgres.h"
 #include "fmgr.h"
 #include "funcapi.h"
+#include "miscadmin.h"
 #include "access/htup_details.h"
 #include "catalog/namespace.h"
 #include "catalog/pg_class.h"
 #include "catalog/pg_type.h"
 #include "executor/spi.h"
 #include "lib/stringinfo.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/tuplestore.h"
 
 PG_MODULE_MAGIC;
 
@@ -27,11 +32,28 @@ typedef struct {
     char *index_name;
 } export_table;
 
+/* A table being read by bottledwater_export_chunk */
+typedef struct {
+    Relation rel;
+    Relation index_rel;             /* Primary key or replica identity index */
+    int num_key_columns;
+    char **key_names;               /* Names of the key columns, in index order */
+    Oid *key_types;
+    shard_spec shard;
+    schema_cache_t schema_cache;
+    avro_schema_t frame_schema;
+    avro_value_iface_t *frame_iface;
+    avro_value_t frame_value;
+    Tuplestorestate *tupstore;
+    TupleDesc result_desc;
+} chunk_state;
+
 /* State that we need to remember between calls of bottledwater_export */
 typedef struct {
     MemoryContext memcontext;
     export_table *tables;
     error_policy_t error_policy;
+    shard_spec shard;
     int num_tables, current_table;
     avro_schema_t frame_schema;
     avro_value_iface_t *frame_iface;
@@ -46,6 +68,12 @@ void open_next_table(export_state *state);
 void close_current_table(export_state *state);
 bytea *format_snapshot_row(export_state *state);
 bytea *schema_for_relname(char *relname, bool get_key);
+Tuplestorestate *chunk_result_store(FunctionCallInfo fcinfo, TupleDesc *desc_out);
+void chunk_open(chunk_state *state, text *table_name);
+void chunk_close(chunk_state *state);
+void chunk_read(chunk_state *state, ArrayType *after_key, int32 chunk_size);
+void chunk_row(chunk_state *state, TupleDesc tupdesc, HeapTuple tuple);
+bytea *chunk_frame(chunk_state *state);
 
 
 PG_FUNCTION_INFO_V1(bottledwater_key_schema);
@@ -76,10 +104,11 @@ PG_FUNCTION_INFO_V1(bottledwater_frame_schema);
 
 /* Returns a JSON string containing the frame schema of the logical log output plugin.
  * This should be used by clients to decode the data streamed from the log, allowing
- * schema evolution to handle version changes of the plugin. */
+ * schema evolution to handle version changes of the plugin. The schema is in the
+ * version of the protocol selected by the bottledwater.protocol_version setting. */
 Datum bottledwater_frame_schema(PG_FUNCTION_ARGS) {
     bytea *json;
-    avro_schema_t schema = schema_for_frame();
+    avro_schema_t schema = schema_for_frame(protocol_version_setting);
     int err = try_writing(&json, &write_schema_json, schema);
     avro_schema_decref(schema);
 
@@ -96,7 +125,8 @@ PG_FUNCTION_INFO_V1(bottledwater_export);
 
 /* Given a search pattern for tables ('%' matches all tables), returns a set of byte array values.
  * Each byte array is a frame of our wire protocol, containing schemas and/or rows of the selected
- * tables. This is a set-returning function (SRF), which means it gets called once for each row of
+ * tables. If a shard ("i/n") is given, only the tables and rows belonging to that shard are
+ * returned, using the same assignment as the output plugin (see shard.c). This is a set-returning function (SRF), which means it gets called once for each row of
  * output, allowing us to stream through large datasets without loading everything into memory.
  *
  * SRF docs: http://www.postgresql.org/docs/9.4/static/xfunc-c.html#XFUNC-C-RETURN-SET */
@@ -107,6 +137,7 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
     int ret;
     text *table_pattern;
     bool allow_unkeyed;
+    char *shard, *shard_key_tables;
     bytea *result;
 
     oldcontext = CurrentMemoryContext;
@@ -124,7 +155,7 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
         /* Things allocated in this memory context will live until SRF_RETURN_DONE(). */
         MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-        state = (export_state *) palloc(sizeof(export_state));
+        state = (export_state *) palloc0(sizeof(export_state));
 
         state->memcontext = AllocSetContextCreate(CurrentMemoryContext,
                                                   "bottledwater_export per-tuple context",
@@ -133,7 +164,7 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
                                                   ALLOCSET_DEFAULT_MAXSIZE);
 
         state->current_table = 0;
-        state->frame_schema = schema_for_frame();
+        state->frame_schema = schema_for_frame(protocol_version_setting);
         state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
         avro_generic_value_new(state->frame_iface, &state->frame_value);
         state->schema_cache = schema_cache_new(funcctx->multi_call_memory_ctx);
@@ -143,6 +174,16 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
         allow_unkeyed = PG_GETARG_BOOL(1);
         state->error_policy = parse_error_policy(TextDatumGetCString(PG_GETARG_TEXT_P(2)));
 
+        /* The shard arguments were added in version 0.2 of the extension. Until
+         * ALTER EXTENSION ... UPDATE is run, the function is still declared with
+         * the three arguments of 0.1, but this library is already the new one. */
+        if (PG_NARGS() > 3) {
+            shard = TextDatumGetCString(PG_GETARG_TEXT_P(3));
+            shard_key_tables = TextDatumGetCString(PG_GETARG_TEXT_P(4));
+            if (shard[0] != '\0') shard_parse(&state->shard, shard);
+            if (shard_key_tables[0] != '\0') shard_parse_key_tables(&state->shard, shard_key_tables);
+        }
+
         get_table_list(state, table_pattern, allow_unkeyed);
         if (state->num_tables > 0) open_next_table(state);
     }
@@ -188,6 +229,258 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
     SRF_RETURN_DONE(funcctx);
 }
 
+PG_FUNCTION_INFO_V1(bottledwater_export_tables);
+
+/* Returns the relid and qualified name of each table that a chunked snapshot should
+ * export. Tables without a key are an error, rather than exported without one as
+ * --allow-unkeyed does for bottledwater_export, since a chunked snapshot reads them
+ * in key order, and matches their rows with the replication stream by key. */
+Datum bottledwater_export_tables(PG_FUNCTION_ARGS) {
+    export_state state;
+    TupleDesc result_desc;
+    Tuplestorestate *tupstore = chunk_result_store(fcinfo, &result_desc);
+    char *shard = TextDatumGetCString(PG_GETARG_TEXT_P(0));
+    char *shard_key_tables = TextDatumGetCString(PG_GETARG_TEXT_P(1));
+    int ret;
+
+    memset(&state, 0, sizeof(export_state));
+    if (shard[0] != '\0') shard_parse(&state.shard, shard);
+    if (shard_key_tables[0] != '\0') shard_parse_key_tables(&state.shard, shard_key_tables);
+
+    if ((ret = SPI_connect()) < 0) {
+        elog(ERROR, "bottledwater_export_tables: SPI_connect returned %d", ret);
+    }
+    get_table_list(&state, cstring_to_text("%"), false);
+
+    for (int i = 0; i < state.num_tables; i++) {
+        export_table *table = &state.tables[i];
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        values[0] = ObjectIdGetDatum(table->relid);
+        values[1] = CStringGetTextDatum(quote_qualified_identifier(table->namespace, table->rel_name));
+        tuplestore_putvalues(tupstore, result_desc, values, nulls);
+        relation_close(table->rel, AccessShareLock);
+    }
+
+    SPI_finish();
+    return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(bottledwater_export_chunk);
+
+/* Returns the next chunk of a table's rows in key order, for a snapshot that reads
+ * each chunk in its own short transaction rather than holding one snapshot open for
+ * the whole export. See bottledwater--0.2.sql for the arguments and result. */
+Datum bottledwater_export_chunk(PG_FUNCTION_ARGS) {
+    chunk_state state;
+    int32 chunk_size = PG_GETARG_INT32(2);
+    char *shard = TextDatumGetCString(PG_GETARG_TEXT_P(3));
+    char *shard_key_tables = TextDatumGetCString(PG_GETARG_TEXT_P(4));
+    Datum values[3];
+    bool nulls[3] = {true, false, true};
+    schema_cache_entry *entry;
+
+    if (chunk_size < 1) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("chunk size must be at least 1")));
+    }
+
+    chunk_open(&state, PG_GETARG_TEXT_P(0));
+    state.tupstore = chunk_result_store(fcinfo, &state.result_desc);
+    if (shard[0] != '\0') shard_parse(&state.shard, shard);
+    if (shard_key_tables[0] != '\0') shard_parse_key_tables(&state.shard, shard_key_tables);
+
+    /* The schema goes in a frame of its own, since the client may drop any of the
+     * row frames that follow */
+    if (schema_cache_lookup(state.schema_cache, state.rel, &entry) < 0 ||
+            avro_value_reset(&state.frame_value) ||
+            update_frame_with_table_schema(&state.frame_value, entry)) {
+        elog(ERROR, "bottledwater_export_chunk: Could not encode schema: %s", avro_strerror());
+    }
+    values[1] = PointerGetDatum(chunk_frame(&state));
+    tuplestore_putvalues(state.tupstore, state.result_desc, values, nulls);
+
+    chunk_read(&state, PG_GETARG_ARRAYTYPE_P(1), chunk_size);
+
+    chunk_close(&state);
+    return (Datum) 0;
+}
+
+/* Sets up materialize mode, in which a set-returning function puts all its result
+ * rows into a tuplestore before returning. A chunk is small enough for that. */
+Tuplestorestate *chunk_result_store(FunctionCallInfo fcinfo, TupleDesc *desc_out) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    MemoryContext oldcontext;
+    Tuplestorestate *tupstore;
+    TupleDesc tupdesc;
+
+    if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize)) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("set-valued function called in context that cannot accept a set")));
+    }
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+        elog(ERROR, "bottledwater_export_chunk: return type must be a row type");
+    }
+
+    oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    tupdesc = CreateTupleDescCopy(tupdesc);
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+    MemoryContextSwitchTo(oldcontext);
+
+    *desc_out = tupdesc;
+    return tupstore;
+}
+
+/* Opens the table and its key index, and looks up the names and types of the key
+ * columns, by which the chunk is ordered. */
+void chunk_open(chunk_state *state, text *table_name) {
+    List *relname_list = string_to_qualified_name_list(text_to_cstring(table_name));
+    TupleDesc rel_tupdesc;
+    Form_pg_index key_index;
+
+    memset(state, 0, sizeof(chunk_state));
+    state->rel = relation_openrv(makeRangeVarFromNameList(relname_list), AccessShareLock);
+    state->index_rel = table_key_index(state->rel);
+    if (!state->index_rel) {
+        elog(ERROR, "Table \"%s\" does not have a primary key or replica identity, so it cannot "
+                "be exported in chunks", text_to_cstring(table_name));
+    }
+
+    rel_tupdesc = RelationGetDescr(state->rel);
+    key_index = state->index_rel->rd_index;
+    state->num_key_columns = key_index->indkey.dim1;
+    state->key_names = palloc(state->num_key_columns * sizeof(char *));
+    state->key_types = palloc(state->num_key_columns * sizeof(Oid));
+
+    for (int field = 0; field < state->num_key_columns; field++) {
+        Form_pg_attribute attr = TupleDescAttr(rel_tupdesc, key_index->indkey.values[field] - 1);
+        state->key_names[field] = pstrdup(NameStr(attr->attname));
+        state->key_types[field] = attr->atttypid;
+    }
+
+    state->schema_cache = schema_cache_new(CurrentMemoryContext);
+    state->frame_schema = schema_for_frame(protocol_version_setting);
+    state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
+    avro_generic_value_new(state->frame_iface, &state->frame_value);
+}
+
+void chunk_close(chunk_state *state) {
+    schema_cache_free(state->schema_cache);
+    avro_value_decref(&state->frame_value);
+    avro_value_iface_decref(state->frame_iface);
+    avro_schema_decref(state->frame_schema);
+    relation_close(state->index_rel, AccessShareLock);
+    relation_close(state->rel, AccessShareLock);
+}
+
+/* Reads up to chunk_size rows with keys greater than after_key, in key order. The
+ * comparison is of the whole key as a row value, which an index on the key can
+ * answer by starting its scan at after_key. */
+void chunk_read(chunk_state *state, ArrayType *after_key, int32 chunk_size) {
+    StringInfoData query;
+    Datum *elems, *args = NULL;
+    bool *elem_nulls;
+    int num_elems, ret;
+
+    deconstruct_array(after_key, TEXTOID, -1, false, 'i', &elems, &elem_nulls, &num_elems);
+    if (num_elems != 0 && num_elems != state->num_key_columns) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("after_key has %d values, but the key of table \"%s\" has %d columns",
+                    num_elems, RelationGetRelationName(state->rel), state->num_key_columns)));
+    }
+
+    initStringInfo(&query);
+    appendStringInfo(&query, "SELECT * FROM %s",
+            quote_qualified_identifier(get_namespace_name(RelationGetNamespace(state->rel)),
+                                       RelationGetRelationName(state->rel)));
+
+    if (num_elems > 0) {
+        args = palloc(num_elems * sizeof(Datum));
+        appendStringInfoString(&query, " WHERE (");
+        for (int i = 0; i < num_elems; i++) {
+            Oid input_func, input_param;
+            if (elem_nulls[i]) elog(ERROR, "bottledwater_export_chunk: null value in after_key");
+
+            getTypeInputInfo(state->key_types[i], &input_func, &input_param);
+            args[i] = OidInputFunctionCall(input_func, TextDatumGetCString(elems[i]), input_param, -1);
+            appendStringInfo(&query, "%s%s", i > 0 ? ", " : "", quote_identifier(state->key_names[i]));
+        }
+        appendStringInfoString(&query, ") > (");
+        for (int i = 0; i < num_elems; i++) {
+            appendStringInfo(&query, "%s$%d", i > 0 ? ", " : "", i + 1);
+        }
+        appendStringInfoChar(&query, ')');
+    }
+
+    appendStringInfoString(&query, " ORDER BY ");
+    for (int i = 0; i < state->num_key_columns; i++) {
+        appendStringInfo(&query, "%s%s", i > 0 ? ", " : "", quote_identifier(state->key_names[i]));
+    }
+    appendStringInfo(&query, " LIMIT %d", chunk_size);
+
+    if ((ret = SPI_connect()) < 0) {
+        elog(ERROR, "bottledwater_export_chunk: SPI_connect returned %d", ret);
+    }
+    ret = SPI_execute_with_args(query.data, num_elems, state->key_types, args, NULL, true, 0);
+    if (ret != SPI_OK_SELECT) {
+        elog(ERROR, "bottledwater_export_chunk: SPI_execute_with_args returned %d", ret);
+    }
+
+    for (uint64 i = 0; i < SPI_processed; i++) {
+        chunk_row(state, SPI_tuptable->tupdesc, SPI_tuptable->vals[i]);
+    }
+    SPI_freetuptable(SPI_tuptable);
+    SPI_finish();
+}
+
+/* Adds one row of the chunk to the result: its encoded key, a frame with its insert
+ * (both omitted if it belongs to another shard), and the text of its key columns. */
+void chunk_row(chunk_state *state, TupleDesc tupdesc, HeapTuple tuple) {
+    Datum values[3];
+    bool nulls[3] = {false, false, false};
+    Datum *key_values = palloc(state->num_key_columns * sizeof(Datum));
+    schema_cache_entry *entry;
+    bytea *key_bin = NULL;
+
+    for (int i = 0; i < state->num_key_columns; i++) {
+        int column = SPI_fnumber(tupdesc, state->key_names[i]);
+        key_values[i] = CStringGetTextDatum(SPI_getvalue(tuple, tupdesc, column));
+    }
+    values[2] = PointerGetDatum(construct_array(key_values, state->num_key_columns,
+                TEXTOID, -1, false, 'i'));
+
+    if (shard_contains_row(&state->shard, state->rel, tupdesc, tuple)) {
+        if (avro_value_reset(&state->frame_value) ||
+                update_frame_with_insert(&state->frame_value, state->schema_cache, state->rel, tupdesc, tuple) ||
+                schema_cache_lookup(state->schema_cache, state->rel, &entry) < 0 ||
+                avro_value_reset(&entry->key_value) ||
+                tuple_to_avro_key(&entry->key_value, tupdesc, tuple, state->rel, state->index_rel->rd_index) ||
+                try_writing(&key_bin, &write_avro_binary, &entry->key_value)) {
+            elog(ERROR, "bottledwater_export_chunk: Avro conversion failed: %s", avro_strerror());
+        }
+        values[0] = PointerGetDatum(key_bin);
+        values[1] = PointerGetDatum(chunk_frame(state));
+    } else {
+        nulls[0] = nulls[1] = true;
+    }
+
+    tuplestore_putvalues(state->tupstore, state->result_desc, values, nulls);
+}
+
+/* Writes out state->frame_value as a byte array. */
+bytea *chunk_frame(chunk_state *state) {
+    bytea *output = NULL;
+    if (try_writing(&output, &write_avro_binary, &state->frame_value)) {
+        elog(ERROR, "bottledwater_export_chunk: writing Avro binary failed: %s", avro_strerror());
+    }
+    return output;
+}
+
 /* Queries the PG catalog to get a list of tables (matching the given table name pattern)
  * that we should export. The pattern is given to the LIKE operator, so "%" means any
  * table. Selects only ordinary tables (no views, foreign tables, etc) and excludes any
@@ -233,14 +526,15 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
     }
 
     state->tables = palloc0(SPI_processed * sizeof(export_table));
-    state->num_tables = SPI_processed;
+    state->num_tables = 0;
     initStringInfo(&errors);
 
-    for (int i = 0; i < SPI_processed; i++) {
+    for (int row = 0; row < SPI_processed; row++) {
         bool oid_null, namespace_null, relname_null, replident_null, indname_null;
-        HeapTuple tuple = SPI_tuptable->vals[i];
+        HeapTuple tuple = SPI_tuptable->vals[row];
         TupleDesc tupdesc = SPI_tuptable->tupdesc;
         export_table *table;
+        int i = state->num_tables;
 
         Datum oid_d       = heap_getattr(tuple, 1, tupdesc, &oid_null);
         Datum namespace_d = heap_getattr(tuple, 2, tupdesc, &namespace_null);
@@ -255,6 +549,15 @@ void get_table_list(export_state *state, text *table_pattern, bool allow_unkeyed
         table = &state->tables[i];
         table->relid      = DatumGetObjectId(oid_d);
         table->rel        = relation_open(table->relid, AccessShareLock);
+
+        /* Tables belonging entirely to other shards are exported by their clients */
+        if (!shard_contains_table(&state->shard, table->rel)) {
+            relation_close(table->rel, AccessShareLock);
+            memset(table, 0, sizeof(export_table));
+            continue;
+        }
+        state->num_tables++;
+
         table->namespace  = pstrdup(NameStr(*DatumGetName(namespace_d)));
         table->rel_name   = pstrdup(NameStr(*DatumGetName(relname_d)));
         table->repl_ident = DatumGetChar(replident_d);
@@ -326,7 +629,8 @@ void close_current_table(export_state *state) {
 }
 
 /* Call this when SPI_tuptable contains one row of a table, fetched from a cursor.
- * This function encodes that tuple as Avro and returns it as a byte array. */
+ * This function encodes that tuple as Avro and returns it as a byte array, or
+ * returns NULL if the row belongs to another shard. */
 bytea *format_snapshot_row(export_state *state) {
     export_table *table = &state->tables[state->current_table];
     bytea *output=NULL;
@@ -334,6 +638,9 @@ bytea *format_snapshot_row(export_state *state) {
     if (SPI_processed != 1) {
         elog(ERROR, "Expected exactly 1 row from cursor, but got %d rows", SPI_processed);
     }
+    if (!shard_contains_row(&state->shard, table->rel, SPI_tuptable->tupdesc, SPI_tuptable->vals[0])) {
+        return NULL;
+    }
     if (avro_value_reset(&state->frame_value)) {
         elog(ERROR, "Avro value reset failed: %s", avro_strerror());
     }
@@ -362,7 +669,7 @@ bytea *schema_for_relname(char *relname, bool get_key) {
     int err;
     bytea *json=NULL;
     avro_schema_t schema;
-    List *relname_list = stringToQualifiedNameList(relname);
+    List *relname_list = string_to_qualified_name_list(relname);
     RangeVar *relvar = makeRangeVarFromNameList(relname_list);
     Relation rel = relation_openrv(relvar, AccessShareLock);
 
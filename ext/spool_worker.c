@@ -0,0 +1,332 @@
+/* Background worker that decodes a replication slot inside the server, using
+ * this extension's own output plugin, and appends the frames to spool files in
+ * a local directory. This avoids the walsender, the CopyData protocol and the
+ * client process altogether, which makes it a cheap way of archiving changes
+ * on a single host. The worker does not take an initial snapshot; it streams
+ * changes from the slot's current position, as a client with --skip-snapshot
+ * would.
+ *
+ * The worker is enabled by loading the library in shared_preload_libraries and
+ * setting bottledwater.spool_slot to the name of an existing logical slot that
+ * uses the bottledwater plugin. Frames are written to files named after the
+ * LSN at which they begin (e.g. 000000010000A2F8.bwspool). Each record is
+ *
+ *     8 bytes   WAL position of the frame, big-endian
+ *     4 bytes   length of the frame, big-endian
+ *     n bytes   the frame, as sent by the output plugin over the replication protocol
+ *
+ * so a reader can hand each frame to the client's frame_reader. Frames are in the
+ * latest version of the protocol (PROTOCOL_VERSION). Files are written
+ * sequentially, and never rewritten once the worker has moved on to the next
+ * one. Every bottledwater.spool_sync_interval milliseconds, the
+ * worker fsyncs the current file and then confirms the slot up to the WAL it has
+ * decoded, so the slot never moves past data that is not durably written. After
+ * a crash, the last file may end in a torn record, and its final transactions
+ * are written again to the next file; readers should skip the torn record and
+ * drop transactions whose commit LSN they have already seen.
+ *
+ * Logical decoding in a background worker needs Postgres 14 or later. */
+
+#include "spool_worker.h"
+#include "protocol.h"
+
+#include "utils/guc.h"
+
+#if PG_VERSION_NUM >= 140000
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/xlog.h"
+#include "access/xlogutils.h"
+#include "common/file_perm.h"
+#include "lib/stringinfo.h"
+#include "nodes/makefuncs.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "replication/logical.h"
+#include "replication/slot.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/timestamp.h"
+
+/* Write buffered frames to the file once this many bytes have accumulated */
+#define SPOOL_WRITE_BUFFER_LEN 65536
+
+static char *spool_slot = NULL;
+static char *spool_database = NULL;
+static char *spool_directory = NULL;
+static char *spool_error_policy = NULL;
+static int spool_segment_size = 64;
+static int spool_sync_interval = 200;
+
+typedef struct {
+    int fd;                     /* Current spool file, or -1 */
+    char path[MAXPGPATH];       /* Name of the current spool file */
+    off_t file_len;             /* Bytes written to the current file so far */
+    StringInfoData buffer;      /* Records not yet written to the file */
+    bool unsynced;              /* Written to the file, but not yet fsynced */
+} spool_file;
+
+static spool_file spool;
+
+void spool_open(XLogRecPtr start_lsn);
+void spool_close(void);
+void spool_flush(void);
+void spool_sync(LogicalDecodingContext *ctx);
+void spool_put_uint(StringInfo buf, uint64 value, int bytes);
+static void spool_prepare_write(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+        TransactionId xid, bool last_write);
+static void spool_write(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+        TransactionId xid, bool last_write);
+
+
+/* Called from _PG_init. Defines the worker's settings and, if the library is
+ * being preloaded and a slot is configured, registers the worker. */
+void spool_worker_init() {
+    BackgroundWorker worker;
+
+    if (!process_shared_preload_libraries_in_progress) return;
+
+    DefineCustomStringVariable("bottledwater.spool_slot",
+            "Logical replication slot that the spool worker decodes.",
+            "If empty, the spool worker is not started.",
+            &spool_slot, "", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomStringVariable("bottledwater.spool_database",
+            "Database in which the spool worker's slot was created.",
+            NULL, &spool_database, "postgres", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomStringVariable("bottledwater.spool_directory",
+            "Directory to which the spool worker writes, relative to the data directory.",
+            NULL, &spool_directory, "bottledwater_spool", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomStringVariable("bottledwater.spool_error_policy",
+            "What the spool worker does when a row cannot be converted: log or exit.",
+            NULL, &spool_error_policy, "exit", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("bottledwater.spool_segment_size",
+            "Size at which the spool worker starts a new file.",
+            NULL, &spool_segment_size, 64, 1, 1024 * 1024, PGC_SIGHUP, GUC_UNIT_MB,
+            NULL, NULL, NULL);
+    DefineCustomIntVariable("bottledwater.spool_sync_interval",
+            "Time between fsyncs of the spool file, after which the slot is confirmed.",
+            NULL, &spool_sync_interval, 200, 1, 60 * 1000, PGC_SIGHUP, GUC_UNIT_MS,
+            NULL, NULL, NULL);
+
+    if (!spool_slot || spool_slot[0] == '\0') return;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "bottledwater");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "bottledwater_spool_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "bottledwater spool worker for slot %s", spool_slot);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "bottledwater spool worker");
+    RegisterBackgroundWorker(&worker);
+}
+
+/* Entry point of the background worker. Decodes the slot until the worker is
+ * terminated; any error exits the worker, and the postmaster restarts it, from
+ * the slot's confirmed position, after bgw_restart_time. */
+void bottledwater_spool_main(Datum main_arg) {
+    LogicalDecodingContext *ctx;
+    List *options;
+    TimestampTz last_sync;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    BackgroundWorkerInitializeConnection(spool_database, NULL, 0);
+    CreateAuxProcessResourceOwner();
+
+    if (MakePGDirectory(spool_directory) < 0 && errno != EEXIST) {
+        ereport(ERROR, (errcode_for_file_access(),
+                errmsg("could not create directory \"%s\": %m", spool_directory)));
+    }
+
+    spool.fd = -1;
+    initStringInfo(&spool.buffer);
+
+    ReplicationSlotAcquire(spool_slot, true);
+    if (!SlotIsLogical(MyReplicationSlot) ||
+            strcmp(NameStr(MyReplicationSlot->data.plugin), "bottledwater") != 0) {
+        ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                errmsg("replication slot \"%s\" does not use the bottledwater output plugin",
+                    spool_slot)));
+    }
+
+    options = list_make2(makeDefElem("error_policy",
+                (Node *) makeString(pstrdup(spool_error_policy)), -1),
+            makeDefElem("protocol_version", (Node *) makeString(psprintf("%d", PROTOCOL_VERSION)), -1));
+
+    ctx = CreateDecodingContext(InvalidXLogRecPtr, options, false,
+            XL_ROUTINE(.page_read = read_local_xlog_page,
+                       .segment_open = wal_segment_open,
+                       .segment_close = wal_segment_close),
+            spool_prepare_write, spool_write, NULL);
+
+    XLogBeginRead(ctx->reader, MyReplicationSlot->data.restart_lsn);
+    spool_open(MyReplicationSlot->data.confirmed_flush);
+
+    ereport(LOG, (errmsg("bottledwater spool worker decoding slot \"%s\" from %X/%X into \"%s\"",
+                    spool_slot, LSN_FORMAT_ARGS(MyReplicationSlot->data.confirmed_flush),
+                    spool_directory)));
+
+    last_sync = GetCurrentTimestamp();
+
+    for (;;) {
+#if PG_VERSION_NUM >= 150000
+        XLogRecPtr end_of_wal = GetFlushRecPtr(NULL);
+#else
+        XLogRecPtr end_of_wal = GetFlushRecPtr();
+#endif
+
+        /* Decode whatever WAL is available, but stop now and then to sync, so
+         * that the slot keeps advancing under a continuous stream of changes */
+        while (ctx->reader->EndRecPtr < end_of_wal &&
+                !TimestampDifferenceExceeds(last_sync, GetCurrentTimestamp(), spool_sync_interval)) {
+            char *errm = NULL;
+            XLogRecord *record = XLogReadRecord(ctx->reader, &errm);
+            if (errm) elog(ERROR, "could not read WAL: %s", errm);
+            if (record) LogicalDecodingProcessRecord(ctx, ctx->reader);
+            CHECK_FOR_INTERRUPTS();
+        }
+
+        spool_sync(ctx);
+        last_sync = GetCurrentTimestamp();
+
+        if (ConfigReloadPending) {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        /* Caught up with the WAL; wait a while before looking for more */
+        if (ctx->reader->EndRecPtr >= end_of_wal) {
+            (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                    spool_sync_interval, PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+/* Output plugin callback, called before the plugin writes a frame to ctx->out. */
+static void spool_prepare_write(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+        TransactionId xid, bool last_write) {
+    resetStringInfo(ctx->out);
+}
+
+/* Output plugin callback, called with a complete frame in ctx->out. Appends it
+ * to the write buffer, which is written out once it is large enough. */
+static void spool_write(LogicalDecodingContext *ctx, XLogRecPtr lsn,
+        TransactionId xid, bool last_write) {
+    spool_put_uint(&spool.buffer, lsn, 8);
+    spool_put_uint(&spool.buffer, ctx->out->len, 4);
+    appendBinaryStringInfo(&spool.buffer, ctx->out->data, ctx->out->len);
+
+    if (spool.buffer.len >= SPOOL_WRITE_BUFFER_LEN) spool_flush();
+}
+
+/* Makes everything decoded so far durable, and then confirms it to the slot, so
+ * that the server can recycle the WAL. Starts a new file if the current one has
+ * reached bottledwater.spool_segment_size. */
+void spool_sync(LogicalDecodingContext *ctx) {
+    XLogRecPtr decoded_lsn = ctx->reader->EndRecPtr;
+
+    spool_flush();
+    if (spool.unsynced) {
+        if (pg_fsync(spool.fd) != 0) {
+            ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not fsync file \"%s\": %m", spool.path)));
+        }
+        spool.unsynced = false;
+    }
+
+    if (decoded_lsn > MyReplicationSlot->data.confirmed_flush) {
+        LogicalConfirmReceivedLocation(decoded_lsn);
+    }
+
+    if (spool.file_len >= (off_t) spool_segment_size * 1024 * 1024) {
+        spool_close();
+        spool_open(decoded_lsn);
+    }
+}
+
+/* Opens the spool file that starts at the given (confirmed) WAL position. If a
+ * file of that name already exists, the worker was restarted before confirming
+ * anything past its start, so its contents will be decoded again, and it is
+ * truncated. */
+void spool_open(XLogRecPtr start_lsn) {
+    snprintf(spool.path, MAXPGPATH, "%s/%08X%08X.bwspool", spool_directory,
+            LSN_FORMAT_ARGS(start_lsn));
+
+    spool.fd = open(spool.path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY, pg_file_create_mode);
+    if (spool.fd < 0) {
+        ereport(ERROR, (errcode_for_file_access(),
+                errmsg("could not create file \"%s\": %m", spool.path)));
+    }
+    spool.file_len = 0;
+    spool.unsynced = false;
+}
+
+void spool_close() {
+    if (spool.fd < 0) return;
+    if (close(spool.fd) != 0) {
+        ereport(ERROR, (errcode_for_file_access(),
+                errmsg("could not close file \"%s\": %m", spool.path)));
+    }
+    spool.fd = -1;
+}
+
+/* Writes the buffered records to the current file (without fsyncing it). */
+void spool_flush() {
+    int offset = 0;
+
+    while (offset < spool.buffer.len) {
+        ssize_t written = write(spool.fd, spool.buffer.data + offset, spool.buffer.len - offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            ereport(ERROR, (errcode_for_file_access(),
+                    errmsg("could not write to file \"%s\": %m", spool.path)));
+        }
+        offset += written;
+    }
+
+    spool.file_len += spool.buffer.len;
+    if (spool.buffer.len > 0) spool.unsynced = true;
+    resetStringInfo(&spool.buffer);
+}
+
+/* Appends an unsigned integer to the buffer in big-endian byte order. */
+void spool_put_uint(StringInfo buf, uint64 value, int bytes) {
+    char encoded[8];
+    for (int i = 0; i < bytes; i++) {
+        encoded[i] = (char) (value >> (8 * (bytes - i - 1)));
+    }
+    appendBinaryStringInfo(buf, encoded, bytes);
+}
+
+#else /* PG_VERSION_NUM < 140000 */
+
+/* The worker's settings are not defined on older servers, so setting them would
+ * otherwise silently do nothing. */
+void spool_worker_init() {
+    const char *slot = GetConfigOption("bottledwater.spool_slot", true, false);
+    if (slot && slot[0] != '\0') {
+        ereport(WARNING,
+                (errmsg("bottledwater.spool_slot is ignored: the bottledwater spool worker "
+                        "requires Postgres 14 or later")));
+    }
+}
+
+void bottledwater_spool_main(Datum main_arg) {
+    elog(ERROR, "the bottledwater spool worker requires Postgres 14 or later");
+}
+
+#endif /* PG_VERSION_NUM >= 140000 */
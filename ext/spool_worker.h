@@ -0,0 +1,10 @@
+#ifndef SPOOL_WORKER_H
+#define SPOOL_WORKER_H
+
+#include "postgres.h"
+#include "fmgr.h"
+
+void spool_worker_init(void);
+PGDLLEXPORT void bottledwater_spool_main(Datum main_arg);
+
+#endif /* SPOOL_WORKER_H */
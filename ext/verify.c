@@ -0,0 +1,288 @@
+/* Server side of bwverify, which checks that a table's Kafka topic holds the same
+ * data as the table. Rather than exporting the table, these functions encode each
+ * row in the same way as the snapshot and the output plugin do, and return hashes
+ * of the encoded rows, grouped into buckets by key (see verify_hash.h). bwverify
+ * computes the same hashes over the latest value of each key in the topic, and
+ * only asks for finer buckets, and eventually for individual rows, where the two
+ * disagree. */
+
+#include "io_util.h"
+#include "oid2avro.h"
+#include "verify_hash.h"
+
+#include <string.h>
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "access/heapam.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+/* Rows fetched from the cursor at a time */
+#define VERIFY_FETCH_ROWS 1000
+/* Limit on the number of buckets, to bound the memory for per-bucket sums */
+#define VERIFY_MAX_BUCKETS (1 << 24)
+
+typedef struct {
+    Relation rel;
+    Relation index_rel;             /* Primary key or replica identity index */
+    avro_schema_t key_schema, row_schema;
+    avro_value_iface_t *key_iface, *row_iface;
+    avro_value_t key_value, row_value;
+    uint32 num_buckets;
+    uint32 parent_buckets;          /* Rows are only included if ... */
+    bool *parents;                  /* ... parents[bucket % parent_buckets] is set */
+    int64 first_page, last_page;    /* Range of heap pages to read; last_page -1 = end */
+    MemoryContext row_context;      /* Reset after every row */
+    Tuplestorestate *tupstore;      /* Rows to return, for bottledwater_row_hashes */
+    TupleDesc result_desc;
+    int64 *row_counts;              /* Per bucket, for bottledwater_table_hashes */
+    uint64 *hash_sums;
+} verify_state;
+
+void verify_open(verify_state *state, Name table_name, int32 num_buckets, int32 parent_buckets,
+        ArrayType *parents, int64 first_page, int64 last_page);
+void verify_close(verify_state *state);
+Tuplestorestate *verify_result_store(FunctionCallInfo fcinfo, TupleDesc *desc_out);
+void verify_scan(verify_state *state);
+void verify_row(verify_state *state, TupleDesc tupdesc, HeapTuple tuple);
+
+
+PG_FUNCTION_INFO_V1(bottledwater_table_hashes);
+
+/* Returns the row count and sum of row hashes of each non-empty bucket of a table.
+ * See bottledwater--0.2.sql for the arguments. */
+Datum bottledwater_table_hashes(PG_FUNCTION_ARGS) {
+    verify_state state;
+    Datum values[3];
+    bool nulls[3] = {false, false, false};
+
+    verify_open(&state, PG_GETARG_NAME(0), PG_GETARG_INT32(1), PG_GETARG_INT32(2),
+            PG_GETARG_ARRAYTYPE_P(3), PG_GETARG_INT64(4), PG_GETARG_INT64(5));
+    state.row_counts = palloc0(state.num_buckets * sizeof(int64));
+    state.hash_sums = palloc0(state.num_buckets * sizeof(uint64));
+    state.tupstore = verify_result_store(fcinfo, &state.result_desc);
+
+    verify_scan(&state);
+
+    for (uint32 bucket = 0; bucket < state.num_buckets; bucket++) {
+        if (state.row_counts[bucket] == 0) continue;
+        values[0] = Int32GetDatum(bucket);
+        values[1] = Int64GetDatum(state.row_counts[bucket]);
+        values[2] = Int64GetDatum((int64) state.hash_sums[bucket]);
+        tuplestore_putvalues(state.tupstore, state.result_desc, values, nulls);
+    }
+
+    verify_close(&state);
+    return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(bottledwater_row_hashes);
+
+/* Returns the bucket, encoded key and row hash of each row of a table in the
+ * selected buckets. See bottledwater--0.2.sql for the arguments. */
+Datum bottledwater_row_hashes(PG_FUNCTION_ARGS) {
+    verify_state state;
+    int32 num_buckets = PG_GETARG_INT32(1);
+
+    verify_open(&state, PG_GETARG_NAME(0), num_buckets, num_buckets,
+            PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_INT64(3), PG_GETARG_INT64(4));
+    state.tupstore = verify_result_store(fcinfo, &state.result_desc);
+
+    verify_scan(&state);
+
+    verify_close(&state);
+    return (Datum) 0;
+}
+
+/* Opens the table and checks the arguments common to both functions. */
+void verify_open(verify_state *state, Name table_name, int32 num_buckets, int32 parent_buckets,
+        ArrayType *parents, int64 first_page, int64 last_page) {
+    Datum *elems;
+    bool *elem_nulls;
+    int num_elems;
+    List *relname_list;
+
+    memset(state, 0, sizeof(verify_state));
+
+    if (num_buckets < 1 || num_buckets > VERIFY_MAX_BUCKETS) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("number of buckets must be between 1 and %d", VERIFY_MAX_BUCKETS)));
+    }
+    if (parent_buckets < 1 || num_buckets % parent_buckets != 0) {
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg("number of buckets (%d) must be a multiple of parent buckets (%d)",
+                    num_buckets, parent_buckets)));
+    }
+    state->num_buckets = num_buckets;
+    state->parent_buckets = parent_buckets;
+    state->first_page = first_page;
+    state->last_page = last_page;
+
+    state->parents = palloc0(parent_buckets * sizeof(bool));
+    deconstruct_array(parents, INT4OID, sizeof(int32), true, 'i', &elems, &elem_nulls, &num_elems);
+    for (int i = 0; i < num_elems; i++) {
+        int32 parent = DatumGetInt32(elems[i]);
+        if (elem_nulls[i] || parent < 0 || parent >= parent_buckets) {
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("bucket numbers must be between 0 and %d", parent_buckets - 1)));
+        }
+        state->parents[parent] = true;
+    }
+
+    relname_list = string_to_qualified_name_list(NameStr(*table_name));
+    state->rel = relation_openrv(makeRangeVarFromNameList(relname_list), AccessShareLock);
+    state->index_rel = table_key_index(state->rel);
+    if (!state->index_rel) {
+        elog(ERROR, "Table \"%s\" does not have a primary key or replica identity, so its topic "
+                "cannot be compared by key", NameStr(*table_name));
+    }
+
+    if (schema_for_table_key(state->rel, &state->key_schema) ||
+            schema_for_table_row(state->rel, &state->row_schema)) {
+        elog(ERROR, "bottledwater_verify: Could not get schema for table %s: %s",
+                NameStr(*table_name), avro_strerror());
+    }
+    state->key_iface = avro_generic_class_from_schema(state->key_schema);
+    state->row_iface = avro_generic_class_from_schema(state->row_schema);
+    avro_generic_value_new(state->key_iface, &state->key_value);
+    avro_generic_value_new(state->row_iface, &state->row_value);
+
+    state->row_context = AllocSetContextCreate(CurrentMemoryContext,
+                                               "bottledwater_verify per-row context",
+                                               ALLOCSET_DEFAULT_MINSIZE,
+                                               ALLOCSET_DEFAULT_INITSIZE,
+                                               ALLOCSET_DEFAULT_MAXSIZE);
+}
+
+void verify_close(verify_state *state) {
+    avro_value_decref(&state->key_value);
+    avro_value_decref(&state->row_value);
+    avro_value_iface_decref(state->key_iface);
+    avro_value_iface_decref(state->row_iface);
+    avro_schema_decref(state->key_schema);
+    avro_schema_decref(state->row_schema);
+    relation_close(state->index_rel, AccessShareLock);
+    relation_close(state->rel, AccessShareLock);
+    MemoryContextDelete(state->row_context);
+}
+
+/* Sets up materialize mode, in which a set-returning function puts all its result
+ * rows into a tuplestore before returning. */
+Tuplestorestate *verify_result_store(FunctionCallInfo fcinfo, TupleDesc *desc_out) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    MemoryContext oldcontext;
+    Tuplestorestate *tupstore;
+    TupleDesc tupdesc;
+
+    if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize)) {
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("set-valued function called in context that cannot accept a set")));
+    }
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+        elog(ERROR, "bottledwater_verify: return type must be a row type");
+    }
+
+    oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    tupdesc = CreateTupleDescCopy(tupdesc);
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = tupdesc;
+    MemoryContextSwitchTo(oldcontext);
+
+    *desc_out = tupdesc;
+    return tupstore;
+}
+
+/* Reads the table's rows in the requested range of pages. Like the snapshot, this
+ * goes through SPI, so the tuple descriptor omits dropped columns, and the rows
+ * are those visible to the calling transaction's snapshot. */
+void verify_scan(verify_state *state) {
+    StringInfoData query;
+    SPIPlanPtr plan;
+    Portal cursor;
+    int ret;
+
+    if ((ret = SPI_connect()) < 0) {
+        elog(ERROR, "bottledwater_verify: SPI_connect returned %d", ret);
+    }
+
+    /* Postgres 14 and later turn the ctid condition into a scan of just those pages */
+    initStringInfo(&query);
+    appendStringInfo(&query, "SELECT * FROM %s WHERE ctid >= '(" INT64_FORMAT ",0)'::tid",
+            quote_qualified_identifier(get_namespace_name(RelationGetNamespace(state->rel)),
+                                       RelationGetRelationName(state->rel)),
+            state->first_page);
+    if (state->last_page >= 0) {
+        appendStringInfo(&query, " AND ctid < '(" INT64_FORMAT ",0)'::tid", state->last_page);
+    }
+
+    plan = SPI_prepare_cursor(query.data, 0, NULL, CURSOR_OPT_NO_SCROLL);
+    if (!plan) {
+        elog(ERROR, "bottledwater_verify: SPI_prepare_cursor failed with error %d", SPI_result);
+    }
+    cursor = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+
+    for (;;) {
+        SPI_cursor_fetch(cursor, true, VERIFY_FETCH_ROWS);
+        if (SPI_processed == 0) break;
+
+        for (uint64 i = 0; i < SPI_processed; i++) {
+            MemoryContext oldcontext = MemoryContextSwitchTo(state->row_context);
+            verify_row(state, SPI_tuptable->tupdesc, SPI_tuptable->vals[i]);
+            MemoryContextSwitchTo(oldcontext);
+            MemoryContextReset(state->row_context);
+        }
+        SPI_freetuptable(SPI_tuptable);
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    SPI_cursor_close(cursor);
+    SPI_finish();
+}
+
+/* Encodes one row as the output plugin would, and adds it to its bucket. */
+void verify_row(verify_state *state, TupleDesc tupdesc, HeapTuple tuple) {
+    bytea *key_bin = NULL, *row_bin = NULL;
+    uint64 key_hash, row_hash;
+    uint32 bucket;
+
+    if (avro_value_reset(&state->key_value) ||
+            tuple_to_avro_key(&state->key_value, tupdesc, tuple, state->rel, state->index_rel->rd_index) ||
+            try_writing(&key_bin, &write_avro_binary, &state->key_value)) {
+        elog(ERROR, "bottledwater_verify: Could not encode key: %s", avro_strerror());
+    }
+
+    key_hash = verify_key_hash(VARDATA(key_bin), VARSIZE(key_bin) - VARHDRSZ);
+    bucket = verify_bucket(key_hash, state->num_buckets);
+    if (!state->parents[bucket % state->parent_buckets]) return;
+
+    if (avro_value_reset(&state->row_value) ||
+            tuple_to_avro_row(&state->row_value, tupdesc, tuple) ||
+            try_writing(&row_bin, &write_avro_binary, &state->row_value)) {
+        elog(ERROR, "bottledwater_verify: Could not encode row: %s", avro_strerror());
+    }
+
+    row_hash = verify_row_hash(key_hash, VARDATA(row_bin), VARSIZE(row_bin) - VARHDRSZ);
+
+    if (state->row_counts) {
+        state->row_counts[bucket]++;
+        state->hash_sums[bucket] += row_hash;
+    } else {
+        Datum values[3];
+        bool nulls[3] = {false, false, false};
+        values[0] = Int32GetDatum(bucket);
+        values[1] = PointerGetDatum(key_bin);
+        values[2] = Int64GetDatum((int64) row_hash);
+        tuplestore_putvalues(state->tupstore, state->result_desc, values, nulls);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef VERIFY_HASH_H
+#define VERIFY_HASH_H
+
+/* Hashes shared by bottledwater_table_hashes() in the extension and by bwverify,
+ * which computes them over the Avro-encoded keys and rows of a table and of its
+ * Kafka topic respectively. Both sides must agree bit for bit, so this header is
+ * self-contained and used by both. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VERIFY_FNV64_OFFSET_BASIS 14695981039346656037ULL
+#define VERIFY_FNV64_PRIME 1099511628211ULL
+
+/* 64-bit FNV-1a, continuing from a previous hash value. */
+static inline uint64_t verify_hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= VERIFY_FNV64_PRIME;
+    }
+    return hash;
+}
+
+/* Finalizer from MurmurHash3, so that every bit of the output depends on every
+ * bit of the FNV hash before it is reduced to a bucket or summed. */
+static inline uint64_t verify_hash_mix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Hash of a row's key, as encoded with the table's key schema. Never 0. */
+static inline uint64_t verify_key_hash(const void *key, size_t key_len) {
+    uint64_t hash = verify_hash_mix(verify_hash_bytes(VERIFY_FNV64_OFFSET_BASIS, key, key_len));
+    return hash ? hash : 1;
+}
+
+/* Hash of a row's key and value, as encoded with the table's row schema. Bucket
+ * hashes are the sum (modulo 2^64) of the row hashes in them, so that the order
+ * in which rows are seen does not matter. Never 0. */
+static inline uint64_t verify_row_hash(uint64_t key_hash, const void *row, size_t row_len) {
+    uint64_t hash = verify_hash_mix(verify_hash_bytes(key_hash, row, row_len));
+    return hash ? hash : 1;
+}
+
+/* Assigns a key to one of num_buckets buckets. If num_buckets is a multiple of
+ * parent_buckets, the key is in bucket (verify_bucket(key_hash, num_buckets) %
+ * parent_buckets) of the coarser division, which is what allows drilling down
+ * into the buckets that differ. */
+static inline uint32_t verify_bucket(uint64_t key_hash, uint32_t num_buckets) {
+    return (uint32_t) (key_hash % num_buckets);
+}
+
+#endif /* VERIFY_HASH_H */
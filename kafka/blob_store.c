@@ -0,0 +1,207 @@
+/* Claim-check storage for oversized values (see --claim-check-store).
+ *
+ * Values above the threshold are put into a blob store, and the Kafka message
+ * carries a reference to the blob instead of the value. The only backend so far is
+ * "dir", which keeps each blob in a file under a local (or network-mounted)
+ * directory:
+ *
+ *   <dir>/<first two hex digits of the SHA-256>/<SHA-256 in hex>
+ *
+ * A blob is written to a temporary file, flushed to disk and then renamed into
+ * place, so a reader never sees a partly written blob, and a blob is durable before
+ * the message that refers to it is produced. */
+
+#include "blob_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int dir_store_open(blob_store_t store);
+int dir_store_put(blob_store_t store, const char *name, const void *data, size_t len);
+void dir_store_close(blob_store_t store);
+int dir_store_mkdir(blob_store_t store, const char *path);
+int dir_store_write_file(blob_store_t store, const char *path, const void *data, size_t len);
+int dir_store_fsync_dir(blob_store_t store, const char *path);
+void blob_store_set_error(blob_store_t store, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+static const blob_store_backend blob_store_backends[] = {
+    {"dir", dir_store_open, dir_store_put, dir_store_close}
+};
+
+#define NUM_BLOB_STORE_BACKENDS (sizeof(blob_store_backends) / sizeof(blob_store_backends[0]))
+
+
+/* Creates a blob store from a spec of the form backend:location, e.g.
+ * "dir:/var/lib/bottledwater/blobs". Returns NULL if the spec doesn't name a known
+ * backend. Call blob_store_open() before putting blobs into it. */
+blob_store_t blob_store_new(const char *spec) {
+    const char *colon = strchr(spec, ':');
+    if (!colon || !colon[1]) return NULL;
+
+    for (int i = 0; i < NUM_BLOB_STORE_BACKENDS; i++) {
+        const blob_store_backend *backend = &blob_store_backends[i];
+        if (strlen(backend->name) != colon - spec || strncmp(backend->name, spec, colon - spec)) {
+            continue;
+        }
+
+        blob_store_t store = malloc(sizeof(blob_store));
+        memset(store, 0, sizeof(blob_store));
+        store->backend = backend;
+        store->location = strdup(colon + 1);
+        return store;
+    }
+    return NULL;
+}
+
+/* Prepares the store for writing. Returns nonzero on failure, with the reason in
+ * store->error. */
+int blob_store_open(blob_store_t store) {
+    return store->backend->open(store);
+}
+
+/* Stores a blob, unless a blob with the same content is already stored, and sets
+ * name to its SHA-256 in hex. Returns only once the blob is durably stored, or
+ * nonzero on failure (with the reason in store->error). */
+int blob_store_put(blob_store_t store, const void *data, size_t len, char name[SHA256_HEX_LEN]) {
+    sha256_hex(data, len, name);
+    return store->backend->put(store, name, data, len);
+}
+
+void blob_store_free(blob_store_t store) {
+    store->backend->close(store);
+    free(store->location);
+    free(store);
+}
+
+
+/* Creates the directory if it doesn't exist yet, and checks that we can write to it. */
+int dir_store_open(blob_store_t store) {
+    if (strlen(store->location) + 1 + 2 + 1 + SHA256_HEX_LEN + 32 > BLOB_STORE_MAX_PATH) {
+        blob_store_set_error(store, "Blob store path too long: %s", store->location);
+        return ENAMETOOLONG;
+    }
+
+    int err = dir_store_mkdir(store, store->location);
+    if (err) return err;
+
+    if (access(store->location, W_OK | X_OK)) {
+        err = errno;
+        blob_store_set_error(store, "Cannot write to blob store directory %s: %s",
+                store->location, strerror(err));
+        return err;
+    }
+    return 0;
+}
+
+int dir_store_put(blob_store_t store, const char *name, const void *data, size_t len) {
+    char dir[BLOB_STORE_MAX_PATH], path[BLOB_STORE_MAX_PATH], tmp_path[BLOB_STORE_MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s/%.2s", store->location, name);
+    snprintf(path, sizeof(path), "%s/%.2s/%s", store->location, name, name);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%.2s/.%s.%d.tmp", store->location, name, name, (int) getpid());
+
+    // The same content is often stored again, e.g. when a transaction is replayed
+    // after a restart. A complete blob of the right size must have the same content.
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == (off_t) len) return 0;
+
+    int err = dir_store_mkdir(store, dir);
+    if (err) return err;
+
+    err = dir_store_write_file(store, tmp_path, data, len);
+    if (err) {
+        unlink(tmp_path);
+        return err;
+    }
+
+    if (rename(tmp_path, path)) {
+        err = errno;
+        blob_store_set_error(store, "Could not rename %s to %s: %s", tmp_path, path, strerror(err));
+        unlink(tmp_path);
+        return err;
+    }
+
+    err = dir_store_fsync_dir(store, dir);
+    if (err) return err;
+
+    store->blobs_written++;
+    store->bytes_written += len;
+    return 0;
+}
+
+void dir_store_close(blob_store_t store) {
+    // The directory backend keeps no state
+}
+
+int dir_store_mkdir(blob_store_t store, const char *path) {
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        int err = errno;
+        blob_store_set_error(store, "Could not create blob store directory %s: %s",
+                path, strerror(err));
+        return err;
+    }
+    return 0;
+}
+
+/* Writes the file and flushes it to disk. */
+int dir_store_write_file(blob_store_t store, const char *path, const void *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        int err = errno;
+        blob_store_set_error(store, "Could not create %s: %s", path, strerror(err));
+        return err;
+    }
+
+    const char *bytes = data;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t ret = write(fd, &bytes[written], len - written);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0) {
+            int err = errno;
+            blob_store_set_error(store, "Could not write %s: %s", path, strerror(err));
+            close(fd);
+            return err;
+        }
+        written += ret;
+    }
+
+    if (fsync(fd)) {
+        int err = errno;
+        blob_store_set_error(store, "Could not flush %s to disk: %s", path, strerror(err));
+        close(fd);
+        return err;
+    }
+    if (close(fd)) {
+        int err = errno;
+        blob_store_set_error(store, "Could not close %s: %s", path, strerror(err));
+        return err;
+    }
+    return 0;
+}
+
+/* Flushes a directory to disk, so that a file renamed into it stays there. */
+int dir_store_fsync_dir(blob_store_t store, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fsync(fd)) {
+        int err = errno;
+        blob_store_set_error(store, "Could not flush directory %s to disk: %s", path, strerror(err));
+        if (fd >= 0) close(fd);
+        return err;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Updates the store's statically allocated error buffer with a message. */
+void blob_store_set_error(blob_store_t store, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(store->error, BLOB_STORE_ERROR_LEN, fmt, args);
+    va_end(args);
+}
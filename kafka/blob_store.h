@@ -0,0 +1,41 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include "sha256.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOB_STORE_ERROR_LEN 512
+#define BLOB_STORE_MAX_PATH 4096
+
+typedef struct blob_store blob_store;
+typedef blob_store *blob_store_t;
+
+/* A kind of place to keep blobs. To add a backend, implement these and add it to
+ * the list in blob_store.c. */
+typedef struct {
+    const char *name;           /* Prefix of the store spec, e.g. "dir" in "dir:/var/lib/bw" */
+    int (*open)(blob_store_t store);    /* Prepares the location for writing; nonzero on failure */
+    int (*put)(blob_store_t store, const char *name, const void *data, size_t len);
+    void (*close)(blob_store_t store);  /* Releases anything that open allocated */
+} blob_store_backend;
+
+/* Content-addressed storage for values that are too large to be sent to Kafka.
+ * Blobs are named by the SHA-256 of their content, so storing the same value twice
+ * stores it once, and a reference to a blob can be checked against its content. */
+struct blob_store {
+    const blob_store_backend *backend;
+    char *location;             /* Backend-specific part of the spec, after the colon */
+    void *state;                /* Backend-specific state, set by open */
+    uint64_t blobs_written;     /* Blobs put into the store that were not already in it */
+    uint64_t bytes_written;     /* Total size of those blobs */
+    char error[BLOB_STORE_ERROR_LEN];
+};
+
+blob_store_t blob_store_new(const char *spec);
+int blob_store_open(blob_store_t store);
+int blob_store_put(blob_store_t store, const void *data, size_t len, char name[SHA256_HEX_LEN]);
+void blob_store_free(blob_store_t store);
+
+#endif /* BLOB_STORE_H */
@@ -14,6 +14,8 @@
 #include "logger.h"
 
 #include <avro.h>
+#include <stdio.h>
+#include <string.h>
 
 int avro_bin_to_json(avro_schema_t schema,
         const void *val_bin, size_t val_len,
@@ -41,6 +43,36 @@ int json_encode_msg(table_metadata_t table,
 }
 
 
+/* Writes str to buf as a JSON string, with quotes, escaping any characters that
+ * need it. If it does not fit in size bytes (at least 3), it is truncated, but
+ * still closed with a quote. Returns the length written, not counting the
+ * terminating null. */
+int json_quote_string(char *buf, size_t size, const char *str) {
+    size_t len = 0;
+    buf[len++] = '"';
+
+    // Leave room for the longest escape sequence, the closing quote and the null
+    for (const char *c = str; *c && len + 8 < size; c++) {
+        switch (*c) {
+            case '"':  len += sprintf(buf + len, "\\\""); break;
+            case '\\': len += sprintf(buf + len, "\\\\"); break;
+            case '\n': len += sprintf(buf + len, "\\n"); break;
+            case '\r': len += sprintf(buf + len, "\\r"); break;
+            case '\t': len += sprintf(buf + len, "\\t"); break;
+            default:
+                if ((unsigned char) *c < 0x20) {
+                    len += sprintf(buf + len, "\\u%04x", (unsigned char) *c);
+                } else {
+                    buf[len++] = *c;
+                }
+        }
+    }
+    buf[len++] = '"';
+    buf[len] = '\0';
+    return len;
+}
+
+
 int avro_bin_to_json(avro_schema_t schema,
         const void *val_bin, size_t val_len,
         char **val_out, size_t *val_len_out) {
@@ -10,6 +10,7 @@ int json_encode_msg(table_metadata_t table,
         char **key_out, size_t *key_len_out,
         const void *row_bin, size_t row_len,
         char **row_out, size_t *row_len_out);
+int json_quote_string(char *buf, size_t size, const char *str);
 
 
 #endif /* JSON_H */
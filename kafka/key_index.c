@@ -0,0 +1,203 @@
+/* Index of the keys of every live row, per table, kept for --on-truncate=tombstones.
+ *
+ * A TRUNCATE reaches us without the rows it removed, so to write a tombstone for
+ * each of them we have to know their keys already. Every row event we send adds its
+ * key to the table's set, and every delete removes it. The index lives in memory
+ * only, so it knows every key only if it has seen all of the table's rows since
+ * they were first written to Kafka: i.e. if this process took the snapshot, or the
+ * table was created, or last truncated, while it was running. Tables for which that
+ * is not so are marked incomplete, and the caller has to deal with a truncation of
+ * them in some other way.
+ *
+ * Keys are compared byte for byte, in the Avro binary encoding received from
+ * Postgres, which is the same for equal keys as long as the key schema does not
+ * change. */
+
+#include "key_index.h"
+#include "partitioner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY_INDEX_INITIAL_BUCKETS 64
+
+key_index_table *key_index_lookup(key_index_t index, Oid relid);
+key_index_table *key_index_table_get(key_index_t index, Oid relid);
+void key_index_table_resize(key_index_table *table, int num_buckets);
+void key_index_table_clear(key_index_t index, key_index_table *table);
+
+
+/* Creates an empty index. If complete is true, tables are assumed to have had no
+ * rows before their first key is added (i.e. the snapshot is about to be taken). */
+key_index_t key_index_new(bool complete) {
+    key_index_t index = malloc(sizeof(key_index));
+    memset(index, 0, sizeof(key_index));
+    index->complete = complete;
+    index->capacity = 16;
+    index->tables = malloc(index->capacity * sizeof(void*));
+    return index;
+}
+
+/* Adds a key to a table's set, unless it is there already. */
+void key_index_add(key_index_t index, Oid relid, const void *key, size_t key_len) {
+    key_index_table *table = key_index_table_get(index, relid);
+    uint32_t hash = murmur2(key, key_len);
+    int bucket = hash & (table->num_buckets - 1);
+
+    for (key_index_entry *entry = table->buckets[bucket]; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->key_len == key_len &&
+                memcmp(entry->key, key, key_len) == 0) {
+            return;
+        }
+    }
+
+    key_index_entry *entry = malloc(sizeof(key_index_entry) + key_len);
+    entry->hash = hash;
+    entry->key_len = key_len;
+    memcpy(entry->key, key, key_len);
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+
+    table->num_keys++;
+    index->num_keys++;
+    index->num_bytes += key_len;
+
+    // Keep the load factor at or below 1
+    if (table->num_keys > (uint64_t) table->num_buckets) {
+        key_index_table_resize(table, 2 * table->num_buckets);
+    }
+}
+
+/* Removes a key from a table's set, if it is there. */
+void key_index_remove(key_index_t index, Oid relid, const void *key, size_t key_len) {
+    key_index_table *table = key_index_lookup(index, relid);
+    if (!table) return;
+
+    uint32_t hash = murmur2(key, key_len);
+    key_index_entry **link = &table->buckets[hash & (table->num_buckets - 1)];
+
+    for (; *link; link = &(*link)->next) {
+        key_index_entry *entry = *link;
+        if (entry->hash == hash && entry->key_len == key_len &&
+                memcmp(entry->key, key, key_len) == 0) {
+            *link = entry->next;
+            table->num_keys--;
+            index->num_keys--;
+            index->num_bytes -= key_len;
+            free(entry);
+            return;
+        }
+    }
+}
+
+/* Returns true if the index holds the key of every live row of the table. */
+bool key_index_complete(key_index_t index, Oid relid) {
+    key_index_table *table = key_index_lookup(index, relid);
+    return table ? table->complete : index->complete;
+}
+
+/* Records that some of the table's keys may be missing from the index, e.g.
+ * because its key schema changed, so that earlier keys are encoded differently. */
+void key_index_mark_incomplete(key_index_t index, Oid relid) {
+    key_index_table *table = key_index_table_get(index, relid);
+    key_index_table_clear(index, table);
+    table->complete = false;
+}
+
+/* Calls cb with every key in the table's set, in no particular order. Stops at,
+ * and returns, the first nonzero value that cb returns. cb must not modify the
+ * index. */
+int key_index_foreach(key_index_t index, Oid relid, key_index_cb cb, void *context) {
+    key_index_table *table = key_index_lookup(index, relid);
+    if (!table) return 0;
+
+    for (int i = 0; i < table->num_buckets; i++) {
+        for (key_index_entry *entry = table->buckets[i]; entry; entry = entry->next) {
+            int err = cb(context, entry->key, entry->key_len);
+            if (err) return err;
+        }
+    }
+    return 0;
+}
+
+/* Empties a table's set, after the table was truncated. As the table now has no
+ * rows, the index knows all of its keys from here on. */
+void key_index_clear(key_index_t index, Oid relid) {
+    key_index_table *table = key_index_table_get(index, relid);
+    key_index_table_clear(index, table);
+    table->complete = true;
+}
+
+void key_index_free(key_index_t index) {
+    for (int i = 0; i < index->num_tables; i++) {
+        key_index_table *table = index->tables[i];
+        key_index_table_clear(index, table);
+        free(table->buckets);
+        free(table);
+    }
+    free(index->tables);
+    free(index);
+}
+
+/* Returns the set of the given table, or NULL if no key of it was ever added. */
+key_index_table *key_index_lookup(key_index_t index, Oid relid) {
+    for (int i = 0; i < index->num_tables; i++) {
+        if (index->tables[i]->relid == relid) return index->tables[i];
+    }
+    return NULL;
+}
+
+/* Returns the set of the given table, creating an empty one if necessary. */
+key_index_table *key_index_table_get(key_index_t index, Oid relid) {
+    key_index_table *table = key_index_lookup(index, relid);
+    if (table) return table;
+
+    if (index->num_tables == index->capacity) {
+        index->capacity *= 4;
+        index->tables = realloc(index->tables, index->capacity * sizeof(void*));
+    }
+
+    table = malloc(sizeof(key_index_table));
+    memset(table, 0, sizeof(key_index_table));
+    table->relid = relid;
+    table->complete = index->complete;
+    table->num_buckets = KEY_INDEX_INITIAL_BUCKETS;
+    table->buckets = calloc(table->num_buckets, sizeof(key_index_entry *));
+
+    index->tables[index->num_tables++] = table;
+    return table;
+}
+
+/* Rehashes a table's keys into num_buckets buckets. */
+void key_index_table_resize(key_index_table *table, int num_buckets) {
+    key_index_entry **buckets = calloc(num_buckets, sizeof(key_index_entry *));
+
+    for (int i = 0; i < table->num_buckets; i++) {
+        key_index_entry *entry = table->buckets[i], *next;
+        for (; entry; entry = next) {
+            next = entry->next;
+            int bucket = entry->hash & (num_buckets - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->num_buckets = num_buckets;
+}
+
+/* Frees every key of a table's set, keeping its buckets. */
+void key_index_table_clear(key_index_t index, key_index_table *table) {
+    for (int i = 0; i < table->num_buckets; i++) {
+        key_index_entry *entry = table->buckets[i], *next;
+        for (; entry; entry = next) {
+            next = entry->next;
+            index->num_bytes -= entry->key_len;
+            free(entry);
+        }
+        table->buckets[i] = NULL;
+    }
+    index->num_keys -= table->num_keys;
+    table->num_keys = 0;
+}
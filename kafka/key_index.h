@@ -0,0 +1,50 @@
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+
+#include <postgres_ext.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* One key in a table's hash set, in the binary encoding received from Postgres */
+typedef struct key_index_entry {
+    struct key_index_entry *next; /* Next entry in the same bucket */
+    uint32_t hash;
+    size_t key_len;
+    char key[];
+} key_index_entry;
+
+typedef struct {
+    Oid relid;
+    bool complete;              /* Every key of the table's rows is in the set */
+    key_index_entry **buckets;  /* Hash set of keys, chained per bucket */
+    int num_buckets;            /* Allocated size of buckets, a power of two */
+    uint64_t num_keys;
+} key_index_table;
+
+/* The keys of the live rows of each table, so that a TRUNCATE can be turned into a
+ * tombstone for every row it removed (see --on-truncate=tombstones). */
+typedef struct {
+    bool complete;              /* Whether tables seen for the first time start out complete */
+    key_index_table **tables;   /* Array of pointers to per-table sets */
+    int num_tables;
+    int capacity;               /* Allocated size of tables array */
+    uint64_t num_keys;          /* Keys in all tables */
+    uint64_t num_bytes;         /* Total size of those keys */
+} key_index;
+
+typedef key_index *key_index_t;
+
+/* Parameters: context, key_bin, key_len */
+typedef int (*key_index_cb)(void *, const void *, size_t);
+
+key_index_t key_index_new(bool complete);
+void key_index_add(key_index_t index, Oid relid, const void *key, size_t key_len);
+void key_index_remove(key_index_t index, Oid relid, const void *key, size_t key_len);
+bool key_index_complete(key_index_t index, Oid relid);
+void key_index_mark_incomplete(key_index_t index, Oid relid);
+int key_index_foreach(key_index_t index, Oid relid, key_index_cb cb, void *context);
+void key_index_clear(key_index_t index, Oid relid);
+void key_index_free(key_index_t index);
+
+#endif /* KEY_INDEX_H */
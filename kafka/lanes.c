@@ -0,0 +1,222 @@
+/* Priority lanes for row events on their way to Kafka (see --lane).
+ *
+ * Without lanes, every table shares the Kafka producer's queue, so a bulk rewrite of
+ * one big table can fill it and hold up the messages of every other table until it
+ * has drained. Each lane instead has its own queue, and a budget of messages that it
+ * may have in flight (produced but not yet acknowledged) per sink. Lanes take turns
+ * to hand messages to the producer by deficit round robin: in each round, a lane
+ * sends up to its weight in messages, or fewer if its queue is empty or its budget
+ * is used up. A lane that is not in a position to send loses the rest of its turn.
+ *
+ * A table belongs to exactly one lane, and each lane's queue is first in, first out,
+ * so the messages of any one table reach the producer in the order in which they
+ * were received. Only messages of tables in different lanes can overtake each other.
+ * Checkpoints count a message as pending from the moment it is queued, so they are
+ * unaffected by the reordering. */
+
+#include "lanes.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int lane_add_tables(lane_set_t lanes, lane_t lane, const char *list);
+bool lane_has_budget(lane_t lane, const bool *sink_attached, int num_sinks);
+void lane_set_error(lane_set_t lanes, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+
+/* Adds a lane, given as name:weight:max_in_flight[:table,table,...]. The lane named
+ * "default" takes every table not listed in another lane, and may not list any
+ * itself. Returns nonzero (with the reason in lanes->error) if the spec is invalid. */
+int lane_set_add(lane_set_t lanes, const char *spec) {
+    if (lanes->num_lanes == LANES_MAX) {
+        lane_set_error(lanes, "too many lanes (at most %d)", LANES_MAX);
+        return EINVAL;
+    }
+
+    char name[64], tables[4096] = "";
+    int weight, max_in_flight, consumed = 0;
+    if (sscanf(spec, "%63[^:]:%d:%d%n", name, &weight, &max_in_flight, &consumed) != 3 ||
+            (spec[consumed] != '\0' && spec[consumed] != ':')) {
+        lane_set_error(lanes, "invalid lane (expected name:weight:max_in_flight[:tables]): %s", spec);
+        return EINVAL;
+    }
+    if (spec[consumed] == ':') {
+        if (strlen(&spec[consumed + 1]) >= sizeof(tables)) {
+            lane_set_error(lanes, "list of tables too long in lane %s", name);
+            return EINVAL;
+        }
+        strcpy(tables, &spec[consumed + 1]);
+    }
+
+    if (weight < 1 || max_in_flight < 0) {
+        lane_set_error(lanes, "invalid lane %s: weight must be at least 1, "
+                "and max_in_flight at least 0", name);
+        return EINVAL;
+    }
+    for (int i = 0; i < lanes->num_lanes; i++) {
+        if (!strcmp(lanes->lanes[i].name, name)) {
+            lane_set_error(lanes, "lane %s defined more than once", name);
+            return EINVAL;
+        }
+    }
+
+    bool is_default = !strcmp(name, LANES_DEFAULT_NAME);
+    if (is_default && tables[0]) {
+        lane_set_error(lanes, "the %s lane takes every table not listed in another lane, "
+                "and cannot list tables itself", LANES_DEFAULT_NAME);
+        return EINVAL;
+    } else if (!is_default && !tables[0]) {
+        lane_set_error(lanes, "lane %s does not list any tables", name);
+        return EINVAL;
+    }
+
+    lane_t lane = &lanes->lanes[lanes->num_lanes];
+    memset(lane, 0, sizeof(*lane));
+    lane->name = strdup(name);
+    lane->weight = weight;
+    lane->max_in_flight = max_in_flight;
+
+    int err = lane_add_tables(lanes, lane, tables);
+    if (err) {
+        free(lane->name);
+        for (int i = 0; i < lane->num_tables; i++) free(lane->tables[i]);
+        free(lane->tables);
+        memset(lane, 0, sizeof(*lane));
+        return err;
+    }
+
+    lanes->num_lanes++;
+    if (is_default) lanes->default_lane = lane;
+    return 0;
+}
+
+/* Adds a comma-separated list of tables to a lane. A table may only be listed in
+ * one lane. */
+int lane_add_tables(lane_set_t lanes, lane_t lane, const char *list) {
+    char *copy = strdup(list), *saveptr, *table;
+    int err = 0;
+
+    for (table = strtok_r(copy, ",", &saveptr); table; table = strtok_r(NULL, ",", &saveptr)) {
+        lane_t other = lane_for_table(lanes, table);
+        if (other && other != lanes->default_lane) {
+            lane_set_error(lanes, "table %s is listed in both lane %s and lane %s",
+                    table, other->name, lane->name);
+            err = EINVAL;
+            break;
+        }
+
+        lane->tables = realloc(lane->tables, (lane->num_tables + 1) * sizeof(char *));
+        lane->tables[lane->num_tables++] = strdup(table);
+    }
+
+    free(copy);
+    return err;
+}
+
+/* Returns the lane of the table with the given name (as in the topic name, i.e.
+ * qualified with the schema unless it is "public"), or the default lane if no
+ * lane lists the table. */
+lane_t lane_for_table(lane_set_t lanes, const char *table_name) {
+    for (int i = 0; i < lanes->num_lanes; i++) {
+        lane_t lane = &lanes->lanes[i];
+        for (int j = 0; j < lane->num_tables; j++) {
+            if (!strcmp(lane->tables[j], table_name)) return lane;
+        }
+    }
+    return lanes->default_lane;
+}
+
+/* Appends a message to the back of a lane's queue. */
+void lane_push(lane_set_t lanes, lane_t lane, void *msg) {
+    if (lane->queue_len == lane->queue_capacity) {
+        int capacity = lane->queue_capacity ? 2 * lane->queue_capacity : 64;
+        void **queue = malloc(capacity * sizeof(void *));
+
+        // Unwrap the ring buffer, so that the oldest message is at index 0
+        for (int i = 0; i < lane->queue_len; i++) {
+            queue[i] = lane->queue[(lane->queue_head + i) % lane->queue_capacity];
+        }
+        free(lane->queue);
+        lane->queue = queue;
+        lane->queue_head = 0;
+        lane->queue_capacity = capacity;
+    }
+
+    lane->queue[(lane->queue_head + lane->queue_len) % lane->queue_capacity] = msg;
+    lane->queue_len++;
+    lanes->queued++;
+}
+
+/* Returns the message at the front of a lane's queue, or NULL if it is empty. */
+void *lane_peek(lane_t lane) {
+    if (lane->queue_len == 0) return NULL;
+    return lane->queue[lane->queue_head];
+}
+
+/* Removes and returns the message at the front of a lane's queue, or returns NULL
+ * if it is empty. */
+void *lane_pop(lane_set_t lanes, lane_t lane) {
+    void *msg = lane_peek(lane);
+    if (!msg) return NULL;
+
+    lane->queue_head = (lane->queue_head + 1) % lane->queue_capacity;
+    lane->queue_len--;
+    lane->messages_sent++;
+    lanes->queued--;
+    return msg;
+}
+
+/* Returns the lane from which the next message should be produced, or NULL if
+ * every lane is either empty or has used up its in-flight budget for one of the
+ * sinks that messages are still written to. Each call uses up one message of the
+ * lane's turn, so the caller must go on to pop a message from it. */
+lane_t lane_set_next(lane_set_t lanes, const bool *sink_attached, int num_sinks) {
+    for (int i = 0; i < lanes->num_lanes; i++) {
+        lane_t lane = &lanes->lanes[lanes->current];
+
+        if (lane->queue_len > 0 && lane_has_budget(lane, sink_attached, num_sinks)) {
+            if (lane->deficit == 0) lane->deficit = lane->weight;
+            lane->deficit--;
+            if (lane->deficit == 0) lanes->current = (lanes->current + 1) % lanes->num_lanes;
+            return lane;
+        }
+
+        lane->deficit = 0;
+        lanes->current = (lanes->current + 1) % lanes->num_lanes;
+    }
+    return NULL;
+}
+
+/* Returns true if the lane may produce another message to every attached sink. */
+bool lane_has_budget(lane_t lane, const bool *sink_attached, int num_sinks) {
+    if (lane->max_in_flight == 0) return true;
+
+    for (int i = 0; i < num_sinks; i++) {
+        if (sink_attached[i] && lane->in_flight[i] >= lane->max_in_flight) return false;
+    }
+    return true;
+}
+
+/* Frees the lanes' configuration and queues. Messages still queued are not freed,
+ * since only the caller knows what they are. */
+void lane_set_clear(lane_set_t lanes) {
+    for (int i = 0; i < lanes->num_lanes; i++) {
+        lane_t lane = &lanes->lanes[i];
+        free(lane->name);
+        for (int j = 0; j < lane->num_tables; j++) free(lane->tables[j]);
+        free(lane->tables);
+        free(lane->queue);
+    }
+    memset(lanes, 0, sizeof(*lanes));
+}
+
+/* Updates the lane set's statically allocated error buffer with a message. */
+void lane_set_error(lane_set_t lanes, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(lanes->error, LANES_ERROR_LEN, fmt, args);
+    va_end(args);
+}
@@ -0,0 +1,51 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LANES_MAX 8
+#define LANES_MAX_SINKS 8
+#define LANES_ERROR_LEN 512
+#define LANES_DEFAULT_NAME "default"
+
+/* A priority class of tables. Row events for the lane's tables wait in its queue,
+ * in the order in which they were received, until the lane has both its turn and
+ * room in its in-flight budget. */
+typedef struct {
+    char *name;                 /* Name of the lane, used in logs and metrics */
+    int weight;                 /* Messages sent per scheduling round, relative to other lanes */
+    int max_in_flight;          /* Per sink limit on unacknowledged messages; 0 = unlimited */
+    char **tables;              /* Names of the tables in this lane */
+    int num_tables;
+    void **queue;               /* Messages waiting to be produced, oldest first */
+    int queue_head;             /* Index of the oldest entry in queue */
+    int queue_len;              /* Number of entries in queue, from queue_head */
+    int queue_capacity;         /* Allocated size of queue */
+    int deficit;                /* Messages the lane may still send in the current round */
+    int in_flight[LANES_MAX_SINKS]; /* Messages produced to each sink but not yet acknowledged */
+    uint64_t messages_sent;     /* Messages taken from the queue to be produced */
+} lane;
+
+typedef lane *lane_t;
+
+typedef struct {
+    lane lanes[LANES_MAX];
+    int num_lanes;
+    lane_t default_lane;        /* Lane for tables that are not listed in any other */
+    int current;                /* Lane whose turn it is */
+    int queued;                 /* Messages waiting in all lanes */
+    char error[LANES_ERROR_LEN];
+} lane_set;
+
+typedef lane_set *lane_set_t;
+
+int lane_set_add(lane_set_t lanes, const char *spec);
+lane_t lane_for_table(lane_set_t lanes, const char *table_name);
+void lane_push(lane_set_t lanes, lane_t lane, void *msg);
+void *lane_peek(lane_t lane);
+void *lane_pop(lane_set_t lanes, lane_t lane);
+lane_t lane_set_next(lane_set_t lanes, const bool *sink_attached, int num_sinks);
+void lane_set_clear(lane_set_t lanes);
+
+#endif /* LANES_H */
@@ -1,27 +1,371 @@
+/* Log output for the bottledwater process. Until logger_start() is called, lines
+ * are written to stderr straight away. After that, logging only formats the line
+ * into a ring buffer, and a background thread writes it out, so that a burst of
+ * log messages (for example, a delivery error for every message in flight during
+ * a broker outage) does not hold up replication. If the ring buffer is full, the
+ * message is dropped and counted rather than waiting for space.
+ *
+ * The ring buffer is a bounded queue in which each slot carries a sequence
+ * number: a producer claims a slot by advancing enqueue_pos with compare-and-swap,
+ * fills it, and publishes it by setting the slot's sequence number; the writer
+ * thread frees it again after writing it out. The queue takes no locks, and it is
+ * safe to log from any thread.
+ *
+ * Each call site (identified by its file and line) may also log at most
+ * LOG_RATE_BURST debug, info or warning lines per second. Lines beyond that are
+ * counted, and the writer thread reports how many were suppressed. The counts are
+ * kept under a mutex, which is only contended if several threads log at once.
+ * Errors are never suppressed, though they may still be dropped if the ring buffer
+ * is full. Fatal messages bypass the ring buffer: once everything logged before
+ * them has been written out, they are written to stderr directly. */
+
 #include "logger.h"
 
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* Number of slots in the ring buffer; must be a power of two */
+#define LOG_RING_SIZE 1024
+/* Longest message kept; longer ones are truncated */
+#define LOG_MESSAGE_MAX 1024
+/* How long the writer thread sleeps when there is nothing to write */
+#define LOG_IDLE_MSEC 10
+/* Lines that one call site may log per second before being suppressed */
+#define LOG_RATE_BURST 10
+/* Number of call sites that are rate limited; further ones are not */
+#define LOG_MAX_SITES 256
+
+typedef struct {
+    uint64_t seq;               /* Equal to the position of the slot when it is free */
+    log_level level;
+    int64_t time_usec;          /* When the message was logged */
+    char message[LOG_MESSAGE_MAX];
+} log_slot;
+
+typedef struct {
+    const char *file;           /* Source file of the call site, or NULL if unused */
+    int line;                   /* Line of the call site in that file */
+    const char *fmt;            /* Format string last logged from the call site */
+    int64_t window_start;       /* Start of the current one-second window */
+    int count;                  /* Lines logged in the current window */
+    int suppressed;             /* Lines suppressed and not yet reported */
+} log_site;
+
+static log_slot ring[LOG_RING_SIZE];
+static uint64_t enqueue_pos;    /* Next position to be claimed by a producer */
+static uint64_t dequeue_pos;    /* Next position to be written out */
+static uint64_t written_pos;    /* Positions before this one have reached stderr */
+static uint64_t dropped;        /* Messages dropped because the ring buffer was full */
 
+static log_site sites[LOG_MAX_SITES];
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static log_format output_format = LOG_FORMAT_TEXT;
+static bool started = false;
+static bool stopping = false;
+static pthread_t writer_thread;
+
+static const char *level_name(log_level level);
+static int64_t log_now(void);
+static void log_write(log_level level, int64_t now, const char *fmt, va_list args)
+    __attribute__ ((format (printf, 3, 0)));
+static bool log_rate_limited(const char *file, int line, const char *fmt, int64_t now);
+static bool log_enqueue(log_level level, int64_t now, const char *fmt, va_list args)
+    __attribute__ ((format (printf, 3, 0)));
+static int log_dequeue(char *buf, size_t size);
+static int log_report_suppressed(char *buf, size_t size);
+static int format_line(char *buf, size_t size, log_level level, int64_t time_usec, const char *message);
+static void *log_writer_main(void *arg);
+static void log_flush(void);
+
+
+/* Sets how log lines are formatted. Must be called before logger_start(). */
+void logger_set_format(log_format format) {
+    output_format = format;
+}
+
+/* Starts the background writer thread. From now on, logging does not block. The
+ * remaining messages are written out when the process exits. */
+void logger_start() {
+    if (started) return;
+
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) ring[i].seq = i;
+
+    // The writer thread inherits a mask that blocks all signals, so that signals
+    // go to the main thread, whose select() and polls they are meant to interrupt.
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    int err = pthread_create(&writer_thread, NULL, log_writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (err) {
+        log_warn("Could not start log writer thread, logging synchronously");
+        return;
+    }
+    __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+    atexit(logger_stop);
+}
+
+/* Writes out any messages still in the ring buffer, and stops the writer thread. */
+void logger_stop() {
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) return;
+
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    __atomic_store_n(&started, false, __ATOMIC_RELEASE);
+}
 
-void daemon_log(log_level level, const char *fmt, ...) {
+void daemon_log(log_level level, const char *file, int line, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    vdaemon_log(level, fmt, args);
+    vdaemon_log(level, file, line, fmt, args);
     va_end(args);
 }
 
-void vdaemon_log(log_level level, const char *fmt, va_list args) {
-    const char *level_str=NULL;
+void vdaemon_log(log_level level, const char *file, int line, const char *fmt, va_list args) {
+    int64_t now = log_now();
+
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+        log_write(level, now, fmt, args);
+        return;
+    }
+
+    /* The process is about to exit, so make sure the reason gets out, after
+     * whatever led up to it, even if the ring buffer is full */
+    if (level == LOG_LEVEL_FATAL) {
+        log_flush();
+        log_write(level, now, fmt, args);
+        return;
+    }
+
+    if (level < LOG_LEVEL_ERROR && log_rate_limited(file, line, fmt, now)) return;
+
+    if (!log_enqueue(level, now, fmt, args)) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+static const char *level_name(log_level level) {
     switch (level) {
-        case LOG_LEVEL_DEBUG: level_str = "DEBUG"; break;
-        case LOG_LEVEL_INFO: level_str = "INFO"; break;
-        case LOG_LEVEL_WARN: level_str = "WARN"; break;
-        case LOG_LEVEL_ERROR: level_str = "ERROR"; break;
-        case LOG_LEVEL_FATAL: level_str = "FATAL"; break;
+        case LOG_LEVEL_DEBUG: return "DEBUG";
+        case LOG_LEVEL_INFO: return "INFO";
+        case LOG_LEVEL_WARN: return "WARN";
+        case LOG_LEVEL_ERROR: return "ERROR";
+        case LOG_LEVEL_FATAL: return "FATAL";
     }
+    return NULL;
+}
 
-    fprintf(stderr, "[%s] ", level_str);
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+/* Wall clock time in microseconds since the epoch. */
+static int64_t log_now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Formats a line and writes it to stderr straight away. */
+static void log_write(log_level level, int64_t now, const char *fmt, va_list args) {
+    char message[LOG_MESSAGE_MAX], line[2 * LOG_MESSAGE_MAX];
+    vsnprintf(message, sizeof(message), fmt, args);
+    int len = format_line(line, sizeof(line), level, now, message);
+    fwrite(line, 1, len, stderr);
+    fflush(stderr);
+}
+
+/* Returns true if the call site at the given file and line has already used up
+ * its lines for the current second, and counts the line as suppressed. */
+static bool log_rate_limited(const char *file, int line, const char *fmt, int64_t now) {
+    bool limited = false;
+    size_t start = (((uintptr_t) file >> 3) * 31 + line) % LOG_MAX_SITES;
+
+    pthread_mutex_lock(&sites_lock);
+    for (size_t i = 0; i < LOG_MAX_SITES; i++) {
+        log_site *site = &sites[(start + i) % LOG_MAX_SITES];
+        if (site->file && (site->line != line || strcmp(site->file, file) != 0)) continue;
+
+        if (!site->file || now - site->window_start >= 1000000) {
+            site->file = file;
+            site->line = line;
+            site->window_start = now;
+            site->count = 0;
+        }
+        site->fmt = fmt;
+        if (site->count < LOG_RATE_BURST) {
+            site->count++;
+        } else {
+            site->suppressed++;
+            limited = true;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&sites_lock);
+    return limited;
+}
+
+/* Formats a message into a free slot of the ring buffer. Returns false if there
+ * is none. */
+static bool log_enqueue(log_level level, int64_t now, const char *fmt, va_list args) {
+    uint64_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    log_slot *slot;
+
+    while (true) {
+        slot = &ring[pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t) __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t) pos;
+
+        if (diff == 0) {
+            // The slot is free; try to claim it. On failure, pos is updated.
+            if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return false; // The writer has not yet freed this slot, so the buffer is full
+        } else {
+            pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = level;
+    slot->time_usec = now;
+    vsnprintf(slot->message, LOG_MESSAGE_MAX, fmt, args);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Formats the oldest message in the ring buffer as a line into buf, and frees its
+ * slot. Returns the length of the line, or 0 if there was no message. */
+static int log_dequeue(char *buf, size_t size) {
+    log_slot *slot = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != dequeue_pos + 1) return 0;
+
+    int len = format_line(buf, size, slot->level, slot->time_usec, slot->message);
+    __atomic_store_n(&slot->seq, dequeue_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&dequeue_pos, dequeue_pos + 1, __ATOMIC_RELEASE);
+    return len;
+}
+
+/* Formats lines saying how many messages were suppressed or dropped since the
+ * last report into buf, and returns their length. */
+static int log_report_suppressed(char *buf, size_t size) {
+    char message[LOG_MESSAGE_MAX];
+    int len = 0;
+    int64_t now = log_now();
+
+    pthread_mutex_lock(&sites_lock);
+    for (int i = 0; i < LOG_MAX_SITES && size - len > 2 * LOG_MESSAGE_MAX; i++) {
+        log_site *site = &sites[i];
+        if (!site->file || site->suppressed == 0) continue;
+
+        snprintf(message, sizeof(message), "Suppressed %d more messages from %s:%d like: %s",
+                 site->suppressed, site->file, site->line, site->fmt);
+        len += format_line(buf + len, size - len, LOG_LEVEL_WARN, now, message);
+        site->suppressed = 0;
+    }
+    pthread_mutex_unlock(&sites_lock);
+
+    uint64_t num_dropped = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (num_dropped > 0 && size - len > 2 * LOG_MESSAGE_MAX) {
+        snprintf(message, sizeof(message), "Dropped %" PRIu64 " log messages because the "
+                 "log buffer was full", num_dropped);
+        len += format_line(buf + len, size - len, LOG_LEVEL_WARN, now, message);
+    }
+    return len;
+}
+
+/* Formats one line of output, including the newline, and returns its length. In
+ * the text format, this is just the level and the message, as always; in the JSON
+ * format, it is an object with the time, level and message. */
+static int format_line(char *buf, size_t size, log_level level, int64_t time_usec, const char *message) {
+    size_t len = 0;
+
+    if (output_format == LOG_FORMAT_TEXT) {
+        len = snprintf(buf, size, "[%s] %s\n", level_name(level), message);
+        return len < size ? len : size - 1;
+    }
+
+    char timestamp[32];
+    time_t secs = time_usec / 1000000;
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    len = snprintf(buf, size, "{\"time\":\"%s.%03dZ\",\"level\":\"%s\",\"message\":\"",
+                   timestamp, (int) (time_usec % 1000000 / 1000), level_name(level));
+
+    // Leave room for the escape sequence of one character, and the closing characters
+    for (const char *c = message; *c && len + 10 < size; c++) {
+        switch (*c) {
+            case '"':  len += sprintf(buf + len, "\\\""); break;
+            case '\\': len += sprintf(buf + len, "\\\\"); break;
+            case '\n': len += sprintf(buf + len, "\\n"); break;
+            case '\r': len += sprintf(buf + len, "\\r"); break;
+            case '\t': len += sprintf(buf + len, "\\t"); break;
+            default:
+                if ((unsigned char) *c < 0x20) {
+                    len += sprintf(buf + len, "\\u%04x", (unsigned char) *c);
+                } else {
+                    buf[len++] = *c;
+                }
+        }
+    }
+    len += sprintf(buf + len, "\"}\n");
+    return len;
+}
+
+/* Body of the writer thread. Collects as many lines as are waiting into one buffer,
+ * and writes them to stderr with a single call. Reports suppressed and dropped
+ * messages about once a second. */
+static void *log_writer_main(void *arg) {
+    static char buf[64 * LOG_MESSAGE_MAX];
+    int64_t last_report = log_now();
+
+    while (true) {
+        bool stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        size_t len = 0;
+        int line_len;
+
+        while (sizeof(buf) - len > 2 * LOG_MESSAGE_MAX &&
+                (line_len = log_dequeue(buf + len, sizeof(buf) - len)) > 0) {
+            len += line_len;
+        }
+
+        int64_t now = log_now();
+        if (stop || now - last_report >= 1000000) {
+            len += log_report_suppressed(buf + len, sizeof(buf) - len);
+            last_report = now;
+        }
+
+        if (len > 0) {
+            fwrite(buf, 1, len, stderr);
+            __atomic_store_n(&written_pos, __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED),
+                             __ATOMIC_RELEASE);
+            continue;
+        }
+        if (stop) break;
+
+        struct timespec idle = { 0, LOG_IDLE_MSEC * 1000000 };
+        nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+/* Waits (for up to a second) until the writer thread has written out everything
+ * logged so far. */
+static void log_flush() {
+    uint64_t target = __atomic_load_n(&enqueue_pos, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < 1000; i++) {
+        if (__atomic_load_n(&written_pos, __ATOMIC_ACQUIRE) >= target) return;
+        struct timespec wait = { 0, 1000000 };
+        nanosleep(&wait, NULL);
+    }
 }
@@ -12,25 +12,37 @@ typedef enum log_level {
   LOG_LEVEL_FATAL
 } log_level;
 
-void daemon_log(log_level level, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
-void vdaemon_log(log_level level, const char *fmt, va_list args) __attribute__ ((format (printf, 2, 0)));
+typedef enum log_format {
+  LOG_FORMAT_TEXT,                /* "[LEVEL] message" */
+  LOG_FORMAT_JSON                 /* One JSON object per line, with time, level and message */
+} log_format;
+
+void logger_set_format(log_format format);
+void logger_start(void);
+void logger_stop(void);
+/* file and line identify the call site, for rate limiting; the macros below fill
+ * them in. */
+void daemon_log(log_level level, const char *file, int line, const char *fmt, ...)
+    __attribute__ ((format (printf, 4, 5)));
+void vdaemon_log(log_level level, const char *file, int line, const char *fmt, va_list args)
+    __attribute__ ((format (printf, 4, 0)));
 
 #ifdef DEBUG
-#define log_debug(...) daemon_log(LOG_LEVEL_DEBUG, __VA_ARGS__)
-#define vlog_debug(args) vdaemon_log(LOG_LEVEL_DEBUG, (args))
+#define log_debug(...) daemon_log(LOG_LEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#define vlog_debug(...) vdaemon_log(LOG_LEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
 #else
 #define log_debug(...)
-#define vlog_debug(args)
+#define vlog_debug(...)
 #endif
 
-#define log_info(...) daemon_log(LOG_LEVEL_INFO, __VA_ARGS__)
-#define vlog_info(args) vdaemon_log(LOG_LEVEL_INFO, (args))
-#define log_warn(...) daemon_log(LOG_LEVEL_WARN, __VA_ARGS__)
-#define vlog_warn(args) vdaemon_log(LOG_LEVEL_WARN, (args))
-#define log_error(...) daemon_log(LOG_LEVEL_ERROR, __VA_ARGS__)
-#define vlog_error(...) vdaemon_log(LOG_LEVEL_ERROR, __VA_ARGS__)
-#define log_fatal(...) daemon_log(LOG_LEVEL_FATAL, __VA_ARGS__)
-#define vlog_fatal(...) vdaemon_log(LOG_LEVEL_FATAL, __VA_ARGS__)
+#define log_info(...) daemon_log(LOG_LEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
+#define vlog_info(...) vdaemon_log(LOG_LEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
+#define log_warn(...) daemon_log(LOG_LEVEL_WARN, __FILE__, __LINE__, __VA_ARGS__)
+#define vlog_warn(...) vdaemon_log(LOG_LEVEL_WARN, __FILE__, __LINE__, __VA_ARGS__)
+#define log_error(...) daemon_log(LOG_LEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
+#define vlog_error(...) vdaemon_log(LOG_LEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
+#define log_fatal(...) daemon_log(LOG_LEVEL_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+#define vlog_fatal(...) vdaemon_log(LOG_LEVEL_FATAL, __FILE__, __LINE__, __VA_ARGS__)
 
 
 #endif /* LOGGER_H */
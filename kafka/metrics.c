@@ -0,0 +1,238 @@
+/* Exposes counters and histograms about the pipeline over HTTP, in the text
+ * format understood by Prometheus:
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
+ *
+ * The server is deliberately minimal. It runs on the main thread: the listening
+ * socket is non-blocking, and is polled from the main loop (and while applying
+ * backpressure), so there are no locks around the counters it reports. Each
+ * connection gets the current metrics, whatever the request path, and is then
+ * closed. Scrapes are infrequent and responses small, so briefly blocking while
+ * answering one does not noticeably hold up replication; to keep it that way
+ * when many connections arrive at once, each poll answers at most
+ * METRICS_ACCEPTS_PER_POLL of them, and the rest wait for the next poll. */
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* How long we wait for a scraper to send its request, or to accept our response. */
+#define METRICS_IO_TIMEOUT_MSEC 100
+
+/* How many connections one call of metrics_server_poll() answers at most. */
+#define METRICS_ACCEPTS_PER_POLL 1
+
+/* Bucket upper bounds in microseconds, from 100us to 10s. */
+static const int64_t histogram_bounds[METRICS_HISTOGRAM_BUCKETS] = {
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000
+};
+
+void metrics_server_error(metrics_server_t server, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void metrics_server_respond(metrics_server_t server, int fd);
+
+
+/* Creates a metrics server that is not yet listening. The render callback is
+ * invoked with cb_context for every scrape. */
+metrics_server_t metrics_server_new(metrics_render_cb render, void *cb_context) {
+    metrics_server_t server = malloc(sizeof(metrics_server)); if(server == NULL) return NULL;
+    memset(server, 0, sizeof(metrics_server));
+    server->listen_fd = -1;
+    server->render = render;
+    server->cb_context = cb_context;
+    return server;
+}
+
+/* Starts accepting connections on the given TCP port, on the interface with the
+ * given address (a host name, or an IPv4 or IPv6 address), or on all interfaces
+ * if address is NULL. Returns 0 on success. On failure, sets server->error and
+ * returns an errno code. */
+int metrics_server_listen(metrics_server_t server, const char *address, int port) {
+    struct addrinfo hints, *addrs;
+    char port_str[8];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = address ? AF_UNSPEC : AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    int ret = getaddrinfo(address, port_str, &hints, &addrs);
+    if (ret != 0) {
+        metrics_server_error(server, "Could not resolve metrics address %s: %s",
+                address, gai_strerror(ret));
+        return EINVAL;
+    }
+
+    int fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+    if (fd < 0) {
+        metrics_server_error(server, "Could not create socket: %s", strerror(errno));
+        freeaddrinfo(addrs);
+        return errno;
+    }
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (bind(fd, addrs->ai_addr, addrs->ai_addrlen) < 0 || listen(fd, 8) < 0 ||
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        int err = errno;
+        metrics_server_error(server, "Could not listen on %s port %d: %s",
+                address ? address : "all interfaces", port, strerror(err));
+        freeaddrinfo(addrs);
+        close(fd);
+        return err;
+    }
+
+    freeaddrinfo(addrs);
+    server->listen_fd = fd;
+    return 0;
+}
+
+/* Answers up to METRICS_ACCEPTS_PER_POLL scrape requests that are waiting to be
+ * accepted, without blocking if there are none. Returns 0 on success, or an errno
+ * code if the listening socket failed (in which case server->error is set). */
+int metrics_server_poll(metrics_server_t server) {
+    if (server->listen_fd < 0) return 0;
+
+    for (int i = 0; i < METRICS_ACCEPTS_PER_POLL; i++) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                    errno == ECONNABORTED) {
+                return 0;
+            }
+            metrics_server_error(server, "Could not accept connection: %s", strerror(errno));
+            return errno;
+        }
+
+        metrics_server_respond(server, fd);
+        close(fd);
+    }
+    return 0;
+}
+
+/* Reads (and ignores) the request, then writes the current metrics to the
+ * connection. Failures only affect this one scrape, so they are not reported. */
+void metrics_server_respond(metrics_server_t server, int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, METRICS_IO_TIMEOUT_MSEC) <= 0) return;
+
+    char request[1024];
+    if (recv(fd, request, sizeof(request), 0) <= 0) return;
+
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = METRICS_IO_TIMEOUT_MSEC * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    PQExpBuffer body = createPQExpBuffer();
+    server->render(server->cb_context, body);
+
+    PQExpBuffer response = createPQExpBuffer();
+    appendPQExpBuffer(response,
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", body->len);
+    appendBinaryPQExpBuffer(response, body->data, body->len);
+
+    size_t sent = 0;
+    while (sent < response->len) {
+        ssize_t n = send(fd, response->data + sent, response->len - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+
+    destroyPQExpBuffer(response);
+    destroyPQExpBuffer(body);
+}
+
+void metrics_server_free(metrics_server_t server) {
+    if (server->listen_fd >= 0) close(server->listen_fd);
+    free(server);
+}
+
+
+/* Returns a monotonic timestamp in microseconds, for measuring durations. */
+int64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Records one observation (e.g. a latency) in a histogram. */
+void metrics_histogram_observe(metrics_histogram *hist, int64_t usecs) {
+    int bucket = 0;
+    while (bucket < METRICS_HISTOGRAM_BUCKETS && usecs > histogram_bounds[bucket]) bucket++;
+
+    hist->counts[bucket]++;
+    hist->count++;
+    hist->sum += usecs;
+}
+
+/* Writes the HELP and TYPE lines that precede the samples of a metric. */
+void metrics_header(PQExpBuffer out, const char *name, const char *type, const char *help) {
+    appendPQExpBuffer(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Writes one sample. labels is either NULL, or a comma-separated list of
+ * label="value" pairs without the surrounding braces. */
+void metrics_sample(PQExpBuffer out, const char *name, const char *labels, double value) {
+    if (labels && labels[0]) {
+        appendPQExpBuffer(out, "%s{%s} %.15g\n", name, labels, value);
+    } else {
+        appendPQExpBuffer(out, "%s %.15g\n", name, value);
+    }
+}
+
+/* Writes the cumulative buckets, sum and count of a histogram. Observations are
+ * recorded in microseconds but reported in seconds, as Prometheus expects. */
+void metrics_histogram_render(PQExpBuffer out, const char *name, const char *labels,
+        metrics_histogram *hist) {
+    const char *sep = (labels && labels[0]) ? "," : "";
+    if (!labels) labels = "";
+
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= METRICS_HISTOGRAM_BUCKETS; i++) {
+        cumulative += hist->counts[i];
+        if (i < METRICS_HISTOGRAM_BUCKETS) {
+            appendPQExpBuffer(out, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n",
+                    name, labels, sep, histogram_bounds[i] / 1000000.0, cumulative);
+        } else {
+            appendPQExpBuffer(out, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n",
+                    name, labels, sep, cumulative);
+        }
+    }
+
+    PQExpBuffer suffixed = createPQExpBuffer();
+    appendPQExpBuffer(suffixed, "%s_sum", name);
+    metrics_sample(out, suffixed->data, labels, hist->sum / 1000000.0);
+    resetPQExpBuffer(suffixed);
+    appendPQExpBuffer(suffixed, "%s_count", name);
+    metrics_sample(out, suffixed->data, labels, (double) hist->count);
+    destroyPQExpBuffer(suffixed);
+}
+
+
+/* Updates the server's statically allocated error buffer with a message. */
+void metrics_server_error(metrics_server_t server, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(server->error, METRICS_SERVER_ERROR_LEN, fmt, args);
+    va_end(args);
+}
@@ -0,0 +1,45 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <postgres_fe.h>
+#include <internal/pqexpbuffer.h>
+
+#define METRICS_SERVER_ERROR_LEN 512
+
+/* Upper bounds of the histogram buckets, in microseconds; see metrics.c. The
+ * last bucket (+Inf) is implicit. */
+#define METRICS_HISTOGRAM_BUCKETS 16
+
+typedef struct {
+    uint64_t counts[METRICS_HISTOGRAM_BUCKETS + 1]; /* Non-cumulative count per bucket, last is +Inf */
+    uint64_t count;                                 /* Total number of observations */
+    int64_t sum;                                    /* Sum of all observations, in microseconds */
+} metrics_histogram;
+
+/* Called when a scrape request arrives, to append the current metrics in the
+ * Prometheus text exposition format to the buffer. */
+typedef void (*metrics_render_cb)(void *cb_context, PQExpBuffer out);
+
+typedef struct {
+    int listen_fd;                          /* Non-blocking listening socket */
+    metrics_render_cb render;               /* Produces the response body */
+    void *cb_context;                       /* Passed to render */
+    char error[METRICS_SERVER_ERROR_LEN];   /* Buffer for error messages */
+} metrics_server;
+
+typedef metrics_server *metrics_server_t;
+
+metrics_server_t metrics_server_new(metrics_render_cb render, void *cb_context);
+int metrics_server_listen(metrics_server_t server, const char *address, int port);
+int metrics_server_poll(metrics_server_t server);
+void metrics_server_free(metrics_server_t server);
+
+int64_t metrics_now(void);
+void metrics_histogram_observe(metrics_histogram *hist, int64_t usecs);
+void metrics_header(PQExpBuffer out, const char *name, const char *type, const char *help);
+void metrics_sample(PQExpBuffer out, const char *name, const char *labels, double value);
+void metrics_histogram_render(PQExpBuffer out, const char *name, const char *labels,
+        metrics_histogram *hist);
+
+#endif /* METRICS_H */
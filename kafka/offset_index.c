@@ -0,0 +1,251 @@
+/* Index of the Kafka offsets at which each point in a replication slot's history
+ * can be found, so that consumers and operators can seek to a given LSN or commit
+ * time without scanning whole topics.
+ *
+ * The offsets come from delivery reports (produce.offset.report). Messages are
+ * produced in commit order, so within a partition, the offsets of a transaction's
+ * messages come after those of every transaction committed before it. Once a
+ * transaction is checkpointed, the last offset delivered from it or any earlier
+ * transaction in each partition is where its changes end. As delivery reports of
+ * later transactions may already have arrived by then, offsets are kept per
+ * transaction until the transaction is checkpointed.
+ *
+ * At most every interval, after a checkpoint, a record is written to the index
+ * topic. Its key is the slot name and commit LSN, so that the records written again
+ * after a restart replace the earlier ones if the topic is compacted. Its value
+ * is JSON:
+ *
+ *   {"slot": "...", "commit_lsn": "16/B374D848", "commit_time": "2026-...Z",
+ *    "offsets": [{"topic": "...", "partition": 0, "last_offset": 1234}, ...]}
+ *
+ * Every partition that has had messages delivered since the process started is
+ * included, so each record stands on its own. */
+
+#include "offset_index.h"
+
+#include <postgres_fe.h>
+#include <datatype/timestamp.h>
+#include <internal/pqexpbuffer.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FNV32_OFFSET_BASIS 2166136261u
+#define FNV32_PRIME 16777619u
+
+offset_index_partition *offset_index_partition_get(offset_index_t index, const char *topic,
+        int32_t partition);
+void offset_index_grow(offset_index_t index);
+uint32_t offset_index_hash(const char *topic, int32_t partition);
+void offset_index_partition_advance(offset_index_partition *part, uint64_t checkpoint_seq);
+int offset_index_write(offset_index_t index);
+
+
+/* Creates an index that writes records about the given slot to topic_name, using
+ * the given Kafka producer, at most every interval_secs seconds. Returns NULL if the
+ * topic cannot be created. */
+offset_index_t offset_index_new(rd_kafka_t *kafka, const char *topic_name,
+        rd_kafka_topic_conf_t *topic_conf, const char *slot_name, int interval_secs) {
+    rd_kafka_topic_t *topic = rd_kafka_topic_new(kafka, topic_name, rd_kafka_topic_conf_dup(topic_conf));
+    if (!topic) return NULL;
+
+    offset_index_t index = malloc(sizeof(offset_index));
+    if (!index) {
+        rd_kafka_topic_destroy(topic);
+        return NULL;
+    }
+    memset(index, 0, sizeof(offset_index));
+    index->topic = topic;
+    index->slot_name = strdup(slot_name);
+    index->interval = (int64_t) interval_secs * USECS_PER_SEC;
+    index->capacity = 64;
+    index->partitions = calloc(index->capacity, sizeof(offset_index_partition));
+    return index;
+}
+
+/* Called with each successful delivery report: records that the message from the
+ * transaction with the given sequence number is at the given offset. */
+void offset_index_delivered(offset_index_t index, const char *topic, int32_t partition,
+        int64_t offset, uint64_t xact_seq) {
+    offset_index_partition *part = offset_index_partition_get(index, topic, partition);
+
+    // Clear out transactions checkpointed since, so that the list stays short
+    offset_index_partition_advance(part, index->checkpoint_seq);
+
+    if (xact_seq <= index->checkpoint_seq) {
+        // Can only happen if the transaction was checkpointed without waiting for
+        // this sink (see --sink-detach-lag)
+        if (offset > part->last_offset) part->last_offset = offset;
+        return;
+    }
+
+    if (part->num_pending > 0) {
+        offset_index_pending *last = &part->pending[part->pending_head + part->num_pending - 1];
+        if (last->xact_seq == xact_seq) {
+            if (offset > last->offset) last->offset = offset;
+            return;
+        }
+    }
+
+    if (part->pending_head + part->num_pending == part->pending_capacity) {
+        if (part->pending_head > 0) {
+            memmove(part->pending, &part->pending[part->pending_head],
+                    part->num_pending * sizeof(offset_index_pending));
+            part->pending_head = 0;
+        } else {
+            part->pending_capacity = part->pending_capacity ? 2 * part->pending_capacity : 4;
+            part->pending = realloc(part->pending, part->pending_capacity * sizeof(offset_index_pending));
+        }
+    }
+
+    offset_index_pending *entry = &part->pending[part->pending_head + part->num_pending++];
+    entry->xact_seq = xact_seq;
+    entry->offset = offset;
+}
+
+/* Called when the transaction with the given sequence number, commit LSN and commit
+ * time has been checkpointed. Writes an index record if one is due, and returns
+ * nonzero if that fails (with the reason in index->error). */
+int offset_index_checkpoint(offset_index_t index, uint64_t xact_seq, uint64_t commit_lsn,
+        int64_t commit_time, int64_t now) {
+    index->checkpoint_seq = xact_seq;
+    index->checkpoint_lsn = commit_lsn;
+    index->checkpoint_time = commit_time;
+
+    if (now - index->last_written < index->interval) return 0;
+    if (index->checkpoint_lsn == index->written_lsn) return 0;
+
+    index->last_written = now;
+    return offset_index_write(index);
+}
+
+void offset_index_free(offset_index_t index) {
+    for (int i = 0; i < index->capacity; i++) {
+        free(index->partitions[i].topic);
+        free(index->partitions[i].pending);
+    }
+    free(index->partitions);
+    rd_kafka_topic_destroy(index->topic);
+    free(index->slot_name);
+    free(index);
+}
+
+
+/* Returns the hash table entry for the given partition, creating it if needed. */
+offset_index_partition *offset_index_partition_get(offset_index_t index, const char *topic,
+        int32_t partition) {
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = offset_index_hash(topic, partition) & mask;
+
+    while (index->partitions[i].topic) {
+        offset_index_partition *part = &index->partitions[i];
+        if (part->partition == partition && !strcmp(part->topic, topic)) return part;
+        i = (i + 1) & mask;
+    }
+
+    if (2 * (index->num_partitions + 1) > index->capacity) {
+        offset_index_grow(index);
+        return offset_index_partition_get(index, topic, partition);
+    }
+
+    offset_index_partition *part = &index->partitions[i];
+    part->topic = strdup(topic);
+    part->partition = partition;
+    part->last_offset = -1;
+    index->num_partitions++;
+    return part;
+}
+
+/* Doubles the size of the hash table. */
+void offset_index_grow(offset_index_t index) {
+    offset_index_partition *old = index->partitions;
+    int old_capacity = index->capacity;
+
+    index->capacity *= 2;
+    index->partitions = calloc(index->capacity, sizeof(offset_index_partition));
+    uint32_t mask = index->capacity - 1;
+
+    for (int j = 0; j < old_capacity; j++) {
+        if (!old[j].topic) continue;
+        uint32_t i = offset_index_hash(old[j].topic, old[j].partition) & mask;
+        while (index->partitions[i].topic) i = (i + 1) & mask;
+        index->partitions[i] = old[j];
+    }
+    free(old);
+}
+
+/* FNV-1a of the topic name and partition number. */
+uint32_t offset_index_hash(const char *topic, int32_t partition) {
+    uint32_t hash = FNV32_OFFSET_BASIS;
+    for (const char *c = topic; *c; c++) {
+        hash = (hash ^ (unsigned char) *c) * FNV32_PRIME;
+    }
+    return (hash ^ (uint32_t) partition) * FNV32_PRIME;
+}
+
+/* Folds the offsets of transactions up to checkpoint_seq into last_offset. */
+void offset_index_partition_advance(offset_index_partition *part, uint64_t checkpoint_seq) {
+    while (part->num_pending > 0 && part->pending[part->pending_head].xact_seq <= checkpoint_seq) {
+        offset_index_pending *entry = &part->pending[part->pending_head];
+        if (entry->offset > part->last_offset) part->last_offset = entry->offset;
+        part->pending_head++;
+        part->num_pending--;
+    }
+    if (part->num_pending == 0) part->pending_head = 0;
+}
+
+/* Produces an index record for the last checkpoint. Delivery reports for it are
+ * ignored by on_deliver_msg(), since it has no message envelope. */
+int offset_index_write(offset_index_t index) {
+    PQExpBuffer key = createPQExpBuffer(), value = createPQExpBuffer();
+    uint32 lsn_hi = (uint32) (index->checkpoint_lsn >> 32), lsn_lo = (uint32) index->checkpoint_lsn;
+
+    // Zero-padded, so that keys sort in LSN order
+    appendPQExpBuffer(key, "%s/%08X%08X", index->slot_name, lsn_hi, lsn_lo);
+
+    appendPQExpBuffer(value, "{\"slot\":\"%s\",\"commit_lsn\":\"%X/%X\",\"commit_time\":",
+                      index->slot_name, lsn_hi, lsn_lo);
+    if (index->checkpoint_time) {
+        char timestamp[32];
+        int64_t unix_usecs = index->checkpoint_time +
+            (int64_t) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC;
+        time_t secs = unix_usecs / USECS_PER_SEC;
+        struct tm tm;
+        gmtime_r(&secs, &tm);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        appendPQExpBuffer(value, "\"%s.%06dZ\"", timestamp, (int) (unix_usecs % USECS_PER_SEC));
+    } else {
+        appendPQExpBufferStr(value, "null");
+    }
+
+    appendPQExpBufferStr(value, ",\"offsets\":[");
+    bool first = true;
+    for (int i = 0; i < index->capacity; i++) {
+        offset_index_partition *part = &index->partitions[i];
+        if (!part->topic) continue;
+
+        offset_index_partition_advance(part, index->checkpoint_seq);
+        if (part->last_offset < 0) continue;
+
+        appendPQExpBuffer(value, "%s{\"topic\":\"%s\",\"partition\":%d,\"last_offset\":%lld}",
+                          first ? "" : ",", part->topic, part->partition,
+                          (long long) part->last_offset);
+        first = false;
+    }
+    appendPQExpBufferStr(value, "]}");
+
+    int err = rd_kafka_produce(index->topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_COPY,
+            value->data, value->len, key->data, key->len, NULL);
+    if (err) {
+        snprintf(index->error, OFFSET_INDEX_ERROR_LEN, "Could not write to offset index topic %s: %s",
+                 rd_kafka_topic_name(index->topic), rd_kafka_err2str(rd_kafka_errno2err(errno)));
+    } else {
+        index->written_lsn = index->checkpoint_lsn;
+        index->records_written++;
+    }
+
+    destroyPQExpBuffer(key);
+    destroyPQExpBuffer(value);
+    return err;
+}
@@ -0,0 +1,51 @@
+#ifndef OFFSET_INDEX_H
+#define OFFSET_INDEX_H
+
+#include <librdkafka/rdkafka.h>
+#include <stdint.h>
+
+#define OFFSET_INDEX_ERROR_LEN 512
+
+/* Offsets delivered to a partition from a transaction that is not yet checkpointed */
+typedef struct {
+    uint64_t xact_seq;          /* Sequence number of the transaction within its stream */
+    int64_t offset;             /* Last offset delivered from that transaction */
+} offset_index_pending;
+
+typedef struct {
+    char *topic;                /* Name of the topic, or NULL if this hash table slot is free */
+    int32_t partition;
+    int64_t last_offset;        /* Last offset of a message from a checkpointed transaction, or -1 */
+    offset_index_pending *pending; /* Offsets of later transactions, oldest first */
+    int pending_head;           /* Index of the oldest entry in pending */
+    int num_pending;            /* Number of entries in pending, from pending_head */
+    int pending_capacity;       /* Allocated size of pending */
+} offset_index_partition;
+
+typedef struct {
+    rd_kafka_topic_t *topic;    /* Topic to which index records are written */
+    char *slot_name;            /* Replication slot whose progress is indexed */
+    int64_t interval;           /* Microseconds between index records */
+    int64_t last_written;       /* metrics_now() when the last record was written */
+    uint64_t checkpoint_seq;    /* Sequence number of the last checkpointed transaction */
+    uint64_t checkpoint_lsn;    /* Its commit LSN, or 0 if nothing has been checkpointed */
+    int64_t checkpoint_time;    /* Its commit time (microseconds since the Postgres epoch), or 0 */
+    uint64_t written_lsn;       /* checkpoint_lsn as of the last record written */
+    int num_partitions;         /* Number of partitions that have had messages delivered */
+    int capacity;               /* Allocated size of partitions (a power of two) */
+    offset_index_partition *partitions; /* Hash table, keyed by topic name and partition */
+    uint64_t records_written;   /* Number of index records produced */
+    char error[OFFSET_INDEX_ERROR_LEN];
+} offset_index;
+
+typedef offset_index *offset_index_t;
+
+offset_index_t offset_index_new(rd_kafka_t *kafka, const char *topic_name,
+        rd_kafka_topic_conf_t *topic_conf, const char *slot_name, int interval_secs);
+void offset_index_delivered(offset_index_t index, const char *topic, int32_t partition,
+        int64_t offset, uint64_t xact_seq);
+int offset_index_checkpoint(offset_index_t index, uint64_t xact_seq, uint64_t commit_lsn,
+        int64_t commit_time, int64_t now);
+void offset_index_free(offset_index_t index);
+
+#endif /* OFFSET_INDEX_H */
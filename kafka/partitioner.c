@@ -0,0 +1,46 @@
+/* Key hashing compatible with the default partitioner of the Java Kafka client,
+ * so that topics written by Bottled Water are partitioned in the same way as topics
+ * written by Java producers (including Kafka Streams), and can be joined with them
+ * without repartitioning. The Java client partitions a keyed message by
+ * (murmur2(key) & 0x7fffffff) % partitions, using the variant of MurmurHash2 below. */
+
+#include "partitioner.h"
+
+#define MURMUR2_SEED 0x9747b28cu
+#define MURMUR2_M 0x5bd1e995u
+#define MURMUR2_R 24
+
+
+/* MurmurHash2, as implemented by org.apache.kafka.common.utils.Utils.murmur2(). */
+uint32_t murmur2(const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    uint32_t h = MURMUR2_SEED ^ (uint32_t) len;
+    size_t i;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        uint32_t k = (uint32_t) bytes[i] | ((uint32_t) bytes[i + 1] << 8) |
+            ((uint32_t) bytes[i + 2] << 16) | ((uint32_t) bytes[i + 3] << 24);
+        k *= MURMUR2_M;
+        k ^= k >> MURMUR2_R;
+        k *= MURMUR2_M;
+        h *= MURMUR2_M;
+        h ^= k;
+    }
+
+    switch (len - i) {
+        case 3: h ^= (uint32_t) bytes[i + 2] << 16;  /* fall through */
+        case 2: h ^= (uint32_t) bytes[i + 1] << 8;   /* fall through */
+        case 1: h ^= (uint32_t) bytes[i];
+                h *= MURMUR2_M;
+    }
+
+    h ^= h >> 13;
+    h *= MURMUR2_M;
+    h ^= h >> 15;
+    return h;
+}
+
+/* Maps a key hash to a partition in the same way as the Java client. */
+int32_t murmur2_partition(uint32_t hash, int32_t partition_cnt) {
+    return (int32_t) ((hash & 0x7fffffff) % (uint32_t) partition_cnt);
+}
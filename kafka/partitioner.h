@@ -0,0 +1,10 @@
+#ifndef PARTITIONER_H
+#define PARTITIONER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t murmur2(const void *data, size_t len);
+int32_t murmur2_partition(uint32_t hash, int32_t partition_cnt);
+
+#endif /* PARTITIONER_H */
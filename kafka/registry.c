@@ -119,7 +119,9 @@ int schema_registry_request(schema_registry_t registry, const char *name, int is
     curl_easy_setopt(registry->curl, CURLOPT_WRITEDATA, response);
     curl_easy_setopt(registry->curl, CURLOPT_ERRORBUFFER, registry->curl_error);
 
+    int64_t started = metrics_now();
     CURLcode result = curl_easy_perform(registry->curl);
+    metrics_histogram_observe(&registry->request_latency, metrics_now() - started);
 
     int schema_id = 0;
     int err = registry_parse_response(registry, result, response->data, response->len, &schema_id);
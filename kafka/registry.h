@@ -5,6 +5,8 @@
 #include <curl/curl.h>
 #include <avro.h>
 
+#include "metrics.h"
+
 /* 5 bytes prefix is added by schema_registry_encode_msg(). */
 #define SCHEMA_REGISTRY_MSG_PREFIX_LEN 5
 
@@ -16,6 +18,7 @@ typedef struct {
     char curl_error[CURL_ERROR_SIZE];      /* Buffer for libcurl error messages */
     char error[SCHEMA_REGISTRY_ERROR_LEN]; /* Buffer for general error messages */
     char *registry_url;                    /* URL of server */
+    metrics_histogram request_latency;     /* Time taken by requests to the registry */
 } schema_registry;
 
 typedef schema_registry *schema_registry_t;
@@ -0,0 +1,13 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN 32
+#define SHA256_HEX_LEN (2 * SHA256_DIGEST_LEN + 1)
+
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_LEN]);
+void sha256_hex(const void *data, size_t len, char hex[SHA256_HEX_LEN]);
+
+#endif /* SHA256_H */
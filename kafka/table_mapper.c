@@ -4,7 +4,11 @@
  *   * the schema ids for keys and rows, assigned by the schema registry
  *     (needed for Avro output)
  *   * the Avro schemas for keys and rows (needed to convert the Avro-binary-
- *     encoded values received from the Postgres extension into JSON output) */
+ *     encoded values received from the Postgres extension into JSON output)
+ *
+ * If max_open_tables is set, the Kafka topic handles of the least recently used
+ * tables are closed when more than that many tables are in use, and reopened
+ * when those tables are next written to. */
 
 #include "logger.h"
 #include "table_mapper.h"
@@ -15,7 +19,10 @@
 
 table_metadata_t table_metadata_new(table_mapper_t mapper, Oid relid);
 int table_metadata_update_topic(table_mapper_t mapper, table_metadata_t table, const char* table_name);
-int table_metadata_update_schema(table_mapper_t mapper, table_metadata_t table, int is_key, const char* schema_json, size_t schema_len);
+void table_metadata_close(table_mapper_t mapper, table_metadata_t table);
+void table_mapper_remove(table_mapper_t mapper, table_metadata_t table);
+int table_metadata_update_schema(table_mapper_t mapper, table_metadata_t table, int is_key,
+        const char* schema_json, size_t schema_len, avro_schema_t schema);
 void table_metadata_set_schema_id(table_metadata_t table, int is_key, int schema_id);
 void table_metadata_set_schema(table_metadata_t table, int is_key, avro_schema_t new_schema);
 void table_metadata_free(table_metadata_t table);
@@ -24,14 +31,15 @@ void mapper_error(table_mapper_t mapper, char *fmt, ...) __attribute__ ((format
 
 
 /* Creates a new table_mapper.  Takes references to (but does not adopt
- * ownership of) the Kafka producer connection and topic configuration (so it
- * can create the topics associated with each table), and the schema registry
+ * ownership of) the Kafka producer connections and topic configuration (so it
+ * can create the topics associated with each table, in each of the num_sinks
+ * Kafka clusters we are writing to), and the schema registry
  * client (so it can register schemas and retrieve schema ids).  Takes a copy
  * of topic_prefix (unless it is NULL).
  *
  * The registry parameter may be NULL if running without a schema registry. */
 table_mapper_t table_mapper_new(
-        rd_kafka_t *kafka,
+        rd_kafka_t **kafka, int num_sinks,
         rd_kafka_topic_conf_t *topic_conf,
         schema_registry_t registry,
         const char *topic_prefix) {
@@ -42,7 +50,8 @@ table_mapper_t table_mapper_new(
     mapper->capacity = 16;
     mapper->tables = malloc(mapper->capacity * sizeof(void*)); if(mapper == NULL){ free(mapper); return NULL;}
 
-    mapper->kafka = kafka;
+    memcpy(mapper->kafka, kafka, num_sinks * sizeof(rd_kafka_t *));
+    mapper->num_sinks = num_sinks;
     mapper->topic_conf = topic_conf;
     mapper->registry = registry;
 
@@ -58,7 +67,7 @@ table_mapper_t table_mapper_new(
 table_metadata_t table_mapper_lookup(table_mapper_t mapper, Oid relid) {
     for (int i = 0; i < mapper->num_tables; i++) {
         table_metadata_t table = mapper->tables[i];
-        if (!table->deleted && table->relid == relid) return table;
+        if (table->relid == relid) return table;
     }
     return NULL;
 }
@@ -71,14 +80,21 @@ table_metadata_t table_mapper_lookup(table_mapper_t mapper, Oid relid) {
  *  * will open the named topic, closing the old one if necessary.
  *  * if running with a schema registry, will register the schemas.
  *
+ * If the table is already known under the same name, with schemas of the same
+ * fingerprint, none of that is repeated: the registry ids from last time are kept.
+ *
  * Returns the updated metadata record on success, or NULL on failure.  Consult
  * mapper->error for the error message on failure. */
 table_metadata_t table_mapper_update(table_mapper_t mapper, Oid relid,
-        const char* table_name,
-        const char* key_schema_json, size_t key_schema_len,
-        const char* row_schema_json, size_t row_schema_len) {
+        const char* table_name, uint64_t fingerprint,
+        const char* key_schema_json, size_t key_schema_len, avro_schema_t key_schema,
+        const char* row_schema_json, size_t row_schema_len, avro_schema_t row_schema) {
     table_metadata_t table = table_mapper_lookup(mapper, relid);
-    if (table) {
+    if (table && table->fingerprint == fingerprint && table->table_name &&
+            !strcmp(table->table_name, table_name)) {
+        /* Typically after a reconnect, when the server announces every table again */
+        return table;
+    } else if (table) {
         log_info("Updating metadata for table %s (relid %" PRIu32 ")", table_name, relid);
     } else {
         log_info("Registering metadata for table %s (relid %" PRIu32 ")", table_name, relid);
@@ -112,38 +128,30 @@ table_metadata_t table_mapper_update(table_mapper_t mapper, Oid relid,
      *        so we threaten the stability of Postgres if the error persists.
      *
      * This might need to end up being a configuration choice.  For now, we
-     * choose option b) - we leave the table unregistered (by marking it as
-     * deleted), which means send_kafka_msg in bottledwater.c will fail to look
+     * choose option b) - we leave the table unregistered (by removing its
+     * record), which means send_kafka_msg in bottledwater.c will fail to look
      * up the schema and invoke its error handling policy.
      */
     int err;
 
     err = table_metadata_update_topic(mapper, table, table_name);
-    if (err) /*goto error;*/ { if (table) table->deleted = 1; return NULL;}
+    if (err) goto error;
 
-    err = table_metadata_update_schema(mapper, table, 1, key_schema_json, key_schema_len);
-    if (err) /*goto error;*/ { if (table) table->deleted = 1; return NULL;}
+    err = table_metadata_update_schema(mapper, table, 1, key_schema_json, key_schema_len, key_schema);
+    if (err) goto error;
 
-    err = table_metadata_update_schema(mapper, table, 0, row_schema_json, row_schema_len);
-    if (err) /*goto error;*/ { if (table) table->deleted = 1; return NULL;}
+    err = table_metadata_update_schema(mapper, table, 0, row_schema_json, row_schema_len, row_schema);
+    if (err) goto error;
 
+    table->fingerprint = fingerprint;
     return table;
 
-//error:
-    /* Mark the table as deleted so we don't try to proceed with incomplete
-     * information.
-     *
-     * It would be preferable to actually delete the table record (i.e. free
-     * the memory and avoid registering it in the mapper->tables array).
-     * However because we're using a plain array to register tables, doing so
-     * would be messy (especially if updating an existing record, in which case
-     * we'd have to shuffle records around).  So for now we just set this flag.
-     *
-     * N.B. this means the record will *never* be freed!  So we should revisit
-     * this if we anticipate having a large number of deleted records.
-     */
-//    if (table) table->deleted = 1;
-//    return NULL;
+error:
+    /* Remove the table so we don't try to proceed with incomplete information.
+     * Nothing keeps pointers to table records beyond a single lookup, so it can
+     * be freed right away. */
+    table_mapper_remove(mapper, table);
+    return NULL;
 }
 
 /* Destroys the table mapper along with all stored metadata.  Will close any
@@ -185,17 +193,18 @@ table_metadata_t table_metadata_new(table_mapper_t mapper, Oid relid) {
 int table_metadata_update_topic(table_mapper_t mapper, table_metadata_t table, const char* table_name) {
     const char* prev_table_name = table->table_name;
 
-    if (table->topic) {
+    if (prev_table_name) {
         if (strcmp(table_name, prev_table_name)) {
             log_info("Registering new table (was \"%s\", now \"%s\") for relid %" PRIu32, prev_table_name, table_name, table->relid);
 
+            table_metadata_close(mapper, table);
             free(table->table_name);
-            rd_kafka_topic_destroy(table->topic);
-        } else return 0; // table name didn't change, nothing to do
+            free(table->topic_name);
+            table->table_name = NULL;
+            table->topic_name = NULL;
+        } else return table_mapper_open(mapper, table); // table name didn't change, nothing to do
     }
 
-    table->table_name = strdup(table_name);
-
     /* Kafka topic naming convention: [topic_prefix].[postgres_schema_name].table_name
      *
      *   - topic_prefix is optional, set via the --topic-prefix command-line option;
@@ -206,9 +215,6 @@ int table_metadata_update_topic(table_mapper_t mapper, table_metadata_t table, c
      *
      * See the README for more discussion of topic naming. */
 
-    const char *topic_name;
-    /* both branches set topic_name to a pointer we don't need to free,
-     * since rd_kafka_topic_new below is going to copy it anyway */
     if (mapper->topic_prefix != NULL) {
         char prefixed_name[TABLE_MAPPER_MAX_TOPIC_LEN];
         int size = snprintf(prefixed_name, TABLE_MAPPER_MAX_TOPIC_LEN,
@@ -221,35 +227,128 @@ int table_metadata_update_topic(table_mapper_t mapper, table_metadata_t table, c
             return -1;
         }
 
-        topic_name = prefixed_name;
-        /* needn't free topic_name because prefixed_name was stack-allocated */
+        table->topic_name = strdup(prefixed_name);
     } else {
-        topic_name = table_name;
-        /* needn't free topic_name because it aliases table_name which we don't own */
+        table->topic_name = strdup(table_name);
+    }
+    table->table_name = strdup(table_name);
+
+    log_info("Opening Kafka topic \"%s\" for table \"%s\"", table->topic_name, table_name);
+    return table_mapper_open(mapper, table);
+}
+
+/* Makes sure the Kafka topics of a table are open, and marks the table as
+ * recently used.  If max_open_tables tables already have open topics, the
+ * topics of the least recently used one are closed.  Messages already produced
+ * to a closed topic are still delivered, as librdkafka keeps its own reference.
+ *
+ * Returns 0 on success.  On failure, sets mapper->error and returns nonzero. */
+int table_mapper_open(table_mapper_t mapper, table_metadata_t table) {
+    table->last_used = ++mapper->use_counter;
+    if (table->topics[0]) return 0;
+
+    if (mapper->max_open_tables > 0 && mapper->num_open_tables >= mapper->max_open_tables) {
+        table_metadata_t lru = NULL;
+        for (int i = 0; i < mapper->num_tables; i++) {
+            table_metadata_t other = mapper->tables[i];
+            if (other->topics[0] && (!lru || other->last_used < lru->last_used)) lru = other;
+        }
+        if (lru) {
+            log_debug("Closing Kafka topic \"%s\" of idle table \"%s\"", lru->topic_name, lru->table_name);
+            table_metadata_close(mapper, lru);
+        }
+    }
+
+    for (int i = 0; i < mapper->num_sinks; i++) {
+        table->topics[i] = rd_kafka_topic_new(mapper->kafka[i], table->topic_name,
+                rd_kafka_topic_conf_dup(mapper->topic_conf));
+        if (!table->topics[i]) {
+            mapper_error(mapper, "Cannot open Kafka topic %s: %s", table->topic_name,
+                    rd_kafka_err2str(rd_kafka_errno2err(errno)));
+            for (int j = 0; j < i; j++) {
+                rd_kafka_topic_destroy(table->topics[j]);
+                table->topics[j] = NULL;
+            }
+            return -1;
+        }
     }
 
-    log_info("Opening Kafka topic \"%s\" for table \"%s\"", topic_name, table_name);
+    mapper->num_open_tables++;
+    return 0;
+}
 
-    table->topic = rd_kafka_topic_new(mapper->kafka, topic_name,
-            rd_kafka_topic_conf_dup(mapper->topic_conf));
-    if (!table->topic) {
-        mapper_error(mapper, "Cannot open Kafka topic %s: %s", topic_name,
-                rd_kafka_err2str(rd_kafka_errno2err(errno)));
+/* Opens the table's control topic, named after its topic with the given suffix,
+ * unless it is open already. The table's topics must be open (see
+ * table_mapper_open()); the control topic is closed along with them, so it does
+ * not count separately towards max_open_tables.
+ *
+ * Returns 0 on success.  On failure, sets mapper->error and returns nonzero. */
+int table_mapper_open_control(table_mapper_t mapper, table_metadata_t table, const char *suffix) {
+    if (table->control_topics[0]) return 0;
+
+    char topic_name[TABLE_MAPPER_MAX_TOPIC_LEN];
+    int size = snprintf(topic_name, sizeof(topic_name), "%s%s", table->topic_name, suffix);
+    if (size >= TABLE_MAPPER_MAX_TOPIC_LEN) {
+        mapper_error(mapper, "control topic name is too long (max %d bytes): %s%s",
+                TABLE_MAPPER_MAX_TOPIC_LEN, table->topic_name, suffix);
         return -1;
     }
 
+    for (int i = 0; i < mapper->num_sinks; i++) {
+        table->control_topics[i] = rd_kafka_topic_new(mapper->kafka[i], topic_name,
+                rd_kafka_topic_conf_dup(mapper->topic_conf));
+        if (!table->control_topics[i]) {
+            mapper_error(mapper, "Cannot open Kafka topic %s: %s", topic_name,
+                    rd_kafka_err2str(rd_kafka_errno2err(errno)));
+            for (int j = 0; j < i; j++) {
+                rd_kafka_topic_destroy(table->control_topics[j]);
+                table->control_topics[j] = NULL;
+            }
+            return -1;
+        }
+    }
     return 0;
 }
 
+/* Closes the Kafka topics of a table, if they are open. */
+void table_metadata_close(table_mapper_t mapper, table_metadata_t table) {
+    for (int i = 0; i < mapper->num_sinks; i++) {
+        if (table->control_topics[i]) rd_kafka_topic_destroy(table->control_topics[i]);
+        table->control_topics[i] = NULL;
+    }
+    if (!table->topics[0]) return;
+
+    for (int i = 0; i < mapper->num_sinks; i++) {
+        if (table->topics[i]) rd_kafka_topic_destroy(table->topics[i]);
+        table->topics[i] = NULL;
+    }
+    mapper->num_open_tables--;
+}
+
+/* Frees a table record and removes it from the tables array. */
+void table_mapper_remove(table_mapper_t mapper, table_metadata_t table) {
+    for (int i = 0; i < mapper->num_tables; i++) {
+        if (mapper->tables[i] != table) continue;
+
+        table_metadata_close(mapper, table);
+        table_metadata_free(table);
+        free(table);
+
+        mapper->tables[i] = mapper->tables[mapper->num_tables - 1];
+        mapper->num_tables--;
+        return;
+    }
+}
+
 /* Returns 0 on success.  On failure, sets mapper->error and returns nonzero. */
-int table_metadata_update_schema(table_mapper_t mapper, table_metadata_t table, int is_key, const char* schema_json, size_t schema_len) {
-    int prev_schema_id = is_key ? table->key_schema_id : table->row_schema_id;
+int table_metadata_update_schema(table_mapper_t mapper, table_metadata_t table, int is_key,
+        const char* schema_json, size_t schema_len, avro_schema_t schema) {
     int schema_id = TABLE_MAPPER_SCHEMA_ID_MISSING;
 
     int err;
 
     if (mapper->registry) {
-        err = schema_registry_request(mapper->registry, rd_kafka_topic_name(table->topic), is_key,
+        err = schema_registry_request(mapper->registry, table->topic_name, is_key,
                 schema_json, schema_len,
                 &schema_id);
         if (err) {
@@ -261,36 +360,9 @@ int table_metadata_update_schema(table_mapper_t mapper, table_metadata_t table,
         table_metadata_set_schema_id(table, is_key, schema_id);
     }
 
-    avro_schema_t schema;
-
-    /* If running with a schema registry, we can use the registry to detect
-     * if the schema we just saw is the same as the one we remembered
-     * previously (since the registry guarantees to return the same id for
-     * identical schemas).  If the registry returns the same id as before, we
-     * can skip parsing the new schema and just keep the previous one.
-     *
-     * However, if we're running without a registry, it's not so easy to detect
-     * whether or not the schema changed, so in that case we just always parse
-     * the new schema.  (We could store the previous schema JSON and strcmp()
-     * it with the new JSON, but that probably wouldn't save much over just
-     * parsing the JSON, given this isn't a hot code path.) */
-    if (prev_schema_id == TABLE_MAPPER_SCHEMA_ID_MISSING || prev_schema_id != schema_id) {
-        if (schema_json) {
-            err = avro_schema_from_json_length(schema_json, schema_len, &schema);
-
-            if (err) {
-                mapper_error(mapper, "Could not parse %s schema: %s",
-                        is_key ? "key" : "row", avro_strerror());
-                return err;
-            }
-        } else {
-            schema = NULL;
-        }
-
-        table_metadata_set_schema(table, is_key, schema);
-
-        if (schema) avro_schema_decref(schema);
-    }
+    /* The frame reader has already parsed the JSON (or reused a copy it parsed
+     * earlier, if the fingerprint was known), so we just keep a reference. */
+    table_metadata_set_schema(table, is_key, schema);
 
     return 0;
 }
@@ -336,8 +408,10 @@ void table_metadata_set_schema(table_metadata_t table, int is_key, avro_schema_t
 
 void table_metadata_free(table_metadata_t table) {
     if (table->table_name) free(table->table_name);
-    if (table->topic) {
-        rd_kafka_topic_destroy(table->topic);
+    if (table->topic_name) free(table->topic_name);
+    for (int i = 0; i < TABLE_MAPPER_MAX_SINKS; i++) {
+        if (table->topics[i]) rd_kafka_topic_destroy(table->topics[i]);
+        if (table->control_topics[i]) rd_kafka_topic_destroy(table->control_topics[i]);
     }
     if (table->row_schema) avro_schema_decref(table->row_schema);
     if (table->key_schema) avro_schema_decref(table->key_schema);
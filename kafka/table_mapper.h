@@ -12,17 +12,24 @@
 #define TABLE_MAPPER_ERROR_LEN 512
 #define TABLE_MAPPER_MAX_TOPIC_LEN (256 + 1)
 #define TABLE_MAPPER_TOPIC_PREFIX_DEL '.'
+#define TABLE_MAPPER_MAX_SINKS 8
 
 
 typedef struct {
     Oid relid;                  /* Uniquely identifies a table, even when it is renamed */
     char *table_name;           /* Name of the table in Postgres */
-    rd_kafka_topic_t *topic;    /* Kafka topic to which messages are produced */
+    char *topic_name;           /* Name of the Kafka topic, including any prefix */
+    uint64_t fingerprint;       /* Fingerprint of the schemas last registered, or 0 */
+    rd_kafka_topic_t *topics[TABLE_MAPPER_MAX_SINKS]; /* Kafka topic to which messages are produced, one handle per sink; NULL while closed */
+    rd_kafka_topic_t *control_topics[TABLE_MAPPER_MAX_SINKS]; /* Topic for events about the table, per sink; NULL until used, and while closed */
+    uint64_t last_used;         /* Value of table_mapper.use_counter when the topics were last used */
     int key_schema_id;          /* Identifier for the current key schema, assigned by the registry */
     avro_schema_t key_schema;   /* Schema to use for converting key values to JSON */
     int row_schema_id;          /* Identifier for the current row schema, assigned by the registry */
     avro_schema_t row_schema;   /* Schema to use for converting row values to JSON */
-    char deleted;               /* Whether this table record has been deleted */
+    uint64_t rows_produced;     /* Number of messages handed to the Kafka producer */
+    uint64_t bytes_produced;    /* Total size of keys and values of those messages */
+    metrics_histogram commit_latency; /* Time from commit in Postgres to acknowledgement by Kafka */
 } table_metadata;
 
 typedef table_metadata *table_metadata_t;
@@ -30,27 +37,33 @@ typedef table_metadata *table_metadata_t;
 
 typedef struct {
     char error[TABLE_MAPPER_ERROR_LEN]; /* Buffer for error messages */
-    rd_kafka_t *kafka;                  /* Reference to the Kafka connection (so we can create topics) */
+    rd_kafka_t *kafka[TABLE_MAPPER_MAX_SINKS]; /* References to the Kafka connections (so we can create topics) */
+    int num_sinks;                      /* Number of Kafka connections */
     rd_kafka_topic_conf_t *topic_conf;  /* Reference to the Kafka topic configuration */
     schema_registry_t registry;         /* Reference to the schema registry client */
     char *topic_prefix;                 /* String to be prepended to all topic names */
     int num_tables;                     /* Number of tables known */
     int capacity;                       /* Allocated size of tables array */
     table_metadata **tables;            /* Array of pointers to table_metadata structs */
+    int max_open_tables;                /* Maximum number of tables with open topics; 0 = unlimited */
+    int num_open_tables;                /* Number of tables whose topics are open */
+    uint64_t use_counter;               /* Incremented every time a table's topics are used, for LRU eviction */
 } table_mapper;
 
 typedef table_mapper *table_mapper_t;
 
 table_mapper_t table_mapper_new(
-        rd_kafka_t *kafka,
+        rd_kafka_t **kafka, int num_sinks,
         rd_kafka_topic_conf_t *topic_conf,
         schema_registry_t registry,
         const char *topic_prefix);
 table_metadata_t table_mapper_lookup(table_mapper_t mapper, Oid relid);
 table_metadata_t table_mapper_update(table_mapper_t mapper, Oid relid,
-        const char* table_name,
-        const char* key_schema_json, size_t key_schema_len,
-        const char* row_schema_json, size_t row_schema_len);
+        const char* table_name, uint64_t fingerprint,
+        const char* key_schema_json, size_t key_schema_len, avro_schema_t key_schema,
+        const char* row_schema_json, size_t row_schema_len, avro_schema_t row_schema);
+int table_mapper_open(table_mapper_t mapper, table_metadata_t table);
+int table_mapper_open_control(table_mapper_t mapper, table_metadata_t table, const char *suffix);
 void table_mapper_free(table_mapper_t mapper);
 
 
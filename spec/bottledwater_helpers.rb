@@ -0,0 +1,43 @@
+require 'shellwords'
+
+module BottledWaterHelpers
+  # Runs SQL with psql inside the Bottled Water container, so that it can reach
+  # any database on the cluster's Postgres server (TEST_CLUSTER.postgres is only
+  # connected to one).
+  def psql(dbname, sql)
+    result = TEST_CLUSTER.bottledwater_exec('psql', '-h', 'postgres', '-U', 'postgres', '-d', dbname, '-c', sql)
+    raise "psql failed: #{result.captured_error}" unless result.status.success?
+    result.captured_output
+  end
+
+  def bottledwater_conninfo(dbname = 'postgres')
+    TEST_CLUSTER.bottledwater_postgres.sub('dbname=postgres', "dbname=#{dbname}")
+  end
+
+  # Runs another Bottled Water process inside the container, next to the one the
+  # cluster started.  Without log:, waits for it to exit and returns the finished
+  # command; with log:, leaves it running in the background, writing its log to
+  # that file in the container (see bottledwater_process_log).
+  def bottledwater_process(*options, log: nil)
+    command = %w(bottledwater --broker=kafka:9092 --output-format=json) + options
+    if log
+      TEST_CLUSTER.bottledwater_exec('bash', '-c', "#{command.shelljoin} 2>#{log.shellescape}", detach: true)
+    else
+      TEST_CLUSTER.bottledwater_exec(*command)
+    end
+  end
+
+  def bottledwater_process_log(log)
+    TEST_CLUSTER.bottledwater_exec('cat', log).captured_output
+  end
+
+  # Kills, without warning, the extra Bottled Water processes whose options end
+  # with the given ones, as if their host had failed.
+  def bottledwater_process_kill(*options)
+    script = 'for proc in /proc/[0-9]*; do ' \
+             'cmdline=$(tr "\0" " " <"$proc/cmdline" 2>/dev/null); ' \
+             '[[ $cmdline == "bottledwater "*"$1" ]] && kill -9 "${proc#/proc/}"; ' \
+             'done; true'
+    TEST_CLUSTER.bottledwater_exec('bash', '-c', script, 'kill', " #{options.join(' ')} ")
+  end
+end
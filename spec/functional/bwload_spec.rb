@@ -0,0 +1,76 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'bwload', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  def bwload(*options)
+    TEST_CLUSTER.bottledwater_exec(
+      'bwload',
+      "--postgres=#{TEST_CLUSTER.bottledwater_postgres}",
+      '--keys=100',
+      '--step-seconds=2',
+      *options)
+  end
+
+  example 'reports each rate step separately' do
+    result = bwload('--drop-existing', '--rates=20,50', '--output=/tmp/bwload.csv', '--label=spec')
+    expect(result.status).to be_success
+
+    steps = result.captured_output.split("\n").grep(/^rate /)
+    expect(steps.size).to eq(2)
+    expect(steps[0]).to match(%r{^rate +20 txn/s: achieved +[0-9.]+ txn/s, latency ms p50 })
+    expect(steps[1]).to match(%r{^rate +50 txn/s: achieved +[0-9.]+ txn/s, latency ms p50 })
+
+    # Each step waits for its own commits, so its achieved rate can't include
+    # transactions left over from the step before.
+    achieved = steps.map {|line| Float(line[/achieved +([0-9.]+)/, 1]) }
+    expect(achieved[0]).to be <= 25
+
+    csv = TEST_CLUSTER.bottledwater_exec('cat', '/tmp/bwload.csv').captured_output
+    rows = csv.split("\n").map {|line| line.split(',') }
+    expect(rows.map {|row| row.take(2) }).to eq([%w(spec 20), %w(spec 50)])
+    expect(rows.map(&:size).uniq).to eq([14])
+  end
+
+  example 'drops its replication slot on exit' do
+    result = bwload('--drop-existing', '--rates=10')
+    expect(result.status).to be_success
+
+    slots = postgres.exec("SELECT 1 FROM pg_replication_slots WHERE slot_name = 'bwload'")
+    expect(slots.ntuples).to eq(0)
+  end
+
+  example 'refuses to reuse an existing slot without --drop-existing' do
+    postgres.exec("SELECT pg_create_logical_replication_slot('bwload', 'bottledwater')")
+
+    result = bwload('--rates=10')
+    expect(result.status).to_not be_success
+    expect(result.captured_error).to include('replication slot "bwload" already exists')
+    expect(result.captured_error).to include('--drop-existing')
+
+    result = bwload('--drop-existing', '--rates=10')
+    expect(result.status).to be_success
+  end
+
+  example 'refuses to reuse existing tables without --drop-existing' do
+    postgres.exec('CREATE TABLE IF NOT EXISTS bwload_txn (id BIGINT PRIMARY KEY)')
+
+    result = bwload('--rates=10')
+    expect(result.status).to_not be_success
+    expect(result.captured_error).to include('already exists')
+    expect(result.captured_error).to include('--drop-existing')
+
+    result = bwload('--drop-existing', '--rates=10')
+    expect(result.status).to be_success
+  end
+end
@@ -0,0 +1,147 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'bwverify', functional: true, format: :avro do
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  # Two tables with the same columns, whose topics hold the same rows except
+  # that one row differs, one is missing and one is extra in accounts_copy.
+  def create_accounts
+    postgres = TEST_CLUSTER.postgres
+    %w(accounts accounts_copy).each do |table|
+      postgres.exec("CREATE TABLE #{table} (id INTEGER PRIMARY KEY, name TEXT NOT NULL, balance INTEGER)")
+    end
+    postgres.exec("INSERT INTO accounts SELECT id, 'account ' || id, id * 100 FROM generate_series(1, 20) AS id")
+    postgres.exec('INSERT INTO accounts_copy SELECT * FROM accounts')
+    postgres.exec('UPDATE accounts_copy SET balance = 0 WHERE id = 5')
+    postgres.exec('DELETE FROM accounts_copy WHERE id = 20')
+    postgres.exec("INSERT INTO accounts_copy VALUES (21, 'account 21', 2100)")
+    sleep 3
+  end
+
+  def bwverify(*options)
+    TEST_CLUSTER.bottledwater_exec('bwverify', "--postgres=#{bottledwater_conninfo}", '--broker=kafka:9092',
+                                   *options)
+  end
+
+  shared_examples 'comparing a table with its topic' do
+    example 'a topic that matches its table' do
+      result = bwverify('--table=accounts')
+
+      expect(result.status.exitstatus).to eq(0)
+      expect(result.captured_output).to include('Table accounts and topic accounts match')
+      expect(result.captured_error).to include('read 20 messages with 20 distinct keys from topic accounts')
+    end
+
+    example 'rows that differ are listed' do
+      result = bwverify('--table=accounts', '--topic=accounts_copy')
+
+      expect(result.status.exitstatus).to eq(1)
+      output = result.captured_output
+      expect(output).to match(/^differs \(partition 0, offset \d+\): .*5/)
+      expect(output).to match(/^missing from topic: .*20/)
+      expect(output).to match(/^missing from table: key at partition 0, offset \d+$/)
+      expect(output).to include('3 rows differ between table accounts and topic accounts_copy')
+    end
+
+    example 'a table that does not exist is an error' do
+      result = bwverify('--table=no_such_table')
+
+      expect(result.status.exitstatus).to eq(2)
+      expect(result.captured_error).to include('no_such_table')
+    end
+  end
+
+  describe 'on Postgres 16' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.postgres_version = '16'
+      TEST_CLUSTER.bottledwater_format = :avro
+      TEST_CLUSTER.start
+      create_accounts
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    it_behaves_like 'comparing a table with its topic'
+
+    example 'the table is hashed by several sessions' do
+      result = bwverify('--table=accounts', '--slot=bottledwater', '--jobs=4')
+
+      expect(result.status.exitstatus).to eq(0)
+      expect(result.captured_error).not_to include('warning')
+    end
+
+    example 'values in the claim-check store are read back from it' do
+      postgres.exec('CREATE TABLE documents (id INTEGER PRIMARY KEY, body TEXT NOT NULL)')
+      postgres.exec_params("INSERT INTO documents VALUES (1, $1), (2, 'small')", ['x' * 1500])
+      bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=claims', '--topic-prefix=claims',
+                           '--output-format=avro', '--schema-registry=http://schema-registry:8081',
+                           '--claim-check-store=dir:/tmp/bwverify_claims', '--claim-check-threshold=1000',
+                           log: '/tmp/bwverify_claims.log')
+      sleep 5
+
+      without_store = bwverify('--table=documents', '--topic=claims.documents')
+      expect(without_store.status.exitstatus).to eq(0)
+      expect(without_store.captured_output).to match(/^unverifiable, in claim-check store \(partition 0, offset \d+\): .*1/)
+      expect(without_store.captured_output).to include(
+        'Table documents and topic claims.documents match, except for 1 rows whose values could not be read')
+      expect(without_store.captured_error).to include(
+        'warning: 1 values are in the claim-check store (see --claim-check-store), and cannot be verified')
+
+      with_store = bwverify('--table=documents', '--topic=claims.documents',
+                            '--claim-check-store=dir:/tmp/bwverify_claims')
+      expect(with_store.status.exitstatus).to eq(0)
+      expect(with_store.captured_output).to include('Table documents and topic claims.documents match')
+      expect(with_store.captured_error).to include('read 1 values from the claim-check store')
+    end
+
+    example 'rows before a truncate marker are not counted' do
+      postgres.exec('CREATE TABLE ledger (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+      bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=marked', '--topic-prefix=marked',
+                           '--output-format=avro', '--schema-registry=http://schema-registry:8081',
+                           '--on-truncate=marker', log: '/tmp/bwverify_marked.log')
+      sleep 3
+      postgres.exec('INSERT INTO ledger (n) SELECT * FROM generate_series(1, 5) AS n')
+      postgres.exec('TRUNCATE ledger')
+      postgres.exec('INSERT INTO ledger (n) VALUES (6), (7)')
+      sleep 3
+
+      result = bwverify('--table=ledger', '--topic=marked.ledger', '--slot=marked')
+      expect(result.status.exitstatus).to eq(0)
+      expect(result.captured_output).to include('Table ledger and topic marked.ledger match')
+      expect(result.captured_error).to include('read 8 messages with 2 distinct keys from topic marked.ledger')
+    end
+  end
+
+  describe 'on Postgres 9.5' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.bottledwater_format = :avro
+      TEST_CLUSTER.start
+      create_accounts
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    it_behaves_like 'comparing a table with its topic'
+
+    example 'several jobs each read the whole table' do
+      result = bwverify('--table=accounts', '--jobs=4')
+
+      expect(result.status.exitstatus).to eq(0)
+      expect(result.captured_error).to include('warning: before Postgres 14, each of the 4 jobs reads the whole table')
+    end
+
+    example 'the slot cannot be waited for' do
+      result = bwverify('--table=accounts', '--slot=bottledwater')
+
+      expect(result.status.exitstatus).to eq(0)
+      expect(result.captured_error).to include('warning: before Postgres 9.6, cannot wait for slot "bottledwater"')
+    end
+  end
+end
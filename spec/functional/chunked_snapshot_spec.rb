@@ -0,0 +1,61 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'chunked snapshot', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  # The latest value of each key in a topic, as a consumer compacting it would see.
+  def latest_values(topic)
+    kafka_take_all(topic, wait: 10).each_with_object({}) do |message, latest|
+      latest[fetch_int(decode_key(message.key), 'id')] = message.value && fetch_int(decode_value(message.value), 'n')
+    end
+  end
+
+  example 'existing rows are read in chunks while changes are streamed' do
+    postgres.exec('CREATE TABLE catalog (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO catalog (n) SELECT * FROM generate_series(1, 250) AS n')
+
+    bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=chunked', '--topic-prefix=chunked',
+                         '--snapshot-chunk-size=100', log: '/tmp/chunked.log')
+
+    # Change rows once the slot exists, while the snapshot may still be reading them
+    50.times do
+      break if postgres.exec("SELECT 1 FROM pg_replication_slots WHERE slot_name = 'chunked'").ntuples > 0
+      sleep 0.1
+    end
+    (1..250).step(10) {|id| postgres.exec_params('UPDATE catalog SET n = n + 1000 WHERE id = $1', [id]) }
+    postgres.exec('DELETE FROM catalog WHERE id > 240')
+    postgres.exec('INSERT INTO catalog (n) VALUES (251)')
+    sleep 5
+
+    expected = postgres.exec('SELECT id, n FROM catalog').each_with_object({}) do |row, table|
+      table[Integer(row['id'])] = Integer(row['n'])
+    end
+    (241..250).each {|id| expected[id] = nil }
+
+    # Rows may appear in the topic both from the snapshot and from the changes
+    latest = latest_values('chunked.catalog')
+    expect(latest).to eq(expected)
+
+    log = bottledwater_process_log('/tmp/chunked.log')
+    expect(log).to match(/Created replication slot "chunked", reading \d+ tables in chunks of 100 rows while streaming/)
+    expect(log).to match(/Chunked snapshot of slot "chunked" complete: \d+ chunks, \d+ rows, \d+ rows superseded/)
+  end
+
+  example 'a chunked snapshot cannot include unkeyed tables' do
+    result = bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=unkeyed_chunks',
+                                  '--snapshot-chunk-size=100', '--allow-unkeyed')
+
+    expect(result.status.success?).to be_falsey
+    expect(result.captured_error).to include('--snapshot-chunk-size cannot be combined with --allow-unkeyed')
+  end
+end
@@ -0,0 +1,86 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'digest'
+
+describe 'claim-check store', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  CLAIMS_DIR = '/tmp/claims'
+
+  def claim_file(store, sha256)
+    "#{CLAIMS_DIR}/#{store}/#{sha256[0, 2]}/#{sha256}"
+  end
+
+  def stored_files(store)
+    TEST_CLUSTER.bottledwater_exec('find', "#{CLAIMS_DIR}/#{store}", '-type', 'f').captured_output.split("\n").sort
+  end
+
+  def start_with_store(name)
+    bottledwater_process("--postgres=#{bottledwater_conninfo}", "--slot=#{name}", "--topic-prefix=#{name}",
+                         "--claim-check-store=dir:#{CLAIMS_DIR}/#{name}", '--claim-check-threshold=1000',
+                         log: "/tmp/#{name}.log")
+    sleep 3
+  end
+
+  example 'values above the threshold are replaced by a reference to the store' do
+    start_with_store('claims')
+
+    large = 'large value ' * 500
+    postgres.exec('CREATE TABLE documents (id SERIAL PRIMARY KEY, body TEXT NOT NULL)')
+    postgres.exec_params('INSERT INTO documents (body) VALUES ($1), ($2), ($1)', [large, 'small value'])
+
+    first, small, repeated = kafka_take_messages('claims.documents', 3)
+
+    expect(fetch_string(decode_value(small.value), 'body')).to eq('small value')
+
+    reference = JSON.parse(first.value).fetch('claim_check')
+    expect(reference.fetch('store')).to eq('dir')
+    sha256 = reference.fetch('sha256')
+    expect(sha256).to match(/\A[0-9a-f]{64}\z/)
+
+    # The file holds the value as it would otherwise have been sent
+    stored = TEST_CLUSTER.bottledwater_exec('cat', claim_file('claims', sha256)).captured_output
+    expect(Digest::SHA256.hexdigest(stored)).to eq(sha256)
+    expect(reference.fetch('size')).to eq(stored.bytesize)
+    expect(fetch_string(decode_value(stored), 'body')).to eq(large)
+    expect(fetch_int(decode_value(stored), 'id')).to eq(fetch_int(decode_key(first.key), 'id'))
+
+    # The rows differ in their id, so their values are stored separately, and
+    # nothing else is left in the store.
+    repeated_sha256 = JSON.parse(repeated.value).fetch('claim_check').fetch('sha256')
+    expect(repeated_sha256).not_to eq(sha256)
+    expect(stored_files('claims')).to eq([claim_file('claims', sha256), claim_file('claims', repeated_sha256)].sort)
+  end
+
+  example 'an identical value is stored only once' do
+    postgres.exec('CREATE TABLE blobs (id SERIAL PRIMARY KEY, body TEXT NOT NULL)')
+    start_with_store('dedup')
+
+    # Updating a row to the same value produces the same message value
+    postgres.exec_params('INSERT INTO blobs (id, body) VALUES (1, $1)', ['x' * 1500])
+    postgres.exec('UPDATE blobs SET body = body WHERE id = 1')
+
+    messages = kafka_take_messages('dedup.blobs', 2)
+    hashes = messages.map {|m| JSON.parse(m.value).fetch('claim_check').fetch('sha256') }
+    expect(hashes.uniq.size).to eq(1)
+
+    expect(stored_files('dedup')).to eq([claim_file('dedup', hashes.first)])
+  end
+
+  example 'the store must be given as dir:path' do
+    result = bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=bad_store',
+                                  '--claim-check-store=s3:bucket')
+
+    expect(result.status.success?).to be_falsey
+    expect(result.captured_error).to include('invalid claim-check store (expected dir:path): s3:bucket')
+  end
+end
@@ -0,0 +1,49 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'parallel encoding', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.postgres_version = '16'
+    TEST_CLUSTER.bottledwater_encode_workers = 2
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  example 'the output plugin starts encoder workers' do
+    workers = postgres.exec("SELECT count(*) FROM pg_stat_activity WHERE backend_type LIKE 'bottledwater encoder%'")
+    expect(workers.getvalue(0, 0)).to eq('2')
+  end
+
+  example 'changes are written out in their original order' do
+    postgres.exec('CREATE TABLE counters (id INTEGER PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO counters (id, n) VALUES (1, 0)')
+    50.times { postgres.exec('UPDATE counters SET n = n + 1') }
+    postgres.exec('DELETE FROM counters')
+
+    messages = kafka_take_messages('counters', 52)
+    values = messages.map {|m| m.value && fetch_int(decode_value(m.value), 'n') }
+    expect(values).to eq((0..50).to_a + [nil])
+  end
+
+  example 'changes to several tables in one transaction keep their order' do
+    postgres.exec('CREATE TABLE lefts (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('CREATE TABLE rights (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+
+    postgres.transaction do |txn|
+      (1..200).each do |i|
+        txn.exec_params("INSERT INTO #{i.even? ? 'lefts' : 'rights'} (n) VALUES ($1)", [i])
+      end
+    end
+
+    lefts = kafka_take_messages('lefts', 100).map {|m| fetch_int(decode_value(m.value), 'n') }
+    rights = kafka_take_messages('rights', 100).map {|m| fetch_int(decode_value(m.value), 'n') }
+    expect(lefts).to eq((1..200).select(&:even?))
+    expect(rights).to eq((1..200).select(&:odd?))
+  end
+end
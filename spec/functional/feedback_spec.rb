@@ -0,0 +1,92 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'feedback to Postgres', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  def start_with_feedback(name, mode)
+    bottledwater_process("--postgres=#{bottledwater_conninfo} application_name=#{name}",
+                         "--slot=#{name}", "--topic-prefix=#{name}", "--feedback=#{mode}",
+                         log: "/tmp/#{name}.log")
+    sleep 5
+  end
+
+  def current_location
+    postgres.exec('SELECT pg_current_xlog_location()').getvalue(0, 0)
+  end
+
+  # The replication connection with the given application_name, as seen by the
+  # server: its reported positions and whether it is a synchronous standby.
+  def replication_status(name)
+    postgres.exec_params('SELECT * FROM pg_stat_replication WHERE application_name = $1', [name]).first
+  end
+
+  # Whether the client has reported the given position as flushed.
+  def flushed?(name, location)
+    lag = postgres.exec_params('SELECT pg_xlog_location_diff($1, flush_location) FROM pg_stat_replication ' \
+                               'WHERE application_name = $2', [location, name]).getvalue(0, 0)
+    Integer(lag) <= 0
+  end
+
+  example 'by default, acknowledged changes are reported within a second' do
+    postgres.exec('CREATE TABLE adaptive (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO adaptive (n) VALUES (1)')
+    location = current_location
+
+    kafka_take_messages('adaptive', 1)
+    sleep 1
+
+    expect(flushed?('bottledwater', location)).to be_truthy
+  end
+
+  example '--feedback=periodic reports at least every 10 seconds' do
+    start_with_feedback('periodic', 'periodic')
+
+    postgres.exec('CREATE TABLE periodic_items (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO periodic_items (n) VALUES (1)')
+    location = current_location
+
+    kafka_take_messages('periodic.periodic_items', 1)
+    sleep 11
+
+    expect(flushed?('periodic', location)).to be_truthy
+    expect(bottledwater_process_log('/tmp/periodic.log')).not_to match(/\[ERROR\]/)
+  end
+
+  example '--feedback=sync makes a commit return once its changes are in Kafka' do
+    start_with_feedback('kafka_sync', 'sync')
+    postgres.exec("ALTER SYSTEM SET synchronous_standby_names = 'kafka_sync'")
+    postgres.exec('SELECT pg_reload_conf()')
+    sleep 1
+
+    begin
+      expect(replication_status('kafka_sync').fetch('sync_state')).to eq('sync')
+
+      postgres.exec('CREATE TABLE synced (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+      postgres.exec('INSERT INTO synced (n) SELECT * FROM generate_series(1, 10) AS n')
+      location = current_location
+
+      # The commit has returned, so everything up to it has been reported as
+      # written, flushed and applied, without waiting for a periodic update.
+      expect(flushed?('kafka_sync', location)).to be_truthy
+      status = replication_status('kafka_sync')
+      expect(status.fetch('write_location')).to eq(status.fetch('flush_location'))
+      expect(status.fetch('replay_location')).to eq(status.fetch('flush_location'))
+
+      messages = kafka_take_messages('kafka_sync.synced', 10)
+      expect(messages.map {|m| fetch_int(decode_value(m.value), 'n') }).to eq((1..10).to_a)
+    ensure
+      postgres.exec('ALTER SYSTEM RESET synchronous_standby_names')
+      postgres.exec('SELECT pg_reload_conf()')
+    end
+  end
+end
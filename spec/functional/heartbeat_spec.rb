@@ -0,0 +1,74 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'heartbeats', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+
+    # confirmed_flush_lsn needs Postgres 9.6 or later
+    TEST_CLUSTER.postgres_version = '16'
+    TEST_CLUSTER.bottledwater_heartbeat_interval = 1
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+  let(:kazoo) { TEST_CLUSTER.kazoo }
+
+  def confirmed_flush_lsn
+    postgres.exec("SELECT confirmed_flush_lsn FROM pg_replication_slots WHERE slot_name = 'bottledwater'").
+      getvalue(0, 0)
+  end
+
+  example 'the slot advances while the exported database is idle' do
+    before = confirmed_flush_lsn
+
+    # Write WAL that the slot has no reason to confirm: it belongs to another database.
+    postgres.exec('CREATE DATABASE elsewhere')
+    sleep 3
+
+    advanced = postgres.exec_params('SELECT pg_wal_lsn_diff($1::pg_lsn, $2::pg_lsn) > 0',
+                                    [confirmed_flush_lsn, before]).getvalue(0, 0)
+    expect(advanced).to eq('t')
+  end
+
+  example 'heartbeats update the heartbeat table' do
+    sleep 2
+
+    recent = postgres.exec(%{SELECT beat_time > now() - interval '5 seconds' FROM bottledwater_heartbeat
+                             WHERE slot_name = 'bottledwater'})
+    expect(recent.ntuples).to eq(1)
+    expect(recent.getvalue(0, 0)).to eq('t')
+  end
+
+  example 'heartbeats are not published to Kafka' do
+    postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO items (item) VALUES (42)')
+    sleep 3
+
+    kazoo.reset_metadata
+    expect(kazoo.topics).to have_key('items')
+    expect(kazoo.topics).not_to have_key('bottledwater_heartbeat')
+  end
+
+  example 'a failed heartbeat is logged and retried without stopping replication' do
+    postgres.exec('ALTER TABLE bottledwater_heartbeat RENAME TO bottledwater_heartbeat_moved')
+    begin
+      sleep 3
+      expect(TEST_CLUSTER.bottledwater_log).to match(/Heartbeat on slot "bottledwater" failed, retrying in 1 seconds/)
+      expect(TEST_CLUSTER.bottledwater_running?).to be_truthy
+    ensure
+      postgres.exec('ALTER TABLE bottledwater_heartbeat_moved RENAME TO bottledwater_heartbeat')
+    end
+
+    postgres.exec('CREATE TABLE things (id SERIAL PRIMARY KEY, thing INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO things (thing) VALUES (42)')
+    sleep 1
+
+    messages = kafka_take_messages('things', 1)
+    expect(fetch_int(decode_value(messages.first.value), 'thing')).to eq(42)
+  end
+end
@@ -0,0 +1,83 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'priority lanes', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  LANES_METRICS_PORT = 9188
+
+  def start_with_lanes(name, *lanes)
+    bottledwater_process("--postgres=#{bottledwater_conninfo}", "--slot=#{name}", "--topic-prefix=#{name}",
+                         "--metrics-port=#{LANES_METRICS_PORT}", *lanes.map {|lane| "--lane=#{lane}" },
+                         log: "/tmp/#{name}.log")
+    sleep 3
+  end
+
+  def scrape
+    TEST_CLUSTER.bottledwater_exec('bash', '-c', %{
+      exec 3<>/dev/tcp/localhost/#{LANES_METRICS_PORT} &&
+      printf 'GET /metrics HTTP/1.0\\r\\n\\r\\n' >&3 &&
+      cat <&3
+    }).captured_output
+  end
+
+  def sample(body, name, labels)
+    line = body.split("\n").detect {|l| l.start_with?("#{name}{#{labels}} ") }
+    line && Float(line.split(' ').last)
+  end
+
+  example 'tables in different lanes are delivered, each in commit order' do
+    start_with_lanes('laned', 'critical:8:10:orders,payments', 'default:1:50')
+
+    %w(orders payments bulk).each do |table|
+      postgres.exec("CREATE TABLE #{table} (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)")
+    end
+    postgres.transaction do |txn|
+      txn.exec('INSERT INTO bulk (n) SELECT * FROM generate_series(1, 2000) AS n')
+      (1..20).each do |n|
+        txn.exec_params('INSERT INTO orders (n) VALUES ($1)', [n])
+        txn.exec_params('INSERT INTO payments (n) VALUES ($1)', [n])
+      end
+    end
+    (21..40).each {|n| postgres.exec_params('INSERT INTO orders (n) VALUES ($1)', [n]) }
+
+    { 'orders' => 40, 'payments' => 20, 'bulk' => 2000 }.each do |table, count|
+      messages = kafka_take_messages("laned.#{table}", count, wait: 10)
+      expect(messages.map {|m| fetch_int(decode_value(m.value), 'n') }).to eq((1..count).to_a)
+    end
+
+    body = scrape
+    expect(sample(body, 'bottledwater_lane_messages_sent_total', 'lane="critical"')).to eq(60)
+    expect(sample(body, 'bottledwater_lane_messages_sent_total', 'lane="default"')).to be >= 2000
+    %w(critical default).each do |lane|
+      expect(sample(body, 'bottledwater_lane_queue_length', %{lane="#{lane}"})).to eq(0)
+      expect(sample(body, 'bottledwater_lane_messages_in_flight', %{lane="#{lane}",sink="kafka:9092"})).to eq(0)
+    end
+
+    expect(bottledwater_process_log('/tmp/laned.log')).not_to match(/\[ERROR\]/)
+  end
+
+  example 'a table may only be listed in one lane' do
+    result = bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=overlapping',
+                                  '--lane=first:1:0:orders', '--lane=second:1:0:orders')
+
+    expect(result.status.success?).to be_falsey
+    expect(result.captured_error).to include('table orders is listed in both lane first and lane second')
+  end
+
+  example 'a lane must be given as name:weight:max_in_flight:tables' do
+    result = bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=malformed', '--lane=fast')
+
+    expect(result.status.success?).to be_falsey
+    expect(result.captured_error).to include('invalid lane (expected name:weight:max_in_flight[:tables]): fast')
+  end
+end
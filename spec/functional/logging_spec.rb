@@ -0,0 +1,75 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'logging', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.bottledwater_on_error = :log
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  # Creates tables in one transaction and writes a row to each, so that Bottled
+  # Water opens their topics, and logs that it does, within a second.
+  def create_tables(names)
+    postgres.transaction do |txn|
+      names.each do |name|
+        txn.exec("CREATE TABLE #{name} (id SERIAL PRIMARY KEY)")
+        txn.exec("INSERT INTO #{name} DEFAULT VALUES")
+      end
+    end
+    sleep 3
+  end
+
+  example '--log-format=json writes each line as a JSON object' do
+    bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=json_log', '--topic-prefix=json_log',
+                         '--log-format=json', log: '/tmp/json_log.log')
+    sleep 3
+    create_tables(%w(json_logged))
+
+    lines = bottledwater_process_log('/tmp/json_log.log').lines.map(&:chomp).reject(&:empty?)
+    expect(lines).not_to be_empty
+
+    entries = lines.map {|line| JSON.parse(line) }
+    entries.each do |entry|
+      expect(entry.keys).to eq(%w(time level message))
+      expect(entry.fetch('time')).to match(/\A\d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{3}Z\z/)
+      expect(%w(DEBUG INFO WARN ERROR)).to include(entry.fetch('level'))
+    end
+    expect(entries.map {|entry| entry.fetch('message') }).to include(
+      'Opening Kafka topic "json_log.json_logged" for table "json_logged"')
+  end
+
+  example 'repeated messages from one place are rate limited and counted' do
+    names = (1..30).map {|i| "limited#{i}" }
+    create_tables(names)
+
+    log = TEST_CLUSTER.bottledwater_log
+    shown = log.scan(/^\[INFO\] Opening Kafka topic "limited\d+"/).size
+    suppressed = log.scan(/^\[WARN\] Suppressed (\d+) more messages from \S*table_mapper\.c:\d+ like: Opening Kafka topic/)
+                    .map {|(count)| Integer(count) }
+
+    expect(suppressed).not_to be_empty
+    expect(shown).to be < names.size
+    expect(shown + suppressed.inject(:+)).to eq(names.size)
+
+    # Nothing is lost from the stream itself
+    names.each {|name| expect(kafka_take_messages(name, 1).size).to eq(1) }
+  end
+
+  example 'errors are never suppressed' do
+    postgres.exec('CREATE TABLE big_events (id SERIAL PRIMARY KEY, event TEXT)')
+    postgres.exec("INSERT INTO big_events (event) SELECT repeat('x', 2000000) FROM generate_series(1, 15)")
+    sleep 5
+
+    log = TEST_CLUSTER.bottledwater_log
+    expect(log.scan(/^\[ERROR\] .*Failed to produce to Kafka \(topic big_events,/).size).to eq(15)
+    expect(log).not_to match(/Suppressed \d+ more messages .* like: .*Failed to produce/)
+    expect(TEST_CLUSTER.bottledwater_running?).to be_truthy
+  end
+end
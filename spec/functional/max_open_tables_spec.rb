@@ -0,0 +1,56 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'limiting open tables', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.bottledwater_max_open_tables = 2
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  ROUND_ROBIN_TABLES = %w(alpha beta gamma delta epsilon)
+
+  example 'changes to more tables than are kept open are all delivered in order' do
+    ROUND_ROBIN_TABLES.each do |table|
+      postgres.exec("CREATE TABLE #{table} (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)")
+    end
+
+    # Round-robin over the tables, so that each write closes the topic of the
+    # table that is written to next.
+    (1..10).each do |n|
+      ROUND_ROBIN_TABLES.each do |table|
+        postgres.exec_params("INSERT INTO #{table} (n) VALUES ($1)", [n])
+      end
+    end
+
+    ROUND_ROBIN_TABLES.each do |table|
+      messages = kafka_take_messages(table, 10)
+      expect(messages.map {|m| fetch_int(decode_value(m.value), 'n') }).to eq((1..10).to_a)
+    end
+    expect(TEST_CLUSTER.bottledwater_running?).to be_truthy
+  end
+
+  example 'a table whose topic was closed picks up a schema change' do
+    postgres.exec('CREATE TABLE people (id SERIAL PRIMARY KEY, name TEXT NOT NULL)')
+    postgres.exec("INSERT INTO people (name) VALUES ('before')")
+
+    # Push the table out of the open set
+    %w(others1 others2).each do |table|
+      postgres.exec("CREATE TABLE #{table} (id SERIAL PRIMARY KEY)")
+      postgres.exec("INSERT INTO #{table} DEFAULT VALUES")
+    end
+
+    postgres.exec('ALTER TABLE people ADD COLUMN age INTEGER')
+    postgres.exec("INSERT INTO people (name, age) VALUES ('after', 42)")
+
+    before, after = kafka_take_messages('people', 2).map {|m| decode_value(m.value) }
+    expect(fetch_string(before, 'name')).to eq('before')
+    expect(fetch_int(after, 'age')).to eq(42)
+  end
+end
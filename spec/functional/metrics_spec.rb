@@ -0,0 +1,116 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'metrics', functional: true, format: :json do
+  METRICS_PORT = 9187
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  # Scrapes the metrics endpoint from inside the Bottled Water container, using
+  # bash's /dev/tcp so that the image needs no HTTP client.
+  def scrape(host = 'localhost')
+    TEST_CLUSTER.bottledwater_exec('bash', '-c', %{
+      exec 3<>/dev/tcp/#{host}/#{METRICS_PORT} &&
+      printf 'GET /metrics HTTP/1.0\\r\\n\\r\\n' >&3 &&
+      cat <&3
+    })
+  end
+
+  def sample(body, name, labels = nil)
+    series = labels ? "#{name}{#{labels}}" : name
+    line = body.split("\n").detect {|l| l.start_with?("#{series} ") }
+    line && Float(line.split(' ').last)
+  end
+
+  describe 'with --metrics-port' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.bottledwater_metrics_port = METRICS_PORT
+      TEST_CLUSTER.start
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    example 'serves metrics in the Prometheus text format' do
+      result = scrape
+      expect(result.status).to be_success
+
+      response = result.captured_output
+      expect(response).to start_with("HTTP/1.0 200 OK\r\n")
+      expect(response).to include('Content-Type: text/plain; version=0.0.4')
+      expect(response).to include('# TYPE bottledwater_frames_received_total counter')
+      expect(sample(response, 'bottledwater_frames_received_total', 'slot="bottledwater"')).to be > 0
+    end
+
+    example 'counts rows received and produced' do
+      postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+      postgres.exec('INSERT INTO items (item) SELECT * FROM generate_series(1, 10) AS item')
+      postgres.exec('DELETE FROM items WHERE item > 7')
+      kafka_take_messages('items', 13)
+
+      body = scrape.captured_output
+      expect(sample(body, 'bottledwater_rows_received_total', 'op="insert"')).to be >= 10
+      expect(sample(body, 'bottledwater_rows_received_total', 'op="delete"')).to be >= 3
+      expect(sample(body, 'bottledwater_table_rows_produced_total', 'slot="bottledwater",table="items"')).to eq(13)
+    end
+
+    example 'breaks the latency of delivered messages down by stage' do
+      postgres.exec('CREATE TABLE events (id SERIAL PRIMARY KEY, event TEXT)')
+      postgres.exec("INSERT INTO events (event) SELECT 'event ' || n FROM generate_series(1, 5) AS n")
+      kafka_take_messages('events', 5)
+      sleep 1
+
+      body = scrape.captured_output
+      %w(decode network client enqueue delivery).each do |stage|
+        count = sample(body, 'bottledwater_stage_latency_seconds_count', %(stage="#{stage}"))
+        expect(count).to be >= 5
+      end
+      count = sample(body, 'bottledwater_table_commit_latency_seconds_count', 'slot="bottledwater",table="events"')
+      expect(count).to eq(5)
+    end
+
+    example 'answers repeated scrapes without holding up replication' do
+      postgres.exec('CREATE TABLE things (id SERIAL PRIMARY KEY, thing INTEGER NOT NULL)')
+
+      5.times do |i|
+        postgres.exec_params('INSERT INTO things (thing) VALUES ($1)', [i])
+        expect(scrape.status).to be_success
+      end
+
+      messages = kafka_take_messages('things', 5)
+      expect(messages.map {|m| fetch_int(decode_value(m.value), 'thing') }).to eq((0...5).to_a)
+    end
+
+    example 'listens on all interfaces by default' do
+      result = scrape('$(hostname -i | cut -d" " -f1)')
+      expect(result.status).to be_success
+      expect(result.captured_output).to start_with("HTTP/1.0 200 OK\r\n")
+    end
+  end
+
+  describe 'with --metrics-address=127.0.0.1' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.bottledwater_metrics_port = METRICS_PORT
+      TEST_CLUSTER.bottledwater_metrics_address = '127.0.0.1'
+      TEST_CLUSTER.start
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    example 'answers scrapes on the loopback interface' do
+      result = scrape('127.0.0.1')
+      expect(result.status).to be_success
+      expect(result.captured_output).to start_with("HTTP/1.0 200 OK\r\n")
+    end
+
+    example 'does not listen on other interfaces' do
+      result = scrape('$(hostname -i | cut -d" " -f1)')
+      expect(result.status).to_not be_success
+    end
+  end
+end
@@ -0,0 +1,58 @@
+require 'spec_helper'
+require 'format_contexts'
+
+# The test cluster only has one Kafka broker, so these specs give it twice to
+# make two sinks, or pair it with a broker that does not exist.
+describe 'multiple Kafka clusters', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  example 'every message is written to each cluster' do
+    postgres.exec('CREATE TABLE things (id SERIAL PRIMARY KEY, thing INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO things (thing) VALUES (1)')
+
+    bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=twice', '--topic-prefix=twice',
+                         '--broker=kafka:9092', log: '/tmp/twice.log')
+    sleep 5
+
+    postgres.exec('INSERT INTO things (thing) VALUES (2)')
+    sleep 1
+
+    messages = kafka_take_messages('twice.things', 4)
+    values = messages.map {|m| fetch_int(decode_value(m.value), 'thing') }
+    expect(values.sort).to eq([1, 1, 2, 2])
+  end
+
+  example 'with --sink-detach-lag, a cluster that does not acknowledge is detached' do
+    postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+
+    bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=detach', '--topic-prefix=detach',
+                         '--broker=nowhere:9092', '--sink-detach-lag=2', log: '/tmp/detach.log')
+    sleep 5
+
+    postgres.exec('INSERT INTO items (item) VALUES (1)')
+    sleep 5
+    postgres.exec('INSERT INTO items (item) VALUES (2)')
+    sleep 1
+
+    messages = kafka_take_messages('detach.items', 2)
+    expect(messages.map {|m| fetch_int(decode_value(m.value), 'item') }).to eq([1, 2])
+
+    log = bottledwater_process_log('/tmp/detach.log')
+    expect(log).to match(/Detaching sink nowhere:9092: it has not acknowledged xid \d+/)
+  end
+
+  example '--sink-detach-lag needs several --broker options' do
+    result = bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=lonely', '--sink-detach-lag=2')
+    expect(result.status).to_not be_success
+    expect(result.captured_error).to include('--sink-detach-lag only makes sense with several --broker options')
+  end
+end
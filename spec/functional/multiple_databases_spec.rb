@@ -0,0 +1,53 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'multiple databases', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+
+    TEST_CLUSTER.postgres.exec('CREATE DATABASE orders')
+    TEST_CLUSTER.postgres.exec('CREATE DATABASE users')
+    %w(orders users).each {|dbname| psql(dbname, 'CREATE EXTENSION bottledwater') }
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  example 'one process streams each database to its own topics' do
+    %w(orders users).each do |dbname|
+      psql(dbname, 'CREATE TABLE items (id SERIAL PRIMARY KEY, db TEXT NOT NULL)')
+      psql(dbname, "INSERT INTO items (db) VALUES ('#{dbname} snapshot')")
+    end
+
+    bottledwater_process("--postgres=#{bottledwater_conninfo('orders')}", '--slot=orders', '--topic-prefix=orders',
+                         "--postgres=#{bottledwater_conninfo('users')}", '--slot=users', '--topic-prefix=users',
+                         log: '/tmp/multiple_databases.log')
+    sleep 5
+
+    %w(orders users).each do |dbname|
+      psql(dbname, "INSERT INTO items (db) VALUES ('#{dbname} stream')")
+    end
+    sleep 1
+
+    %w(orders users).each do |dbname|
+      messages = kafka_take_messages("#{dbname}.items", 2)
+      values = messages.map {|m| fetch_string(decode_value(m.value), 'db') }
+      expect(values).to eq(["#{dbname} snapshot", "#{dbname} stream"])
+    end
+
+    slots = TEST_CLUSTER.postgres.exec("SELECT slot_name, database FROM pg_replication_slots " \
+                                       "WHERE slot_name IN ('orders', 'users') ORDER BY slot_name")
+    expect(slots.map {|row| [row['slot_name'], row['database']] }).to eq([%w(orders orders), %w(users users)])
+
+    expect(bottledwater_process_log('/tmp/multiple_databases.log')).not_to include('have the same topic prefix')
+  end
+
+  example 'a --slot is required for each database' do
+    result = bottledwater_process("--postgres=#{bottledwater_conninfo('orders')}",
+                                  "--postgres=#{bottledwater_conninfo('users')}", '--slot=orders')
+    expect(result.status).to_not be_success
+    expect(result.captured_error).to include('give a --slot for each --postgres option')
+  end
+end
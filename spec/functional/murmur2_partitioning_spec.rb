@@ -0,0 +1,106 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'test_cluster'
+
+# MurmurHash2 as implemented by org.apache.kafka.common.utils.Utils.murmur2(),
+# returning the hash as an unsigned 32-bit integer.
+def java_murmur2(data)
+  m = 0x5bd1e995
+  mask = 0xffffffff
+  bytes = data.bytes
+  h = (0x9747b28c ^ bytes.size) & mask
+
+  whole = bytes.size / 4 * 4
+  bytes.take(whole).each_slice(4) do |b0, b1, b2, b3|
+    k = (b0 | (b1 << 8) | (b2 << 16) | (b3 << 24)) * m & mask
+    k = (k ^ (k >> 24)) * m & mask
+    h = (h * m & mask) ^ k
+  end
+
+  tail = bytes.drop(whole)
+  unless tail.empty?
+    tail.each_with_index {|b, i| h ^= b << (8 * i) }
+    h = h * m & mask
+  end
+
+  h = (h ^ (h >> 13)) * m & mask
+  h ^ (h >> 15)
+end
+
+shared_examples 'murmur2 partitioning' do |format|
+  before(:context) do
+    TEST_CLUSTER.bottledwater_format = format
+    TEST_CLUSTER.bottledwater_partitioner = :murmur2
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+  let(:kazoo) { TEST_CLUSTER.kazoo }
+
+  # The part of a key that is hashed: in Avro mode, the schema ID prefix is left out.
+  def hashed_key(key)
+    TEST_CLUSTER.bottledwater_format == :avro ? key.byteslice(5..-1) : key
+  end
+
+  def java_partition(key, partitions)
+    (java_murmur2(hashed_key(key)) & 0x7fffffff) % partitions
+  end
+
+  example 'the hash matches the Java client for its test vectors' do
+    {
+      '21' => -973932308,
+      'foobar' => -790332482,
+      'a-little-bit-long-string' => -985981536,
+      'a-little-bit-longer-string' => -1486304829,
+      'lkjh234lh9fiuh90y23oiuhsafujhadof229phr9h19h89h8' => -58897971,
+      'abc' => 479470107,
+    }.each do |input, java_hash|
+      expect(java_murmur2(input)).to eq(java_hash & 0xffffffff)
+    end
+  end
+
+  example 'keyed messages go to the partition the Java client would choose' do
+    kazoo.create_topic('hashed_items', partitions: 3, replication_factor: 1)
+
+    postgres.exec('CREATE TABLE hashed_items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO hashed_items (item) SELECT * FROM generate_series(1, 60) AS item')
+    sleep 1
+
+    partitions = kafka_take_messages('hashed_items', 60, collect_partitions: true)
+    expect(partitions.size).to eq(3)
+
+    partitions.each do |partition, messages|
+      messages.each {|message| expect(java_partition(message.key, 3)).to eq(partition) }
+    end
+  end
+
+  example 'updates and deletes stay in the partition of their key' do
+    kazoo.create_topic('hashed_things', partitions: 3, replication_factor: 1)
+
+    postgres.exec('CREATE TABLE hashed_things (name TEXT PRIMARY KEY, thing INTEGER NOT NULL)')
+    postgres.exec("INSERT INTO hashed_things SELECT 'thing ' || n, n FROM generate_series(1, 20) AS n")
+    postgres.exec('UPDATE hashed_things SET thing = thing + 1')
+    postgres.exec('DELETE FROM hashed_things')
+
+    partitions = kafka_take_messages('hashed_things', 60, collect_partitions: true)
+    partitions.each do |partition, messages|
+      messages.group_by(&:key).each do |key, messages_for_key|
+        expect(messages_for_key.size).to eq(3)
+        expect(java_partition(key, 3)).to eq(partition)
+      end
+    end
+  end
+end
+
+
+describe 'murmur2 partitioning (JSON)', functional: true, format: :json do
+  include_examples 'murmur2 partitioning', :json
+end
+
+describe 'murmur2 partitioning (Avro)', functional: true, format: :avro do
+  include_examples 'murmur2 partitioning', :avro
+end
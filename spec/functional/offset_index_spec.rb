@@ -0,0 +1,55 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'offset index', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  def lsn_value(lsn)
+    hi, lo = lsn.split('/').map {|half| Integer(half, 16) }
+    (hi << 32) | lo
+  end
+
+  example 'checkpoints are recorded with the offsets they reached' do
+    bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=indexed', '--topic-prefix=indexed',
+                         '--offset-index-topic=indexed_offsets', log: '/tmp/indexed.log')
+    sleep 3
+
+    postgres.exec('CREATE TABLE indexed_items (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO indexed_items (n) SELECT * FROM generate_series(1, 5) AS n')
+    location = lsn_value(postgres.exec('SELECT pg_current_xlog_location()').getvalue(0, 0))
+
+    # Records are written at most every 10 seconds
+    sleep 11
+    postgres.exec('INSERT INTO indexed_items (n) VALUES (6)')
+    sleep 11
+
+    records = kafka_take_all('indexed_offsets', wait: 10)
+    expect(records).not_to be_empty
+
+    keys = records.map(&:key)
+    keys.each {|key| expect(key).to match(%r{\Aindexed/[0-9A-F]{16}\z}) }
+    expect(keys).to eq(keys.sort)
+
+    values = records.map {|record| JSON.parse(record.value) }
+    values.zip(keys).each do |value, key|
+      expect(value.fetch('slot')).to eq('indexed')
+      expect(lsn_value(value.fetch('commit_lsn'))).to eq(Integer(key.split('/').last, 16))
+      expect(value.fetch('commit_time')).to match(/\A\d{4}-\d\d-\d\dT\d\d:\d\d:\d\d\.\d{6}Z\z/)
+    end
+
+    # A checkpoint past the insert of five rows has reached at least offset 4
+    covering = values.find {|value| lsn_value(value.fetch('commit_lsn')) >= location }
+    expect(covering).not_to be_nil
+    offsets = covering.fetch('offsets').select {|offset| offset.fetch('topic') == 'indexed.indexed_items' }
+    expect(offsets.map {|offset| offset.fetch('last_offset') }.inject(:+)).to be >= 4
+  end
+end
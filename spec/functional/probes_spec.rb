@@ -0,0 +1,39 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'USDT probes', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  # The build images install <sys/sdt.h>, so each probe should be recorded in the
+  # binary's .note.stapsdt section, which holds the provider and probe names as
+  # plain strings.
+  def probe_names(binary)
+    result = TEST_CLUSTER.bottledwater_exec('grep', '-a', '-o', '-E', '[a-z]+__[a-z]+|\bsend\b|\bdeliver\b|\bcheckpoint\b',
+                                            "/usr/local/bin/#{binary}")
+    expect(result.status).to be_success
+    result.captured_output.split("\n").uniq
+  end
+
+  def has_stapsdt_note?(binary)
+    TEST_CLUSTER.bottledwater_exec('grep', '-a', '-q', 'stapsdt', "/usr/local/bin/#{binary}").status.success?
+  end
+
+  %w(bottledwater bwtest bwload).each do |binary|
+    example "#{binary} has the client's frame probes" do
+      expect(has_stapsdt_note?(binary)).to be_truthy
+      expect(probe_names(binary)).to include('frame__start', 'frame__done')
+    end
+  end
+
+  example "bottledwater has the Kafka client's probes" do
+    expect(probe_names('bottledwater')).to include(
+      'send', 'backpressure__start', 'backpressure__done', 'deliver', 'checkpoint')
+  end
+end
@@ -0,0 +1,80 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'avro'
+require 'stringio'
+
+describe 'protocol versions', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.postgres_version = '16'
+    TEST_CLUSTER.start
+
+    TEST_CLUSTER.postgres.exec("SELECT pg_create_logical_replication_slot('versions', 'bottledwater')")
+    TEST_CLUSTER.postgres.exec('CREATE TABLE things (id SERIAL PRIMARY KEY, thing TEXT NOT NULL)')
+    TEST_CLUSTER.postgres.exec("INSERT INTO things (thing) VALUES ('one')")
+    TEST_CLUSTER.postgres.exec('TRUNCATE things')
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  # Decodes the messages that the output plugin would send from the slot to a
+  # client that asks for the given protocol version, or for none if nil.
+  def messages(protocol_version)
+    postgres.exec("SET bottledwater.protocol_version = #{protocol_version || 1}")
+    schema = Avro::Schema.parse(postgres.exec('SELECT bottledwater_frame_schema()').getvalue(0, 0))
+    reader = Avro::IO::DatumReader.new(schema)
+    option_args = protocol_version ? ", 'protocol_version', '#{protocol_version}'" : ''
+
+    result = postgres.exec_params(
+      "SELECT data FROM pg_logical_slot_peek_binary_changes('versions', NULL, NULL#{option_args})", [], 1)
+    result.flat_map {|row| reader.read(Avro::IO::BinaryDecoder.new(StringIO.new(row['data']))).fetch('msg') }
+  end
+
+  example 'a client that does not ask for a version gets the frames of the first release' do
+    msgs = messages(nil)
+
+    begin_txn = msgs.detect {|msg| msg.keys == ['xid'] }
+    expect(begin_txn).not_to be_nil
+    expect(msgs.select {|msg| msg.key?('lsn') }.map(&:keys)).to all(eq(%w(xid lsn)))
+    expect(msgs.select {|msg| msg.key?('rowSchema') }.map(&:keys)).to all(eq(%w(relid keySchema rowSchema)))
+    expect(msgs.select {|msg| msg.keys == ['relid'] }).to be_empty
+  end
+
+  example 'version 2 adds commit times, fingerprints and truncations' do
+    msgs = messages(2)
+
+    expect(msgs.select {|msg| msg.key?('lsn') }.map(&:keys)).to all(eq(%w(xid lsn commitTime)))
+    expect(msgs.select {|msg| msg.key?('rowSchema') }.map(&:keys)).to all(eq(%w(relid keySchema rowSchema fingerprint)))
+    expect(msgs.select {|msg| msg.keys == ['relid'] }.size).to eq(1)
+  end
+
+  example 'the snapshot functions follow bottledwater.protocol_version' do
+    postgres.exec('SET bottledwater.protocol_version = 1')
+    expect(postgres.exec('SELECT bottledwater_frame_schema()').getvalue(0, 0)).not_to include('commitTime')
+
+    postgres.exec('SET bottledwater.protocol_version = 2')
+    expect(postgres.exec('SELECT bottledwater_frame_schema()').getvalue(0, 0)).to include('commitTime')
+  end
+
+  example 'an unknown version is rejected' do
+    expect {
+      postgres.exec("SELECT data FROM pg_logical_slot_peek_binary_changes('versions', NULL, NULL, " \
+                    "'protocol_version', '3')")
+    }.to raise_error(PG::InvalidParameterValue, /must be an integer between 1 and 2/)
+  end
+
+  example 'the client refuses an extension that has not been updated' do
+    postgres.exec('CREATE DATABASE outdated')
+    psql('outdated', "CREATE EXTENSION bottledwater VERSION '0.1'")
+
+    result = bottledwater_process("--postgres=#{bottledwater_conninfo('outdated')}", '--slot=outdated')
+
+    expect(result.status.success?).to be_falsey
+    expect(result.captured_error).to include(
+      'Extension bottledwater is at version 0.1 in this database, but this client needs version 0.2 or later')
+  end
+end
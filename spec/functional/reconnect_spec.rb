@@ -0,0 +1,65 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'reconnecting', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  # Kills the walsender serving the replication connection with the given
+  # application_name, as happens when the server restarts or fails over.
+  def terminate_walsender(name)
+    terminated = postgres.exec_params('SELECT pg_terminate_backend(pid) FROM pg_stat_replication ' \
+                                      'WHERE application_name = $1', [name])
+    expect(terminated.ntuples).to eq(1)
+  end
+
+  def slot_active?(slot)
+    postgres.exec_params('SELECT active FROM pg_replication_slots WHERE slot_name = $1', [slot]).getvalue(0, 0) == 't'
+  end
+
+  example 'streaming resumes after the replication connection is lost' do
+    postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO items (item) SELECT * FROM generate_series(1, 5) AS item')
+    kafka_take_messages('items', 5)
+
+    terminate_walsender('bottledwater')
+    postgres.exec('INSERT INTO items (item) SELECT * FROM generate_series(6, 10) AS item')
+    sleep 3
+
+    expect(TEST_CLUSTER.bottledwater_running?).to be_truthy
+    expect(slot_active?('bottledwater')).to be_truthy
+
+    # The transaction in flight when the connection failed may be sent again.
+    messages = kafka_take_messages('items', 10)
+    expect(messages.map {|m| fetch_int(decode_value(m.value), 'item') }.uniq).to eq((1..10).to_a)
+
+    log = TEST_CLUSTER.bottledwater_log
+    expect(log).to include('Replication from slot "bottledwater" failed')
+    expect(log).to match(/Reconnecting slot "bottledwater" \(attempt 1 of 10\), resuming from/)
+    expect(log).to include('Resumed streaming from slot "bottledwater".')
+  end
+
+  example '--reconnect-attempts=0 exits when the replication connection is lost' do
+    bottledwater_process("--postgres=#{bottledwater_conninfo} application_name=no_reconnect",
+                         '--slot=no_reconnect', '--topic-prefix=no_reconnect', '--reconnect-attempts=0',
+                         log: '/tmp/no_reconnect.log')
+    sleep 5
+    expect(slot_active?('no_reconnect')).to be_truthy
+
+    terminate_walsender('no_reconnect')
+    sleep 2
+
+    expect(slot_active?('no_reconnect')).to be_falsey
+    log = bottledwater_process_log('/tmp/no_reconnect.log')
+    expect(log).not_to include('Reconnecting slot "no_reconnect"')
+    expect(TEST_CLUSTER.bottledwater_running?).to be_truthy
+  end
+end
@@ -0,0 +1,94 @@
+require 'spec_helper'
+require 'format_contexts'
+require 'avro'
+require 'stringio'
+
+describe 'schema fingerprints', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+
+    TEST_CLUSTER.postgres.exec("SELECT pg_create_logical_replication_slot('fingerprints', 'bottledwater')")
+    TEST_CLUSTER.postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item TEXT NOT NULL)')
+    TEST_CLUSTER.postgres.exec("INSERT INTO items (item) VALUES ('one')")
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  CRC64_AVRO_EMPTY = 0xc15d213aa4d7a795
+  CRC64_AVRO_TABLE = (0...256).map do |i|
+    8.times.inject(i) {|entry, _| (entry >> 1) ^ (CRC64_AVRO_EMPTY & -(entry & 1)) }
+  end.freeze
+
+  # The Avro CRC-64 of the row schema JSON and then the key schema JSON, each
+  # followed by a null byte, as computed by the extension and the client.
+  def fingerprint(row_schema, key_schema)
+    [row_schema, key_schema].compact.inject(CRC64_AVRO_EMPTY) do |fp, json|
+      (json.b + "\0").each_byte.inject(fp) {|f, byte| (f >> 8) ^ CRC64_AVRO_TABLE[(f ^ byte) & 0xff] }
+    end
+  end
+
+  # Decodes the frames that the output plugin would send from the slot, given
+  # the plugin options as name, value pairs. Fingerprints are only sent from
+  # version 2 of the protocol.
+  def frames(*options)
+    postgres.exec('SET bottledwater.protocol_version = 2')
+    schema = Avro::Schema.parse(postgres.exec('SELECT bottledwater_frame_schema()').getvalue(0, 0))
+    reader = Avro::IO::DatumReader.new(schema)
+    option_args = (['protocol_version', '2'] + options).map {|option| ", #{postgres.escape_literal(option)}" }.join
+
+    result = postgres.exec_params(
+      "SELECT data FROM pg_logical_slot_peek_binary_changes('fingerprints', NULL, NULL#{option_args})", [], 1)
+    result.map {|row| reader.read(Avro::IO::BinaryDecoder.new(StringIO.new(row['data']))) }
+  end
+
+  def table_schemas(*options)
+    frames(*options).flat_map {|frame| frame.fetch('msg') }.select {|msg| msg.key?('fingerprint') }
+  end
+
+  def unsigned(fingerprint)
+    fingerprint & 0xffff_ffff_ffff_ffff
+  end
+
+  example 'each table schema carries the CRC-64-AVRO fingerprint of its JSON' do
+    schemas = table_schemas
+    expect(schemas.size).to eq(1)
+
+    schema = schemas.first
+    expect(schema.fetch('keySchema')).not_to be_nil
+    expect(unsigned(schema.fetch('fingerprint'))).to eq(fingerprint(schema.fetch('rowSchema'), schema.fetch('keySchema')))
+  end
+
+  example 'the fingerprint matches the schemas returned by the SQL functions' do
+    row_schema = postgres.exec("SELECT bottledwater_row_schema('items')").getvalue(0, 0)
+    key_schema = postgres.exec("SELECT bottledwater_key_schema('items')").getvalue(0, 0)
+
+    expect(unsigned(table_schemas.first.fetch('fingerprint'))).to eq(fingerprint(row_schema, key_schema))
+  end
+
+  example 'schemas that the client already has are sent as their fingerprint only' do
+    known = unsigned(table_schemas.first.fetch('fingerprint'))
+
+    schema = table_schemas('known_schemas', format('%x', known)).first
+    expect(unsigned(schema.fetch('fingerprint'))).to eq(known)
+    expect(schema.fetch('keySchema')).to be_nil
+    expect(schema.fetch('rowSchema')).to eq('')
+  end
+
+  example 'schemas with other fingerprints are sent in full' do
+    known = unsigned(table_schemas.first.fetch('fingerprint'))
+
+    schema = table_schemas('known_schemas', format('%x', known ^ 1)).first
+    expect(unsigned(schema.fetch('fingerprint'))).to eq(known)
+    expect(schema.fetch('rowSchema')).not_to be_empty
+  end
+
+  example 'a malformed list of known schemas is rejected' do
+    expect { frames('known_schemas', 'not-a-fingerprint') }.to raise_error(
+      PG::InvalidParameterValue, /must be a comma-separated list of hexadecimal fingerprints/)
+  end
+end
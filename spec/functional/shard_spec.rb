@@ -0,0 +1,77 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'sharding', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+  let(:kazoo) { TEST_CLUSTER.kazoo }
+
+  TABLES = %w(apples bananas cherries dates elderberries figs).freeze
+
+  # Starts one process per shard, each with its own slot and topic prefix
+  # (name followed by the shard index).
+  def start_shards(name, *options)
+    2.times do |i|
+      bottledwater_process("--postgres=#{bottledwater_conninfo}", "--slot=#{name}#{i}",
+                           "--topic-prefix=#{name}#{i}", "--shard=#{i}/2", *options,
+                           log: "/tmp/#{name}#{i}.log")
+    end
+    sleep 5
+  end
+
+  def topic_exists?(topic)
+    kazoo.reset_metadata
+    kazoo.topics.key?(topic)
+  end
+
+  example 'each table is exported by exactly one shard' do
+    TABLES.each do |table|
+      postgres.exec("CREATE TABLE #{table} (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)")
+      postgres.exec("INSERT INTO #{table} (n) SELECT * FROM generate_series(1, 5) AS n")
+    end
+
+    start_shards('tables')
+
+    TABLES.each do |table|
+      postgres.exec("INSERT INTO #{table} (n) SELECT * FROM generate_series(6, 10) AS n")
+    end
+    sleep 2
+
+    owners = TABLES.map do |table|
+      shards = (0..1).select {|i| topic_exists?("tables#{i}.#{table}") }
+      expect(shards.size).to eq(1), "expected #{table} in one shard, but found it in #{shards.inspect}"
+
+      messages = kafka_take_messages("tables#{shards.first}.#{table}", 10)
+      expect(messages.map {|m| fetch_int(decode_value(m.value), 'n') }).to eq((1..10).to_a)
+      shards.first
+    end
+
+    # With six tables, both shards should have been given something to do.
+    expect(owners.uniq.sort).to eq([0, 1])
+  end
+
+  example 'rows of --shard-key-tables are spread across all shards' do
+    postgres.exec('CREATE TABLE events (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO events (n) SELECT * FROM generate_series(1, 50) AS n')
+
+    start_shards('keys', '--shard-key-tables=events')
+
+    postgres.exec('INSERT INTO events (n) SELECT * FROM generate_series(51, 100) AS n')
+    sleep 2
+
+    rows = (0..1).map do |i|
+      Set.new(kafka_take_all("keys#{i}.events").map {|m| fetch_int(decode_value(m.value), 'n') })
+    end
+    expect(rows[0] & rows[1]).to be_empty
+    expect(rows[0] | rows[1]).to eq(Set.new(1..100))
+    expect(rows[0].size).to be_within(25).of(rows[1].size)
+  end
+end
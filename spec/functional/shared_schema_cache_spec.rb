@@ -0,0 +1,85 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'shared schema cache', functional: true, format: :json do
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  def preload_extension
+    postgres.exec("ALTER SYSTEM SET shared_preload_libraries = 'bottledwater'")
+    TEST_CLUSTER.restart_postgres
+    # Bottled Water reconnects after the restart
+    sleep 5
+  end
+
+  shared_examples 'a shared schema cache' do
+    example 'schemas are reused across connections' do
+      postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+      postgres.exec('INSERT INTO items (item) VALUES (1)')
+
+      # The second process looks up the schema that the first one generated.
+      bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=second', '--topic-prefix=second',
+                           log: '/tmp/second.log')
+      sleep 5
+      postgres.exec('INSERT INTO items (item) VALUES (2)')
+      sleep 1
+
+      %w(items second.items).each do |topic|
+        messages = kafka_take_messages(topic, 2)
+        expect(messages.map {|m| fetch_int(decode_value(m.value), 'item') }).to eq([1, 2])
+      end
+    end
+
+    example 'a schema change replaces the cached schema' do
+      postgres.exec('CREATE TABLE users (id SERIAL PRIMARY KEY, name TEXT NOT NULL)')
+      postgres.exec("INSERT INTO users (name) VALUES ('before')")
+      sleep 1
+      postgres.exec('ALTER TABLE users ADD COLUMN age INTEGER')
+      postgres.exec("INSERT INTO users (name, age) VALUES ('after', 42)")
+
+      before, after = kafka_take_messages('users', 2).map {|m| decode_value(m.value) }
+      expect(before).not_to have_key('age')
+      expect(fetch_int(after, 'age')).to eq(42)
+    end
+  end
+
+  describe 'on Postgres 16' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.postgres_version = '16'
+      TEST_CLUSTER.start
+      preload_extension
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    example 'the cache is allocated in shared memory' do
+      allocations = postgres.exec("SELECT name FROM pg_shmem_allocations WHERE name LIKE 'Bottled Water%' ORDER BY name")
+      expect(allocations.map {|row| row['name'] }).to eq(['Bottled Water schema cache', 'Bottled Water schema cache entries'])
+    end
+
+    it_behaves_like 'a shared schema cache'
+  end
+
+  # Before 9.6, the cache uses an add-in lock rather than a named tranche.
+  describe 'on Postgres 9.5' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.start
+      preload_extension
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    example 'the server starts with the extension preloaded' do
+      setting = postgres.exec('SHOW shared_preload_libraries').getvalue(0, 0)
+      expect(setting).to eq('bottledwater')
+      expect(TEST_CLUSTER.postgres_running?).to be_truthy
+    end
+
+    it_behaves_like 'a shared schema cache'
+  end
+end
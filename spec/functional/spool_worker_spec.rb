@@ -0,0 +1,96 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'spool worker', functional: true, format: :json do
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  def configure_spool(slot)
+    postgres.exec("ALTER SYSTEM SET shared_preload_libraries = 'bottledwater'")
+    postgres.exec("ALTER SYSTEM SET bottledwater.spool_slot = '#{slot}'")
+    postgres.exec("ALTER SYSTEM SET bottledwater.spool_database = 'postgres'")
+    postgres.exec("ALTER SYSTEM SET bottledwater.spool_sync_interval = 100")
+    TEST_CLUSTER.restart_postgres
+  end
+
+  describe 'on Postgres 16' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.postgres_version = '16'
+      TEST_CLUSTER.start
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    def spool_files
+      postgres.exec("SELECT f FROM pg_ls_dir('bottledwater_spool') AS f ORDER BY f").map {|row| row['f'] }
+    end
+
+    def spool_contents(file)
+      result = postgres.exec_params("SELECT pg_read_binary_file('bottledwater_spool/' || $1)", [file], 1)
+      result.getvalue(0, 0)
+    end
+
+    # Splits a spool file into [wal_pos, frame] records, allowing for a partial
+    # record at the end.
+    def spool_records(data)
+      records = []
+      offset = 0
+      while offset + 12 <= data.bytesize
+        wal_pos, length = data.byteslice(offset, 12).unpack('Q>L>')
+        break if offset + 12 + length > data.bytesize
+        records << [wal_pos, data.byteslice(offset + 12, length)]
+        offset += 12 + length
+      end
+      records
+    end
+
+    example 'changes are written to spool files and the slot advances' do
+      postgres.exec("SELECT pg_create_logical_replication_slot('archive', 'bottledwater')")
+      configure_spool('archive')
+      sleep 2
+
+      postgres.exec('CREATE TABLE notes (id SERIAL PRIMARY KEY, note TEXT NOT NULL)')
+      postgres.exec("INSERT INTO notes (note) VALUES ('spooled note one'), ('spooled note two')")
+      sleep 2
+
+      files = spool_files
+      expect(files).not_to be_empty
+      expect(files).to all(match(/\.bwspool$/))
+
+      records = files.flat_map {|file| spool_records(spool_contents(file)) }
+      expect(records).not_to be_empty
+      expect(records.map(&:first)).to eq(records.map(&:first).sort)
+
+      frames = records.map(&:last).join
+      expect(frames).to include('spooled note one')
+      expect(frames).to include('spooled note two')
+
+      confirmed = postgres.exec("SELECT pg_wal_lsn_diff(confirmed_flush_lsn, '0/0') FROM pg_replication_slots " \
+                                "WHERE slot_name = 'archive'").getvalue(0, 0)
+      expect(Integer(confirmed)).to be >= records.first.first
+
+      expect(TEST_CLUSTER.postgres_log).to include('bottledwater spool worker decoding slot "archive"')
+    end
+  end
+
+  describe 'on Postgres 9.5' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.start
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    example 'setting bottledwater.spool_slot logs a warning' do
+      configure_spool('archive')
+      sleep 1
+
+      expect(TEST_CLUSTER.postgres_log).to include(
+        'bottledwater.spool_slot is ignored: the bottledwater spool worker requires Postgres 14 or later')
+    end
+  end
+end
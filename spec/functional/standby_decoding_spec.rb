@@ -0,0 +1,66 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'decoding on a standby', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.postgres_version = '16'
+    TEST_CLUSTER.start
+    @standby = TEST_CLUSTER.start_postgres_standby
+  end
+
+  after(:context) do
+    @standby.close rescue nil
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  def standby_conninfo
+    bottledwater_conninfo.sub('host=postgres', 'host=postgres-16-standby')
+  end
+
+  # Creating a slot on a standby waits for the primary to log a snapshot of
+  # running transactions, which an idle primary does only every 15 seconds.
+  def start_on_standby(slot, *options)
+    bottledwater_process("--postgres=#{standby_conninfo}", "--slot=#{slot}", "--topic-prefix=#{slot}",
+                         *options, log: "/tmp/#{slot}.log")
+    5.times do
+      postgres.exec('SELECT pg_log_standby_snapshot()')
+      sleep 1
+    end
+  end
+
+  example 'changes made on the primary are streamed from the standby' do
+    postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO items (item) SELECT * FROM generate_series(1, 5) AS item')
+    sleep 1
+
+    start_on_standby('on_standby')
+
+    postgres.exec('INSERT INTO items (item) SELECT * FROM generate_series(6, 10) AS item')
+    sleep 2
+
+    messages = kafka_take_messages('on_standby.items', 10)
+    expect(messages.map {|m| fetch_int(decode_value(m.value), 'item') }).to eq((1..10).to_a)
+
+    log = bottledwater_process_log('/tmp/on_standby.log')
+    expect(log).to include('Decoding "on_standby" on a standby server.')
+    expect(log).not_to include('hot_standby_feedback is off')
+
+    slots = @standby.exec("SELECT 1 FROM pg_replication_slots WHERE slot_name = 'on_standby'")
+    expect(slots.ntuples).to eq(1)
+  end
+
+  example 'heartbeats are not sent to a standby' do
+    start_on_standby('standby_heartbeat', '--heartbeat-interval=1')
+    sleep 2
+
+    log = bottledwater_process_log('/tmp/standby_heartbeat.log')
+    expect(log).to include('Heartbeats are disabled for "standby_heartbeat", as a standby is read-only.')
+    expect(log).not_to match(/Heartbeat on slot "standby_heartbeat" failed/)
+
+    beats = postgres.exec("SELECT 1 FROM bottledwater_heartbeat WHERE slot_name = 'standby_heartbeat'")
+    expect(beats.ntuples).to eq(0)
+  end
+end
@@ -0,0 +1,77 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'standby processes', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  # The backends holding the lease on a slot: an advisory lock keyed by its name.
+  def lease_holders(slot = 'bottledwater')
+    postgres.exec_params("SELECT pid, query FROM pg_locks JOIN pg_stat_activity USING (pid) " \
+                         "WHERE locktype = 'advisory' AND granted AND " \
+                         "classid = hashtext('bottledwater')::oid AND objid = hashtext($1)::oid", [slot])
+  end
+
+  example 'a second process for a leased slot exits' do
+    result = bottledwater_process("--postgres=#{bottledwater_conninfo}", '--slot=bottledwater')
+
+    expect(result.status.success?).to be_falsey
+    expect(result.captured_error).to include('Replication slot "bottledwater" is leased by another Bottled Water')
+    expect(TEST_CLUSTER.bottledwater_running?).to be_truthy
+  end
+
+  example 'the lease connection is probed with a query' do
+    sleep 2
+    holders = lease_holders
+    expect(holders.ntuples).to eq(1)
+    expect(holders.first.fetch('query')).to eq('SELECT 1')
+  end
+
+  example 'a lost lease connection is replaced without interrupting the stream' do
+    postgres.exec('CREATE TABLE renewed (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO renewed (n) VALUES (1)')
+    kafka_take_messages('renewed', 1)
+
+    postgres.exec_params('SELECT pg_terminate_backend($1)', [lease_holders.first.fetch('pid')])
+    sleep 3
+    postgres.exec('INSERT INTO renewed (n) VALUES (2)')
+
+    messages = kafka_take_messages('renewed', 2)
+    expect(messages.map {|m| fetch_int(decode_value(m.value), 'n') }).to eq([1, 2])
+    expect(TEST_CLUSTER.bottledwater_log).to include('Lease connection for slot "bottledwater" failed, took the lease again')
+    expect(lease_holders.ntuples).to eq(1)
+  end
+
+  example 'a standby process takes over when the active one fails' do
+    active = ["--postgres=#{bottledwater_conninfo}", '--slot=leased', '--topic-prefix=leased']
+    bottledwater_process(*active, log: '/tmp/active.log')
+    sleep 3
+
+    postgres.exec('CREATE TABLE handed_over (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)')
+    postgres.exec('INSERT INTO handed_over (n) VALUES (1)')
+    kafka_take_messages('leased.handed_over', 1)
+
+    bottledwater_process(*active, '--standby', log: '/tmp/standby.log')
+    sleep 3
+    standby_log = bottledwater_process_log('/tmp/standby.log')
+    expect(standby_log).to include('Standing by to take over replication slot "leased".')
+    expect(standby_log).not_to include('Took over lease')
+
+    bottledwater_process_kill(*active.drop(1))
+    sleep 5
+    postgres.exec('INSERT INTO handed_over (n) VALUES (2)')
+
+    messages = kafka_take_messages('leased.handed_over', 2)
+    expect(messages.map {|m| fetch_int(decode_value(m.value), 'n') }).to eq([1, 2])
+    expect(bottledwater_process_log('/tmp/standby.log')).to include('Took over lease on replication slot "leased".')
+    expect(lease_holders('leased').ntuples).to eq(1)
+  end
+end
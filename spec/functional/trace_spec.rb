@@ -0,0 +1,56 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'tracing', functional: true, format: :json do
+  let(:postgres) { TEST_CLUSTER.postgres }
+
+  def trace_lines
+    TEST_CLUSTER.bottledwater_log.split("\n").grep(/Trace: /)
+  end
+
+  describe 'with --trace-sample=2' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.bottledwater_trace_sample = 2
+      TEST_CLUSTER.start
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    example 'logs the stage breakdown of every other delivered message' do
+      postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+      postgres.exec('INSERT INTO items (item) SELECT * FROM generate_series(1, 6) AS item')
+      kafka_take_messages('items', 6)
+      sleep 1
+
+      traces = trace_lines.grep(/Trace: topic items,/)
+      expect(traces.size).to eq(3)
+      traces.each do |line|
+        expect(line).to match(%r{xid \d+, WAL position \h+/\h+: decode -?\d+ us, network -?\d+ us, })
+        expect(line).to match(/client \d+ us, enqueue \d+ us, delivery \d+ us, commit to ack -?\d+ us$/)
+      end
+    end
+  end
+
+  describe 'without --trace-sample' do
+    before(:context) do
+      require 'test_cluster'
+      TEST_CLUSTER.start
+    end
+
+    after(:context) do
+      TEST_CLUSTER.stop
+    end
+
+    example 'logs no traces' do
+      postgres.exec('CREATE TABLE items (id SERIAL PRIMARY KEY, item INTEGER NOT NULL)')
+      postgres.exec('INSERT INTO items (item) SELECT * FROM generate_series(1, 6) AS item')
+      kafka_take_messages('items', 6)
+      sleep 1
+
+      expect(trace_lines).to be_empty
+    end
+  end
+end
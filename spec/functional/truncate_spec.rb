@@ -0,0 +1,139 @@
+require 'spec_helper'
+require 'format_contexts'
+
+describe 'truncating tables', functional: true, format: :json do
+  before(:context) do
+    require 'test_cluster'
+    TEST_CLUSTER.postgres_version = '16'
+    TEST_CLUSTER.start
+  end
+
+  after(:context) do
+    TEST_CLUSTER.stop
+  end
+
+  let(:postgres) { TEST_CLUSTER.postgres }
+  let(:kazoo) { TEST_CLUSTER.kazoo }
+
+  TRUNCATE_METRICS_PORT = 9189
+
+  def start_on_truncate(name, action, *options)
+    bottledwater_process("--postgres=#{bottledwater_conninfo}", "--slot=#{name}", "--topic-prefix=#{name}",
+                         "--on-truncate=#{action}", *options, log: "/tmp/#{name}.log")
+    sleep 3
+  end
+
+  def create_and_fill(table, rows)
+    postgres.exec("CREATE TABLE #{table} (id SERIAL PRIMARY KEY, n INTEGER NOT NULL)")
+    postgres.exec("INSERT INTO #{table} (n) SELECT * FROM generate_series(1, #{rows}) AS n")
+  end
+
+  def scrape
+    TEST_CLUSTER.bottledwater_exec('bash', '-c', %{
+      exec 3<>/dev/tcp/localhost/#{TRUNCATE_METRICS_PORT} &&
+      printf 'GET /metrics HTTP/1.0\\r\\n\\r\\n' >&3 &&
+      cat <&3
+    }).captured_output
+  end
+
+  def sample(body, name, labels)
+    line = body.split("\n").detect {|l| l.start_with?("#{name}{#{labels}} ") }
+    line && Float(line.split(' ').last)
+  end
+
+  example 'by default, a truncation is logged and the rows stay in the topic' do
+    create_and_fill('ignored', 5)
+    postgres.exec('TRUNCATE ignored')
+    postgres.exec('INSERT INTO ignored (n) VALUES (6)')
+
+    messages = kafka_take_messages('ignored', 6)
+    expect(messages.map {|m| fetch_int(decode_value(m.value), 'n') }).to eq((1..6).to_a)
+    expect(TEST_CLUSTER.bottledwater_log).to match(
+      %r{Table ignored was truncated at [0-9A-F]+/[0-9A-F]+, but its rows remain in topic ignored \(see --on-truncate\)})
+  end
+
+  example '--on-truncate=marker writes a marker to every partition' do
+    kazoo.create_topic('marked.cleared', partitions: 3, replication_factor: 1)
+    start_on_truncate('marked', 'marker')
+
+    create_and_fill('cleared', 30)
+    postgres.exec('TRUNCATE cleared')
+
+    partitions = kafka_take_messages('marked.cleared', 33, collect_partitions: true)
+    expect(partitions.size).to eq(3)
+    partitions.each do |partition, messages|
+      marker = messages.last
+      expect(marker.key).to eq('')
+      expect(marker.value).to be_nil
+      expect(messages[0...-1].map(&:key)).to all(satisfy {|key| !key.to_s.empty? })
+    end
+  end
+
+  example '--on-truncate=control writes an event to the control topic' do
+    start_on_truncate('controlled', 'control')
+
+    create_and_fill('audited', 3)
+    xid = postgres.transaction do |txn|
+      txn.exec('TRUNCATE audited')
+      txn.exec('SELECT txid_current()').getvalue(0, 0)
+    end
+
+    expect(kafka_take_messages('controlled.audited', 3).size).to eq(3)
+
+    event_message = kafka_take_messages('controlled.audited-control', 1).first
+    expect(event_message.key).to eq('audited')
+
+    event = JSON.parse(event_message.value)
+    expect(event.fetch('event')).to eq('truncate')
+    expect(event.fetch('table')).to eq('audited')
+    expect(event.fetch('topic')).to eq('controlled.audited')
+    expect(event.fetch('lsn')).to match(%r{\A[0-9A-F]+/[0-9A-F]+\z})
+    expect(event.fetch('xid')).to eq(Integer(xid))
+  end
+
+  describe '--on-truncate=tombstones' do
+    example 'writes a tombstone for every row of the table' do
+      start_on_truncate('tombstoned', 'tombstones', "--metrics-port=#{TRUNCATE_METRICS_PORT}")
+
+      create_and_fill('removed', 10)
+      postgres.exec('DELETE FROM removed WHERE n > 8')
+      kafka_take_messages('tombstoned.removed', 12)
+
+      body = scrape
+      expect(sample(body, 'bottledwater_key_index_keys', 'slot="tombstoned"')).to be >= 8
+      expect(sample(body, 'bottledwater_key_index_bytes', 'slot="tombstoned"')).to be > 0
+
+      keys_before = postgres.exec('SELECT id FROM removed').map {|row| Integer(row['id']) }
+      postgres.exec('TRUNCATE removed')
+
+      messages = kafka_take_messages('tombstoned.removed', 20)
+      tombstones = messages.drop(12)
+      expect(tombstones.map(&:value)).to all(be_nil)
+      expect(tombstones.map {|m| fetch_int(decode_key(m.key), 'id') }.sort).to eq(keys_before.sort)
+
+      expect(sample(scrape, 'bottledwater_key_index_keys', 'slot="tombstoned"')).to eq(
+        sample(body, 'bottledwater_key_index_keys', 'slot="tombstoned"') - 8)
+    end
+
+    example 'writes a marker after a restart, when not all keys are known' do
+      kazoo.create_topic('restarted.refilled', partitions: 1, replication_factor: 1)
+      start_on_truncate('restarted', 'tombstones')
+      create_and_fill('refilled', 5)
+      kafka_take_messages('restarted.refilled', 5)
+
+      bottledwater_process_kill('--slot=restarted', '--topic-prefix=restarted', '--on-truncate=tombstones')
+      sleep 1
+      start_on_truncate('restarted', 'tombstones')
+      postgres.exec('TRUNCATE refilled')
+
+      # The rows may be sent again after the restart, but the marker comes last
+      sleep 3
+      marker = kafka_take_all('restarted.refilled').last
+      expect(marker.key).to eq('')
+      expect(marker.value).to be_nil
+      expect(bottledwater_process_log('/tmp/restarted.log')).to include(
+        'Not all keys of table refilled are known (e.g. because the replication slot was created by another ' \
+        'process), so writing a truncate marker to topic restarted.refilled instead of tombstones.')
+    end
+  end
+end
@@ -34,5 +34,27 @@ module KafkaHelpers
   ensure
     consumer.interrupt if consumer
   end
+
+  # Returns all the messages in the topic, for when the number to expect is not
+  # known: i.e. whatever arrives within wait seconds.
+  def kafka_take_all(topic, wait: 5)
+    consumer = Kafka::Consumer.new(
+      'test',
+      [topic],
+      zookeeper: TEST_CLUSTER.zookeeper_hostport,
+      initial_offset: :earliest_offset,
+      logger: logger)
+
+    messages = []
+    begin
+      timeout(wait) do
+        consumer.each {|message| messages << message }
+      end
+    rescue Timeout::Error
+    end
+    messages
+  ensure
+    consumer.interrupt if consumer
+  end
 end
 
@@ -1,3 +1,4 @@
+require 'bottledwater_helpers'
 require 'kafka_helpers'
 
 require 'logger'
@@ -32,6 +33,7 @@ RSpec.configure do |config|
   config.include StringLogger
   config.include KnownBugs
   config.include KafkaHelpers
+  config.include BottledWaterHelpers
   config.include Constants
 
   config.around(:example) do |example|
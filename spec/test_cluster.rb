@@ -45,6 +45,13 @@ class TestCluster
     self.bottledwater_on_error = :exit
     self.bottledwater_skip_snapshot = false
     self.bottledwater_topic_prefix = nil
+    self.bottledwater_heartbeat_interval = nil
+    self.bottledwater_metrics_port = nil
+    self.bottledwater_metrics_address = nil
+    self.bottledwater_trace_sample = nil
+    self.bottledwater_encode_workers = nil
+    self.bottledwater_max_open_tables = nil
+    self.bottledwater_partitioner = nil
 
     self.valgrind = false
 
@@ -131,6 +138,7 @@ class TestCluster
     case postgres_version
     when '9.5'; :postgres
     when '9.4'; :'postgres-94'
+    when '16';  :'postgres-16'
     else
       raise "Unknown postgres_version #{postgres_version}"
     end
@@ -154,6 +162,34 @@ class TestCluster
     ENV['BOTTLED_WATER_TOPIC_PREFIX'] = prefix.to_s
   end
 
+  def bottledwater_heartbeat_interval=(seconds)
+    ENV['BOTTLED_WATER_HEARTBEAT_INTERVAL'] = seconds.to_s
+  end
+
+  def bottledwater_metrics_port=(port)
+    ENV['BOTTLED_WATER_METRICS_PORT'] = port.to_s
+  end
+
+  def bottledwater_metrics_address=(address)
+    ENV['BOTTLED_WATER_METRICS_ADDRESS'] = address.to_s
+  end
+
+  def bottledwater_trace_sample=(n)
+    ENV['BOTTLED_WATER_TRACE_SAMPLE'] = n.to_s
+  end
+
+  def bottledwater_encode_workers=(n)
+    ENV['BOTTLED_WATER_ENCODE_WORKERS'] = n.to_s
+  end
+
+  def bottledwater_max_open_tables=(n)
+    ENV['BOTTLED_WATER_MAX_OPEN_TABLES'] = n.to_s
+  end
+
+  def bottledwater_partitioner=(partitioner)
+    ENV['BOTTLED_WATER_PARTITIONER'] = partitioner.to_s
+  end
+
   def valgrind=(enabled)
     if enabled
       @valgrind = true
@@ -219,6 +255,60 @@ class TestCluster
     service_running?(bottledwater_service)
   end
 
+  # Connection string for Postgres as seen from inside the Bottled Water
+  # container (matches bottledwater-docker-wrapper.sh).
+  def bottledwater_postgres
+    'host=postgres port=5432 dbname=postgres user=postgres'
+  end
+
+  # Runs a command inside the Bottled Water container, e.g. one of the tools
+  # installed next to bottledwater.  Returns the finished command, so callers
+  # can check its status, captured_output and captured_error.  With detach:
+  # true, the command is left running in the background.
+  def bottledwater_exec(*command, detach: false)
+    container = container_for_service(bottledwater_service)
+    options = detach ? ['-d'] : []
+    @docker.shell.run(:docker, :exec, *options, container.id, *command).join
+  end
+
+  # Everything Bottled Water has logged so far (it logs to stderr).
+  def bottledwater_log
+    container_log(bottledwater_service)
+  end
+
+  # Everything the Postgres server has logged so far.
+  def postgres_log
+    container_log(postgres_service)
+  end
+
+  # Restarts the Postgres server, e.g. to apply settings made with ALTER SYSTEM
+  # that only take effect at server start, and reconnects to it.
+  def restart_postgres
+    check_started!
+    @postgres.close rescue nil
+
+    @compose.run!(:restart, postgres_service)
+
+    pg_port = wait_for_port(postgres_service, 5432, max_tries: 10) do |port|
+      PG::Connection.ping(host: @host, port: port, user: 'postgres') == PG::PQPING_OK
+    end
+    @postgres = PG::Connection.open(host: @host, port: pg_port, user: 'postgres')
+  end
+
+  # Starts a hot standby of the Postgres 16 server, once the cluster is
+  # running, and returns a connection to it.  Bottled Water can reach it as
+  # host postgres-16-standby.
+  def start_postgres_standby
+    raise 'a standby needs postgres_version 16' unless postgres_version == '16'
+    check_started!
+
+    start_service(:'postgres-16-standby')
+    standby_port = wait_for_port(:'postgres-16-standby', 5432, max_tries: 30) do |port|
+      PG::Connection.ping(host: @host, port: port, user: 'postgres') == PG::PQPING_OK
+    end
+    PG::Connection.open(host: @host, port: standby_port, user: 'postgres')
+  end
+
   def stop(should_reset: true, dump_logs: true)
     return if stopped?
 
@@ -372,6 +462,11 @@ class TestCluster
     containers.select {|container| container.exit_code != 0 }
   end
 
+  def container_log(service)
+    container = container_for_service(service)
+    @docker.shell.run(:docker, :logs, container.id).join.captured_error
+  end
+
   def dump_container_logs(container)
     logs_command = @docker.shell.run(:docker, :logs, container.id).join
     unless logs_command.status.success?